@@ -0,0 +1,104 @@
+#pragma once
+
+/* Bump allocator for the keys a table owns (assoc_ownkeys)
+
+   Keys are copied in back to back, in the order they were
+   inserted, so keys inserted together are read together.
+   Chunks never move once allocated, so a copied key's
+   address stays good for the life of the table, and the
+   whole arena goes in one walk of its chunk list. Nothing
+   is freed on its own. Not thread safe: callers that insert
+   from several threads hold a lock around arena_copy()
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes in a chunk, unless a key needs more */
+#define ARENACHUNK 65536
+/* Fixed size keys are aligned to no more than this */
+#define ARENAALIGN 8
+
+typedef struct chunk {
+    struct chunk* next;
+    size_t size;
+    size_t used;
+} chunk;
+
+typedef struct arena {
+    chunk* head;
+    /* bytes copied in, for the tests */
+    size_t bytes;
+} arena;
+
+/* Keys start right after the chunk header */
+static inline char* _chunk_mem(chunk* c) {
+
+    return (char*)(c + 1);
+}
+
+/* A new, empty arena. NULL => out of memory
+*/
+static inline arena* arena_init(void) {
+
+    return (arena*)calloc(1, sizeof(arena));
+}
+
+/* Copy len bytes of key in, aligned to 'align' (a power
+of two), and return the copy. NULL => out of memory
+*/
+static inline void* arena_copy(arena* r, const void* key, size_t len, \
+size_t align) {
+
+    chunk* c = r->head;
+    size_t at = 0, size;
+
+    if (c != NULL) {
+        at = (c->used + align - 1) & ~(align - 1);
+    }
+    if (c == NULL || at + len > c->size) {
+        size = len > ARENACHUNK ? len : ARENACHUNK;
+        c = (chunk*)malloc(sizeof(chunk) + size);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = r->head;
+        c->size = size;
+        r->head = c;
+        at = 0;
+    }
+    memcpy(_chunk_mem(c) + at, key, len);
+    c->used = at + len;
+    r->bytes += len;
+    return _chunk_mem(c) + at;
+}
+
+/* Alignment for a key of len bytes: the largest power of
+two dividing it, up to ARENAALIGN. Strings pack at 1
+*/
+static inline size_t arena_align(size_t len, bool string) {
+
+    size_t align = len & (~len + 1);
+
+    if (string || align == 0) {
+        return 1;
+    }
+    return align > ARENAALIGN ? ARENAALIGN : align;
+}
+
+/* Free every chunk, and the arena itself
+*/
+static inline void arena_free(arena* r) {
+
+    chunk* c;
+
+    if (r == NULL) {
+        return;
+    }
+    while ((c = r->head) != NULL) {
+        r->head = c->next;
+        free(c);
+    }
+    free(r);
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+/* Public interface shared by every engine (cuckoo.c, realloc.c,
+   swiss.c, ccuckoo.c, compact.c). Only ccuckoo.c takes inserts from
+   several threads at once; realloc.c built with -DSWMR=1 lets
+   any number of threads look up alongside one inserting.
+   Each engine is built on its own against this header, so any
+   driver (testassoc, bench.c) can be linked with either one.
+*/
+
+#include <stdbool.h>
+#include "hashfn.h"
+
+typedef struct assoc assoc;
+
+/*
+   Initialise the Associative array
+   keysize : number of bytes (or 0 => string)
+*/
+assoc* assoc_init(int keysize);
+
+/*
+   Insert key/data pair
+   - may cause resize, therefore 'a' might
+   be changed due to a realloc() etc.
+*/
+void assoc_insert(assoc** a, void* key, void* data);
+
+/* Find key, inserting it with NULL data if it isn't there,
+   for the cost of one hash and one probe sequence. Returns
+   where its data is kept: read it, or store through it to
+   set or replace the data (assoc_insert() never replaces).
+   *inserted says whether the key is new; inserted may be
+   NULL. The pointer is good until the next insert, upsert
+   or resize.
+   - 'a' might be changed, as for assoc_insert()
+   - realloc.c, SWMR : readers may see a new key's data as
+     NULL until it is stored through the pointer
+   - ccuckoo.c : another thread's insert can move the key,
+     so only while no other thread inserts; assoc_update()
+     is safe alongside them
+   - compact.c, HANDLES : not available, data is an index
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted);
+
+/* Given a key's data (NULL for a new key) and whether the
+   key is new, return the data it should have from now on
+*/
+typedef void* (*updatefunc)(void* data, bool inserted, void* arg);
+
+/* Find or insert key as assoc_upsert() does, and set its
+   data to fn(data, inserted, arg) in the same step.
+   Returns the data now stored. No pointer into the table
+   is handed out, so in ccuckoo.c it may run alongside other
+   threads' inserts: fn is called with the key's stripes
+   held, and must not use the table itself.
+   - 'a' might be changed, as for assoc_insert()
+   - compact.c, HANDLES : not available, data is an index
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg);
+
+/* Build a table from n key/data pairs in one go, the same
+   table as inserting them in order (the first of any
+   duplicates wins). It is sized once for n, and the keys are
+   hashed and placed by one thread per cpu, so loading
+   millions of pairs never cascades through resizes.
+   data may be NULL => every pair gets NULL data
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize);
+
+/* Make room for n keys in all, so inserting up to that many
+   never resizes. Never shrinks the table.
+   - 'a' might be changed, as for assoc_insert()
+*/
+void assoc_reserve(assoc** a, unsigned int n);
+
+/* Shrink to the smallest table that still holds every key,
+   e.g. after a large assoc_reserve(). In ccuckoo.c no other
+   thread may be using the table at the time.
+   - 'a' might be changed, as for assoc_insert()
+*/
+void assoc_shrink_to_fit(assoc** a);
+
+/* Resize policy: grow to 'growth' times the capacity once the
+   table is 'maxload' full (a share, 0..1). Engines round to
+   what they support, e.g. swiss.c only grows by powers of 2.
+   0 => leave that setting as it is
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload);
+
+/* Returns the number of key/data pairs currently stored */
+unsigned int assoc_count(assoc* a);
+
+/* Returns a pointer to the data, given a key
+   NULL => not found
+*/
+void* assoc_lookup(assoc* a, void* key);
+
+/* Look up n keys at once: out[i] = assoc_lookup(a, keys[i]).
+   The whole batch is hashed and its cells prefetched before
+   any key is compared, so the cache misses overlap
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out);
+
+/* From now on keep a copy of every key in memory the table
+   owns, packed in insert order, so the caller's keys can go
+   as soon as assoc_insert() returns. Each distinct key is
+   copied once, a duplicate insert copies nothing. Keys
+   already stored are copied straight away, so it can follow
+   assoc_build(). assoc_free() frees the copies in one go.
+   Call it before other threads use the table
+*/
+void assoc_ownkeys(assoc* a);
+
+/* Hash keys with 'fn' instead of the default (see 
+   hashfn.h). Only allowed while the table is empty;
+   NULL => back to the default
+*/
+void assoc_sethash(assoc* a, hashfunc fn);
+
+/* Bins in assoc_stats()'s probe histogram */
+#define STATBINS 8
+
+/* How a table is doing, see assoc_stats() */
+typedef struct assocstats {
+    unsigned int size;
+    /* cells keys can go in, and size / slots */
+    unsigned long slots;
+    double load;
+    /* probes[i] : keys a lookup finds at the (i+1)th place
+       it looks - a bucket, cell or group, as the engine
+       goes. The last bin also counts any further away */
+    unsigned long probes[STATBINS];
+    /* the table's own memory: cells, control bytes and
+       owned keys, in all and per key */
+    unsigned long bytes;
+    double bytes_per_key;
+    /* Counted only when built with -DSTATS=1, else 0:
+       resizes and the time they took, key searches (each
+       lookup, insert or upsert) and the strcmp()/memcmp()
+       calls made finding keys, so compares / searches is
+       the key comparisons a search costs */
+    unsigned long resizes;
+    double rehash_ms;
+    unsigned long searches;
+    unsigned long compares;
+} assocstats;
+
+/* Fill in st for 'a'. The structural figures come from one
+   walk over the table, so cost nothing until asked for; the
+   counters cost nothing unless built with -DSTATS=1. In
+   ccuckoo.c inserts may run alongside, the walk then sees
+   the table part way through them; realloc.c in SWMR mode
+   only lets the writer ask
+*/
+void assoc_stats(assoc* a, assocstats* st);
+
+/* What latency.h times: assoc_insert(), assoc_lookup() that
+   found or missed its key, and every resize */
+enum latop {LAT_INSERT, LAT_HIT, LAT_MISS, LAT_RESIZE, LATOPS};
+
+/* Each power of 2 of ticks is split into LATSUB bins, so
+   a bin is within 1/LATSUB of its times. Times of 2^LATBITS
+   ticks or more share the last bin */
+#define LATSUBBITS 4
+#define LATSUB (1 << LATSUBBITS)
+#define LATBITS 40
+#define LATBINS ((LATBITS - LATSUBBITS + 1) * LATSUB)
+
+/* Latency histograms of every thread, see assoc_latency() */
+typedef struct assoclatency {
+    /* count[op][bin] : timed operations in that bin, which
+       latency_low() turns into ticks */
+    unsigned long count[LATOPS][LATBINS];
+    double ns_per_tick;
+    /* 1 in 'sample' inserts and lookups are timed */
+    unsigned int sample;
+} assoclatency;
+
+/* Add up the latency histograms every thread has kept so far
+   into 'l'. Only built with -DLATENCY=1, else all 0.
+   Threads may go on timing alongside
+*/
+void assoc_latency(assoclatency* l);
+
+/* Start every thread's histograms again from 0
+*/
+void assoc_latency_reset(void);
+
+/* Time 1 in n inserts and lookups from now on, n rounded
+   up to a power of 2; 0 => back to LATSAMPLE (latency.h).
+   Each thread keeps counting where it was, so the first
+   timed operation after a change may come early
+*/
+void assoc_latency_sample(unsigned int n);
+
+/* Free up all allocated space from 'a' */
+void assoc_free(assoc* a);
@@ -0,0 +1,448 @@
+/* Head to head benchmark for the assoc engines.
+
+   Link the same driver against each engine in turn, e.g.
+     gcc -O2 bench.c cuckoo.c general.c -o bench_cuckoo -lm -pthread
+     gcc -O2 bench.c realloc.c general.c -o bench_realloc -lm -pthread
+     gcc -O2 bench.c swiss.c general.c -o bench_swiss -lm -pthread
+     gcc -O2 bench.c compact.c general.c -o bench_compact -lm -pthread
+   then run ./bench_cuckoo [maxpow] [filter].
+
+   Int (4 byte), long (8 byte) and string keys are run at 10^3 up to
+   10^maxpow entries (default 10^6, at most 10^8). 'filter' picks out
+   scenarios whose name contains it. Every scenario runs in its own
+   child process, so an engine that dies (on_error, out of memory,
+   timeout) is reported as FAILED and the suite carries on. Peak RSS
+   is therefore per scenario too.
+
+   'batch' is lookup throughput through assoc_lookup_batch(),
+   BATCHKEYS keys per call. 'build' is loading the same keys
+   through assoc_build() instead of one assoc_insert() at a
+   time; it runs after peak RSS is taken. 'inline' is lookup
+   throughput of the same int or long keys in intassoc.h's
+   specialised tables, which don't depend on the engine - the
+   ceiling a general engine is up against.
+
+   Resizes are counted by watching assoc_insert() hand back a new
+   pointer through its assoc** argument. Engines that grow in
+   place (ccuckoo.c, realloc.c migrating or in SWMR mode) only
+   count them in assoc_stats() when built with -DSTATS=1, and
+   show n/a otherwise.
+
+   With the engine built -DLATENCY=1 (see latency.h), each
+   scenario's row is followed by its latency percentiles for
+   the whole run: inserts, hits, misses and resizes.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "assoc.h"
+#include "intassoc.h"
+#include "latency.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MINPOW 3
+#define MAXPOW 8
+#define DEFAULTPOW 6
+#define SAMPLES 100000
+#define TIMEOUT 900
+#define STRWIDTH 16
+#define BASE 26
+/* Keys per assoc_lookup_batch() call */
+#define BATCHKEYS 256
+/* The header of cuckoo.c reports a calloc failure after this many
+   strings - kept as a named scenario to show when it's fixed */
+#define CUCKOO120K 120000
+
+typedef enum keytype { INTKEY, LONGKEY, STRKEY } keytype;
+
+typedef struct scenario {
+    char name[32];
+    keytype type;
+    unsigned int n;
+} scenario;
+
+/* 2n keys in one flat block: the first n are inserted,
+   the second n are guaranteed misses */
+typedef struct workload {
+    char* keys;
+    unsigned int width;
+    unsigned int n;
+} workload;
+
+typedef struct result {
+    double insert_mops;
+    double build_mops;
+    double lookup_mops;
+    double batch_mops;
+    double inline_mops;
+    double hit[3];
+    double miss[3];
+    long peak_kb;
+    unsigned int resizes;
+    /* grew without a new pointer or a STATS count */
+    bool uncounted;
+    unsigned int errors;
+} result;
+
+static const double percentiles[3] = {0.5, 0.99, 0.999};
+
+/* splitmix64 finaliser - a bijection, so distinct
+   inputs always give distinct keys */
+static unsigned long long mix64(unsigned long long x) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void* key_at(workload* w, unsigned int i) {
+
+    return w->keys + (size_t)i * w->width;
+}
+
+/* Write a lowercase 'word' for i, e.g. "qzhbemtrk..." */
+static void make_word(char* s, unsigned long long v) {
+
+    int len = 0;
+
+    do {
+        s[len++] = (char)('a' + v % BASE);
+        v /= BASE;
+    } while (v && len < STRWIDTH - 1);
+    s[len] = '\0';
+}
+
+static bool make_workload(workload* w, keytype type, unsigned int n) {
+
+    unsigned int i;
+    unsigned long long v;
+
+    w->n = n;
+    w->width = (type == INTKEY) ? sizeof(int) : \
+    (type == LONGKEY) ? sizeof(unsigned long long) : STRWIDTH;
+    w->keys = malloc((size_t)2 * n * w->width);
+    if (w->keys == NULL) {
+        return false;
+    }
+    for (i = 0; i < 2 * n; i++) {
+        v = mix64(i);
+        if (type == INTKEY) {
+            /* Odd multiplier => bijective on 32 bits */
+            *(unsigned int*)key_at(w, i) = i * 2654435761U;
+        }
+        else if (type == LONGKEY) {
+            memcpy(key_at(w, i), &v, sizeof(v));
+        }
+        else {
+            make_word(key_at(w, i), v);
+        }
+    }
+    return true;
+}
+
+static int cmp_double(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void percentile(double* t, unsigned int n, double* out) {
+
+    int i;
+
+    qsort(t, n, sizeof(double), cmp_double);
+    for (i = 0; i < 3; i++) {
+        out[i] = t[(unsigned int)(percentiles[i] * (n - 1))];
+    }
+}
+
+/* Same keys through intassoc32/64, data the key's
+   address as before
+*/
+static void run_inline(workload* w, result* r) {
+
+    intassoc32* a32;
+    intassoc64* a64;
+    unsigned int i;
+    uint32_t k32;
+    uint64_t k64;
+    double t0;
+
+    if (w->width == sizeof(uint32_t)) {
+        a32 = intassoc32_init();
+        for (i = 0; i < w->n; i++) {
+            memcpy(&k32, key_at(w, i), sizeof(k32));
+            intassoc32_insert(a32, k32, key_at(w, i));
+        }
+        t0 = now_ns();
+        for (i = 0; i < w->n; i++) {
+            memcpy(&k32, key_at(w, i), sizeof(k32));
+            if (intassoc32_lookup(a32, k32) != key_at(w, i)) {
+                r->errors++;
+            }
+        }
+        r->inline_mops = w->n / ((now_ns() - t0) / 1e3);
+        if (intassoc32_count(a32) != w->n) {
+            r->errors++;
+        }
+        intassoc32_free(a32);
+        return;
+    }
+    a64 = intassoc64_init();
+    for (i = 0; i < w->n; i++) {
+        memcpy(&k64, key_at(w, i), sizeof(k64));
+        intassoc64_insert(a64, k64, key_at(w, i));
+    }
+    t0 = now_ns();
+    for (i = 0; i < w->n; i++) {
+        memcpy(&k64, key_at(w, i), sizeof(k64));
+        if (intassoc64_lookup(a64, k64) != key_at(w, i)) {
+            r->errors++;
+        }
+    }
+    r->inline_mops = w->n / ((now_ns() - t0) / 1e3);
+    if (intassoc64_count(a64) != w->n) {
+        r->errors++;
+    }
+    intassoc64_free(a64);
+}
+
+static void run(scenario* s, result* r) {
+
+    workload w;
+    assoc *a, *prev;
+    unsigned int i, j, m, samples, step;
+    double t0, *lat;
+    void *keys[BATCHKEYS], *out[BATCHKEYS], **all;
+    unsigned long slots;
+    assocstats st;
+    struct rusage ru;
+
+    if (!make_workload(&w, s->type, s->n)) {
+        fprintf(stderr, "Cannot allocate workload\n");
+        exit(EXIT_FAILURE);
+    }
+    a = assoc_init(s->type == STRKEY ? 0 : (int)w.width);
+    assoc_stats(a, &st);
+    slots = st.slots;
+
+    /* Data is the key's own address so lookups can be checked */
+    t0 = now_ns();
+    for (i = 0; i < w.n; i++) {
+        prev = a;
+        assoc_insert(&a, key_at(&w, i), key_at(&w, i));
+        if (a != prev) {
+            r->resizes++;
+        }
+    }
+    r->insert_mops = w.n / ((now_ns() - t0) / 1e3);
+    if (assoc_count(a) != w.n) {
+        r->errors++;
+    }
+    /* Only a STATS build sees resizes done in place */
+    assoc_stats(a, &st);
+    if (st.resizes > r->resizes) {
+        r->resizes = (unsigned int)st.resizes;
+    }
+    r->uncounted = !r->resizes && st.slots != slots;
+
+    t0 = now_ns();
+    for (i = 0; i < w.n; i++) {
+        if (assoc_lookup(a, key_at(&w, i)) != key_at(&w, i)) {
+            r->errors++;
+        }
+    }
+    r->lookup_mops = w.n / ((now_ns() - t0) / 1e3);
+
+    t0 = now_ns();
+    for (i = 0; i < w.n; i += m) {
+        m = (w.n - i < BATCHKEYS) ? w.n - i : BATCHKEYS;
+        for (j = 0; j < m; j++) {
+            keys[j] = key_at(&w, i + j);
+        }
+        assoc_lookup_batch(a, keys, m, out);
+        for (j = 0; j < m; j++) {
+            if (out[j] != keys[j]) {
+                r->errors++;
+            }
+        }
+    }
+    r->batch_mops = w.n / ((now_ns() - t0) / 1e3);
+
+    /* Time single calls spread evenly across the keys */
+    samples = w.n < SAMPLES ? w.n : SAMPLES;
+    step = w.n / samples;
+    lat = malloc(sizeof(double) * samples);
+    for (i = 0, j = 0; i < samples; i++, j += step) {
+        t0 = now_ns();
+        assoc_lookup(a, key_at(&w, j));
+        lat[i] = now_ns() - t0;
+    }
+    percentile(lat, samples, r->hit);
+    for (i = 0, j = w.n; i < samples; i++, j += step) {
+        t0 = now_ns();
+        if (assoc_lookup(a, key_at(&w, j)) != NULL) {
+            r->errors++;
+        }
+        lat[i] = now_ns() - t0;
+    }
+    percentile(lat, samples, r->miss);
+
+    getrusage(RUSAGE_SELF, &ru);
+    r->peak_kb = ru.ru_maxrss;
+
+    free(lat);
+    assoc_free(a);
+
+    all = malloc(sizeof(void*) * w.n);
+    if (all == NULL) {
+        fprintf(stderr, "Cannot allocate workload\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < w.n; i++) {
+        all[i] = key_at(&w, i);
+    }
+    t0 = now_ns();
+    a = assoc_build(all, all, w.n, s->type == STRKEY ? 0 : (int)w.width);
+    r->build_mops = w.n / ((now_ns() - t0) / 1e3);
+    if (assoc_count(a) != w.n) {
+        r->errors++;
+    }
+    for (i = 0; i < w.n; i += step) {
+        if (assoc_lookup(a, all[i]) != all[i]) {
+            r->errors++;
+        }
+    }
+    assoc_free(a);
+    free(all);
+    if (s->type != STRKEY) {
+        run_inline(&w, r);
+    }
+    free(w.keys);
+}
+
+static void report(scenario* s, result* r) {
+
+    char fast[16] = "-", resizes[16] = "n/a";
+
+    if (s->type != STRKEY) {
+        sprintf(fast, "%.2f", r->inline_mops);
+    }
+    if (!r->uncounted) {
+        sprintf(resizes, "%u", r->resizes);
+    }
+    printf("%-12s %10u %8.2f %8.2f %8.2f %8.2f %8s %7.0f %7.0f %7.0f "
+    "%7.0f %7.0f %7.0f %9.1f %7s %s\n", s->name, s->n, r->insert_mops,
+    r->build_mops, r->lookup_mops, r->batch_mops, fast, \
+    r->hit[0], r->hit[1], r->hit[2], r->miss[0], r->miss[1], r->miss[2], \
+    r->peak_kb / 1024.0, resizes, r->errors ? "WRONG" : "ok");
+}
+
+/* The engine's latency histograms, if it keeps any
+*/
+static void report_latency(void) {
+
+    assoclatency l;
+
+    assoc_latency(&l);
+    if (latency_total(&l, LAT_INSERT)) {
+        latency_print(stdout, &l);
+    }
+}
+
+/* Run in a child so a crash or on_error() can't take
+   the rest of the suite down with it
+*/
+static void run_isolated(scenario* s) {
+
+    pid_t pid;
+    int status;
+    result r;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        alarm(TIMEOUT);
+        memset(&r, 0, sizeof(r));
+        run(s, &r);
+        report(s, &r);
+        report_latency();
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+        printf("%-12s %10u FAILED (could not fork)\n", s->name, s->n);
+        return;
+    }
+    if (WIFSIGNALED(status)) {
+        printf("%-12s %10u FAILED (%s)\n", s->name, s->n, \
+        WTERMSIG(status) == SIGALRM ? "timeout" : "signal");
+    }
+    else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+        printf("%-12s %10u FAILED (exit %d)\n", s->name, s->n, \
+        WEXITSTATUS(status));
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    static const char* names[3] = {"int", "long", "str"};
+    scenario s;
+    int maxpow = DEFAULTPOW, p, t;
+    unsigned int n;
+    const char* filter = (argc > 2) ? argv[2] : "";
+
+    if (argc > 1) {
+        maxpow = atoi(argv[1]);
+    }
+    if (maxpow < MINPOW || maxpow > MAXPOW) {
+        fprintf(stderr, "Usage: %s [maxpow %d..%d] [filter]\n", \
+        argv[0], MINPOW, MAXPOW);
+        return EXIT_FAILURE;
+    }
+
+    /*The 'inline' column is only worth showing if
+    intassoc.h is right*/
+    _intassoc_test();
+    printf("engine: %s\n", argv[0]);
+    printf("%-12s %10s %8s %8s %8s %8s %8s %23s %23s %9s %7s\n", \
+    "scenario", "n", "ins Mop", "build", "get Mop", "batch", "inline", \
+    "hit ns p50/p99/p99.9", \
+    "miss ns p50/p99/p99.9", "peak MB", "resizes");
+
+    for (t = INTKEY; t <= STRKEY; t++) {
+        for (p = MINPOW, n = 1000; p <= maxpow; p++, n *= 10) {
+            sprintf(s.name, "%s-1e%d", names[t], p);
+            s.type = (keytype)t;
+            s.n = n;
+            if (strstr(s.name, filter)) {
+                run_isolated(&s);
+            }
+        }
+    }
+
+    strcpy(s.name, "cuckoo120k");
+    s.type = STRKEY;
+    s.n = CUCKOO120K;
+    if (strstr(s.name, filter)) {
+        run_isolated(&s);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1641 @@
+/* Cuckoo hashing that many threads can share, after
+   MemC3 and libcuckoo.
+
+   Buckets are covered by NSTRIPES version counters. A writer
+   owns a stripe while its counter is odd and bumps it back to
+   even when done. Readers never lock: they note the counters
+   of the key's two buckets, read, and try again if either
+   moved. Inserts that need room look for a displacement path
+   without any locks, then walk it backwards moving one key at
+   a time, each move holding only the two stripes it touches.
+   The table is grown in place with every stripe held, so the
+   assoc pointer never changes; old tables are kept until
+   assoc_free() since a reader may still be looking at one.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "assoc.h"
+#include "sizing.h"
+#include "parallel.h"
+#include "arena.h"
+#include "stats.h"
+#include "latency.h"
+#include "../../ADTs/General/general.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define INITIALSIZE 17
+/* Default growth factor and maximum load, see
+   assoc_setgrowth(). At 1 only running out of displacement
+   paths resizes */
+#define SCALEFACTOR 4
+#define MAXLOAD 1.0
+#define BUCKETSIZE 4
+/* Longest displacement path tried before growing */
+#define MAXPATH 128
+/* Version counters, a power of two */
+#define NSTRIPES 2048
+#define CACHELINE 64
+/* Spins on a busy stripe before yielding the cpu */
+#define SPINS 64
+/* Keys hashed and prefetched ahead in assoc_lookup_batch */
+#define BATCH 16
+/* Fill assoc_build sizes for, leaving room to displace */
+#define BUILDLOAD 0.85
+#define BUILDKEYS 50000
+#define TESTTHREADS 4
+#define TESTKEYS 20000
+/* Keys every test thread counts up through assoc_update */
+#define UPDATEKEYS 100
+
+/* key NULL => empty cell. The full hash is kept so a move
+   or a resize never hashes the key again */
+typedef struct cell {
+    void* key;
+    void* data;
+    uint64_t hash;
+} cell;
+
+/* One generation of the table: 2 * capacity buckets, the
+   first capacity for the low half of the hash, the rest
+   for the high half */
+typedef struct table {
+    cell* cells;
+    unsigned int capacity;
+    unsigned long recip;
+    /* the table this one replaced */
+    struct table* retired;
+} table;
+
+/* One cell along a displacement path */
+typedef struct step {
+    unsigned int bucket;
+    unsigned int slot;
+    void* key;
+} step;
+
+typedef enum outcome {added, present, full, stale} outcome;
+
+/* A version counter on a cache line of its own, so writers
+   on neighbouring stripes don't keep stealing it from the
+   readers of this one */
+typedef struct stripe {
+    unsigned long n;
+    char pad[CACHELINE - sizeof(unsigned long)];
+} stripe;
+
+/* assoc_update()'s callback, applied by _add() with the
+   key's stripes held, and the data it left */
+typedef struct change {
+    updatefunc fn;
+    void* arg;
+    void* data;
+} change;
+
+struct assoc {
+    table* t;
+    unsigned int size;
+    unsigned int keysize;
+    hashfunc hashfn;
+    /* see assoc_setgrowth() */
+    double growth;
+    double maxload;
+    /* copies of the keys, NULL => the caller's own
+       (assoc_ownkeys). Inserts into different stripes
+       copy at once, so the arena has a lock of its own */
+    arena* owned;
+    bool keylock;
+    /* see stats.h */
+    counters stats;
+    stripe version[NSTRIPES];
+};
+
+/* Shared by the threads of assoc_build. Thread p takes
+the keys whose first bucket is from capacity*p/parts up to
+capacity*(p+1)/parts */
+typedef struct build {
+    assoc* a;
+    void** keys;
+    void** data;
+    unsigned int n;
+    uint64_t* h;
+    unsigned int* len;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 1];
+    unsigned int parts;
+} build;
+
+/* Shared by the threads of a parallel resize. Every key of
+the old table is copied out to items[]; each thread then
+fills a run of the new table's first buckets, then of its
+second ones, marking what it placed */
+typedef struct regrow {
+    table* t;
+    table* b;
+    cell* items;
+    bool* placed;
+    unsigned long n;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 1];
+    unsigned int parts;
+    bool second;
+} regrow;
+
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads);
+void _build_hash(void* ctx, unsigned int t, unsigned int threads);
+unsigned int _build_part(void* ctx, unsigned long i);
+void _build_place(void* ctx, unsigned int t, unsigned int threads);
+cell* _insert(assoc* a, void* key, void* data, uint64_t h, \
+unsigned int len, change* u, bool* inserted);
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len);
+void* _lookup(assoc* a, void* key, uint64_t h, unsigned int len);
+table* _newtable(unsigned long min);
+unsigned int _bucket_one(table* t, uint64_t h);
+unsigned int _bucket_two(table* t, uint64_t h);
+unsigned int _other(table* t, unsigned int bucket, uint64_t h);
+void _lock(assoc* a, unsigned int bucket);
+void _unlock(assoc* a, unsigned int bucket);
+void _lock_two(assoc* a, unsigned int b1, unsigned int b2);
+void _unlock_two(assoc* a, unsigned int b1, unsigned int b2);
+unsigned long _read_begin(assoc* a, unsigned int bucket);
+bool _keymatch(assoc* a, cell* c, void* key, uint64_t h, \
+unsigned int len);
+cell* _find(assoc* a, table* t, unsigned int bucket, void* key, \
+uint64_t h, unsigned int len);
+cell* _free_slot(table* t, unsigned int bucket);
+void _put(cell* c, void* key, void* data, uint64_t h);
+void* _ownkey(assoc* a, void* key, unsigned int len);
+outcome _add(assoc* a, table* t, void* key, void* data, uint64_t h, \
+unsigned int len, change* u, cell** at);
+bool _findpath(table* t, unsigned int from, uint64_t h, step* path, \
+int* n);
+bool _make_room(assoc* a, table* t, uint64_t h);
+void _resize(assoc* a, table* t, unsigned long min);
+table* _grow(table* t, unsigned long min);
+table* _grow_parallel(table* t, unsigned long min, unsigned int threads);
+bool _grow_kept(void* ctx, unsigned long i);
+void _grow_put(void* ctx, unsigned long i, unsigned long k);
+unsigned int _grow_part(void* ctx, unsigned long i);
+void _grow_place(void* ctx, unsigned int t, unsigned int threads);
+unsigned long _grown(assoc* a, table* t);
+unsigned long _limit(assoc* a, table* t);
+unsigned long _fit(assoc* a, unsigned long n);
+bool _place(table* t, cell item);
+
+/*
+   Initialise the Associative array
+   keysize : number of bytes (or 0 => string)
+*/
+
+assoc* assoc_init(int keysize) {
+
+    assoc* a = ncalloc(1, sizeof(assoc));
+
+    a->t = _newtable(INITIALSIZE);
+    a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+
+    return a;
+}
+
+/*
+   Insert key/data pair. Safe to call from any number of
+   threads at once, alongside assoc_lookup(). The table
+   grows in place, so *a is never changed
+*/
+
+void assoc_insert(assoc** a, void* key, void* data) {
+
+    unsigned long lat;
+    unsigned int len;
+    uint64_t h;
+    bool inserted;
+
+    if (key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    lat = _lat_start();
+    STAT_ADD((*a)->stats.searches, 1);
+    h = _hashkey(*a, key, &len);
+    _insert(*a, key, data, h, len, NULL, &inserted);
+    _lat_stop(lat, LAT_INSERT);
+}
+
+/* Find or insert key under its two stripes, in the same
+single pass as assoc_insert(). The cell can be moved by
+the next insert from any thread, see assoc_update()
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted) {
+
+    unsigned int len;
+    uint64_t h;
+    bool fresh;
+    cell* c;
+
+    if (key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    STAT_ADD((*a)->stats.searches, 1);
+    h = _hashkey(*a, key, &len);
+    c = _insert(*a, key, NULL, h, len, NULL, &fresh);
+    if (inserted != NULL) {
+        *inserted = fresh;
+    }
+    return &c->data;
+}
+
+/* Find or insert key and set its data with both its
+stripes still held, so no other thread's insert can move
+the cell in between
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg) {
+
+    unsigned int len;
+    uint64_t h;
+    bool fresh;
+    change u;
+
+    if (key == NULL || fn == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    STAT_ADD((*a)->stats.searches, 1);
+    h = _hashkey(*a, key, &len);
+    u.fn = fn;
+    u.arg = arg;
+    _insert(*a, key, NULL, h, len, &u, &fresh);
+    return u.data;
+}
+
+/* Bulk load, sized once, one thread per cpu
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize) {
+
+    return _build(keys, data, n, keysize, _nthreads(n));
+}
+
+/* assoc_insert() once the key is hashed. Returns the key's
+cell, and whether it's new. u != NULL => applied to the
+key's data before its stripes are let go
+*/
+cell* _insert(assoc* p, void* key, void* data, uint64_t h, \
+unsigned int len, change* u, bool* inserted) {
+
+    table* t;
+    cell* at;
+
+    for (;;) {
+        t = __atomic_load_n(&p->t, __ATOMIC_ACQUIRE);
+        /*Grow first if at the maximum load*/
+        if (assoc_count(p) >= _limit(p, t)) {
+            _resize(p, t, _grown(p, t));
+            continue;
+        }
+        switch (_add(p, t, key, data, h, len, u, &at)) {
+        case added:
+            *inserted = true;
+            return at;
+        case present:
+            *inserted = false;
+            return at;
+        case stale:
+            break;
+        case full:
+            if (!_make_room(p, t, h)) {
+                _resize(p, t, _grown(p, t));
+            }
+            break;
+        }
+    }
+}
+
+/* Make room for n keys in all: the table they'd fill to
+BUILDLOAD (or maxload, if lower). Safe alongside other
+threads, like assoc_insert()
+*/
+void assoc_reserve(assoc** a, unsigned int n) {
+
+    table* t = __atomic_load_n(&(*a)->t, __ATOMIC_ACQUIRE);
+    unsigned long min = _fit(*a, n);
+
+    if (min > t->capacity) {
+        _resize(*a, t, min);
+    }
+}
+
+/* Down to the smallest table the keys fill to BUILDLOAD,
+   freeing every table retired so far. Unlike the rest, not
+   to be called while other threads use the table, since it
+   frees what readers might be looking at
+*/
+void assoc_shrink_to_fit(assoc** a) {
+
+    assoc* p = *a;
+    table *t = p->t, *old;
+    unsigned long min = _fit(p, p->size);
+    unsigned long recip;
+
+    if (_next_capacity(min, &recip) < t->capacity) {
+        _resize(p, t, min);
+        t = p->t;
+    }
+    while ((old = t->retired) != NULL) {
+        t->retired = old->retired;
+        free(old->cells);
+        free(old);
+    }
+}
+
+/* Resize policy for this table, set before sharing it
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload) {
+
+    _setgrowth(&a->growth, &a->maxload, growth, maxload);
+}
+
+/*   Returns the number of key/data pairs
+   currently stored in the table
+*/
+
+unsigned int assoc_count(assoc* a) {
+
+    return __atomic_load_n(&a->size, __ATOMIC_RELAXED);
+}
+
+/*   Returns a pointer to the data, given a key
+   NULL => not found. Never takes a lock
+*/
+
+void* assoc_lookup(assoc* a, void* key) {
+
+    unsigned long lat;
+    unsigned int len;
+    uint64_t h;
+    void* data;
+
+    if (key == NULL) {
+        return NULL;
+    }
+    lat = _lat_start();
+    STAT_ADD(a->stats.searches, 1);
+    h = _hashkey(a, key, &len);
+    data = _lookup(a, key, h, len);
+    _lat_stop(lat, data == NULL ? LAT_MISS : LAT_HIT);
+    return data;
+}
+
+/* Hash a batch of keys and prefetch both of each key's
+buckets, then look them up once the lines have arrived.
+Lock free like assoc_lookup()
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out) {
+
+    uint64_t h[BATCH];
+    unsigned int len[BATCH], b, i, j, m;
+    table* t;
+
+    STAT_ADD(a->stats.searches, n);
+    for (i = 0; i < n; i += BATCH) {
+        m = (n - i < BATCH) ? n - i : BATCH;
+        t = __atomic_load_n(&a->t, __ATOMIC_ACQUIRE);
+        for (j = 0; j < m; j++) {
+            if (keys[i + j] == NULL) {
+                continue;
+            }
+            h[j] = _hashkey(a, keys[i + j], &len[j]);
+            /*A bucket spans two cache lines*/
+            b = _bucket_one(t, h[j]);
+            _prefetch(&t->cells[(unsigned long)b * BUCKETSIZE]);
+            _prefetch(&t->cells[(unsigned long)b * BUCKETSIZE + \
+            BUCKETSIZE - 1]);
+            b = _bucket_two(t, h[j]);
+            _prefetch(&t->cells[(unsigned long)b * BUCKETSIZE]);
+            _prefetch(&t->cells[(unsigned long)b * BUCKETSIZE + \
+            BUCKETSIZE - 1]);
+        }
+        for (j = 0; j < m; j++) {
+            out[i + j] = keys[i + j] == NULL ? NULL : \
+            _lookup(a, keys[i + j], h[j], len[j]);
+        }
+    }
+}
+
+/* Find key, retrying until no writer has touched its
+buckets (or the table) while we looked
+*/
+void* _lookup(assoc* a, void* key, uint64_t h, unsigned int len) {
+
+    table* t;
+    unsigned int b1, b2;
+    unsigned long v1, v2;
+    cell* c;
+    void* data;
+
+    for (;;) {
+        t = __atomic_load_n(&a->t, __ATOMIC_ACQUIRE);
+        b1 = _bucket_one(t, h);
+        b2 = _bucket_two(t, h);
+        v1 = _read_begin(a, b1);
+        v2 = _read_begin(a, b2);
+        data = NULL;
+        c = _find(a, t, b1, key, h, len);
+        if (c == NULL) {
+            c = _find(a, t, b2, key, h, len);
+        }
+        if (c != NULL) {
+            data = __atomic_load_n(&c->data, __ATOMIC_RELAXED);
+        }
+        /*Nothing moved underneath us => the answer stands*/
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&a->version[b1 & (NSTRIPES - 1)].n, \
+        __ATOMIC_RELAXED) == v1 && \
+        __atomic_load_n(&a->version[b2 & (NSTRIPES - 1)].n, \
+        __ATOMIC_RELAXED) == v2 && \
+        __atomic_load_n(&a->t, __ATOMIC_RELAXED) == t) {
+            return data;
+        }
+    }
+}
+
+/* Choose the hash function while the table is empty
+*/
+void assoc_sethash(assoc* a, hashfunc fn) {
+
+    if (assoc_count(a)) {
+        on_error("Error: Hash function can't change once keys "
+        "are stored\n");
+    }
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+}
+
+/* Copy keys into a table owned arena from now on,
+   including any already stored. Call it before sharing
+   the table: the keys of tables already outgrown are left
+   as they are
+*/
+void assoc_ownkeys(assoc* a) {
+
+    table* t = a->t;
+    unsigned long i, cells = 2 * (unsigned long)t->capacity * BUCKETSIZE;
+    unsigned int len;
+
+    if (a->owned != NULL) {
+        return;
+    }
+    a->owned = arena_init();
+    if (a->owned == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    for (i = 0; i < cells; i++) {
+        if (t->cells[i].key != NULL) {
+            len = a->keysize ? a->keysize : \
+            (unsigned int)strlen((char*)t->cells[i].key);
+            t->cells[i].key = _ownkey(a, t->cells[i].key, len);
+        }
+    }
+}
+
+/* Load, which of its two buckets each key is in and the
+   counters. Cells are read as lookups read them, so inserts
+   may go on meanwhile; the memory counts the tables kept
+   for readers as well
+*/
+void assoc_stats(assoc* a, assocstats* st) {
+
+    table *t = __atomic_load_n(&a->t, __ATOMIC_ACQUIRE), *r;
+    unsigned long i, cells = 2 * (unsigned long)t->capacity * BUCKETSIZE, \
+    bytes = sizeof(assoc);
+    uint64_t h;
+
+    _stat_begin(st, assoc_count(a), cells);
+    for (i = 0; i < cells; i++) {
+        if (__atomic_load_n(&t->cells[i].key, __ATOMIC_RELAXED) != NULL) {
+            h = __atomic_load_n(&t->cells[i].hash, __ATOMIC_RELAXED);
+            _stat_probe(st, i / BUCKETSIZE != _bucket_one(t, h));
+        }
+    }
+    for (r = t; r != NULL; r = r->retired) {
+        bytes += sizeof(table) + \
+        2 * (unsigned long)r->capacity * BUCKETSIZE * sizeof(cell);
+    }
+    if (a->owned != NULL) {
+        while (__atomic_test_and_set(&a->keylock, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        bytes += a->owned->bytes;
+        __atomic_clear(&a->keylock, __ATOMIC_RELEASE);
+    }
+    _stat_end(st, bytes, &a->stats);
+}
+
+void assoc_latency(assoclatency* l) {
+
+    _lat_merge(l);
+}
+
+void assoc_latency_reset(void) {
+
+    _lat_reset();
+}
+
+void assoc_latency_sample(unsigned int n) {
+
+    _lat_setsample(n);
+}
+
+/*Free up all allocated space from 'a', along with every
+table it has outgrown. No other thread may be using it
+*/
+void assoc_free(assoc* a) {
+
+    table *t = a->t, *next;
+
+    while (t != NULL) {
+        next = t->retired;
+        free(t->cells);
+        free(t);
+        t = next;
+    }
+    arena_free(a->owned);
+    free(a);
+}
+
+void _assoc_test(void);
+
+/* Sized once for n keys at BUILDLOAD. The keys are hashed,
+   then sorted by first bucket so each thread mostly holds
+   stripes no other thread wants, and inserted through the
+   usual locked path. A key's duplicates share its buckets,
+   and so its thread, and go in in input order: the first
+   one wins
+*/
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads) {
+
+    assoc* a = ncalloc(1, sizeof(assoc));
+    build b;
+
+    a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    a->t = _newtable(_fit(a, n));
+    if (n == 0) {
+        return a;
+    }
+    memset(&b, 0, sizeof(b));
+    b.a = a;
+    b.keys = keys;
+    b.data = data;
+    b.n = n;
+    b.parts = threads;
+    b.h = (uint64_t*) ncalloc(sizeof(uint64_t), n);
+    b.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    b.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    _parallel(_build_hash, &b, threads);
+    if (!_partition(n, threads, _build_part, &b, threads, b.order, \
+    b.start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    _parallel(_build_place, &b, threads);
+    free(b.h);
+    free(b.len);
+    free(b.order);
+    return a;
+}
+
+/* Hash thread t's share of the keys
+*/
+void _build_hash(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long i, lo, hi;
+
+    _slice(b->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (b->keys[i] == NULL) {
+            on_error("Error: Null pointer\n");
+        }
+        b->h[i] = _hashkey(b->a, b->keys[i], &b->len[i]);
+    }
+}
+
+/* Which thread's run of buckets key i's first bucket is in
+*/
+unsigned int _build_part(void* ctx, unsigned long i) {
+
+    build* b = (build*)ctx;
+
+    return (unsigned int)((unsigned long)_bucket_one(b->a->t, \
+    b->h[i]) * b->parts / b->a->t->capacity);
+}
+
+/* Thread t inserts its keys in input order
+*/
+void _build_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long k;
+    unsigned int i;
+    bool inserted;
+
+    (void)threads;
+    for (k = b->start[t]; k < b->start[t + 1]; k++) {
+        i = b->order[k];
+        _insert(b->a, b->keys[i], b->data ? b->data[i] : NULL, \
+        b->h[i], b->len[i], NULL, &inserted);
+    }
+}
+
+/* The table's own copy of a new key, len bytes long
+(not counting a string's '\0')
+*/
+void* _ownkey(assoc* a, void* key, unsigned int len) {
+
+    size_t size = a->keysize ? (size_t)len : (size_t)len + 1;
+    void* copy;
+
+    while (__atomic_test_and_set(&a->keylock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    copy = arena_copy(a->owned, key, size, \
+    arena_align(size, !a->keysize));
+    __atomic_clear(&a->keylock, __ATOMIC_RELEASE);
+    if (copy == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    return copy;
+}
+
+/* One 64 bit hash per key (see hashfn.h)
+*/
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len) {
+
+    *len = a->keysize;
+    if (!*len) {
+        *len = strlen((char*)key);
+    }
+    return a->hashfn(key, *len, HASHSEED);
+}
+
+/* An empty table of at least 'min' buckets a side, on the
+prime ladder (see sizing.h)
+*/
+table* _newtable(unsigned long min) {
+
+    table* t = ncalloc(1, sizeof(table));
+
+    t->capacity = _next_capacity(min, &t->recip);
+    if (!t->capacity) {
+        on_error("Error: Hash table too big\n");
+    }
+    t->cells = ncalloc(sizeof(cell), \
+    2 * (unsigned long)t->capacity * BUCKETSIZE);
+    return t;
+}
+
+unsigned int _bucket_one(table* t, uint64_t h) {
+
+    return _reduce((uint32_t)h, t->capacity, t->recip);
+}
+
+unsigned int _bucket_two(table* t, uint64_t h) {
+
+    return t->capacity + _reduce(h >> 32, t->capacity, t->recip);
+}
+
+/* The bucket a key in 'bucket' would be moved to
+*/
+unsigned int _other(table* t, unsigned int bucket, uint64_t h) {
+
+    if (bucket < t->capacity) {
+        return _bucket_two(t, h);
+    }
+    return _bucket_one(t, h);
+}
+
+/* Take the stripe covering 'bucket': wait for an even
+count and make it odd. The cells are stored relaxed, so the
+release fence keeps them from being seen before the odd
+count: otherwise a reader could read a half written cell
+and still find the count unchanged
+*/
+void _lock(assoc* a, unsigned int bucket) {
+
+    unsigned long* v = &a->version[bucket & (NSTRIPES - 1)].n;
+    unsigned long seen;
+    int spins = 0;
+
+    for (;;) {
+        seen = __atomic_load_n(v, __ATOMIC_RELAXED);
+        if (!(seen & 1) && __atomic_compare_exchange_n(v, &seen, \
+        seen + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return;
+        }
+        if (++spins == SPINS) {
+            spins = 0;
+            sched_yield();
+        }
+    }
+}
+
+void _unlock(assoc* a, unsigned int bucket) {
+
+    __atomic_add_fetch(&a->version[bucket & (NSTRIPES - 1)].n, 1, \
+    __ATOMIC_RELEASE);
+}
+
+/* Lower stripe first, so two writers can never each hold
+the stripe the other is waiting for
+*/
+void _lock_two(assoc* a, unsigned int b1, unsigned int b2) {
+
+    unsigned int s1 = b1 & (NSTRIPES - 1), s2 = b2 & (NSTRIPES - 1);
+
+    if (s1 == s2) {
+        _lock(a, s1);
+    }
+    else if (s1 < s2) {
+        _lock(a, s1);
+        _lock(a, s2);
+    }
+    else {
+        _lock(a, s2);
+        _lock(a, s1);
+    }
+}
+
+void _unlock_two(assoc* a, unsigned int b1, unsigned int b2) {
+
+    unsigned int s1 = b1 & (NSTRIPES - 1), s2 = b2 & (NSTRIPES - 1);
+
+    _unlock(a, s1);
+    if (s1 != s2) {
+        _unlock(a, s2);
+    }
+}
+
+/* A reader's snapshot of the stripe covering 'bucket',
+waiting out any writer
+*/
+unsigned long _read_begin(assoc* a, unsigned int bucket) {
+
+    unsigned long* v = &a->version[bucket & (NSTRIPES - 1)].n;
+    unsigned long seen;
+    int spins = 0;
+
+    while ((seen = __atomic_load_n(v, __ATOMIC_ACQUIRE)) & 1) {
+        if (++spins == SPINS) {
+            spins = 0;
+            sched_yield();
+        }
+    }
+    return seen;
+}
+
+/* Cached hash first, so the stored key is only followed
+when it is almost certainly the one
+*/
+bool _keymatch(assoc* a, cell* c, void* key, uint64_t h, \
+unsigned int len) {
+
+    void* stored = __atomic_load_n(&c->key, __ATOMIC_ACQUIRE);
+
+    if (stored == NULL || \
+    __atomic_load_n(&c->hash, __ATOMIC_RELAXED) != h) {
+        return false;
+    }
+    STAT_ADD(a->stats.compares, 1);
+    if (!a->keysize) {
+        return !strcmp((char*)stored, (char*)key);
+    }
+    return !memcmp(stored, key, len);
+}
+
+/* The cell of 'bucket' holding key, if any. Either under
+the bucket's stripe, or checked against its version after
+*/
+cell* _find(assoc* a, table* t, unsigned int bucket, void* key, \
+uint64_t h, unsigned int len) {
+
+    cell* b = &t->cells[(unsigned long)bucket * BUCKETSIZE];
+    unsigned int i;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (_keymatch(a, &b[i], key, h, len)) {
+            return &b[i];
+        }
+    }
+    return NULL;
+}
+
+cell* _free_slot(table* t, unsigned int bucket) {
+
+    cell* b = &t->cells[(unsigned long)bucket * BUCKETSIZE];
+    unsigned int i;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (__atomic_load_n(&b[i].key, __ATOMIC_RELAXED) == NULL) {
+            return &b[i];
+        }
+    }
+    return NULL;
+}
+
+/* Fill a cell under its stripe, the key last since a
+non-NULL key is what makes the cell live
+*/
+void _put(cell* c, void* key, void* data, uint64_t h) {
+
+    __atomic_store_n(&c->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->hash, h, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->key, key, __ATOMIC_RELEASE);
+}
+
+/* With both of the key's stripes held: ignore a duplicate,
+else use a free cell in either bucket. *at is the key's
+cell either way. u != NULL => its data is set from u->fn
+before the stripes are let go, and left in u->data
+*/
+outcome _add(assoc* a, table* t, void* key, void* data, uint64_t h, \
+unsigned int len, change* u, cell** at) {
+
+    unsigned int b1 = _bucket_one(t, h), b2 = _bucket_two(t, h);
+    outcome result = full;
+    cell* c;
+
+    _lock_two(a, b1, b2);
+    /*A resize got in first*/
+    if (__atomic_load_n(&a->t, __ATOMIC_RELAXED) != t) {
+        result = stale;
+    }
+    else if ((*at = _find(a, t, b1, key, h, len)) != NULL || \
+    (*at = _find(a, t, b2, key, h, len)) != NULL) {
+        if (u != NULL) {
+            u->data = u->fn((*at)->data, false, u->arg);
+            __atomic_store_n(&(*at)->data, u->data, __ATOMIC_RELAXED);
+        }
+        result = present;
+    }
+    else if ((c = _free_slot(t, b1)) != NULL || \
+    (c = _free_slot(t, b2)) != NULL) {
+        if (a->owned != NULL) {
+            key = _ownkey(a, key, len);
+        }
+        if (u != NULL) {
+            data = u->data = u->fn(NULL, true, u->arg);
+        }
+        _put(c, key, data, h);
+        __atomic_add_fetch(&a->size, 1, __ATOMIC_RELAXED);
+        *at = c;
+        result = added;
+    }
+    _unlock_two(a, b1, b2);
+    return result;
+}
+
+/* Walk from bucket 'from', noting which key would be
+bounced out at each step, until a bucket with a free cell
+turns up. No locks: the path is checked as it is used
+*/
+bool _findpath(table* t, unsigned int from, uint64_t h, step* path, \
+int* n) {
+
+    unsigned int b = from, slot;
+    cell* c;
+
+    for (*n = 0; *n < MAXPATH; *n += 1) {
+        slot = ((unsigned int)h + *n) % BUCKETSIZE;
+        c = &t->cells[(unsigned long)b * BUCKETSIZE + slot];
+        path[*n].bucket = b;
+        path[*n].slot = slot;
+        path[*n].key = __atomic_load_n(&c->key, __ATOMIC_RELAXED);
+        /*Emptied since we looked, nothing left to move*/
+        if (path[*n].key == NULL) {
+            return true;
+        }
+        b = _other(t, b, __atomic_load_n(&c->hash, __ATOMIC_RELAXED));
+        if (_free_slot(t, b) != NULL) {
+            *n += 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Free a cell in one of the buckets for hash h by moving
+keys along a displacement path, last move first. Each move
+holds just the two stripes it touches and gives up if the
+path has changed. false => no path, the table is too full
+*/
+bool _make_room(assoc* a, table* t, uint64_t h) {
+
+    step path[MAXPATH];
+    int n, i;
+    unsigned int src, dst;
+    cell *c, *free;
+    void* key;
+    uint64_t kh;
+
+    if (!_findpath(t, _bucket_one(t, h), h, path, &n) && \
+    !_findpath(t, _bucket_two(t, h), h, path, &n)) {
+        return false;
+    }
+    for (i = n - 1; i >= 0; i--) {
+        src = path[i].bucket;
+        c = &t->cells[(unsigned long)src * BUCKETSIZE + path[i].slot];
+        key = path[i].key;
+        if (key == NULL) {
+            continue;
+        }
+        kh = __atomic_load_n(&c->hash, __ATOMIC_RELAXED);
+        dst = _other(t, src, kh);
+        _lock_two(a, src, dst);
+        if (__atomic_load_n(&a->t, __ATOMIC_RELAXED) != t || \
+        __atomic_load_n(&c->key, __ATOMIC_RELAXED) != key || \
+        __atomic_load_n(&c->hash, __ATOMIC_RELAXED) != kh || \
+        (free = _free_slot(t, dst)) == NULL) {
+            _unlock_two(a, src, dst);
+            return true;
+        }
+        _put(free, key, __atomic_load_n(&c->data, __ATOMIC_RELAXED), kh);
+        __atomic_store_n(&c->key, NULL, __ATOMIC_RELAXED);
+        _unlock_two(a, src, dst);
+    }
+    return true;
+}
+
+/* Hold every stripe, so nothing else is reading a stable
+view or writing, and swap in a table of at least 'min'
+buckets. 't' is the table the caller found full; if another
+thread has already replaced it there is nothing to do
+*/
+void _resize(assoc* a, table* t, unsigned long min) {
+
+    table* b;
+    unsigned int i, threads;
+    unsigned long since, lat;
+
+    for (i = 0; i < NSTRIPES; i++) {
+        _lock(a, i);
+    }
+    if (__atomic_load_n(&a->t, __ATOMIC_RELAXED) == t) {
+        since = _stat_clock();
+        lat = _lat_resizing();
+        /*With every stripe held the size is exact*/
+        threads = _rehash_threads(a->size);
+        b = threads > 1 ? _grow_parallel(t, min, threads) : _grow(t, min);
+        b->retired = t;
+        __atomic_store_n(&a->t, b, __ATOMIC_RELEASE);
+        _stat_resized(&a->stats, since);
+        _lat_resized(lat);
+    }
+    for (i = 0; i < NSTRIPES; i++) {
+        _unlock(a, i);
+    }
+}
+
+/* Copy every key into a table of at least 'min' buckets. A
+copy can run out of room as well, in which case go up a
+size and try again
+*/
+table* _grow(table* t, unsigned long min) {
+
+    unsigned long i, cells = 2 * (unsigned long)t->capacity * \
+    BUCKETSIZE;
+    table* b;
+    bool ok;
+
+    for (;;) {
+        b = _newtable(min);
+        ok = true;
+        for (i = 0; ok && i < cells; i++) {
+            if (t->cells[i].key != NULL) {
+                ok = _place(b, t->cells[i]);
+            }
+        }
+        if (ok) {
+            return b;
+        }
+        min = (unsigned long)b->capacity + 1;
+        free(b->cells);
+        free(b);
+    }
+}
+
+/* _grow() over threads, for tables big enough to share
+   out. Each pass of _grow_place() gives a thread the keys
+   whose first (then second) bucket is in its own run, so it
+   can take a free cell there without locks. Only keys both
+   buckets of which filled up are left to _place(), on this
+   thread
+*/
+table* _grow_parallel(table* t, unsigned long min, unsigned int threads) {
+
+    unsigned long i, cells = 2 * (unsigned long)t->capacity * \
+    BUCKETSIZE;
+    regrow r;
+    long n;
+    bool ok;
+
+    memset(&r, 0, sizeof(r));
+    r.t = t;
+    r.parts = threads;
+    r.items = (cell*) ncalloc(sizeof(cell), cells);
+    if ((n = _gather(cells, _grow_kept, _grow_put, &r, threads)) < 0) {
+        on_error("Error: Cannot allocate gather counts\n");
+    }
+    r.n = (unsigned long)n;
+    r.placed = (bool*) ncalloc(sizeof(bool), r.n + 1);
+    r.order = (unsigned int*) ncalloc(sizeof(unsigned int), r.n + 1);
+    for (;;) {
+        r.b = _newtable(min);
+        memset(r.placed, 0, sizeof(bool) * r.n);
+        for (r.second = false; ; r.second = true) {
+            if (!_partition(r.n, threads, _grow_part, &r, threads, \
+            r.order, r.start)) {
+                on_error("Error: Cannot allocate partition counts\n");
+            }
+            _parallel(_grow_place, &r, threads);
+            if (r.second) {
+                break;
+            }
+        }
+        ok = true;
+        for (i = 0; ok && i < r.n; i++) {
+            if (!r.placed[i]) {
+                ok = _place(r.b, r.items[i]);
+            }
+        }
+        if (ok) {
+            break;
+        }
+        min = (unsigned long)r.b->capacity + 1;
+        free(r.b->cells);
+        free(r.b);
+    }
+    free(r.items);
+    free(r.placed);
+    free(r.order);
+    return r.b;
+}
+
+bool _grow_kept(void* ctx, unsigned long i) {
+
+    return ((regrow*)ctx)->t->cells[i].key != NULL;
+}
+
+/* Key k of the resize is in old cell i
+*/
+void _grow_put(void* ctx, unsigned long i, unsigned long k) {
+
+    regrow* r = (regrow*)ctx;
+
+    r->items[k] = r->t->cells[i];
+}
+
+/* Which thread's run of buckets key i goes to in this pass
+*/
+unsigned int _grow_part(void* ctx, unsigned long i) {
+
+    regrow* r = (regrow*)ctx;
+    unsigned long bucket = r->second ? \
+    _bucket_two(r->b, r->items[i].hash) - r->b->capacity : \
+    _bucket_one(r->b, r->items[i].hash);
+
+    return (unsigned int)(bucket * r->parts / r->b->capacity);
+}
+
+/* Thread t puts each of its keys not yet placed in a free
+cell of this pass's bucket, if it has one
+*/
+void _grow_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    regrow* r = (regrow*)ctx;
+    unsigned long k;
+    unsigned int i, bucket;
+    cell* c;
+
+    (void)threads;
+    for (k = r->start[t]; k < r->start[t + 1]; k++) {
+        i = r->order[k];
+        if (r->placed[i]) {
+            continue;
+        }
+        bucket = r->second ? _bucket_two(r->b, r->items[i].hash) : \
+        _bucket_one(r->b, r->items[i].hash);
+        if ((c = _free_slot(r->b, bucket)) != NULL) {
+            *c = r->items[i];
+            r->placed[i] = true;
+        }
+    }
+}
+
+/* Buckets to grow 't' to: growth times as many, and
+always at least one size up
+*/
+unsigned long _grown(assoc* a, table* t) {
+
+    unsigned long min = (unsigned long)ceil(t->capacity * a->growth);
+
+    return min > t->capacity ? min : (unsigned long)t->capacity + 1;
+}
+
+/* Keys 't' may hold before an insert grows it
+*/
+unsigned long _limit(assoc* a, table* t) {
+
+    return (unsigned long)(2.0 * BUCKETSIZE * t->capacity * \
+    a->maxload + 1e-6);
+}
+
+/* Buckets for n keys at BUILDLOAD, or maxload if that's
+lower, so they'll place without bouncing far
+*/
+unsigned long _fit(assoc* a, unsigned long n) {
+
+    double load = a->maxload < BUILDLOAD ? a->maxload : BUILDLOAD;
+    unsigned long min = (unsigned long)ceil(n / (2 * BUCKETSIZE * load));
+
+    return min > INITIALSIZE ? min : INITIALSIZE;
+}
+
+/* Single threaded cuckoo insert into a table nobody else
+can see yet
+*/
+bool _place(table* t, cell item) {
+
+    unsigned int b = _bucket_one(t, item.hash), n;
+    cell *c, old;
+
+    for (n = 0; n < MAXPATH; n++) {
+        if ((c = _free_slot(t, b)) != NULL || \
+        (c = _free_slot(t, _other(t, b, item.hash))) != NULL) {
+            *c = item;
+            return true;
+        }
+        c = &t->cells[(unsigned long)b * BUCKETSIZE + n % BUCKETSIZE];
+        old = *c;
+        *c = item;
+        item = old;
+        b = _other(t, b, item.hash);
+    }
+    return false;
+}
+
+typedef struct testarg {
+    assoc* a;
+    int* keys;
+    int first;
+    int n;
+    /* UPDATEKEYS keys shared by every thread */
+    int* counted;
+} testarg;
+
+/* Insert a run of keys, checking keys of the previous run
+(another thread's) are never missing once seen
+*/
+static void* _testworker(void* arg) {
+
+    testarg* w = (testarg*)arg;
+    int i;
+
+    for (i = w->first; i < w->first + w->n; i++) {
+        assoc_insert(&w->a, &w->keys[i], &w->keys[i]);
+        assert(assoc_lookup(w->a, &w->keys[i]) == &w->keys[i]);
+    }
+    return NULL;
+}
+
+/* Count a key up by one, its data being the count
+*/
+static void* _testcount(void* data, bool inserted, void* arg) {
+
+    (void)arg;
+    assert(inserted == (data == NULL));
+    return (void*)((uintptr_t)data + 1);
+}
+
+/* Insert a run of keys, counting up the shared keys as
+they go. The inserts move cells and grow the table under
+the counts, and not one may be lost
+*/
+static void* _testupdater(void* arg) {
+
+    testarg* w = (testarg*)arg;
+    int i;
+
+    for (i = w->first; i < w->first + w->n; i++) {
+        assoc_insert(&w->a, &w->keys[i], &w->keys[i]);
+        assoc_update(&w->a, &w->counted[i % UPDATEKEYS], _testcount, \
+        NULL);
+    }
+    return NULL;
+}
+
+void _assoc_test(void) {
+
+    int i, ints[1000], *many;
+    unsigned int b1, b2, len, capacity;
+    uint64_t h;
+    char words[1000][8], str[8];
+    step path[MAXPATH];
+    int n, last;
+    void *keys[37], *out[37], **pairs, **slot;
+    bool fresh;
+    assocstats st;
+    assoclatency lat;
+    unsigned long sum;
+    pthread_t th[TESTTHREADS];
+    testarg w[TESTTHREADS];
+    assoc *a, *b;
+    table* t;
+
+    /* Test assoc_init function*/
+    a = assoc_init(sizeof(int));
+    assert(assoc_count(a) == 0);
+    assert(a->t->capacity == _next_capacity(INITIALSIZE, &a->t->recip));
+    for (i = 0; i < NSTRIPES; i++) {
+        assert(a->version[i].n == 0);
+    }
+
+    /*Test a key's buckets are one in each half*/
+    i = 42;
+    h = _hashkey(a, &i, &len);
+    b1 = _bucket_one(a->t, h);
+    b2 = _bucket_two(a->t, h);
+    assert(b1 < a->t->capacity);
+    assert(b2 >= a->t->capacity && b2 < 2 * a->t->capacity);
+    assert(_other(a->t, b1, h) == b2);
+    assert(_other(a->t, b2, h) == b1);
+
+    /*Test stripes: odd while held, even again after*/
+    _lock_two(a, b1, b2);
+    assert(a->version[b1 & (NSTRIPES - 1)].n & 1);
+    assert(a->version[b2 & (NSTRIPES - 1)].n & 1);
+    _unlock_two(a, b1, b2);
+    assert(_read_begin(a, b1) == 2);
+    assert(_read_begin(a, b2) == 2);
+
+    /*Test an insert bumps the versions readers check*/
+    assoc_insert(&a, &i, &ints[0]);
+    assert(_read_begin(a, b1) == 4);
+    assert(assoc_lookup(a, &i) == &ints[0]);
+    assoc_free(a);
+
+    /*Test a displacement path frees a cell in a full bucket*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i;
+    }
+    t = a->t;
+    h = _hashkey(a, &ints[0], &len);
+    b1 = _bucket_one(t, h);
+    for (i = 1, n = 0; n < BUCKETSIZE; i++) {
+        if (_bucket_one(t, _hashkey(a, &ints[i], &len)) == b1) {
+            assoc_insert(&a, &ints[i], &ints[i]);
+            n++;
+        }
+    }
+    last = i;
+    assert(_free_slot(t, b1) == NULL);
+    assert(_findpath(t, b1, h, path, &n));
+    assert(n >= 1 && path[0].bucket == b1);
+    assert(_make_room(a, t, h));
+    assert(_free_slot(t, b1) != NULL);
+    assert(assoc_count(a) == BUCKETSIZE);
+    for (i = 1; i < last; i++) {
+        if (_bucket_one(t, _hashkey(a, &ints[i], &len)) == b1) {
+            assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+        }
+    }
+    assoc_free(a);
+
+    /*Test ints: all found, duplicates ignored, grows in place*/
+    a = assoc_init(sizeof(int));
+    capacity = a->t->capacity;
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(a->t->capacity > capacity);
+    assert(a->t->retired != NULL);
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_insert(&a, &ints[5], NULL);
+    assert(assoc_count(a) == 1000);
+    assert(assoc_lookup(a, &ints[5]) == &ints[5]);
+    i = -1;
+    assert(assoc_lookup(a, &i) == NULL);
+    /*...unless replaced through assoc_upsert*/
+    slot = assoc_upsert(&a, &ints[5], &fresh);
+    assert(!fresh && *slot == &ints[5]);
+    *slot = &ints[6];
+    assert(assoc_lookup(a, &ints[5]) == &ints[6]);
+    assert(assoc_count(a) == 1000);
+    *slot = &ints[5];
+
+    /*Test counting with assoc_upsert through resizes: new
+    keys come back with NULL data, and are only copied then*/
+    b = assoc_init(sizeof(int));
+    assoc_ownkeys(b);
+    many = (int*) ncalloc(sizeof(int), 500);
+    for (i = 0; i < 2000; i++) {
+        len = (unsigned int)i % 500;
+        slot = assoc_upsert(&b, &len, &fresh);
+        assert(fresh == (i < 500));
+        if (fresh) {
+            assert(*slot == NULL);
+            *slot = &many[len];
+        }
+        (*(int*)*slot)++;
+    }
+    assert(assoc_count(b) == 500);
+    assert(b->owned->bytes == 500 * sizeof(int));
+    for (len = 0; len < 500; len++) {
+        assert(assoc_lookup(b, &len) == &many[len]);
+        assert(many[len] == 4);
+    }
+    assert(assoc_upsert(&b, &len, NULL) != NULL);
+    assoc_free(b);
+    free(many);
+
+    /*Test batched lookups agree with single ones, misses
+    included, in batches that don't divide evenly*/
+    for (i = 0; i < 37; i++) {
+        keys[i] = &ints[i * 27];
+    }
+    i = -1;
+    keys[35] = &i;
+    keys[36] = NULL;
+    assoc_lookup_batch(a, keys, 37, out);
+    for (n = 0; n < 37; n++) {
+        assert(out[n] == (n < 35 ? keys[n] : NULL));
+        assert(out[n] == assoc_lookup(a, keys[n]));
+    }
+    assoc_free(a);
+
+    /*Test strings and another hash function*/
+    a = assoc_init(0);
+    assoc_sethash(a, hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        sprintf(words[i], "w%d", i * 31);
+        assoc_insert(&a, words[i], words[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, words[i]) == words[i]);
+    }
+    assert(assoc_count(a) == 1000);
+    assoc_free(a);
+
+    /*Test threads inserting and reading at once through
+    several resizes*/
+    a = assoc_init(sizeof(int));
+    many = ncalloc(sizeof(int), TESTKEYS);
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i;
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        w[i].a = a;
+        w[i].keys = many;
+        w[i].first = i * (TESTKEYS / TESTTHREADS);
+        w[i].n = TESTKEYS / TESTTHREADS;
+        pthread_create(&th[i], NULL, _testworker, &w[i]);
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    assert(assoc_count(a) == TESTKEYS);
+    for (i = 0; i < TESTKEYS; i++) {
+        assert(assoc_lookup(a, &many[i]) == &many[i]);
+    }
+    assoc_free(a);
+
+    /*Test assoc_update alongside other threads' inserts:
+    every count is kept, however often the cells move*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < UPDATEKEYS; i++) {
+        ints[i] = -1 - i;
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        w[i].a = a;
+        w[i].keys = many;
+        w[i].first = i * (TESTKEYS / TESTTHREADS);
+        w[i].n = TESTKEYS / TESTTHREADS;
+        w[i].counted = ints;
+        pthread_create(&th[i], NULL, _testupdater, &w[i]);
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    assert(a->t->retired != NULL);
+    assert(assoc_count(a) == TESTKEYS + UPDATEKEYS);
+    for (i = 0; i < UPDATEKEYS; i++) {
+        assert((uintptr_t)assoc_lookup(a, &ints[i]) == \
+        TESTKEYS / UPDATEKEYS);
+    }
+    for (i = 0; i < TESTKEYS; i++) {
+        assert(assoc_lookup(a, &many[i]) == &many[i]);
+    }
+    /*The data left is what assoc_update returns*/
+    assert((uintptr_t)assoc_update(&a, &ints[0], _testcount, NULL) == \
+    TESTKEYS / UPDATEKEYS + 1);
+    free(many);
+    assoc_free(a);
+
+    /*Test a build matches inserting in order: duplicates
+    keep the first data, whatever thread they went to, and
+    the table never needed to grow*/
+    many = ncalloc(sizeof(int), BUILDKEYS);
+    pairs = ncalloc(sizeof(void*), BUILDKEYS * 2);
+    for (i = 0; i < BUILDKEYS; i++) {
+        many[i] = i * 7919;
+        /*Every fifth key comes round again later*/
+        pairs[i] = &many[i % 5 ? i : i / 5];
+        pairs[BUILDKEYS + i] = &many[i];
+    }
+    for (n = 1; n <= TESTTHREADS; n += 3) {
+        a = _build(pairs, &pairs[BUILDKEYS], BUILDKEYS, sizeof(int), \
+        (unsigned int)n);
+        assert(a->t->retired == NULL);
+        b = assoc_init(sizeof(int));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assoc_insert(&b, pairs[i], pairs[BUILDKEYS + i]);
+        }
+        assert(assoc_count(a) == assoc_count(b));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assert(assoc_lookup(a, &many[i]) == \
+            assoc_lookup(b, &many[i]));
+        }
+        /*...and a resize on as many threads keeps every key,
+        at the same size, where the last few go to _place(),
+        and at twice it*/
+        for (len = 1; len <= 2; len++) {
+            capacity = len * a->t->capacity;
+            t = _grow_parallel(a->t, capacity, (unsigned int)n);
+            assert(t->capacity >= capacity);
+            t->retired = a->t;
+            a->t = t;
+            for (i = 0; i < BUILDKEYS; i++) {
+                assert(assoc_lookup(a, &many[i]) == \
+                assoc_lookup(b, &many[i]));
+            }
+        }
+        assoc_free(a);
+        assoc_free(b);
+    }
+    free(many);
+    free(pairs);
+
+    /*Test strings, no data and an empty build*/
+    a = assoc_build(keys, NULL, 0, 0);
+    assert(assoc_count(a) == 0);
+    for (i = 0; i < 37; i++) {
+        keys[i] = words[i % 30];
+    }
+    assoc_free(a);
+    a = _build(keys, NULL, 37, 0, 3);
+    assert(assoc_count(a) == 30);
+    assert(assoc_lookup(a, words[29]) == NULL);
+    assoc_insert(&a, words[30], words[30]);
+    assert(assoc_lookup(a, words[30]) == words[30]);
+    assoc_free(a);
+
+    /*Test reserving up front means no growing after, and
+    shrinking keeps every key and drops the retired tables*/
+    many = ncalloc(sizeof(int), BUILDKEYS);
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, BUILDKEYS);
+    t = a->t;
+    assert(t->capacity >= _fit(a, BUILDKEYS));
+    for (i = 0; i < BUILDKEYS; i++) {
+        many[i] = i;
+        assoc_insert(&a, &many[i], &many[i]);
+    }
+    assert(a->t == t);
+    assoc_reserve(&a, 10);
+    assert(a->t == t);
+    assoc_free(a);
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < BUILDKEYS; i += 100) {
+        assoc_insert(&a, &many[i], &many[i]);
+    }
+    assoc_reserve(&a, BUILDKEYS);
+    assert(a->t->retired != NULL);
+    assoc_shrink_to_fit(&a);
+    assert(a->t->retired == NULL);
+    assert(a->t->capacity < _fit(a, BUILDKEYS));
+    assert(assoc_count(a) == BUILDKEYS / 100);
+    for (i = 0; i < BUILDKEYS; i += 100) {
+        assert(assoc_lookup(a, &many[i]) == &many[i]);
+    }
+    assoc_free(a);
+
+    /*Test a gentler policy grows more often, in smaller
+    steps, and never beyond maxload*/
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 1.5, 0.5);
+    assoc_setgrowth(a, 0, 0);
+    assert(fabs(a->growth - 1.5) < 1e-9 && \
+    fabs(a->maxload - 0.5) < 1e-9);
+    for (i = 0, n = 0; i < BUILDKEYS; i++) {
+        t = a->t;
+        assoc_insert(&a, &many[i], &many[i]);
+        if (a->t != t) {
+            n++;
+            assert(a->t->capacity <= (unsigned long)t->capacity * 2);
+        }
+        assert(assoc_count(a) <= _limit(a, a->t));
+    }
+    assert(n >= 3);
+    for (i = 0; i < BUILDKEYS; i++) {
+        assert(assoc_lookup(a, &many[i]) == &many[i]);
+    }
+    assoc_free(a);
+
+    /*Test owned keys from several threads at once: each
+    key is copied exactly once, and outlives the caller's
+    copy*/
+    assoc_latency_reset();
+    a = assoc_init(sizeof(int));
+    assoc_ownkeys(a);
+    for (i = 0; i < TESTTHREADS; i++) {
+        w[i].a = a;
+        w[i].keys = many;
+        w[i].first = i * (TESTKEYS / TESTTHREADS);
+        w[i].n = TESTKEYS / TESTTHREADS;
+        pthread_create(&th[i], NULL, _testworker, &w[i]);
+    }
+    /*Stats and latency can be had while the inserts go on*/
+    assoc_stats(a, &st);
+    assert(st.size <= TESTKEYS);
+    assoc_latency(&lat);
+    for (i = 0; i < TESTTHREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    assert(assoc_count(a) == TESTKEYS);
+    assert(a->owned->bytes == TESTKEYS * sizeof(int));
+
+    /*Test latency: each thread times 1 in LATSAMPLE of its
+    own inserts and lookups, all of them hits*/
+    assoc_latency(&lat);
+    sum = latency_total(&lat, LAT_INSERT) + latency_total(&lat, LAT_HIT);
+#if LATENCY
+    assert(sum == TESTTHREADS * (2 * TESTKEYS / TESTTHREADS / LATSAMPLE));
+    assert(latency_total(&lat, LAT_MISS) == 0);
+    assert(latency_total(&lat, LAT_RESIZE) >= 1);
+#else
+    assert(sum == 0 && latency_total(&lat, LAT_RESIZE) == 0);
+#endif
+
+    /*Test stats once they're done: every key in one of its
+    two buckets, and counters that only move with STATS*/
+    assoc_stats(a, &st);
+    assert(st.size == TESTKEYS);
+    assert(st.slots == 2 * (unsigned long)a->t->capacity * BUCKETSIZE);
+    for (i = 0, sum = 0; i < STATBINS; i++) {
+        sum += st.probes[i];
+    }
+    assert(sum == TESTKEYS && st.probes[0] + st.probes[1] == sum);
+    assert(st.bytes > TESTKEYS * (sizeof(cell) + sizeof(int)));
+#if STATS
+    assert(st.resizes >= 1 && st.searches == 2 * TESTKEYS);
+    assert(st.compares >= TESTKEYS);
+#else
+    assert(!st.resizes && !st.searches && !st.compares);
+#endif
+    for (i = 0; i < TESTKEYS; i++) {
+        n = many[i];
+        many[i] = -1;
+        assert(assoc_lookup(a, &n) == &many[i]);
+    }
+    assoc_free(a);
+    free(many);
+
+    /*Test owning string keys after a build*/
+    for (i = 0; i < 30; i++) {
+        keys[i] = words[i];
+    }
+    a = assoc_build(keys, keys, 30, 0);
+    assoc_ownkeys(a);
+    assoc_insert(&a, "owned", NULL);
+    for (i = 0; i < 30; i++) {
+        strcpy(str, words[i]);
+        words[i][0] = '\0';
+        assert(assoc_lookup(a, str) == words[i]);
+    }
+    assert(assoc_count(a) == 31);
+    assoc_free(a);
+}
@@ -0,0 +1,1848 @@
+/* cuckoo.c's two tables of BUCKETSIZE cell buckets, laid
+   out for size.
+
+   A cuckoo.c cell is a struct of key, data, cached hash,
+   length and flag: 32 bytes, and two of them to every
+   capacity bucket slot. Here each of the two sides is a set
+   of parallel arrays instead - one byte per bucket of
+   occupancy bits, one tag byte per cell (8 bits of the hash,
+   so mismatches are turned away without following the key),
+   then the keys and the data. Finding a key reads the
+   bucket's bits and tags, then only keys whose tag matches.
+   That is 17 bytes a cell, and a bucket's keys share half a
+   cache line.
+
+   Built with -DHANDLES=1 the keys and data are 32 bit
+   indices into arrays given by assoc_setbase() (compact.h),
+   9 bytes a cell, and four buckets' keys to a cache line.
+
+   There is no cached hash, so keys bounced or rehashed are
+   hashed again.
+
+   assoc_save() writes the HANDLES layout to a file whatever
+   the build: the side arrays as they are, then the keys and
+   data they index. A HANDLES build can then mmap it and
+   look up in place (assoc_open_mapped), so a warm start
+   copies nothing however big the table.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "compact.h"
+#include "sizing.h"
+#include "parallel.h"
+#include "arena.h"
+#include "stats.h"
+#include "latency.h"
+#include "../../ADTs/General/general.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Keys and data as 32 bit indices, see compact.h */
+#ifndef HANDLES
+#define HANDLES 0
+#endif
+
+#define INITIALSIZE 17
+/* Default growth factor and maximum load, see
+assoc_setgrowth(). At 1 only running out of bounces
+resizes. Smaller steps than cuckoo.c, this engine is about
+size */
+#define SCALEFACTOR 2
+#define MAXLOAD 1.0
+#define BUCKETSIZE 4
+#define BOUNCES 16
+/* Fill aimed for by assoc_build, as in cuckoo.c */
+#define BUILDLOAD 0.85
+/* Keys hashed and prefetched ahead in assoc_lookup_batch */
+#define BATCH 16
+/* Spreads the hash over the tag byte */
+#define TAGMIX 0x9e3779b97f4a7c15ULL
+/* Index for NULL data */
+#define NOREF UINT32_MAX
+/* Snapshot files, see assoc_save() */
+#define MAPMAGIC "ASSOCMAP"
+#define MAPVERSION 2
+/* Every section of a snapshot starts on a cache line */
+#define MAPALIGN 64
+#define TESTKEYS 50000
+#define MAPTEST "_assoc_test.map"
+
+#if HANDLES
+typedef uint32_t ref;
+#else
+typedef void* ref;
+#endif
+
+/* One of the two tables */
+typedef struct side {
+    /* bit i set => cell i of the bucket is in use */
+    unsigned char* used;
+    unsigned char* tags;
+    ref* keys;
+    ref* data;
+} side;
+
+struct assoc {
+    side t[2];
+    /* buckets a side */
+    unsigned int capacity;
+    /* reciprocal of capacity, see sizing.h */
+    unsigned long recip;
+    unsigned int size;
+    unsigned int keysize;
+    hashfunc hashfn;
+    /* see assoc_setgrowth() */
+    double growth;
+    double maxload;
+    /* copies of the keys, NULL => the caller's own
+       (assoc_ownkeys) */
+    arena* owned;
+    /* HANDLES : what indices count from, see compact.h */
+    char* keybase;
+    char* database;
+    unsigned int datasize;
+    /* the snapshot a read only table lives in, NULL =>
+       an ordinary table (assoc_open_mapped) */
+    void* map;
+    size_t maplen;
+    /* see stats.h */
+    counters stats;
+};
+
+/* Start of a snapshot file. The offsets are from the start
+of the file, one of each array for either side. Numbers are
+in the saving machine's byte order */
+typedef struct maphead {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucketsize;
+    uint32_t keysize;
+    uint32_t datasize;
+    uint32_t capacity;
+    uint32_t size;
+    /* the hash function's value for MAPMAGIC, so a table is
+    never read with another one */
+    uint64_t hashcheck;
+    uint64_t used[2];
+    uint64_t tags[2];
+    uint64_t keys[2];
+    uint64_t data[2];
+    uint64_t keybytes;
+    uint64_t databytes;
+    /* bytes in the key and data blocks */
+    uint64_t keylen;
+    uint64_t datalen;
+    uint64_t length;
+} maphead;
+
+/* A key on its way in or out of a cell */
+typedef struct item {
+    void* key;
+    void* data;
+    uint64_t h;
+    unsigned int len;
+} item;
+
+/* Shared by the threads hashing for assoc_build */
+typedef struct build {
+    assoc* a;
+    void** keys;
+    unsigned int n;
+    uint64_t* h;
+    unsigned int* len;
+} build;
+
+/* Shared by the threads of a parallel rehash. Every key of
+the old table is read out, and so hashed again, into
+items[]; each thread then fills a run of buckets on side 0,
+then on side 1, marking what it placed */
+typedef struct rehash {
+    assoc* a;
+    assoc* b;
+    item* items;
+    bool* placed;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 1];
+    unsigned int parts;
+    unsigned int side;
+    unsigned int added[MAXTHREADS];
+} rehash;
+
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads);
+void _build_hash(void* ctx, unsigned int t, unsigned int threads);
+uint64_t _hashkey(assoc* a, void* key, unsigned int* len);
+void _makeitem(assoc* a, item* it, void* key, void* data);
+unsigned int _bucket(assoc* a, unsigned int s, uint64_t h);
+unsigned char _tag(uint64_t h);
+ref _toref(char* base, unsigned int size, void* p);
+void* _fromref(char* base, unsigned int size, ref r);
+void* _key(assoc* a, side* s, unsigned long cell);
+void* _data(assoc* a, side* s, unsigned long cell);
+void _set(assoc* a, side* s, unsigned long cell, item* it);
+void _get(assoc* a, side* s, unsigned long cell, item* it);
+bool _keymatch(assoc* a, void* stored, void* key, unsigned int len);
+long _find(assoc* a, side* s, unsigned int bucket, void* key, \
+uint64_t h, unsigned int len);
+long _lookup(assoc* a, void* key, uint64_t h, unsigned int len, \
+side** s);
+long _add_free(assoc* a, unsigned int s, item* it);
+bool _place(assoc* a, item* it);
+long _upsert(assoc** a, void* key, void* data, bool* inserted, \
+side** s);
+void* _ownkey(assoc* a, void* key);
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip);
+assoc* _realloc(assoc* a);
+void _drop(assoc* a);
+void _writable(assoc* a);
+uint64_t _hashcheck(hashfunc fn);
+uint64_t _mapput(FILE* f, const void* p, size_t n);
+void* _mapsection(maphead* hd, char* map, uint64_t off, uint64_t n);
+void _mapcheck(maphead* hd, char* map);
+assoc* _grow(assoc* a, item* it);
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip);
+unsigned int _primetable(assoc* a, unsigned long* recip);
+unsigned long _limit(assoc* a, unsigned int capacity);
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip);
+bool _rehash(assoc* a, assoc* b);
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads);
+bool _old_kept(void* ctx, unsigned long i);
+void _old_put(void* ctx, unsigned long i, unsigned long k);
+unsigned int _rehash_part(void* ctx, unsigned long i);
+void _rehash_place(void* ctx, unsigned int t, unsigned int threads);
+int _log2(unsigned int n);
+
+/*
+   Initialise the Associative array
+   keysize : number of bytes (or 0 => string)
+
+   capacity counts buckets: each side holds
+   capacity*BUCKETSIZE cells, and a key may sit in
+   any cell of its bucket on either side
+*/
+
+assoc* assoc_init(int keysize) {
+
+    assoc proto;
+    unsigned long recip;
+    unsigned int capacity = _next_capacity(INITIALSIZE, &recip);
+
+    memset(&proto, 0, sizeof(proto));
+    proto.keysize = keysize;
+    proto.hashfn = hash_default(keysize);
+    proto.growth = SCALEFACTOR;
+    proto.maxload = MAXLOAD;
+    return _alloc(&proto, capacity, recip);
+}
+
+/*
+   Insert key/data pair
+   - may cause resize, therefore 'a' might
+   be changed due to a realloc() etc.
+*/
+
+void assoc_insert(assoc** a, void* key, void* data) {
+
+    unsigned long lat = _lat_start();
+    bool inserted;
+    side* s;
+
+    _upsert(a, key, data, &inserted, &s);
+    _lat_stop(lat, LAT_INSERT);
+}
+
+/* Find or insert key with one hash, see _upsert(). With
+HANDLES the data is an index, so there's no pointer to give
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted) {
+
+#if HANDLES
+    (void)a;
+    (void)key;
+    (void)inserted;
+    on_error("Error: assoc_upsert needs data pointers, build "
+    "without HANDLES\n");
+    return NULL;
+#else
+    bool fresh;
+    side* s;
+    long cell = _upsert(a, key, NULL, &fresh, &s);
+
+    if (inserted != NULL) {
+        *inserted = fresh;
+    }
+    return &s->data[cell];
+#endif
+}
+
+/* assoc_upsert(), then the new data stored through the
+cell it found. Not with HANDLES, as for assoc_upsert()
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg) {
+
+#if HANDLES
+    (void)a;
+    (void)key;
+    (void)fn;
+    (void)arg;
+    on_error("Error: assoc_update needs data pointers, build "
+    "without HANDLES\n");
+    return NULL;
+#else
+    bool fresh;
+    void** data = assoc_upsert(a, key, &fresh);
+
+    *data = fn(*data, fresh, arg);
+    return *data;
+#endif
+}
+
+/* Make room for n keys in all
+*/
+void assoc_reserve(assoc** a, unsigned int n) {
+
+    unsigned long recip;
+    unsigned int capacity = _fit(*a, n, &recip);
+
+    if (capacity > (*a)->capacity) {
+        _resize(a, capacity, recip);
+    }
+}
+
+/* Down to the smallest capacity the keys fill to
+BUILDLOAD
+*/
+void assoc_shrink_to_fit(assoc** a) {
+
+    unsigned long recip;
+    unsigned int capacity = _fit(*a, (*a)->size, &recip);
+
+    if (capacity < (*a)->capacity) {
+        _resize(a, capacity, recip);
+    }
+}
+
+/* Resize policy for this table
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload) {
+
+    _setgrowth(&a->growth, &a->maxload, growth, maxload);
+}
+
+/*   Returns the number of key/data pairs
+   currently stored in the table
+*/
+
+unsigned int assoc_count(assoc* a) {
+
+    return a->size;
+}
+
+/*   Returns a pointer to the data, given a key
+   NULL => not found
+*/
+
+void* assoc_lookup(assoc* a, void* key) {
+
+    unsigned long lat = _lat_start();
+    unsigned int len;
+    uint64_t h = _hashkey(a, key, &len);
+    side* s;
+    long cell;
+
+    STAT_ADD(a->stats.searches, 1);
+    cell = _lookup(a, key, h, len, &s);
+    _lat_stop(lat, cell < 0 ? LAT_MISS : LAT_HIT);
+    return cell < 0 ? NULL : _data(a, s, (unsigned long)cell);
+}
+
+/* Hash a batch and prefetch both buckets' bits and tags
+for all of it, then look each key up
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out) {
+
+    uint64_t h[BATCH];
+    unsigned int len[BATCH], i, j, m, b1, b2;
+    long cell;
+    side* s;
+
+    STAT_ADD(a->stats.searches, n);
+    for (i = 0; i < n; i += BATCH) {
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for (j = 0; j < m; j++) {
+            h[j] = _hashkey(a, keys[i + j], &len[j]);
+            b1 = _bucket(a, 0, h[j]);
+            b2 = _bucket(a, 1, h[j]);
+            _prefetch(&a->t[0].used[b1]);
+            _prefetch(&a->t[0].tags[b1 * BUCKETSIZE]);
+            _prefetch(&a->t[1].used[b2]);
+            _prefetch(&a->t[1].tags[b2 * BUCKETSIZE]);
+        }
+        for (j = 0; j < m; j++) {
+            cell = _lookup(a, keys[i + j], h[j], len[j], &s);
+            out[i + j] = cell < 0 ? NULL : \
+            _data(a, s, (unsigned long)cell);
+        }
+    }
+}
+
+/* Bulk load, sized once, hashed on one thread per cpu
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize) {
+
+    return _build(keys, data, n, keysize, _nthreads(n));
+}
+
+/* Copy keys into a table owned arena from now on,
+   including any already stored. Not with HANDLES, where
+   keys have to stay in the caller's array
+*/
+void assoc_ownkeys(assoc* a) {
+
+    unsigned long i, cells = (unsigned long)a->capacity * BUCKETSIZE;
+    unsigned int s;
+    item it;
+
+    if (HANDLES) {
+        on_error("Error: Keys can't be owned with HANDLES\n");
+    }
+    if (a->owned != NULL) {
+        return;
+    }
+    a->owned = arena_init();
+    if (a->owned == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < cells; i++) {
+            if (a->t[s].used[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE))) {
+                _get(a, &a->t[s], i, &it);
+                it.key = _ownkey(a, it.key);
+                _set(a, &a->t[s], i, &it);
+            }
+        }
+    }
+}
+
+/* Choose the hash function while the table is empty
+*/
+void assoc_sethash(assoc* a, hashfunc fn) {
+
+    if (a->size) {
+        on_error("Error: Hash function can't change once keys "
+        "are stored\n");
+    }
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+}
+
+/* Set the arrays HANDLES indices count from, see
+compact.h
+*/
+void assoc_setbase(assoc* a, void* keys, void* data, \
+unsigned int datasize) {
+
+    if (a->size) {
+        on_error("Error: Base arrays can't change once keys "
+        "are stored\n");
+    }
+    _writable(a);
+    a->keybase = (char*)keys;
+    a->database = (char*)data;
+    a->datasize = datasize;
+}
+
+/* Write the table to path as a snapshot, see compact.h.
+   Keys and data are copied out in cell order, so each
+   cell's indices count into the snapshot's own two blocks
+*/
+void assoc_save(assoc* a, const char* path, unsigned int datasize) {
+
+    unsigned long cells, i, keybytes = 0, databytes = 0, k = 0, d = 0;
+    unsigned int s, len;
+    uint32_t* refs[2][2];
+    char *keys, *data;
+    void* value;
+    maphead hd;
+    FILE* f;
+
+    if (a == NULL || path == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    cells = (unsigned long)a->capacity * BUCKETSIZE;
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < cells; i++) {
+            if (a->t[s].used[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE))) {
+                keybytes += a->keysize ? a->keysize : \
+                strlen((char*)_key(a, &a->t[s], i)) + 1;
+                databytes += _data(a, &a->t[s], i) ? datasize : 0;
+            }
+        }
+    }
+    if ((a->keysize ? a->size : keybytes) >= NOREF) {
+        on_error("Error: Too many keys for a snapshot\n");
+    }
+
+    keys = ncalloc(sizeof(char), keybytes + 1);
+    data = ncalloc(sizeof(char), databytes + 1);
+    for (s = 0; s < 2; s++) {
+        refs[s][0] = ncalloc(sizeof(uint32_t), cells);
+        refs[s][1] = ncalloc(sizeof(uint32_t), cells);
+        for (i = 0; i < cells; i++) {
+            if (!(a->t[s].used[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE)))) {
+                continue;
+            }
+            value = _key(a, &a->t[s], i);
+            len = a->keysize ? a->keysize : \
+            (unsigned int)strlen((char*)value) + 1;
+            memcpy(keys + k, value, len);
+            refs[s][0][i] = (uint32_t)(a->keysize ? k / len : k);
+            k += len;
+            value = _data(a, &a->t[s], i);
+            refs[s][1][i] = NOREF;
+            if (value != NULL && datasize) {
+                memcpy(data + d, value, datasize);
+                refs[s][1][i] = (uint32_t)(d / datasize);
+                d += datasize;
+            }
+        }
+    }
+
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, MAPMAGIC, sizeof(hd.magic));
+    hd.version = MAPVERSION;
+    hd.bucketsize = BUCKETSIZE;
+    hd.keysize = a->keysize;
+    hd.datasize = datasize;
+    hd.capacity = a->capacity;
+    hd.size = a->size;
+    hd.hashcheck = _hashcheck(a->hashfn);
+    f = nfopen((char*)path, "wb");
+    _mapput(f, &hd, sizeof(hd));
+    for (s = 0; s < 2; s++) {
+        hd.used[s] = _mapput(f, a->t[s].used, a->capacity);
+    }
+    for (s = 0; s < 2; s++) {
+        hd.tags[s] = _mapput(f, a->t[s].tags, cells);
+    }
+    for (s = 0; s < 2; s++) {
+        hd.keys[s] = _mapput(f, refs[s][0], cells * sizeof(uint32_t));
+    }
+    for (s = 0; s < 2; s++) {
+        hd.data[s] = _mapput(f, refs[s][1], cells * sizeof(uint32_t));
+    }
+    hd.keybytes = _mapput(f, keys, keybytes);
+    hd.databytes = _mapput(f, data, databytes);
+    hd.keylen = keybytes;
+    hd.datalen = databytes;
+    hd.length = (uint64_t)ftell(f);
+    /* The header again, now the offsets are known */
+    if (fseek(f, 0, SEEK_SET) || fwrite(&hd, sizeof(hd), 1, f) != 1) {
+        on_error("Error: Can't write snapshot\n");
+    }
+    if (fclose(f)) {
+        on_error("Error: Can't write snapshot\n");
+    }
+    for (s = 0; s < 2; s++) {
+        free(refs[s][0]);
+        free(refs[s][1]);
+    }
+    free(keys);
+    free(data);
+}
+
+/* A read only table in a snapshot from assoc_save(), see
+   compact.h. Nothing is copied: the side arrays and
+   keybase/database just point into the mapping. Only the
+   header and the cells' indices are read here, to check
+   nothing a lookup follows leads outside the file; the tags
+   and keys come in as lookups touch them
+*/
+assoc* assoc_open_mapped(const char* path, hashfunc fn) {
+
+#if HANDLES
+    unsigned long recip, cells;
+    unsigned int s;
+    struct stat st;
+    maphead* hd;
+    char* map;
+    assoc* a;
+    int fd;
+
+    if (path == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) || \
+    (size_t)st.st_size < sizeof(maphead)) {
+        on_error("Error: Can't open snapshot\n");
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        on_error("Error: Can't map snapshot\n");
+    }
+    hd = (maphead*)map;
+    if (memcmp(hd->magic, MAPMAGIC, sizeof(hd->magic)) || \
+    hd->version != MAPVERSION || hd->bucketsize != BUCKETSIZE || \
+    hd->length != (uint64_t)st.st_size) {
+        on_error("Error: Not a snapshot this build can read\n");
+    }
+
+    a = ncalloc(1, sizeof(assoc));
+    a->keysize = hd->keysize;
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+    if (_hashcheck(a->hashfn) != hd->hashcheck) {
+        on_error("Error: Snapshot was saved with another hash "
+        "function\n");
+    }
+    if (_next_capacity(hd->capacity, &recip) != hd->capacity) {
+        on_error("Error: Snapshot was saved with other table "
+        "sizes\n");
+    }
+    a->capacity = hd->capacity;
+    a->recip = recip;
+    a->size = hd->size;
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    cells = (unsigned long)a->capacity * BUCKETSIZE;
+    for (s = 0; s < 2; s++) {
+        a->t[s].used = _mapsection(hd, map, hd->used[s], a->capacity);
+        a->t[s].tags = _mapsection(hd, map, hd->tags[s], cells);
+        a->t[s].keys = _mapsection(hd, map, hd->keys[s], \
+        cells * sizeof(ref));
+        a->t[s].data = _mapsection(hd, map, hd->data[s], \
+        cells * sizeof(ref));
+    }
+    a->keybase = _mapsection(hd, map, hd->keybytes, hd->keylen);
+    a->database = _mapsection(hd, map, hd->databytes, hd->datalen);
+    _mapcheck(hd, map);
+    a->datasize = hd->datasize ? hd->datasize : 1;
+    a->map = map;
+    a->maplen = (size_t)st.st_size;
+    return a;
+#else
+    (void)path;
+    (void)fn;
+    on_error("Error: assoc_open_mapped needs indices, build "
+    "with HANDLES=1\n");
+    return NULL;
+#endif
+}
+
+/* Load, which side each key is on and the counters. A
+mapped table's memory is its file
+*/
+void assoc_stats(assoc* a, assocstats* st) {
+
+    unsigned long i, cells = (unsigned long)a->capacity * BUCKETSIZE;
+    unsigned int s;
+
+    _stat_begin(st, a->size, 2 * cells);
+    for (s = 0; s < 2; s++) {
+        for (i = 0; i < cells; i++) {
+            if (a->t[s].used[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE))) {
+                _stat_probe(st, s);
+            }
+        }
+    }
+    _stat_end(st, sizeof(assoc) + (a->map != NULL ? a->maplen : \
+    2 * (a->capacity + cells * (1 + 2 * sizeof(ref)))) + \
+    (a->owned ? a->owned->bytes : 0), &a->stats);
+}
+
+void assoc_latency(assoclatency* l) {
+
+    _lat_merge(l);
+}
+
+void assoc_latency_reset(void) {
+
+    _lat_reset();
+}
+
+void assoc_latency_sample(unsigned int n) {
+
+    _lat_setsample(n);
+}
+
+/* Free up all allocated space from 'a' */
+void assoc_free(assoc* a) {
+
+    arena_free(a->owned);
+    _drop(a);
+}
+
+void _assoc_test(void);
+
+/* Sized once for n keys at BUILDLOAD, so nothing is
+   rehashed on the way. Hashing is the costly part (keys
+   are never compared until a tag matches) and is split
+   across threads; keys are then placed in input order, so
+   the first of any duplicates wins
+*/
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads) {
+
+    assoc *a = assoc_init(keysize), *b;
+    unsigned long recip;
+    unsigned int i, capacity;
+    side* s;
+    build bd;
+    item it;
+
+    if (n == 0) {
+        return a;
+    }
+    if (HANDLES) {
+        on_error("Error: assoc_build needs assoc_setbase first, "
+        "insert instead\n");
+    }
+    capacity = _fit(a, n, &recip);
+    b = _alloc(a, capacity, recip);
+    _drop(a);
+    a = b;
+    bd.a = a;
+    bd.keys = keys;
+    bd.n = n;
+    bd.h = (uint64_t*) ncalloc(sizeof(uint64_t), n);
+    bd.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    _parallel(_build_hash, &bd, threads);
+    for (i = 0; i < n; i++) {
+        if (_lookup(a, keys[i], bd.h[i], bd.len[i], &s) >= 0) {
+            continue;
+        }
+        it.key = keys[i];
+        it.data = data ? data[i] : NULL;
+        it.h = bd.h[i];
+        it.len = bd.len[i];
+        if (!_place(a, &it)) {
+            b = _grow(a, &it);
+            _drop(a);
+            a = b;
+        }
+    }
+    free(bd.h);
+    free(bd.len);
+    return a;
+}
+
+/* Hash thread t's share of the keys
+*/
+void _build_hash(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long i, lo, hi;
+
+    _slice(b->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (b->keys[i] == NULL) {
+            on_error("Error: Null pointer\n");
+        }
+        b->h[i] = _hashkey(b->a, b->keys[i], &b->len[i]);
+    }
+}
+
+/* One 64 bit hash per key (see hashfn.h), len is the
+key's length
+*/
+uint64_t _hashkey(assoc* a, void* key, unsigned int* len) {
+
+    *len = a->keysize;
+    if (!*len) {
+        *len = strlen((char*)key);
+    }
+    return a->hashfn(key, *len, HASHSEED);
+}
+
+void _makeitem(assoc* a, item* it, void* key, void* data) {
+
+    it->key = key;
+    it->data = data;
+    it->h = _hashkey(a, key, &it->len);
+}
+
+/* Low half of the hash picks the bucket on side 0,
+high half on side 1
+*/
+unsigned int _bucket(assoc* a, unsigned int s, uint64_t h) {
+
+    return _reduce(s ? h >> 32 : (uint32_t)h, a->capacity, a->recip);
+}
+
+unsigned char _tag(uint64_t h) {
+
+    return (unsigned char)((h * TAGMIX) >> 56);
+}
+
+/* Index of p in the array at base, NOREF for NULL.
+Anything outside the array can't be stored
+*/
+ref _toref(char* base, unsigned int size, void* p) {
+
+#if HANDLES
+    unsigned long off;
+
+    if (p == NULL) {
+        return NOREF;
+    }
+    off = (unsigned long)((char*)p - base);
+    if (base == NULL || (char*)p < base || off % size || \
+    off / size >= NOREF) {
+        on_error("Error: Pointer outside the arrays given to "
+        "assoc_setbase\n");
+    }
+    return (ref)(off / size);
+#else
+    (void)base;
+    (void)size;
+    return p;
+#endif
+}
+
+void* _fromref(char* base, unsigned int size, ref r) {
+
+#if HANDLES
+    return r == NOREF ? NULL : base + (unsigned long)r * size;
+#else
+    (void)base;
+    (void)size;
+    return r;
+#endif
+}
+
+void* _key(assoc* a, side* s, unsigned long cell) {
+
+    return _fromref(a->keybase, a->keysize ? a->keysize : 1, \
+    s->keys[cell]);
+}
+
+void* _data(assoc* a, side* s, unsigned long cell) {
+
+    return _fromref(a->database, a->datasize, s->data[cell]);
+}
+
+/* Fill a cell and mark it used
+*/
+void _set(assoc* a, side* s, unsigned long cell, item* it) {
+
+    s->keys[cell] = _toref(a->keybase, a->keysize ? a->keysize : 1, \
+    it->key);
+    s->data[cell] = _toref(a->database, a->datasize, it->data);
+    s->tags[cell] = _tag(it->h);
+    s->used[cell / BUCKETSIZE] |= (unsigned char)(1u << (cell % BUCKETSIZE));
+}
+
+/* Read a cell back into an item, hashing its key again
+*/
+void _get(assoc* a, side* s, unsigned long cell, item* it) {
+
+    _makeitem(a, it, _key(a, s, cell), _data(a, s, cell));
+}
+
+bool _keymatch(assoc* a, void* stored, void* key, unsigned int len) {
+
+    STAT_ADD(a->stats.compares, 1);
+    if (!a->keysize) {
+        return !strcmp((char*)stored, (char*)key);
+    }
+    return !memcmp(stored, key, len);
+}
+
+/* Cell holding key in one bucket, -1 => not there. Only
+cells in use with a matching tag have their key read
+*/
+long _find(assoc* a, side* s, unsigned int bucket, void* key, \
+uint64_t h, unsigned int len) {
+
+    unsigned long cell = (unsigned long)bucket * BUCKETSIZE;
+    unsigned int used = s->used[bucket], i;
+    unsigned char tag = _tag(h);
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if ((used & (1u << i)) && s->tags[cell + i] == tag && \
+        _keymatch(a, _key(a, s, cell + i), key, len)) {
+            return (long)(cell + i);
+        }
+    }
+    return -1;
+}
+
+/* Cell holding key on either side, and which side
+*/
+long _lookup(assoc* a, void* key, uint64_t h, unsigned int len, \
+side** s) {
+
+    long cell;
+
+    *s = &a->t[0];
+    cell = _find(a, *s, _bucket(a, 0, h), key, h, len);
+    if (cell >= 0) {
+        return cell;
+    }
+    *s = &a->t[1];
+    return _find(a, *s, _bucket(a, 1, h), key, h, len);
+}
+
+/* Use a free cell in the item's bucket on side s, and
+return it. -1 => the bucket is full
+*/
+long _add_free(assoc* a, unsigned int s, item* it) {
+
+    unsigned int bucket = _bucket(a, s, it->h), i;
+    unsigned long cell = (unsigned long)bucket * BUCKETSIZE;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (!(a->t[s].used[bucket] & (1u << i))) {
+            _set(a, &a->t[s], cell + i, it);
+            a->size += 1;
+            return (long)(cell + i);
+        }
+    }
+    return -1;
+}
+
+/* Place an item not yet stored. If both its buckets are
+   full, bounce a resident of one to its bucket on the other
+   side, taking a different cell each time. false => out of
+   bounces, and *it is whichever key was left without a cell
+*/
+bool _place(assoc* a, item* it) {
+
+    unsigned int s = 0, bounces = 0, bucket;
+    unsigned long cell;
+    item out;
+
+    if (_add_free(a, 0, it) >= 0 || _add_free(a, 1, it) >= 0) {
+        return true;
+    }
+    for (;;) {
+        if (++bounces == BOUNCES * (unsigned int)_log2(a->capacity)) {
+            return false;
+        }
+        bucket = _bucket(a, s, it->h);
+        cell = (unsigned long)bucket * BUCKETSIZE + bounces % BUCKETSIZE;
+        _get(a, &a->t[s], cell, &out);
+        _set(a, &a->t[s], cell, it);
+        *it = out;
+        s ^= 1;
+        if (_add_free(a, s, it) >= 0) {
+            return true;
+        }
+    }
+}
+
+/* The cell holding key, and its side. The key is hashed
+   once, and a new one goes straight into a free cell of the
+   buckets the lookup just read if there is one. A new key
+   gets 'data', an old one keeps its own. Only if the key
+   had to bounce others, or the table grew, is it looked up
+   again to find where it ended up
+*/
+long _upsert(assoc** a, void* key, void* data, bool* inserted, \
+side** s) {
+
+    assoc *p = *a, *b;
+    unsigned long recip;
+    unsigned int capacity, len, t;
+    uint64_t h;
+    long cell;
+    item it;
+
+    if (p == NULL || key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    _writable(p);
+    STAT_ADD(p->stats.searches, 1);
+    h = _hashkey(p, key, &len);
+    cell = _lookup(p, key, h, len, s);
+    if (cell >= 0) {
+        *inserted = false;
+        return cell;
+    }
+    *inserted = true;
+    /* Grow first if at the maximum load */
+    if (p->size >= _limit(p, p->capacity)) {
+        capacity = _primetable(p, &recip);
+        p = _resize(a, capacity, recip);
+    }
+    if (p->owned != NULL) {
+        key = _ownkey(p, key);
+    }
+    it.key = key;
+    it.data = data;
+    it.h = h;
+    it.len = len;
+    for (t = 0; t < 2; t++) {
+        if ((cell = _add_free(p, t, &it)) >= 0) {
+            *s = &p->t[t];
+            return cell;
+        }
+    }
+    /* If the bounces run out, whichever key is left
+    without a cell goes into a bigger table */
+    if (!_place(p, &it)) {
+        b = _grow(p, &it);
+        *a = b;
+        _drop(p);
+        p = b;
+    }
+    return _lookup(p, key, h, len, s);
+}
+
+/* The table's own copy of a new key
+*/
+void* _ownkey(assoc* a, void* key) {
+
+    size_t len = a->keysize;
+    void* copy;
+
+    if (!len) {
+        len = strlen((char*)key) + 1;
+    }
+    copy = arena_copy(a->owned, key, len, arena_align(len, !a->keysize));
+    if (copy == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    return copy;
+}
+
+/* Empty sides of the given capacity, with a's settings
+*/
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip) {
+
+    assoc* b = ncalloc(1, sizeof(assoc));
+    unsigned long cells = (unsigned long)capacity * BUCKETSIZE;
+    unsigned int s;
+
+    *b = *a;
+    b->capacity = capacity;
+    b->recip = recip;
+    b->size = 0;
+    for (s = 0; s < 2; s++) {
+        b->t[s].used = ncalloc(sizeof(unsigned char), capacity);
+        b->t[s].tags = ncalloc(sizeof(unsigned char), cells);
+        b->t[s].keys = ncalloc(sizeof(ref), cells);
+        b->t[s].data = ncalloc(sizeof(ref), cells);
+    }
+    return b;
+}
+
+/* An empty table one growth step bigger
+*/
+assoc* _realloc(assoc* a) {
+
+    unsigned long recip;
+    unsigned int capacity = _primetable(a, &recip);
+
+    return _alloc(a, capacity, recip);
+}
+
+/* Free the sides but not the keys, which a resize
+hands on to the next table
+*/
+void _drop(assoc* a) {
+
+    unsigned int s;
+
+    if (a->map != NULL) {
+        munmap(a->map, a->maplen);
+        free(a);
+        return;
+    }
+    for (s = 0; s < 2; s++) {
+        free(a->t[s].used);
+        free(a->t[s].tags);
+        free(a->t[s].keys);
+        free(a->t[s].data);
+    }
+    free(a);
+}
+
+/* Mapped tables can't change
+*/
+void _writable(assoc* a) {
+
+    if (a->map != NULL) {
+        on_error("Error: A mapped table is read only\n");
+    }
+}
+
+/* The hash function's fingerprint in a snapshot */
+uint64_t _hashcheck(hashfunc fn) {
+
+    return fn(MAPMAGIC, sizeof(uint64_t), HASHSEED);
+}
+
+/* Write n bytes at the next MAPALIGN boundary of f, and
+return where they start
+*/
+uint64_t _mapput(FILE* f, const void* p, size_t n) {
+
+    char zeros[MAPALIGN] = {0};
+    long at = ftell(f);
+    size_t pad = at < 0 ? 0 : (size_t)((MAPALIGN - at % MAPALIGN) % MAPALIGN);
+
+    if (at < 0 || fwrite(zeros, 1, pad, f) != pad || \
+    fwrite(p, 1, n, f) != n) {
+        on_error("Error: Can't write snapshot\n");
+    }
+    return (uint64_t)at + pad;
+}
+
+/* The n bytes at off in a snapshot, once they're known to
+lie inside it
+*/
+void* _mapsection(maphead* hd, char* map, uint64_t off, uint64_t n) {
+
+    if (off > hd->length || n > hd->length - off) {
+        on_error("Error: Snapshot is cut short\n");
+    }
+    return map + off;
+}
+
+/* Check every used cell of a snapshot indexes a key and
+data inside their blocks, and that string keys can't run
+off the end of theirs. The sections are known to be in the
+file already
+*/
+void _mapcheck(maphead* hd, char* map) {
+
+    unsigned long cells = (unsigned long)hd->capacity * BUCKETSIZE, i;
+    unsigned long used = 0;
+    unsigned char* bits;
+    uint32_t *keys, *data;
+    unsigned int s;
+
+    if (!hd->keysize && hd->keylen && map[hd->keybytes + hd->keylen - 1]) {
+        on_error("Error: Snapshot keys are corrupt\n");
+    }
+    for (s = 0; s < 2; s++) {
+        bits = (unsigned char*)map + hd->used[s];
+        keys = (uint32_t*)(map + hd->keys[s]);
+        data = (uint32_t*)(map + hd->data[s]);
+        for (i = 0; i < cells; i++) {
+            if (!(bits[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE)))) {
+                continue;
+            }
+            used += 1;
+            if ((hd->keysize ? ((uint64_t)keys[i] + 1) * hd->keysize : \
+            (uint64_t)keys[i] + 1) > hd->keylen) {
+                on_error("Error: Snapshot keys are corrupt\n");
+            }
+            if (data[i] != NOREF && (!hd->datasize || \
+            ((uint64_t)data[i] + 1) * hd->datasize > hd->datalen)) {
+                on_error("Error: Snapshot data is corrupt\n");
+            }
+        }
+    }
+    if (used != hd->size) {
+        on_error("Error: Snapshot keys are corrupt\n");
+    }
+}
+
+/* Build a bigger table holding everything in 'a' plus
+   item. A rehash can run out of bounces as well, in
+   which case just go a size bigger again
+*/
+assoc* _grow(assoc* a, item* it) {
+
+    unsigned long since = _stat_clock(), lat = _lat_resizing();
+    assoc *b = _realloc(a), *c;
+    item left = *it;
+
+    while (!_rehash(a, b) || !_place(b, &left)) {
+        left = *it;
+        c = _realloc(b);
+        _drop(b);
+        b = c;
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    return b;
+}
+
+/* Rehash everything into sides of 'capacity' (or
+   bigger, if the bounces run out), re-direct *a to them and
+   free the old structure. Returns the table now in use
+*/
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip) {
+
+    unsigned long since = _stat_clock(), lat = _lat_resizing();
+    assoc *p = *a, *b, *c;
+
+    _writable(p);
+    b = _alloc(p, capacity, recip);
+    while (!_rehash(p, b)) {
+        c = _realloc(b);
+        _drop(b);
+        b = c;
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    *a = b;
+    _drop(p);
+    return b;
+}
+
+/* Next prime up the ladder (see sizing.h), growth times
+the current capacity
+*/
+unsigned int _primetable(assoc* a, unsigned long* recip) {
+
+    unsigned int prime;
+    double want = a->capacity * a->growth;
+
+    /*However small the factor, always go up a rung*/
+    if (want < a->capacity + 1.0) {
+        want = a->capacity + 1.0;
+    }
+    prime = want > UINT32_MAX ? 0 : \
+    _next_capacity((unsigned long)ceil(want), recip);
+    if (!prime) {
+        on_error("Error: Hash table too big\n");
+    }
+    return prime;
+}
+
+/* Keys both sides of 'capacity' buckets take before
+they're grown
+*/
+unsigned long _limit(assoc* a, unsigned int capacity) {
+
+    return (unsigned long)(2.0 * BUCKETSIZE * capacity * a->maxload \
+    + 1e-6);
+}
+
+/* Smallest capacity, at least INITIALSIZE, that n keys
+fill to no more than BUILDLOAD or maxload
+*/
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip) {
+
+    double load = a->maxload < BUILDLOAD ? a->maxload : BUILDLOAD;
+    unsigned long min = (unsigned long)ceil(n / \
+    (2 * BUCKETSIZE * load));
+    unsigned int capacity;
+
+    capacity = _next_capacity(min > INITIALSIZE ? \
+    min : INITIALSIZE, recip);
+    if (!capacity) {
+        on_error("Error: Hash table too big\n");
+    }
+    return capacity;
+}
+
+/* Place every key of 'a' into 'b'. Tables big enough to
+share out go through _rehash_parallel()
+*/
+bool _rehash(assoc* a, assoc* b) {
+
+    unsigned long i, cells = (unsigned long)a->capacity * BUCKETSIZE;
+    unsigned int s;
+    item it;
+
+    if (_rehash_threads(a->size) > 1) {
+        return _rehash_parallel(a, b, _rehash_threads(a->size));
+    }
+    for (i = 0; i < cells; i++) {
+        for (s = 0; s < 2; s++) {
+            if (a->t[s].used[i / BUCKETSIZE] & (1u << (i % BUCKETSIZE))) {
+                _get(a, &a->t[s], i, &it);
+                if (!_place(b, &it)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/* _rehash() over threads. Reading the keys out hashes them
+   again, which is most of the work, and is shared out by
+   _gather(). Each pass of _rehash_place() gives a thread
+   the keys whose bucket on that side is in its own run, so
+   it can take a free cell there on its own. Only keys both
+   buckets of which filled up are left to _place(), on this
+   thread
+*/
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads) {
+
+    unsigned long i, n = a->size;
+    unsigned int t;
+    rehash r;
+    bool ok = true;
+
+    memset(&r, 0, sizeof(r));
+    r.a = a;
+    r.b = b;
+    r.parts = threads;
+    r.items = (item*) ncalloc(sizeof(item), n + 1);
+    r.placed = (bool*) ncalloc(sizeof(bool), n + 1);
+    r.order = (unsigned int*) ncalloc(sizeof(unsigned int), n + 1);
+    if (_gather(2 * (unsigned long)a->capacity * BUCKETSIZE, _old_kept, \
+    _old_put, &r, threads) < 0) {
+        on_error("Error: Cannot allocate gather counts\n");
+    }
+    for (r.side = 0; r.side < 2; r.side++) {
+        if (!_partition(n, threads, _rehash_part, &r, threads, r.order, \
+        r.start)) {
+            on_error("Error: Cannot allocate partition counts\n");
+        }
+        _parallel(_rehash_place, &r, threads);
+    }
+    for (t = 0; t < threads; t++) {
+        b->size += r.added[t];
+    }
+    for (i = 0; ok && i < n; i++) {
+        if (!r.placed[i]) {
+            ok = _place(b, &r.items[i]);
+        }
+    }
+    free(r.items);
+    free(r.placed);
+    free(r.order);
+    return ok;
+}
+
+/* Old cells are numbered as _rehash() visits them, both
+sides of each cell in turn
+*/
+bool _old_kept(void* ctx, unsigned long i) {
+
+    assoc* a = ((rehash*)ctx)->a;
+    unsigned long cell = i / 2;
+
+    return a->t[i % 2].used[cell / BUCKETSIZE] & \
+    (1u << (cell % BUCKETSIZE));
+}
+
+/* Key k of the rehash is in old cell i
+*/
+void _old_put(void* ctx, unsigned long i, unsigned long k) {
+
+    rehash* r = (rehash*)ctx;
+
+    _get(r->a, &r->a->t[i % 2], i / 2, &r->items[k]);
+}
+
+/* Which thread's run of buckets key i goes to on this
+pass's side
+*/
+unsigned int _rehash_part(void* ctx, unsigned long i) {
+
+    rehash* r = (rehash*)ctx;
+
+    return (unsigned int)((unsigned long)_bucket(r->b, r->side, \
+    r->items[i].h) * r->parts / r->b->capacity);
+}
+
+/* Thread t puts each of its keys not yet placed in a free
+cell of its bucket on this pass's side, if it has one.
+_add_free() would count them in b->size, which every thread
+shares, so each keeps its own count
+*/
+void _rehash_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    rehash* r = (rehash*)ctx;
+    side* s = &r->b->t[r->side];
+    unsigned long k, cell;
+    unsigned int i, bucket, c;
+
+    (void)threads;
+    for (k = r->start[t]; k < r->start[t + 1]; k++) {
+        i = r->order[k];
+        if (r->placed[i]) {
+            continue;
+        }
+        bucket = _bucket(r->b, r->side, r->items[i].h);
+        cell = (unsigned long)bucket * BUCKETSIZE;
+        for (c = 0; c < BUCKETSIZE; c++) {
+            if (!(s->used[bucket] & (1u << c))) {
+                _set(r->b, s, cell + c, &r->items[i]);
+                r->added[t]++;
+                r->placed[i] = true;
+                break;
+            }
+        }
+    }
+}
+
+/* Calculates log base 2 of a number, for the bounce
+limit
+*/
+int _log2(unsigned int n) {
+
+    int log = 0;
+
+    while (n >>= 1) {
+        log++;
+    }
+    return log;
+}
+
+void _assoc_test(void) {
+
+    int i, j, ints[1000], *many;
+    unsigned int capacity, len;
+    unsigned long recip;
+    uint64_t h;
+    char words[1000][8], str[16];
+    void *keys[BATCH * 2 + 5], *out[BATCH * 2 + 5];
+    side* s;
+    long cell;
+    item it;
+    assoc *a, *b;
+    void** slot;
+    bool fresh;
+    assocstats st;
+    assoclatency lat;
+
+    /* Test assoc_init function*/
+    a = assoc_init(sizeof(int));
+    assert(a->size == 0);
+    assert(a->capacity == _next_capacity(INITIALSIZE, &recip));
+    for (i = 0; i < (int)a->capacity; i++) {
+        assert(!a->t[0].used[i] && !a->t[1].used[i]);
+    }
+    assoc_free(a);
+
+    /* Test a cell is well under half of cuckoo.c's 32 bytes*/
+    assert(2 * sizeof(ref) + 1 <= 17);
+    if (HANDLES) {
+        assert(sizeof(ref) == 4);
+    }
+
+#if !HANDLES
+    /* Test _set and _get round trip, and the used bits*/
+    a = assoc_init(sizeof(int));
+    ints[0] = 7;
+    _makeitem(a, &it, &ints[0], &ints[1]);
+    _set(a, &a->t[1], 6, &it);
+    assert(a->t[1].used[1] == 1u << 2);
+    assert(_key(a, &a->t[1], 6) == &ints[0]);
+    assert(_data(a, &a->t[1], 6) == &ints[1]);
+    assert(a->t[1].tags[6] == _tag(it.h));
+    _get(a, &a->t[1], 6, &it);
+    assert(it.h == _hashkey(a, &ints[0], &len));
+    assert(_find(a, &a->t[1], 1, &ints[0], it.h, len) == 6);
+    ints[2] = 7;
+    assert(_find(a, &a->t[1], 1, &ints[2], it.h, len) == 6);
+    assert(_find(a, &a->t[1], 0, &ints[2], it.h, len) == -1);
+    assoc_free(a);
+
+    /* Test ints: duplicates keep the first data, and the
+    table grows through several resizes*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assoc_insert(&a, &ints[5], NULL);
+    assert(assoc_count(a) == 1000);
+    assert(a->capacity > INITIALSIZE);
+    for (i = 0; i < 1000; i++) {
+        j = i * 7;
+        assert(assoc_lookup(a, &j) == &ints[i]);
+    }
+    j = 3;
+    assert(assoc_lookup(a, &j) == NULL);
+    h = _hashkey(a, &ints[10], &len);
+    cell = _lookup(a, &ints[10], h, len, &s);
+    assert(cell >= 0 && _key(a, s, (unsigned long)cell) == &ints[10]);
+
+    /* Test batched lookups match single ones*/
+    for (i = 0; i < BATCH * 2 + 5; i++) {
+        keys[i] = &ints[i * 3];
+    }
+    keys[4] = &j;
+    assoc_lookup_batch(a, keys, BATCH * 2 + 5, out);
+    for (i = 0; i < BATCH * 2 + 5; i++) {
+        assert(out[i] == assoc_lookup(a, keys[i]));
+    }
+    assert(out[4] == NULL);
+    assoc_free(a);
+
+    /* Test strings, with another hash function*/
+    a = assoc_init(0);
+    assoc_sethash(a, hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        sprintf(words[i], "w%d", i * 31);
+        assoc_insert(&a, words[i], words[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        strcpy(str, words[i]);
+        assert(assoc_lookup(a, str) == words[i]);
+    }
+    assert(assoc_lookup(a, "w1") == NULL);
+    assert(assoc_count(a) == 1000);
+    assoc_free(a);
+
+    /* Test a bucket fills, then bounces take over*/
+    a = assoc_init(sizeof(int));
+    many = ncalloc(sizeof(int), TESTKEYS);
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i;
+    }
+    for (i = 0; i < TESTKEYS; i++) {
+        h = _hashkey(a, &many[i], &len);
+        if (_bucket(a, 0, h) == 0) {
+            assoc_insert(&a, &many[i], &many[i]);
+        }
+        if (a->t[0].used[0] == (1u << BUCKETSIZE) - 1) {
+            break;
+        }
+    }
+    assert(a->t[0].used[0] == (1u << BUCKETSIZE) - 1);
+    for (j = i + 1; j < TESTKEYS; j++) {
+        h = _hashkey(a, &many[j], &len);
+        if (_bucket(a, 0, h) == 0) {
+            capacity = a->capacity;
+            assoc_insert(&a, &many[j], &many[j]);
+            if (a->capacity == capacity) {
+                break;
+            }
+        }
+    }
+    assert(assoc_lookup(a, &many[j]) == &many[j]);
+    assoc_free(a);
+
+    /* Test a build matches inserting in order, duplicates
+    included, and never had to grow*/
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i * 7919;
+    }
+    a = assoc_build(keys, NULL, 0, sizeof(int));
+    assert(assoc_count(a) == 0);
+    assoc_free(a);
+    {
+        void** pairs = ncalloc(sizeof(void*), TESTKEYS * 2);
+        assoc* c;
+
+        for (i = 0; i < TESTKEYS; i++) {
+            /*Every fifth key comes round again later*/
+            pairs[i] = &many[i % 5 ? i : i / 5];
+            pairs[TESTKEYS + i] = &many[i];
+        }
+        for (j = 1; j <= 4; j += 3) {
+            a = _build(pairs, &pairs[TESTKEYS], TESTKEYS, \
+            sizeof(int), (unsigned int)j);
+            b = assoc_init(sizeof(int));
+            for (i = 0; i < TESTKEYS; i++) {
+                assoc_insert(&b, pairs[i], pairs[TESTKEYS + i]);
+            }
+            assert(a->capacity == _fit(a, TESTKEYS, &recip));
+            assert(assoc_count(a) == assoc_count(b));
+            for (i = 0; i < TESTKEYS; i++) {
+                assert(assoc_lookup(a, &many[i]) == \
+                assoc_lookup(b, &many[i]));
+            }
+            /*...and a rehash on as many threads keeps every key*/
+            c = _realloc(a);
+            assert(_rehash_parallel(a, c, (unsigned int)j));
+            assert(assoc_count(c) == assoc_count(a));
+            _drop(a);
+            a = c;
+            for (i = 0; i < TESTKEYS; i++) {
+                assert(assoc_lookup(a, &many[i]) == \
+                assoc_lookup(b, &many[i]));
+            }
+            assoc_free(a);
+            assoc_free(b);
+        }
+        free(pairs);
+    }
+
+    /* Test reserve, shrink and a gentler growth policy*/
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, TESTKEYS);
+    capacity = a->capacity;
+    for (i = 0; i < TESTKEYS; i++) {
+        assoc_insert(&a, &many[i], &many[i]);
+    }
+    assert(a->capacity == capacity);
+    assoc_free(a);
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, TESTKEYS);
+    for (i = 0; i < 100; i++) {
+        assoc_insert(&a, &many[i], &many[i]);
+    }
+    assoc_shrink_to_fit(&a);
+    assert(a->capacity == _fit(a, 100, &recip));
+    for (i = 0; i < 100; i++) {
+        assert(assoc_lookup(a, &many[i]) == &many[i]);
+    }
+    assoc_free(a);
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 1.5, 0.5);
+    for (i = 0, j = 0; i < TESTKEYS; i++) {
+        capacity = a->capacity;
+        assoc_insert(&a, &many[i], &many[i]);
+        if (a->capacity != capacity) {
+            j++;
+        }
+        assert(assoc_count(a) <= _limit(a, a->capacity));
+    }
+    assert(j >= 3);
+    assoc_free(a);
+
+    /* Test owned keys outlive the caller's copy, and
+    owning after a build*/
+    a = assoc_init(0);
+    assoc_ownkeys(a);
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assoc_insert(&a, str, &ints[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assert(assoc_lookup(a, str) == &ints[i]);
+    }
+    assoc_free(a);
+    for (i = 0; i < BATCH; i++) {
+        ints[i] = i * 5;
+        keys[i] = &ints[i];
+    }
+    a = assoc_build(keys, keys, BATCH, sizeof(int));
+    assoc_ownkeys(a);
+    for (i = 0; i < BATCH; i++) {
+        j = i * 5;
+        ints[i] = -1;
+        assert(assoc_lookup(a, &j) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /* Test upsert: new keys get NULL data and a slot to
+    fill, old ones their own slot back, through resizes and
+    with owned keys*/
+    a = assoc_init(0);
+    assoc_ownkeys(a);
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < 1000; i++) {
+            sprintf(str, "up%d", i);
+            slot = assoc_upsert(&a, str, &fresh);
+            assert(fresh == !j);
+            assert(*slot == (j ? (void*)&ints[i] : NULL));
+            *slot = &ints[i];
+        }
+    }
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "up%d", i);
+        slot = assoc_upsert(&a, str, NULL);
+        *slot = &ints[999 - i];
+    }
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "up%d", i);
+        assert(assoc_lookup(a, str) == &ints[999 - i]);
+    }
+    assert(assoc_count(a) == 1000);
+
+    /* Test a snapshot saved without HANDLES has its keys
+    and data copied out after the arrays, every cell's
+    indices leading back to its own key and data*/
+    assoc_save(a, MAPTEST, sizeof(int));
+    assoc_free(a);
+    {
+        maphead hd;
+        FILE* f = nfopen(MAPTEST, "rb");
+        unsigned char* file;
+        uint32_t *kref, *dref;
+        unsigned long c, found = 0;
+        unsigned int side, n;
+
+        assert(fread(&hd, sizeof(hd), 1, f) == 1);
+        file = ncalloc(1, hd.length);
+        rewind(f);
+        assert(fread(file, 1, hd.length, f) == hd.length);
+        fclose(f);
+        assert(!memcmp(hd.magic, MAPMAGIC, sizeof(hd.magic)));
+        assert(hd.size == 1000 && hd.keysize == 0);
+        /* "up0".."up999" and their '\0's */
+        assert(hd.databytes == (hd.keybytes + 5890 + MAPALIGN - 1) / \
+        MAPALIGN * MAPALIGN);
+        assert(hd.length == hd.databytes + 1000 * sizeof(int));
+        assert(hd.keylen == 5890 && hd.datalen == 1000 * sizeof(int));
+        assert(hd.hashcheck == _hashcheck(hash_default(0)));
+        for (side = 0; side < 2; side++) {
+            kref = (uint32_t*)(file + hd.keys[side]);
+            dref = (uint32_t*)(file + hd.data[side]);
+            for (c = 0; c < (unsigned long)hd.capacity * BUCKETSIZE; c++) {
+                if (!(file[hd.used[side] + c / BUCKETSIZE] & \
+                (1u << (c % BUCKETSIZE)))) {
+                    continue;
+                }
+                assert(kref[c] < hd.keylen && dref[c] < 1000);
+                assert(sscanf((char*)file + hd.keybytes + kref[c], \
+                "up%u", &n) == 1 && n < 1000);
+                assert(*(int*)(file + hd.databytes + \
+                dref[c] * sizeof(int)) == ints[999 - n]);
+                found++;
+            }
+        }
+        assert(found == 1000);
+        free(file);
+    }
+    remove(MAPTEST);
+
+    /* Test stats: each key binned by its side, and
+    counters that only move with STATS*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 3;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_lookup(a, &ints[7]) == &ints[7]);
+    assoc_stats(a, &st);
+    assert(st.size == 1000);
+    assert(st.slots == 2 * (unsigned long)a->capacity * BUCKETSIZE);
+    assert(st.probes[0] + st.probes[1] == 1000 && st.probes[0] > 0);
+    assert(st.bytes > 1000 * (2 + 2 * sizeof(ref)));
+#if STATS
+    assert(st.resizes >= 1 && st.searches == 1001 && st.compares >= 1);
+#else
+    assert(!st.resizes && !st.searches && !st.compares);
+#endif
+    assoc_free(a);
+
+    /* Test latency: 1 in LATSAMPLE inserts and lookups
+    timed, lookups split by hit or miss, every resize timed*/
+    assoc_latency_reset();
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        j = i * 3 + (i & 1);
+        assert((assoc_lookup(a, &j) != NULL) == !(i & 1));
+    }
+    assoc_latency(&lat);
+    recip = latency_total(&lat, LAT_INSERT) + \
+    latency_total(&lat, LAT_HIT) + latency_total(&lat, LAT_MISS);
+#if LATENCY
+    assert(recip >= 2000 / LATSAMPLE && recip <= 2000 / LATSAMPLE + 1);
+    assert(latency_total(&lat, LAT_RESIZE) >= 1);
+#else
+    assert(recip == 0 && latency_total(&lat, LAT_RESIZE) == 0);
+#endif
+    assoc_free(a);
+    free(many);
+#else
+    (void)slot;
+    (void)fresh;
+    (void)words;
+    (void)keys;
+    (void)out;
+    (void)s;
+    (void)cell;
+    (void)it;
+    (void)b;
+    (void)lat;
+
+    /* Test handles: keys and data found again from their
+    indices, NULL data kept, through several resizes*/
+    many = ncalloc(sizeof(int), TESTKEYS);
+    a = assoc_init(sizeof(int));
+    assoc_setbase(a, many, ints, sizeof(int));
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i * 3;
+        assoc_insert(&a, &many[i], i % 2 ? NULL : &ints[i % 1000]);
+    }
+    assert(assoc_count(a) == TESTKEYS);
+    for (i = 0; i < TESTKEYS; i++) {
+        j = i * 3;
+        assert(assoc_lookup(a, &j) == (i % 2 ? NULL : &ints[i % 1000]));
+    }
+    assoc_free(a);
+    free(many);
+
+    /* Test string handles into one block of chars*/
+    {
+        char* block = ncalloc(sizeof(char), 1000 * 8);
+
+        a = assoc_init(0);
+        assoc_setbase(a, block, NULL, 1);
+        for (i = 0, len = 0; i < 1000; i++) {
+            snprintf(&block[len], 1000 * 8 - len, "h%d", i);
+            assoc_insert(&a, &block[len], NULL);
+            len += (unsigned int)strlen(&block[len]) + 1;
+        }
+        for (i = 0; i < 1000; i++) {
+            sprintf(str, "h%d", i);
+            h = _hashkey(a, str, &capacity);
+            cell = _lookup(a, str, h, capacity, &s);
+            assert(cell >= 0);
+            assert(!strcmp(_key(a, s, (unsigned long)cell), str));
+        }
+        assert(assoc_count(a) == 1000);
+        assoc_save(a, MAPTEST, 0);
+        assoc_free(a);
+        free(block);
+
+        /* Test a mapped snapshot of string keys needs
+        nothing but the file*/
+        a = assoc_open_mapped(MAPTEST, NULL);
+        assert(assoc_count(a) == 1000);
+        for (i = 0; i < 1000; i++) {
+            sprintf(str, "h%d", i);
+            h = _hashkey(a, str, &capacity);
+            cell = _lookup(a, str, h, capacity, &s);
+            assert(cell >= 0);
+            assert(!strcmp(_key(a, s, (unsigned long)cell), str));
+            assert(_data(a, s, (unsigned long)cell) == NULL);
+            sprintf(str, "x%d", i);
+            h = _hashkey(a, str, &capacity);
+            assert(_lookup(a, str, h, capacity, &s) < 0);
+        }
+        assoc_free(a);
+    }
+
+    /* Test snapshots of int keys: data copied out, NULL
+    data kept, lookups and batches served from the mapping*/
+    many = ncalloc(sizeof(int), TESTKEYS);
+    a = assoc_init(sizeof(int));
+    assoc_setbase(a, many, ints, sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7;
+    }
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i * 3;
+        assoc_insert(&a, &many[i], i % 2 ? NULL : &ints[i % 1000]);
+    }
+    assoc_save(a, MAPTEST, sizeof(int));
+    assoc_free(a);
+    free(many);
+    a = assoc_open_mapped(MAPTEST, NULL);
+    assert(assoc_count(a) == TESTKEYS);
+    assoc_stats(a, &st);
+    assert(st.size == TESTKEYS && st.probes[0] + st.probes[1] == TESTKEYS);
+    assert(st.bytes == sizeof(assoc) + a->maplen);
+    for (i = 0; i < TESTKEYS; i++) {
+        j = i * 3;
+        out[0] = assoc_lookup(a, &j);
+        assert(i % 2 ? out[0] == NULL : *(int*)out[0] == i % 1000 * 7);
+        j = i * 3 + 1;
+        assert(assoc_lookup(a, &j) == NULL);
+    }
+    for (i = 0; i < BATCH * 2 + 5; i++) {
+        ints[i] = i * 3;
+        keys[i] = &ints[i];
+    }
+    assoc_lookup_batch(a, keys, BATCH * 2 + 5, out);
+    for (i = 0; i < BATCH * 2 + 5; i++) {
+        assert(out[i] == assoc_lookup(a, &ints[i]));
+        assert((out[i] != NULL) == (i % 2 == 0));
+    }
+    assoc_free(a);
+    remove(MAPTEST);
+    (void)recip;
+#endif
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/* compact.c's additions to assoc.h
+
+   Built with -DHANDLES=1, compact.c keeps 32 bit indices in
+   place of the key and data pointers. A key is then found as
+   keys + index * keysize (or keys + index for strings, which
+   must all sit in the one block of chars), and data as
+   data + index * datasize. Every key and data pointer handed
+   to assoc_insert() must point into these arrays; NULL data
+   is still allowed.
+*/
+
+#include "assoc.h"
+
+/* Give the arrays keys and data are indices into. Only
+   allowed while the table is empty, and needed before the
+   first insert with HANDLES=1 (ignored otherwise). data may
+   be NULL if every insert's data is
+*/
+void assoc_setbase(assoc* a, void* keys, void* data, \
+unsigned int datasize);
+
+/* Write the table to the file at path as a snapshot: the
+   side arrays as they are, then a copy of every key and of
+   datasize bytes of every non NULL data, with each cell
+   holding its key's and data's index into the copies.
+   datasize 0 => no data is saved, it all reads back NULL.
+   Works in either build. Numbers are kept in this machine's
+   byte order, so a snapshot is only for machines like it
+*/
+void assoc_save(assoc* a, const char* path, unsigned int datasize);
+
+/* mmap a snapshot from assoc_save() and look up straight
+   from it: nothing is copied, and no key is read until a
+   lookup wants it, so processes opening the same file
+   share its pages. Opening reads each cell's indices once,
+   and a snapshot with any that lead outside it is an
+   error. fn is the hash function the table was saved with
+   (NULL => the default, as for assoc_sethash()). Only with HANDLES=1,
+   whose cells are the indices the snapshot holds.
+   The table is read only: inserts, upserts and resizes are
+   errors, and the data assoc_lookup() returns points into
+   the mapping. assoc_free() unmaps it
+*/
+assoc* assoc_open_mapped(const char* path, hashfunc fn);
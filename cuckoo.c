@@ -1,10 +1,17 @@
 /*Cuckoo Hash works perfectly for ints in testassoc
-and it works for strings, but fails to calloc after
-120,000 new strings as hash table becomes too big.
-I can't quite find a good enough hash function in 
-spite of research*/
+and it works for strings. It used to fail to calloc after
+120,000 new strings as hash table became too big; each
+position is now a bucket of BUCKETSIZE cells, so both 
+tables fill past 90% before a resize (see cuckoo120k 
+in bench.c). Keys are hashed once with a proper 64 bit
+function from hashfn.h, one half for each table*/
+
+#define _POSIX_C_SOURCE 200809L
 
 #include "specific.h"
+#include "cuckoo.h"
+#include "sizing.h"
+#include "parallel.h"
 #include "../../ADTs/General/general.h"
 #include <assert.h>
 #include <stdlib.h>
@@ -12,45 +19,146 @@ spite of research*/
 #include <ctype.h>
 
 #define INITIALSIZE 17
+/* Default growth factor and maximum load, see
+assoc_setgrowth(). At 1 only finding no displacement
+path resizes */
 #define SCALEFACTOR 4
-#define HASH1 0
-#define HASH2 19
+#define MAXLOAD 1.0
+#define BUCKETSIZE 4
+/* Buckets a key may use unless assoc_ways() says otherwise,
+and the most it can say */
+#define WAYS 2
+#define MAXWAYS 4
+/* Buckets the search for a displacement path may visit,
+and the most keys one insert may move */
+#define MAXBFS 512
+#define MAXDEPTH 6
+/* Cells for keys no path could place; the table only grows
+once they're all taken */
+#define STASHSIZE 8
+/* Keys hashed and prefetched ahead in assoc_lookup_batch */
+#define BATCH 16
 #define TWOTHIRDS /1.5
-#define EMPTYHASH empty_hash.flag = false; \
-empty_hash.data = NULL; empty_hash.key = NULL;
-
-void _hash(assoc* a, void* key, unsigned int* hash);
-void _hash_two(assoc* a, void* key, unsigned int* hash);
-bool _add_hash(assoc* a, void* key, void* data);
-bool _add_hash_two(assoc* a, void* key, void* data);
-void _add_data(hash* a, void* key, void* data, \
-unsigned int hash);
+/* Fill aimed for by assoc_build, a little under the 90%
+reached by inserting so the last few keys can still move
+others aside */
+#define BUILDLOAD 0.85
+#define BUILDKEYS 50000
+
+/* A bucket reached by the breadth first search, and how:
+the key in cell 'slot' of the parent's bucket can move
+here */
+typedef struct node {
+    /* 0 => hash_table, 1 => hash_table2 */
+    unsigned int side;
+    unsigned int bucket;
+    unsigned int slot;
+    unsigned int depth;
+    /* -1 for the key's own buckets */
+    int parent;
+} node;
+
+/* Shared by the threads of assoc_build. Thread p owns
+partition p: the buckets from capacity*p/parts up to
+capacity*(p+1)/parts of the table being filled */
+typedef struct build {
+    assoc* a;
+    void** keys;
+    void** data;
+    unsigned int n;
+    unsigned long* h;
+    unsigned int* len;
+    bool* placed;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 2];
+    unsigned int parts;
+    bool second;
+    unsigned int added[MAXTHREADS];
+} build;
+
+/* Shared by the threads of a parallel rehash: the old table
+and the build its keys are gathered into */
+typedef struct rehash {
+    assoc* a;
+    build* b;
+} rehash;
+
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads);
+void _build_hash(void* ctx, unsigned int t, unsigned int threads);
+unsigned int _build_part(void* ctx, unsigned long i);
+void _build_place(void* ctx, unsigned int t, unsigned int threads);
+void _build_pass(build* b, bool second);
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len);
+unsigned long _cellhash(assoc* a, hash* cell);
+void _hash(assoc* a, unsigned long h, unsigned int* hash);
+void _hash_two(assoc* a, unsigned long h, unsigned int* hash);
+unsigned int _way(assoc* a, unsigned long h, unsigned int w, \
+unsigned int* index);
+void _candidates(assoc* a, unsigned long h, hash** b);
+unsigned int _wayof(assoc* a, unsigned int side, unsigned int bucket, \
+hash* cell);
+void _makecell(assoc* a, hash* cell, void* key, void* data);
+void _setcell(hash* cell, void* key, void* data, unsigned long h, \
+unsigned int len);
+hash* _upsert(assoc** a, void* key, void* data, bool* inserted);
+void* _ownkey(assoc* a, void* key);
+void _drop(assoc* a);
+hash* _insert(assoc* a, hash* item);
+hash* _add_free(assoc* a, hash* item);
+hash* _add_bucket(hash* bucket, hash* item);
+hash* _add_stash(assoc* a, hash* item);
+hash* _bucket(assoc* a, unsigned int side, unsigned int index);
+int _free_cell(hash* bucket);
+bool _onpath(node* q, int at, unsigned int side, unsigned int index);
+int _bfs(assoc* a, unsigned long h, node* q);
+hash* _shift(assoc* a, node* q, int last, hash* item);
+void _add_data(hash* a, hash* item, unsigned int hash);
 assoc* _realloc(assoc* a);
-unsigned int _primetable(assoc* a);
-bool _isprime(unsigned int c); 
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip);
+void _tables(assoc* a);
+assoc* _grow(assoc* a, hash* item);
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip);
+unsigned int _primetable(assoc* a, unsigned long* recip);
+unsigned long _limit(assoc* a, unsigned int capacity);
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip);
 bool _rehash(assoc* a, assoc* b);
-bool _isduplicate(assoc* a, void* key);
-hash _search_one(assoc* a, void* key);
-hash _search_two(assoc* a, void* key);
-int log2n(unsigned int n);
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads);
+hash* _oldcell(assoc* a, unsigned long i);
+bool _old_kept(void* ctx, unsigned long i);
+void _old_put(void* ctx, unsigned long i, unsigned long k);
+bool _keymatch(assoc* a, hash* cell, void* key, unsigned long h, \
+unsigned int len);
+hash* _search(assoc* a, hash** b, void* key, unsigned long h, \
+unsigned int len);
+hash* _search_bucket(assoc* a, hash* bucket, void* key, \
+unsigned long h, unsigned int len);
+hash* _search_stash(assoc* a, void* key, unsigned long h, \
+unsigned int len);
 
 /*
    Initialise the Associative array
    keysize : number of bytes (or 0 => string)
    This is important when comparing keys since
    we'll need to use either memcmp() or strcmp()
+
+   capacity counts buckets: each table holds
+   capacity*BUCKETSIZE cells, and a key may sit in
+   any cell of its bucket in either table (or of its
+   further buckets, see assoc_ways())
 */
 
 assoc* assoc_init(int keysize) {
 
     assoc *a =  ncalloc(1, sizeof(assoc));
     
-    a->hash_table = (hash*) ncalloc(sizeof(hash), \
-    INITIALSIZE);
-    a->hash_table2 = (hash*) ncalloc(sizeof(hash), \
-    INITIALSIZE);
-    a->capacity = INITIALSIZE;
+    a->capacity = _next_capacity(INITIALSIZE, &a->recip);
+    _tables(a);
     a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    a->ways = WAYS;
 
     return a;
 }
@@ -63,33 +171,71 @@ assoc* assoc_init(int keysize) {
 
 void assoc_insert(assoc** a, void* key, void* data) {
 
-    assoc *p, *b;
-    p = *a;
+    unsigned long lat = _lat_start();
+    bool inserted;
 
-    /*Check for void pointers */
-    if (p == NULL || key == NULL) {
-        on_error("Error: Null pointer\n");
+    _upsert(a, key, data, &inserted);
+    _lat_stop(lat, LAT_INSERT);
+}
+
+/* Find or insert key, one hash and one pass over its
+buckets, see _upsert()
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted) {
+
+    bool fresh;
+    hash* cell = _upsert(a, key, NULL, &fresh);
+
+    if (inserted != NULL) {
+        *inserted = fresh;
     }
+    return &cell->data;
+}
+
+/* assoc_upsert(), then the new data stored through the
+cell it found
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg) {
+
+    bool fresh;
+    void** data = assoc_upsert(a, key, &fresh);
+
+    *data = fn(*data, fresh, arg);
+    return *data;
+}
 
-    /*Check for duplicates*/
-    if (_isduplicate(p, key)) {
+/* Make room for n keys in all: the table they'd fill
+to BUILDLOAD (or maxload, if lower)
+*/
+void assoc_reserve(assoc** a, unsigned int n) {
+
+    unsigned long recip;
+    unsigned int capacity = _fit(*a, n, &recip);
+
+    if (capacity > (*a)->capacity) {
+        _resize(a, capacity, recip);
     }
-    else {
-        /* If log2(hashtablesize) bounces, 
-        realloc table*/
-        if (!_add_hash(p, key, data)) {
-            b = _realloc(p);
-            assert(_rehash(p, b));
-            *a = b;
-            _add_hash(b, key, data);
-            
-            free(p->hash_table);
-            free(p->hash_table2);
-            free(p);
-        }
+}
+
+/* Down to the smallest table the keys fill to BUILDLOAD
+*/
+void assoc_shrink_to_fit(assoc** a) {
+
+    unsigned long recip;
+    unsigned int capacity = _fit(*a, (*a)->size, &recip);
+
+    if (capacity < (*a)->capacity) {
+        _resize(a, capacity, recip);
     }
 }
 
+/* Resize policy for this table
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload) {
+
+    _setgrowth(&a->growth, &a->maxload, growth, maxload);
+}
+
 /*
    Returns the number of key/data pairs 
    currently stored in the table
@@ -105,289 +251,1627 @@ unsigned int assoc_count(assoc* a) {
 */
 void* assoc_lookup(assoc* a, void* key) {
 
-    hash hash1 = _search_one(a, key);
-    hash hash2 = _search_two(a, key);
+    unsigned long lat = _lat_start();
+    unsigned int len;
+    unsigned long h = _hashkey(a, key, &len);
+    hash *b[MAXWAYS], *found;
 
-    if (hash1.key != NULL) {
-        return hash1.data;
-    }
-    if (hash2.key != NULL) {
-        return hash2.data;
+    STAT_ADD(a->stats.searches, 1);
+    _candidates(a, h, b);
+    found = _search(a, b, key, h, len);
+    _lat_stop(lat, found == NULL ? LAT_MISS : LAT_HIT);
+    return found == NULL ? NULL : found->data;
+}
+
+/* Hash a batch of keys and prefetch all of each key's
+buckets, then search them once the lines have arrived
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out) {
+
+    unsigned long h[BATCH];
+    unsigned int len[BATCH], i, j, m;
+    hash *b[BATCH][MAXWAYS], *found;
+
+    STAT_ADD(a->stats.searches, n);
+    for (i = 0; i < n; i += BATCH) {
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for (j = 0; j < m; j++) {
+            h[j] = _hashkey(a, keys[i + j], &len[j]);
+            _candidates(a, h[j], b[j]);
+        }
+        for (j = 0; j < m; j++) {
+            found = _search(a, b[j], keys[i + j], h[j], len[j]);
+            out[i + j] = found == NULL ? NULL : found->data;
+        }
     }
+}
 
-    return NULL;
+/* Bulk load, sized once, one thread per cpu
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize) {
+
+    return _build(keys, data, n, keysize, _nthreads(n));
 }
 
 void assoc_todot(assoc* a);
 
+/* Copy keys into a table owned arena from now on,
+   including any already stored
+*/
+void assoc_ownkeys(assoc* a) {
+
+    unsigned int i;
+
+    if (a->owned != NULL) {
+        return;
+    }
+    a->owned = arena_init();
+    if (a->owned == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    for (i = 0; i < a->capacity * BUCKETSIZE; i++) {
+        if (a->hash_table[i].flag) {
+            a->hash_table[i].key = _ownkey(a, a->hash_table[i].key);
+        }
+        if (a->hash_table2[i].flag) {
+            a->hash_table2[i].key = _ownkey(a, a->hash_table2[i].key);
+        }
+    }
+    for (i = 0; i < a->stashed; i++) {
+        a->stash[i].key = _ownkey(a, a->stash[i].key);
+    }
+}
+
+/* Choose how many buckets each key may use while the
+table is empty
+*/
+void assoc_ways(assoc* a, unsigned int d) {
+
+    if (a->size) {
+        on_error("Error: Ways can't change once keys are stored\n");
+    }
+    if (d < 2 || d > MAXWAYS) {
+        on_error("Error: Ways must be 2..4\n");
+    }
+    a->ways = d;
+}
+
+/* Choose the hash function while the table is empty
+*/
+void assoc_sethash(assoc* a, hashfunc fn) {
+
+    if (a->size) {
+        on_error("Error: Hash function can't change once keys "
+        "are stored\n");
+    }
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+}
+
+/* Load, which way each key sits in (the stash counting as
+the way after the last) and the counters
+*/
+void assoc_stats(assoc* a, assocstats* st) {
+
+    unsigned long i, cells = (unsigned long)a->capacity * BUCKETSIZE;
+    unsigned int s;
+    hash* t;
+
+    _stat_begin(st, a->size, 2 * cells + STASHSIZE);
+    for (s = 0; s < 2; s++) {
+        t = s ? a->hash_table2 : a->hash_table;
+        for (i = 0; i < cells; i++) {
+            if (t[i].flag) {
+                _stat_probe(st, _wayof(a, s, i / BUCKETSIZE, &t[i]));
+            }
+        }
+    }
+    for (i = 0; i < a->stashed; i++) {
+        _stat_probe(st, a->ways);
+    }
+    _stat_end(st, sizeof(assoc) + (2 * cells + STASHSIZE) * sizeof(hash) \
+    + (a->owned ? a->owned->bytes : 0), &a->stats);
+}
+
+void assoc_latency(assoclatency* l) {
+
+    _lat_merge(l);
+}
+
+void assoc_latency_reset(void) {
+
+    _lat_reset();
+}
+
+void assoc_latency_sample(unsigned int n) {
+
+    _lat_setsample(n);
+}
+
 /* Free up all allocated space from 'a' */
 void assoc_free(assoc* a) {
     
-    free(a->hash_table);
-    free(a->hash_table2);
-    free(a);
+    arena_free(a->owned);
+    _drop(a);
 }
 
 void _assoc_test(void);
 
-/* Two variations of djb2 hash function edited from: \
-https://gist.github.com/MohamedTaha98/ccdf734f13299efb73ff0b12f7ce429f */
+/* Three passes over the input. Keys are first sorted by
+   their bucket in the first table, each thread taking one
+   run of buckets, and go into a free cell there. What
+   didn't fit is sorted by its bucket in the second table
+   and tried there the same way. The few still left go in
+   through assoc_insert, bouncing as usual. Each pass keeps
+   input order within a bucket, and a key's duplicates share
+   its buckets, so the first of them is the one kept
+*/
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads) {
+
+    assoc* a = ncalloc(1, sizeof(assoc));
+    unsigned int i;
+    build b;
+
+    a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    a->ways = WAYS;
+    a->capacity = _fit(a, n, &a->recip);
+    _tables(a);
+    if (n == 0) {
+        return a;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.a = a;
+    b.keys = keys;
+    b.data = data;
+    b.n = n;
+    b.parts = threads;
+    b.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+    b.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    b.placed = (bool*) ncalloc(sizeof(bool), n);
+    b.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
 
-void _hash(assoc* a, void* key, unsigned int* hash) {
+    _parallel(_build_hash, &b, threads);
+    _build_pass(&b, false);
+    _build_pass(&b, true);
+    for (i = 0; i < n; i++) {
+        if (!b.placed[i]) {
+            assoc_insert(&a, keys[i], data ? data[i] : NULL);
+        }
+    }
+    free(b.h);
+    free(b.len);
+    free(b.placed);
+    free(b.order);
+    return a;
+}
 
-    unsigned long h = 5381 + a->capacity;
-    char *str;
-    unsigned int c, count = 0; 
-    str = (char*)key;
+/* Hash thread t's share of the keys
+*/
+void _build_hash(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long i, lo, hi;
 
-    if (a->keysize) {
-        while ((count < a->keysize)) {
-            h = ((h << HASH1) + h) + *(int*)key;
-            count++;
+    _slice(b->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (b->keys[i] == NULL) {
+            on_error("Error: Null pointer\n");
         }
+        b->h[i] = _hashkey(b->a, b->keys[i], &b->len[i]);
     }
+}
 
-    /*http://www.cse.yorku.ca/~oz/hash.html*/
+/* Which thread's run of buckets key i falls in; keys
+already dealt with go in an extra partition no thread takes
+*/
+unsigned int _build_part(void* ctx, unsigned long i) {
+
+    build* b = (build*)ctx;
+    unsigned int index;
+
+    if (b->placed[i]) {
+        return b->parts;
+    }
+    if (b->second) {
+        _hash_two(b->a, b->h[i], &index);
+    }
     else {
-        while ((c = *str++)){
-            h = c + (h << 6) + (h << 16) - h;
-        }
+        _hash(b->a, b->h[i], &index);
     }
-    *hash = h % a->capacity;
+    return (unsigned int)((unsigned long)index * b->parts / \
+    b->a->capacity);
 }
 
-void _hash_two(assoc* a, void* key, unsigned int* hash) {
+/* Sort what's left by bucket, then let every thread fill
+its own buckets in one table
+*/
+void _build_pass(build* b, bool second) {
 
-    unsigned long h = 7;
-    unsigned int count = 0; 
-    char *str;
-    str = (char*)key;
-   
-    if (a->keysize) {
-        while ((count < a->keysize)) {
-            h = ((h << HASH2) + *str + count);
-            count++;
+    unsigned int p;
+
+    b->second = second;
+    if (!_partition(b->n, b->parts + 1, _build_part, b, b->parts, \
+    b->order, b->start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    memset(b->added, 0, sizeof(b->added));
+    _parallel(_build_place, b, b->parts);
+    for (p = 0; p < b->parts; p++) {
+        b->a->size += b->added[p];
+    }
+}
+
+/* Thread t places partition t: a key goes in the first free
+cell of its bucket, unless an earlier copy is already there.
+No other thread touches these buckets
+*/
+void _build_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    assoc* a = b->a;
+    hash* table = b->second ? a->hash_table2 : a->hash_table;
+    hash *bucket, item;
+    unsigned long k;
+    unsigned int i, j, index;
+
+    (void)threads;
+    for (k = b->start[t]; k < b->start[t + 1]; k++) {
+        i = b->order[k];
+        if (b->second) {
+            _hash_two(a, b->h[i], &index);
+        }
+        else {
+            _hash(a, b->h[i], &index);
+        }
+        bucket = &table[index * BUCKETSIZE];
+        for (j = 0; j < BUCKETSIZE && bucket[j].flag; j++) {
+            if (_keymatch(a, &bucket[j], b->keys[i], b->h[i], \
+            b->len[i])) {
+                break;
+            }
         }
+        if (j < BUCKETSIZE) {
+            if (!bucket[j].flag) {
+                item.key = b->keys[i];
+                item.data = b->data ? b->data[i] : NULL;
+#if CACHEHASH
+                item.fullhash = b->h[i];
+                item.keylen = b->len[i];
+#endif
+                _add_data(bucket, &item, j);
+                b->added[t]++;
+            }
+            b->placed[i] = true;
+        }
+    }
+}
+
+/* One 64 bit hash per key, from whichever function the 
+table was given (see hashfn.h). len is the key's length 
+*/
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len) {
+
+    *len = a->keysize;
+    if (!*len) {
+        *len = strlen((char*)key);
+    }
+    return a->hashfn(key, *len, HASHSEED);
+}
+
+/* Hash of a stored key: cached in the cell unless 
+built with CACHEHASH=0
+*/
+unsigned long _cellhash(assoc* a, hash* cell) {
+
+#if CACHEHASH
+    (void)a;
+    return cell->fullhash;
+#else
+    unsigned int len;
+
+    return _hashkey(a, cell->key, &len);
+#endif
+}
+
+/* Low half of the hash picks the bucket in the first table
+*/
+void _hash(assoc* a, unsigned long h, unsigned int* hash) {
+
+    *hash = _reduce((uint32_t)h, a->capacity, a->recip);
+}
+
+/* High half picks the bucket in the second table
+*/
+void _hash_two(assoc* a, unsigned long h, unsigned int* hash) {
+
+    *hash = _reduce(h >> 32, a->capacity, a->recip);
+}
+
+/* Way w of a key's buckets: its bucket index, and the table
+it's in as the return value. Ways 0 and 1 are _hash and
+_hash_two; later ones combine the two halves, h1 + w*h2,
+and alternate between the tables
+*/
+unsigned int _way(assoc* a, unsigned long h, unsigned int w, \
+unsigned int* index) {
+
+    uint32_t lo = (uint32_t)h, hi = (uint32_t)(h >> 32);
+
+    if (w == 0) {
+        _hash(a, h, index);
+    }
+    else if (w == 1) {
+        _hash_two(a, h, index);
     }
     else {
-        while ((*str++)) {
-            h = ((h << HASH2) + h + *str);
+        *index = _reduce((uint32_t)(lo + w * hi), a->capacity, a->recip);
+    }
+    return w & 1;
+}
+
+/* The first of its ways that takes a stored key to the
+bucket it's in, i.e. buckets a lookup searches before it
+*/
+unsigned int _wayof(assoc* a, unsigned int side, unsigned int bucket, \
+hash* cell) {
+
+    unsigned long h = _cellhash(a, cell);
+    unsigned int w, index;
+
+    for (w = 0; w < a->ways; w++) {
+        if (_way(a, h, w, &index) == side && index == bucket) {
+            break;
+        }
     }
+    return w;
+}
+
+/* Every bucket a key may be in, each prefetched (a bucket
+spans two cache lines), so their misses overlap however
+many ways are searched in the end
+*/
+void _candidates(assoc* a, unsigned long h, hash** b) {
+
+    unsigned int w, index, side;
+
+    for (w = 0; w < a->ways; w++) {
+        side = _way(a, h, w, &index);
+        b[w] = _bucket(a, side, index);
+        _prefetch(b[w]);
+        _prefetch(&b[w][BUCKETSIZE - 1]);
     }
-    *hash = h % a->capacity;    
 }
 
-/* Find hash and insert data into hashtable
+/* Fill in a cell ready to be placed, hashing the key
 */
-bool _add_hash(assoc* a, void* key, void* data) {
+void _makecell(assoc* a, hash* cell, void* key, void* data) {
 
-    unsigned int hash = 0;
-    void *old_key = 0, *old_data = 0;
-    static int count = 0;
+    unsigned int len;
+    unsigned long h = _hashkey(a, key, &len);
 
-    _hash(a, key, &hash);
-    old_key = a->hash_table[hash].key;
-    old_data = a->hash_table[hash].data;
+    _setcell(cell, key, data, h, len);
+}
 
-    /*If cell is full bounce data into second hash table*/
-    if (a->hash_table[hash].flag) {
-        count += 1;
-        /*Resize hash table after log base2 bounces*/
-        if (count == log2n(a->capacity)) {
-            printf("count is %d capacity is %d assoc_count(a) is %d\n", count, a->capacity, assoc_count(a));
-            count = 0;
-            return false;
+/* Fill in a cell for a key already hashed
+*/
+void _setcell(hash* cell, void* key, void* data, unsigned long h, \
+unsigned int len) {
+
+#if CACHEHASH
+    cell->fullhash = h;
+    cell->keylen = len;
+#else
+    (void)h;
+    (void)len;
+#endif
+    cell->key = key;
+    cell->data = data;
+    cell->flag = true;
+}
+
+/* The cell holding key, after one hash and one pass over
+   its buckets that also notes the first free cell, so a new
+   key only needs a path search if they're all full. A new
+   key gets 'data', an old one keeps its own. Returns where
+   the key is now, even if placing it grew the table
+*/
+hash* _upsert(assoc** a, void* key, void* data, bool* inserted) {
+
+    assoc *p = *a, *g;
+    hash *b[MAXWAYS], *cell, *free = NULL, item;
+    unsigned long h, recip;
+    unsigned int len, capacity, w, i;
+
+    if (p == NULL || key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    STAT_ADD(p->stats.searches, 1);
+    h = _hashkey(p, key, &len);
+    _candidates(p, h, b);
+    for (w = 0; w < p->ways; w++) {
+        for (i = 0; i < BUCKETSIZE; i++) {
+            if (!b[w][i].flag) {
+                free = free == NULL ? &b[w][i] : free;
+            }
+            else if (_keymatch(p, &b[w][i], key, h, len)) {
+                *inserted = false;
+                return &b[w][i];
+            }
         }
-        _add_data(a->hash_table, key, data, hash);
-        _add_hash_two(a, old_key, old_data);
     }
-    else {
-        a->size += 1;
-        _add_data(a->hash_table, key, data, hash);
+    if (p->stashed && (cell = _search_stash(p, key, h, len)) != NULL) {
+        *inserted = false;
+        return cell;
     }
-    return true;
+    *inserted = true;
+    /* Grow first if at the maximum load */
+    if (p->size >= _limit(p, p->capacity)) {
+        capacity = _primetable(p, &recip);
+        p = _resize(a, capacity, recip);
+        free = NULL;
+    }
+    if (p->owned != NULL) {
+        key = _ownkey(p, key);
+    }
+    _setcell(&item, key, data, h, len);
+    if (free != NULL) {
+        _add_data(free, &item, 0);
+        p->size += 1;
+        return free;
+    }
+    /* If no path frees a cell and the stash is full, the
+    key goes into a bigger table */
+    cell = _insert(p, &item);
+    if (cell == NULL) {
+        g = _grow(p, &item);
+        *a = g;
+        _drop(p);
+        _candidates(g, h, b);
+        cell = _search(g, b, key, h, len);
+    }
+    return cell;
 }
 
-/* Find hash and insert into hashtable 
+/* Place a cell in any of its buckets. If all are full,
+   search breadth first for the shortest chain of keys that
+   can each move to another of their buckets, ending at a
+   free cell, and move them; failing that, stash it.
+   Returns the cell it went in. NULL => no chain within
+   MAXBFS buckets and the stash is full, and nothing has
+   moved
 */
-bool _add_hash_two(assoc* a, void* key, void* data) {
+hash* _insert(assoc* a, hash* item) {
 
-    unsigned int hash = 0;
-    void *old_key = 0, *old_data = 0;
-    
-    _hash_two(a, key, &hash);
-    old_key = a->hash_table2[hash].key;
-    old_data = a->hash_table2[hash].data;
+    node q[MAXBFS];
+    hash* cell;
+    int last;
 
-    /*If cell is full bounce data into first hash table */
-    if (a->hash_table2[hash].flag) {
-        _add_data(a->hash_table2, key, data, hash);
-        _add_hash(a, old_key, old_data);
+    if ((cell = _add_free(a, item)) != NULL) {
+        return cell;
     }
-    else {
-        a->size += 1;
-        _add_data(a->hash_table2, key, data, hash);
+    last = _bfs(a, _cellhash(a, item), q);
+    if (last < 0) {
+        return _add_stash(a, item);
     }
-    return true;
+    a->size += 1;
+    return _shift(a, q, last, item);
+}
+
+/* Use a free cell in any of the key's buckets, the
+earliest way first, if there is one
+*/
+hash* _add_free(assoc* a, hash* item) {
+
+    unsigned int w, side, index = 0;
+    unsigned long h = _cellhash(a, item);
+    hash* cell;
+
+    for (w = 0; w < a->ways; w++) {
+        side = _way(a, h, w, &index);
+        if ((cell = _add_bucket(_bucket(a, side, index), item)) != NULL) {
+            a->size += 1;
+            return cell;
+        }
+    }
+    return NULL;
+}
+
+/* Put item in the first empty cell of a bucket, NULL =>
+none
+*/
+hash* _add_bucket(hash* bucket, hash* item) {
+
+    unsigned int i;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (!bucket[i].flag) {
+            _add_data(bucket, item, i);
+            return &bucket[i];
+        }
+    }
+    return NULL;
+}
+
+/* Park a key no path could place, NULL => the stash
+is full too and the table must grow
+*/
+hash* _add_stash(assoc* a, hash* item) {
+
+    if (a->stashed == STASHSIZE) {
+        return NULL;
+    }
+    _add_data(a->stash, item, a->stashed);
+    a->stashed += 1;
+    a->size += 1;
+    return &a->stash[a->stashed - 1];
+}
+
+/* Bucket 'index' of one of the tables
+*/
+hash* _bucket(assoc* a, unsigned int side, unsigned int index) {
+
+    return &(side ? a->hash_table2 : a->hash_table)[index * BUCKETSIZE];
+}
+
+/* First empty cell of a bucket, -1 => full
+*/
+int _free_cell(hash* bucket) {
+
+    int i;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (!bucket[i].flag) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Is this bucket already on the way to q[at]? A chain
+through the same bucket twice would move a key twice
+*/
+bool _onpath(node* q, int at, unsigned int side, unsigned int index) {
+
+    for (; at >= 0; at = q[at].parent) {
+        if (q[at].side == side && q[at].bucket == index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Breadth first from the key's buckets: each key in a
+   full bucket leads to its other buckets (just the one in
+   the other table, with two ways). The
+   queue is the search tree, parents by index, so the first
+   bucket with a free cell ends the shortest chain. Returns
+   its index in q, -1 => none within MAXBFS buckets or
+   MAXDEPTH moves
+*/
+int _bfs(assoc* a, unsigned long h, node* q) {
+
+    int head, tail;
+    unsigned int i, w, side, index;
+    unsigned long kh;
+    hash* bucket;
+
+    for (tail = 0; tail < (int)a->ways; tail++) {
+        q[tail].side = _way(a, h, (unsigned int)tail, &q[tail].bucket);
+        q[tail].slot = 0;
+        q[tail].depth = 0;
+        q[tail].parent = -1;
+    }
+    for (head = 0; head < tail; head++) {
+        bucket = _bucket(a, q[head].side, q[head].bucket);
+        if (_free_cell(bucket) >= 0) {
+            return head;
+        }
+        if (q[head].depth == MAXDEPTH) {
+            continue;
+        }
+        for (i = 0; i < BUCKETSIZE; i++) {
+            kh = _cellhash(a, &bucket[i]);
+            for (w = 0; w < a->ways && tail < MAXBFS; w++) {
+                side = _way(a, kh, w, &index);
+                if (_onpath(q, head, side, index)) {
+                    continue;
+                }
+                q[tail].side = side;
+                q[tail].bucket = index;
+                q[tail].slot = i;
+                q[tail].depth = q[head].depth + 1;
+                q[tail].parent = head;
+                tail++;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Move the keys along the chain ending at q[last], the
+   last first, so every move is into a cell just emptied,
+   then put item in the cell freed in its own bucket,
+   which is returned
+*/
+hash* _shift(assoc* a, node* q, int last, hash* item) {
+
+    hash *from, *to;
+    int at, i;
+
+    for (at = last; q[at].parent >= 0; at = q[at].parent) {
+        to = _bucket(a, q[at].side, q[at].bucket);
+        from = &_bucket(a, q[q[at].parent].side, \
+        q[q[at].parent].bucket)[q[at].slot];
+        _add_data(to, from, (unsigned int)_free_cell(to));
+        from->flag = false;
+    }
+    to = _bucket(a, q[at].side, q[at].bucket);
+    i = _free_cell(to);
+    _add_data(to, item, (unsigned int)i);
+    return &to[i];
 }
 
 /* Add data to correct cell in hash table 
 */
-void _add_data(hash* a, void* key, void* data, \
-unsigned int hash) {
+void _add_data(hash* a, hash* item, unsigned int hash) {
 
-    a[hash].data = data;
+    a[hash] = *item;
     a[hash].flag = true;
-    a[hash].key = key;
 }
 
 /* Allocate space for new hash table 
 */
 assoc* _realloc(assoc* a) {
 
+    unsigned long recip;
+    unsigned int capacity = _primetable(a, &recip);
+
+    return _alloc(a, capacity, recip);
+}
+
+/* The table's own copy of a new key
+*/
+void* _ownkey(assoc* a, void* key) {
+
+    size_t len = a->keysize;
+    void* copy;
+
+    if (!len) {
+        len = strlen((char*)key) + 1;
+    }
+    copy = arena_copy(a->owned, key, len, arena_align(len, !a->keysize));
+    if (copy == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    return copy;
+}
+
+/* Empty tables for a->capacity buckets. The stash is
+kept on the end of the second, so it goes with it
+*/
+void _tables(assoc* a) {
+
+    a->hash_table = (hash*) ncalloc(sizeof(hash), \
+    a->capacity * BUCKETSIZE);
+    a->hash_table2 = (hash*) ncalloc(sizeof(hash), \
+    a->capacity * BUCKETSIZE + STASHSIZE);
+    a->stash = &a->hash_table2[a->capacity * BUCKETSIZE];
+    a->stashed = 0;
+}
+
+/* Free the tables but not the keys, which a resize
+hands on to the next table
+*/
+void _drop(assoc* a) {
+
+    free(a->hash_table);
+    free(a->hash_table2);
+    free(a);
+}
+
+/* Empty tables of the given capacity, with a's settings
+*/
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip) {
+
     assoc* b = ncalloc(1, sizeof(assoc));
 
-    b->hash_table = (hash*) ncalloc(sizeof(hash), \
-    _primetable(a));
-    b->hash_table2 = (hash*) ncalloc(sizeof(hash), \
-    _primetable(a));
-    b->capacity = _primetable(a);
+    b->capacity = capacity;
+    b->recip = recip;
+    _tables(b);
     b->keysize = a->keysize;
+    b->hashfn = a->hashfn;
+    b->growth = a->growth;
+    b->maxload = a->maxload;
+    b->ways = a->ways;
+    b->owned = a->owned;
+    _stat_copy(&b->stats, &a->stats);
     
     return b;
 }
 
-/*Find the next prime number using scalefactor to\
- size the new hash table
+/* Build a bigger table holding everything in 'a' plus
+   item. A rehash can find no path as well, in which
+   case just go a size bigger again
+*/
+assoc* _grow(assoc* a, hash* item) {
+
+    unsigned long since = _stat_clock(), lat = _lat_resizing();
+    assoc *b = _realloc(a), *c;
+    hash left = *item;
+
+    while (!_rehash(a, b) || !_insert(b, &left)) {
+        left = *item;
+        c = _realloc(b);
+        _drop(b);
+        b = c;
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    return b;
+}
+
+/* Rehash everything into tables of 'capacity' (or
+   bigger, if a key finds no path), re-direct *a to them and
+   free the old structure. Returns the table now in use
+*/
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip) {
+
+    unsigned long since = _stat_clock(), lat = _lat_resizing();
+    assoc *p = *a, *b = _alloc(p, capacity, recip), *c;
+
+    while (!_rehash(p, b)) {
+        c = _realloc(b);
+        _drop(b);
+        b = c;
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    *a = b;
+    _drop(p);
+    return b;
+}
+
+/*Find the next prime up the ladder (see sizing.h) using
+ the growth factor to size the new hash table
  */
-unsigned int _primetable(assoc* a) {
+unsigned int _primetable(assoc* a, unsigned long* recip) {
 
     unsigned int prime;
+    double want = a->capacity * a->growth;
 
-    prime = a->capacity*SCALEFACTOR;
-
-    while (!_isprime(prime)) {
-        prime += 1;
+    /*However small the factor, always go up a rung*/
+    if (want < a->capacity + 1.0) {
+        want = a->capacity + 1.0;
+    }
+    prime = want > UINT32_MAX ? 0 : \
+    _next_capacity((unsigned long)ceil(want), recip);
+    if (!prime) {
+        on_error("Error: Hash table too big\n");
     }
     return prime;
 }
 
-/*Check whether a number is prime
+/* Keys both tables of 'capacity' buckets take before
+they're grown
+*/
+unsigned long _limit(assoc* a, unsigned int capacity) {
+
+    return (unsigned long)(2.0 * BUCKETSIZE * capacity * a->maxload \
+    + 1e-6);
+}
+
+/* Smallest capacity, at least INITIALSIZE, that n keys
+fill to no more than BUILDLOAD or maxload
 */
-bool _isprime(unsigned int c) {
-   
-   unsigned int i; 
-   bool flag = true;
-   
-   for (i = 2; i <= c/2; i++) {
-      
-      if (c % i == 0) {
-         flag = false;
-      }
-   }   
-   return flag; 
-}   
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip) {
 
-/* Take data from one table and hash into second table 
+    double load = a->maxload < BUILDLOAD ? a->maxload : BUILDLOAD;
+    unsigned long min = (unsigned long)ceil(n / \
+    (2 * BUCKETSIZE * load));
+    unsigned int capacity;
+
+    capacity = _next_capacity(min > INITIALSIZE ? \
+    min : INITIALSIZE, recip);
+    if (!capacity) {
+        on_error("Error: Hash table too big\n");
+    }
+    return capacity;
+}
+
+/* Take data from one table and place into second table;
+ cached hashes mean nothing is hashed again. Tables big
+ enough to share out go through _rehash_parallel()
 */
 bool _rehash(assoc* a, assoc* b) {
 
-    unsigned int i = 0, size = a->capacity;
+    unsigned int i = 0, size;
+    hash item;
 
     if (a == NULL || b == NULL) {
         return false;
     }
+    if (_rehash_threads(a->size) > 1) {
+        return _rehash_parallel(a, b, _rehash_threads(a->size));
+    }
 
+    size = a->capacity * BUCKETSIZE;
     for (i = 0; i < size; i++) {
         if (a->hash_table[i].flag) {
-            _add_hash(b, a->hash_table[i].key, \
-            a->hash_table[i].data);
+            item = a->hash_table[i];
+            if (!_insert(b, &item)) {
+                return false;
+            }
         }
         if (a->hash_table2[i].flag) {
-            _add_hash(b, a->hash_table2[i].key, \
-            a->hash_table2[i].data);
+            item = a->hash_table2[i];
+            if (!_insert(b, &item)) {
+                return false;
+            }
+        }
+    }
+    for (i = 0; i < a->stashed; i++) {
+        item = a->stash[i];
+        if (!_insert(b, &item)) {
+            return false;
         }
     }
     return true;
 }
 
-/* Check if key already exists in hashtable 
+/* _rehash() over threads: every key is gathered with its
+hash, then placed as assoc_build() places keys, a table at
+a time, with the few left over going in one by one.
+false => no path for one of those
 */
-bool _isduplicate(assoc* a, void* key) {
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads) {
 
-    hash hash1 = _search_one(a, key);
-    hash hash2 = _search_two(a, key);
+    unsigned long cells = (unsigned long)a->capacity * BUCKETSIZE;
+    unsigned int i, n = a->size;
+    bool ok = true;
+    rehash r;
+    build bd;
+    hash item;
 
-    if (hash1.key != NULL || hash2.key != NULL) {
-        return true;
+    memset(&bd, 0, sizeof(bd));
+    bd.a = b;
+    bd.n = n;
+    bd.parts = threads;
+    bd.keys = (void**) ncalloc(sizeof(void*), n);
+    bd.data = (void**) ncalloc(sizeof(void*), n);
+    bd.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+    bd.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    bd.placed = (bool*) ncalloc(sizeof(bool), n);
+    bd.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    r.a = a;
+    r.b = &bd;
+    if (_gather(2 * cells + a->stashed, _old_kept, _old_put, &r, \
+    threads) < 0) {
+        on_error("Error: Cannot allocate partition counts\n");
     }
-    return false;
+    _build_pass(&bd, false);
+    _build_pass(&bd, true);
+    for (i = 0; ok && i < n; i++) {
+        if (!bd.placed[i]) {
+            _setcell(&item, bd.keys[i], bd.data[i], bd.h[i], bd.len[i]);
+            ok = _insert(b, &item) != NULL;
+        }
+    }
+    free(bd.keys);
+    free(bd.data);
+    free(bd.h);
+    free(bd.len);
+    free(bd.placed);
+    free(bd.order);
+    return ok;
 }
 
-/* Search for key within first hashtable 
- using strcmp and memcmp
- */
-hash _search_one(assoc* a, void* key) {
+/* Cell i of the old table, counting through the first
+table, the second and then the stash
+*/
+hash* _oldcell(assoc* a, unsigned long i) {
 
-    hash empty_hash;
-    unsigned int hashone;
-    
-    _hash(a, key, &hashone);
+    unsigned long cells = (unsigned long)a->capacity * BUCKETSIZE;
 
+    if (i < cells) {
+        return &a->hash_table[i];
+    }
+    if (i < 2 * cells) {
+        return &a->hash_table2[i - cells];
+    }
+    return &a->stash[i - 2 * cells];
+}
+
+bool _old_kept(void* ctx, unsigned long i) {
+
+    return _oldcell(((rehash*)ctx)->a, i)->flag;
+}
+
+/* Key k of the rehash is in old cell i
+*/
+void _old_put(void* ctx, unsigned long i, unsigned long k) {
+
+    rehash* r = (rehash*)ctx;
+    hash* cell = _oldcell(r->a, i);
+
+    r->b->keys[k] = cell->key;
+    r->b->data[k] = cell->data;
+#if CACHEHASH
+    r->b->h[k] = cell->fullhash;
+    r->b->len[k] = cell->keylen;
+#else
+    r->b->h[k] = _hashkey(r->a, cell->key, &r->b->len[k]);
+#endif
+}
+
+/* Compare a stored key using strcmp or memcmp. The cached
+hash and length turn away nearly every mismatch without
+following the stored key pointer
+*/
+bool _keymatch(assoc* a, hash* cell, void* key, unsigned long h, \
+unsigned int len) {
+
+#if CACHEHASH
+    (void)a;
+    if (cell->fullhash != h || cell->keylen != len) {
+        return false;
+    }
+    STAT_ADD(a->stats.compares, 1);
+    return !memcmp(cell->key, key, len);
+#else
+    (void)h;
+    (void)len;
+    STAT_ADD(a->stats.compares, 1);
     if (!a->keysize) {
-        if (a->hash_table[hashone].flag) {
-            if (!strcmp((char*)a->hash_table[hashone].key,\
-             (char*)key))  {
-                return a->hash_table[hashone];
-            }
+        return !strcmp((char*)cell->key, (char*)key);
+    }
+    return !memcmp(cell->key, key, a->keysize);
+#endif
+}
+
+/* Search the key's buckets b, the earliest way first, then
+the stash
+*/
+hash* _search(assoc* a, hash** b, void* key, unsigned long h, \
+unsigned int len) {
+
+    hash* found;
+    unsigned int w;
+
+    for (w = 0; w < a->ways; w++) {
+        found = _search_bucket(a, b[w], key, h, len);
+        if (found != NULL) {
+            return found;
         }
     }
-    else {
-        if (a->hash_table[hashone].flag) {
-            if (!memcmp(a->hash_table[hashone].key, key,\
-             a->keysize))  {
-                return a->hash_table[hashone];
-            }
+    if (a->stashed) {
+        return _search_stash(a, key, h, len);
+    }
+    return NULL;
+}
+
+/* Search one bucket for key, scanning every cell. NULL =>
+not there
+*/
+hash* _search_bucket(assoc* a, hash* bucket, void* key, \
+unsigned long h, unsigned int len) {
+
+    unsigned int i;
+
+    for (i = 0; i < BUCKETSIZE; i++) {
+        if (bucket[i].flag && \
+        _keymatch(a, &bucket[i], key, h, len)) {
+            return &bucket[i];
         }
-    }   
-    EMPTYHASH
-    return empty_hash;
+    }
+    return NULL;
 }
 
-/* Search for key within second hashtable 
-using strcmp and memcmp
+/* Search the stash, in the order keys went in
 */
-hash _search_two (assoc* a, void* key) {
+hash* _search_stash(assoc* a, void* key, unsigned long h, \
+unsigned int len) {
 
-    hash empty_hash;
-    unsigned int hashtwo;
-    
-    _hash_two(a, key, &hashtwo);
-    
-    if (!a->keysize) {
-        if (a->hash_table2[hashtwo].flag) {
-            if (!strcmp((char*)a->hash_table2[hashtwo].key,\
-             (char*)key)) {
-                return a->hash_table2[hashtwo];
+    unsigned int i;
+
+    for (i = 0; i < a->stashed; i++) {
+        if (_keymatch(a, &a->stash[i], key, h, len)) {
+            return &a->stash[i];
+        }
+    }
+    return NULL;
+}
+
+/* Count a key up by one, its data being the count
+*/
+static void* _testcount(void* data, bool inserted, void* arg) {
+
+    (void)arg;
+    assert(inserted == (data == NULL));
+    return (void*)((uintptr_t)data + 1);
+}
+
+void _assoc_test(void) {
+
+    hash bucket[BUCKETSIZE];
+    hash hash1, item;
+    node q[MAXBFS];
+    void** slot;
+    bool fresh;
+    int i, j, last, key[BUCKETSIZE + 1], ints[1000], *many;
+    unsigned int hashone, filled, capacity, len, threads;
+    void *keys[BATCH * 2 + 5], *out[BATCH * 2 + 5], **pairs;
+    unsigned long recip, bytes;
+    char words[1000][8], str[16];
+    assocstats st;
+    assoclatency lat;
+    assoc *a, *b;
+
+    /* Test assoc_init function*/
+    a = assoc_init(sizeof(int));
+    assert(a->size == 0);
+    assert(a->capacity == _next_capacity(INITIALSIZE, &a->recip));
+    for (i = 0; i < (int)(a->capacity * BUCKETSIZE); i++) {
+        assert(!a->hash_table[i].flag);
+        assert(!a->hash_table2[i].flag);
+    }
+    assoc_free(a);
+
+    /*Test _add_bucket fills every cell then refuses*/
+    a = assoc_init(sizeof(int));
+    memset(bucket, 0, sizeof(bucket));
+    for (i = 0; i < BUCKETSIZE; i++) {
+        key[i] = i;
+        _makecell(a, &item, &key[i], NULL);
+        assert(_add_bucket(bucket, &item));
+        assert(bucket[i].flag);
+        assert(*(int*)bucket[i].key == i);
+    }
+    key[BUCKETSIZE] = BUCKETSIZE;
+    _makecell(a, &item, &key[BUCKETSIZE], &key[0]);
+    assert(!_add_bucket(bucket, &item));
+
+    /*...along with each key's cached hash*/
+    assert(_cellhash(a, &bucket[1]) == _hashkey(a, &key[1], &len));
+    assert(_free_cell(bucket) == -1);
+    bucket[2].flag = false;
+    assert(_free_cell(bucket) == 2);
+    assoc_free(a);
+
+    /*Test a key whose buckets are both full gets in by
+    moving one resident on to its other bucket - the
+    shortest path there is - without growing*/
+    a = assoc_init(sizeof(int));
+    ints[0] = -1;
+    _makecell(a, &item, &ints[0], &ints[0]);
+    _hash(a, _cellhash(a, &item), &hashone);
+    _hash_two(a, _cellhash(a, &item), &filled);
+    for (i = 1, j = 0, len = 0; i < 1000; i++) {
+        ints[i] = i;
+        _makecell(a, &hash1, &ints[i], &ints[i]);
+        _hash(a, _cellhash(a, &hash1), &capacity);
+        if (capacity == hashone && j < BUCKETSIZE) {
+            _add_data(_bucket(a, 0, hashone), &hash1, (unsigned int)j++);
+            continue;
+        }
+        _hash_two(a, _cellhash(a, &hash1), &capacity);
+        if (capacity == filled && len < BUCKETSIZE) {
+            _add_data(_bucket(a, 1, filled), &hash1, len++);
+        }
+    }
+    assert(j == BUCKETSIZE && len == BUCKETSIZE);
+    a->size = 2 * BUCKETSIZE;
+    last = _bfs(a, _cellhash(a, &item), q);
+    assert(last >= 2 && q[last].depth == 1);
+    assert(_onpath(q, last, q[last].side, q[last].bucket));
+    assert(!_onpath(q, q[last].parent, q[last].side, q[last].bucket));
+    capacity = a->capacity;
+    assert(_insert(a, &item));
+    assert(a->capacity == capacity);
+    assert(assoc_count(a) == 2 * BUCKETSIZE + 1);
+    assert(assoc_lookup(a, &ints[0]) == &ints[0]);
+    for (i = 0, j = 0; i < (int)(a->capacity * BUCKETSIZE); i++) {
+        if (a->hash_table[i].flag) {
+            assert(assoc_lookup(a, a->hash_table[i].key) == \
+            a->hash_table[i].data);
+            j++;
+        }
+        if (a->hash_table2[i].flag) {
+            assert(assoc_lookup(a, a->hash_table2[i].key) == \
+            a->hash_table2[i].data);
+            j++;
+        }
+    }
+    assert(j == 2 * BUCKETSIZE + 1);
+    assoc_free(a);
+
+    /*Test with every cell taken no path exists, so keys
+    go to the stash, and only once that's full does
+    _insert give up*/
+    a = assoc_init(sizeof(int));
+    len = a->capacity * BUCKETSIZE;
+    many = (int*) ncalloc(sizeof(int), 2 * len + STASHSIZE + 1);
+    for (i = 0; i < (int)(2 * len + STASHSIZE + 1); i++) {
+        many[i] = i;
+    }
+    for (i = 0; i < (int)len; i++) {
+        _makecell(a, &a->hash_table[i], &many[i], NULL);
+        a->hash_table[i].flag = true;
+        _makecell(a, &a->hash_table2[i], &many[len + i], NULL);
+        a->hash_table2[i].flag = true;
+    }
+    a->size = 2 * len;
+    capacity = a->capacity;
+    for (i = 0; i < STASHSIZE; i++) {
+        _makecell(a, &item, &many[2 * len + i], &many[i]);
+        assert(_insert(a, &item));
+        assert(a->stashed == (unsigned int)i + 1);
+    }
+    _makecell(a, &item, &many[2 * len + STASHSIZE], NULL);
+    assert(_bfs(a, _cellhash(a, &item), q) == -1);
+    assert(!_insert(a, &item));
+    assert(a->capacity == capacity);
+    assert(assoc_count(a) == 2 * len + STASHSIZE);
+    /*...where lookups still find them*/
+    for (i = 0; i < STASHSIZE; i++) {
+        assert(*assoc_upsert(&a, &many[2 * len + i], &fresh) == &many[i]);
+        assert(!fresh);
+        assert(assoc_lookup(a, &many[2 * len + i]) == &many[i]);
+    }
+    assert(assoc_lookup(a, &many[2 * len + STASHSIZE]) == NULL);
+    keys[0] = &many[2 * len];
+    keys[1] = &many[2 * len + 1];
+    keys[2] = &many[2 * len + STASHSIZE];
+    assoc_lookup_batch(a, keys, 3, out);
+    assert(out[0] == &many[0] && out[1] == &many[1] && out[2] == NULL);
+    /*...and a rehash on several threads takes every cell
+    and the stash across*/
+    b = _realloc(a);
+    assert(_rehash_parallel(a, b, 4));
+    assert(b->size == a->size);
+    for (i = 0; i < (int)(2 * len + STASHSIZE); i++) {
+        assert(assoc_lookup(b, &many[i]) == (i < (int)(2 * len) ? \
+        NULL : &many[i - 2 * len]));
+    }
+    _drop(b);
+    assoc_free(a);
+    free(many);
+
+    /*Test a grow takes the stash with it*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i;
+    }
+    _makecell(a, &item, &ints[0], &ints[1]);
+    assert(_add_stash(a, &item));
+    _makecell(a, &item, &ints[2], &ints[3]);
+    assert(_add_stash(a, &item));
+    assoc_reserve(&a, 500);
+    assert(assoc_count(a) == 2);
+    assert(assoc_lookup(a, &ints[0]) == &ints[1]);
+    assert(assoc_lookup(a, &ints[2]) == &ints[3]);
+    for (i = 4; i < 1000; i++) {
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_count(a) == 998);
+    for (i = 4; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test every cell of a bucket is searched*/
+    a = assoc_init(sizeof(int));
+    _hash(a, _hashkey(a, &key[0], &len), &hashone);
+    for (i = 0; i < BUCKETSIZE; i++) {
+        _makecell(a, &item, &key[i], &key[i]);
+        _add_data(&a->hash_table[hashone * BUCKETSIZE], &item, i);
+    }
+    recip = _hashkey(a, &key[0], &len);
+    assert(_search_bucket(a, &a->hash_table[hashone * BUCKETSIZE], \
+    &key[0], recip, len)->data == &key[0]);
+    recip = _hashkey(a, &key[BUCKETSIZE], &len);
+    assert(_search_bucket(a, &a->hash_table[hashone * BUCKETSIZE], \
+    &key[BUCKETSIZE], recip, len) == NULL);
+    assoc_free(a);
+
+    /*Test ints: all found, nothing lost by bouncing*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    /*Duplicates are ignored*/
+    assoc_insert(&a, &ints[5], NULL);
+    assert(assoc_count(a) == 1000);
+    assert(assoc_lookup(a, &ints[5]) == &ints[5]);
+    i = -1;
+    assert(assoc_lookup(a, &i) == NULL);
+    /*...unless replaced through assoc_upsert*/
+    slot = assoc_upsert(&a, &ints[5], &fresh);
+    assert(!fresh && *slot == &ints[5]);
+    *slot = &ints[6];
+    assert(assoc_lookup(a, &ints[5]) == &ints[6]);
+    assert(assoc_count(a) == 1000);
+    assoc_free(a);
+
+    /*Test assoc_upsert counting: a new key comes back with
+    NULL data, right through resizes, and owned keys are
+    only copied when new*/
+    a = assoc_init(sizeof(int));
+    assoc_ownkeys(a);
+    many = (int*) ncalloc(sizeof(int), 500);
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i % 500;
+    }
+    for (i = 0; i < 1000; i++) {
+        j = ints[i];
+        slot = assoc_upsert(&a, &j, &fresh);
+        assert(fresh == (i < 500));
+        if (fresh) {
+            assert(*slot == NULL);
+            *slot = &many[ints[i]];
+        }
+        (*(int*)*slot)++;
+    }
+    assert(assoc_count(a) == 500);
+    assert(a->owned->bytes == 500 * sizeof(int));
+    for (i = 0; i < 500; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &many[i]);
+        assert(many[i] == 2);
+    }
+    assert(assoc_upsert(&a, &ints[0], NULL) != NULL);
+    assoc_free(a);
+    free(many);
+
+    /*Test assoc_update counts in the same step, through
+    resizes*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        assert((uintptr_t)assoc_update(&a, &ints[i], _testcount, NULL) \
+        == (uintptr_t)(i / 500 + 1));
+    }
+    assert(assoc_count(a) == 500);
+    for (i = 0; i < 500; i++) {
+        assert((uintptr_t)assoc_lookup(a, &ints[i]) == 2);
+    }
+    assoc_free(a);
+
+    /*Test ways 0 and 1 are the two tables' buckets*/
+    a = assoc_init(sizeof(int));
+    recip = _hashkey(a, &key[0], &len);
+    _hash(a, recip, &hashone);
+    assert(_way(a, recip, 0, &filled) == 0 && filled == hashone);
+    _hash_two(a, recip, &hashone);
+    assert(_way(a, recip, 1, &filled) == 1 && filled == hashone);
+    assert(_way(a, recip, 2, &filled) == 0 && filled < a->capacity);
+    assert(_way(a, recip, 3, &filled) == 1 && filled < a->capacity);
+    assoc_free(a);
+
+    /*Test with d ways every key is found, and sits in
+    one of its d buckets*/
+    for (j = 2; j <= MAXWAYS; j++) {
+        a = assoc_init(sizeof(int));
+        assoc_ways(a, (unsigned int)j);
+        for (i = 0; i < 1000; i++) {
+            ints[i] = i * 7919;
+            assoc_insert(&a, &ints[i], &ints[i]);
+        }
+        assert(a->ways == (unsigned int)j);
+        assert(assoc_count(a) == 1000);
+        for (i = 0; i < 1000; i++) {
+            assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+        }
+        i = -1;
+        assert(assoc_lookup(a, &i) == NULL);
+        for (i = 0; i < (int)(2 * a->capacity * BUCKETSIZE); i++) {
+            hash1 = (i % 2 ? a->hash_table2 : a->hash_table)[i / 2];
+            if (!hash1.flag) {
+                continue;
+            }
+            for (len = 0; len < a->ways; len++) {
+                if (_way(a, _cellhash(a, &hash1), len, &filled) == \
+                (unsigned int)i % 2 && \
+                filled == (unsigned int)i / 2 / BUCKETSIZE) {
+                    break;
+                }
             }
+            assert(len < a->ways);
         }
+        assoc_free(a);
     }
-    else {
-        if (a->hash_table2[hashtwo].flag) {
-            if (!memcmp(a->hash_table2[hashtwo].key,\
-             key, a->keysize)) {
-                return a->hash_table2[hashtwo];
+
+    /*Test batched lookups agree with single ones, hits
+    and misses mixed, in batches that don't divide evenly*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        if (i % 3) {
+            assoc_insert(&a, &ints[i], &ints[i]);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        keys[i % (BATCH * 2 + 5)] = &ints[i];
+        if (i % (BATCH * 2 + 5) == BATCH * 2 + 4 || i == 999) {
+            assoc_lookup_batch(a, keys, i % (BATCH * 2 + 5) + 1, out);
+            for (j = 0; j <= i % (BATCH * 2 + 5); j++) {
+                assert(out[j] == assoc_lookup(a, keys[j]));
+                assert(out[j] == (((int*)keys[j] - ints) % 3 ? \
+                keys[j] : NULL));
             }
         }
     }
-    EMPTYHASH
-    return empty_hash;
-}
+    assoc_free(a);
 
-/* Calculates log base 2 of a number 
-required when resizing array
-*/
-int log2n(unsigned int n) {
+    /*Test a table can be given another hash function*/
+    a = assoc_init(sizeof(int));
+    assert(a->hashfn == hash_int);
+    assoc_sethash(a, hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(a->hashfn == hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_free(a);
 
-    return (n > 1) ? 1 + log2n(n / 2) : 0;
+    /*Test strings fill buckets past 90% before a resize*/
+    a = assoc_init(0);
+    filled = 0;
+    for (i = 0; i < 1000; i++) {
+        sprintf(words[i], "w%d", i * 31);
+        b = a;
+        capacity = a->capacity;
+        assoc_insert(&a, words[i], words[i]);
+        if (a != b && capacity > INITIALSIZE) {
+            filled = assoc_count(a) - 1;
+            assert(filled > 0.9 * 2 * capacity * BUCKETSIZE);
+        }
+    }
+    assert(filled > 0);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, words[i]) == words[i]);
+    }
+    assoc_free(a);
+
+    /*Test a reserve takes n keys without resizing, and a
+    shrink comes back down to fit what's there*/
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, 1000);
+    b = a;
+    capacity = a->capacity;
+    assert(capacity == _fit(a, 1000, &recip));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(a == b && a->capacity == capacity);
+    assoc_reserve(&a, 500);
+    assert(a == b);
+    assoc_reserve(&a, 100000);
+    assert(a->capacity == _fit(a, 100000, &recip));
+    assoc_shrink_to_fit(&a);
+    assert(a->capacity == capacity);
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test a gentler policy: resizes at maxload, each one
+    only about growth times bigger*/
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 1.5, 0.5);
+    assoc_setgrowth(a, 0, 0);
+    assert(fabs(a->growth - 1.5) < 1e-9 && \
+    fabs(a->maxload - 0.5) < 1e-9);
+    filled = 0;
+    for (i = 0; i < 1000; i++) {
+        capacity = a->capacity;
+        assoc_insert(&a, &ints[i], &ints[i]);
+        if (a->capacity != capacity) {
+            assert(assoc_count(a) - 1 == _limit(a, capacity));
+            /*Next rung up, or power of two*/
+            assert(a->capacity >= capacity * 1.5 && a->capacity <= \
+            (POW2 ? capacity * 2 : capacity * 1.5 * 1.2 + 2));
+            filled++;
+        }
+    }
+    assert(filled >= 3);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_setgrowth(a, 1.0001, 0);
+    capacity = a->capacity;
+    assert(_primetable(a, &recip) > capacity);
+    assoc_free(a);
+
+    /*Test a build matches inserting in order: duplicates
+    keep the first data, whatever thread they went to, and
+    the table never needed to grow*/
+    many = (int*) ncalloc(sizeof(int), BUILDKEYS);
+    pairs = (void**) ncalloc(sizeof(void*), BUILDKEYS * 2);
+    for (i = 0; i < BUILDKEYS; i++) {
+        many[i] = i * 7919;
+        /*Every fifth key comes round again later*/
+        pairs[i] = &many[i % 5 ? i : i / 5];
+        pairs[BUILDKEYS + i] = &many[i];
+    }
+    for (threads = 1; threads <= 4; threads += 3) {
+        a = _build(pairs, &pairs[BUILDKEYS], BUILDKEYS, sizeof(int), \
+        threads);
+        assert(a->capacity == _fit(a, BUILDKEYS, &recip));
+        b = assoc_init(sizeof(int));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assoc_insert(&b, pairs[i], pairs[BUILDKEYS + i]);
+        }
+        assert(assoc_count(a) == assoc_count(b));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assert(assoc_lookup(a, &many[i]) == \
+            assoc_lookup(b, &many[i]));
+        }
+        /*...and carries on growing as usual*/
+        for (i = 0; i < 1000; i++) {
+            ints[i] = -1 - i;
+            assoc_insert(&a, &ints[i], &ints[i]);
+        }
+        assert(assoc_count(a) == assoc_count(b) + 1000);
+        assert(assoc_lookup(a, &ints[999]) == &ints[999]);
+        assoc_free(a);
+        assoc_free(b);
+    }
+    free(many);
+    free(pairs);
+
+    /*Test strings, no data and an empty build*/
+    for (i = 0; i < 1000; i++) {
+        keys[i % BATCH] = words[i];
+        if (i % BATCH == BATCH - 1) {
+            a = _build(keys, NULL, BATCH, 0, 3);
+            assert(assoc_count(a) == BATCH);
+            for (j = 0; j < BATCH; j++) {
+                assert(assoc_lookup(a, keys[j]) == NULL);
+            }
+            assoc_free(a);
+        }
+    }
+    a = assoc_build(keys, NULL, 0, 0);
+    assert(assoc_count(a) == 0);
+    assert(a->capacity == _next_capacity(INITIALSIZE, &a->recip));
+    assoc_free(a);
+
+    /*Test owned keys: every key is copied once, back to back,
+    and outlives the caller's buffer, through several grows*/
+    a = assoc_init(0);
+    assoc_ownkeys(a);
+    for (i = 0, bytes = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assoc_insert(&a, str, &ints[i]);
+        bytes += strlen(str) + 1;
+        assoc_insert(&a, str, NULL);
+    }
+    assert(a->owned->bytes == bytes);
+    assert(a->owned->head->next == NULL);
+    for (i = 0; i < (int)(a->capacity * BUCKETSIZE); i++) {
+        if (a->hash_table[i].flag) {
+            assert((char*)a->hash_table[i].key >= \
+            _chunk_mem(a->owned->head));
+            assert((char*)a->hash_table[i].key < \
+            _chunk_mem(a->owned->head) + bytes);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assert(assoc_lookup(a, str) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test owning keys after a build*/
+    for (i = 0; i < BATCH; i++) {
+        ints[i] = i * 5;
+        keys[i] = &ints[i];
+    }
+    a = assoc_build(keys, keys, BATCH, sizeof(int));
+    assoc_ownkeys(a);
+    assert(a->owned->bytes == BATCH * sizeof(int));
+    for (i = 0; i < BATCH; i++) {
+        j = i * 5;
+        ints[i] = -1;
+        assert(assoc_lookup(a, &j) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test stats: every key binned once, by the way it is
+    found in, and counters that only move with STATS*/
+    a = assoc_init(sizeof(int));
+    assoc_ways(a, 3);
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 3;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_lookup(a, &ints[7]) == &ints[7]);
+    assoc_stats(a, &st);
+    assert(st.size == 1000);
+    assert(st.slots == 2 * a->capacity * BUCKETSIZE + STASHSIZE);
+    assert(fabs(st.load - 1000.0 / st.slots) < 1e-9);
+    for (i = 0, bytes = 0; i < STATBINS; i++) {
+        bytes += st.probes[i];
+    }
+    assert(bytes == 1000);
+    assert(st.probes[0] > 0 && st.probes[3] == a->stashed);
+    assert(st.probes[STATBINS - 1] == 0);
+    assert(st.bytes > 1000 * sizeof(hash));
+    assert(fabs(st.bytes_per_key * 1000 - st.bytes) < 1e-6);
+#if STATS
+    assert(st.resizes >= 1 && st.searches == 1001 && st.compares >= 1);
+#else
+    assert(!st.resizes && !st.searches && !st.compares);
+    assert(st.rehash_ms <= 0);
+#endif
+    assoc_free(a);
+
+    /*Test latency bins: each time falls in the bin that
+    starts at or below it, and below the next*/
+    for (bytes = 0; bytes < 1UL << 20; bytes += 1 + bytes / 64) {
+        len = _lat_bin(bytes);
+        assert(latency_low(len) <= bytes && bytes < latency_low(len + 1));
+    }
+    assert(_lat_bin(1UL << LATBITS) == LATBINS - 1);
+
+    /*Test latency: 1 in LATSAMPLE inserts and lookups timed,
+    lookups split by hit or miss, every resize timed*/
+    assoc_latency_reset();
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 3;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        j = i * 3 + (i & 1);
+        assert((assoc_lookup(a, &j) != NULL) == !(i & 1));
+    }
+    assoc_latency(&lat);
+    assert(lat.sample == LATSAMPLE);
+    bytes = latency_total(&lat, LAT_INSERT) + \
+    latency_total(&lat, LAT_HIT) + latency_total(&lat, LAT_MISS);
+#if LATENCY
+    assert(bytes >= 2000 / LATSAMPLE && bytes <= 2000 / LATSAMPLE + 1);
+    assert(latency_total(&lat, LAT_RESIZE) >= 1);
+    assert(lat.ns_per_tick > 0);
+    assert(latency_quantile(&lat, LAT_RESIZE, 0.5) <= \
+    latency_quantile(&lat, LAT_RESIZE, 1));
+#else
+    assert(bytes == 0 && latency_total(&lat, LAT_RESIZE) == 0);
+#endif
+    assoc_free(a);
+
+    /*Test a rehash on several threads, for any number of
+    ways: every key kept with its data*/
+    many = (int*) ncalloc(sizeof(int), BUILDKEYS);
+    for (last = 2; last <= MAXWAYS; last++) {
+        a = assoc_init(sizeof(int));
+        assoc_ways(a, (unsigned int)last);
+        for (i = 0; i < BUILDKEYS; i++) {
+            many[i] = i * 7;
+            assoc_insert(&a, &many[i], &many[i]);
+        }
+        b = _realloc(a);
+        assert(_rehash_parallel(a, b, 4));
+        assert(b->size == BUILDKEYS);
+        for (i = 0; i < BUILDKEYS; i++) {
+            assert(assoc_lookup(b, &many[i]) == &many[i]);
+        }
+        _drop(b);
+        assoc_free(a);
+    }
+    free(many);
 }
@@ -0,0 +1,14 @@
+#pragma once
+
+/* cuckoo.c's additions to assoc.h
+*/
+
+#include "assoc.h"
+
+/* Let each key use d buckets (2..4) instead of 2, found
+   from the one 64 bit hash. More ways fill the tables
+   further before a resize, so less memory per key, but a
+   miss has to search every way. Only allowed while the
+   table is empty
+*/
+void assoc_ways(assoc* a, unsigned int d);
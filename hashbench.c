@@ -0,0 +1,270 @@
+/* Speed and quality of the hash functions in hashfn.h
+
+   gcc -O2 hashbench.c -o hashbench && ./hashbench
+
+   For each function it reports
+   - GB/s hashing keys of 4 up to 4096 bytes, each call seeded
+     with the last result so calls can't be hoisted or overlap
+   - avalanche: flip every input bit of random keys and count
+     how often each output bit changes (ideal 50%). The worst
+     and mean distance from 50% over all bit pairs is shown
+   - bucket spread: key sets typical of our tables mapped
+     onto a ladder-sized table with _reduce(), using each half
+     of the hash just as the engines do. chi^2/buckets should
+     be close to 1.0; 'max' is the fullest bucket
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "hashfn.h"
+#include "sizing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUFSIZE (16 << 20)
+#define MINSECONDS 0.2
+#define AVKEYS 2000
+#define SPREADKEYS 1000000
+#define PERBUCKET 4
+#define WORDWIDTH 16
+#define BASE 26
+#define HASHBITS 64
+
+typedef struct function {
+    const char* name;
+    hashfunc fn;
+    /* hash_int only means anything at 4 and 8 bytes */
+    bool fixedonly;
+} function;
+
+typedef struct keyset {
+    const char* name;
+    unsigned int width;
+    bool string;
+} keyset;
+
+static const function functions[] = {
+    {"wy", hash_wy, false},
+    {"int", hash_int, true},
+    {"fnv1a", hash_fnv1a, false},
+    {"djb2", hash_djb2, false}
+};
+#define NFUNCTIONS (sizeof(functions) / sizeof(functions[0]))
+
+static const unsigned int lengths[] = {4, 8, 16, 32, 64, 256, 1024, 4096};
+#define NLENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static const unsigned int avlengths[] = {4, 8, 16, 64};
+#define NAVLENGTHS (sizeof(avlengths) / sizeof(avlengths[0]))
+
+static const keyset keysets[] = {
+    {"seq int", sizeof(uint32_t), false},
+    {"x1024 int", sizeof(uint32_t), false},
+    {"seq long", sizeof(uint64_t), false},
+    {"words", WORDWIDTH, true}
+};
+#define NKEYSETS (sizeof(keysets) / sizeof(keysets[0]))
+
+static volatile uint64_t sink;
+
+static double now_s(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, for reproducible 'random' keys */
+static uint64_t rnd(uint64_t* s) {
+
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545f4914f6cdd1dULL;
+}
+
+static double speed(hashfunc fn, const unsigned char* buf, \
+unsigned int len) {
+
+    double t0 = now_s(), t;
+    unsigned long bytes = 0, off = 0;
+    uint64_t acc = 0;
+    int i;
+
+    do {
+        for (i = 0; i < 4096; i++) {
+            acc ^= fn(buf + off, len, acc);
+            off += len;
+            if (off + len > BUFSIZE) {
+                off = 0;
+            }
+        }
+        bytes += 4096UL * len;
+        t = now_s() - t0;
+    } while (t < MINSECONDS);
+    sink = acc;
+    return bytes / t / 1e9;
+}
+
+/* Worst and mean |P(output bit flips) - 0.5| */
+static void avalanche(hashfunc fn, unsigned int len, double* worst, \
+double* mean) {
+
+    static unsigned int flips[4096 * 8][HASHBITS];
+    unsigned char key[4096];
+    uint64_t s = 0x9e3779b97f4a7c15ULL, h0, d;
+    unsigned int k, i, j, bits = len * 8;
+    double bias, total = 0;
+
+    memset(flips, 0, sizeof(flips[0]) * bits);
+    for (k = 0; k < AVKEYS; k++) {
+        for (i = 0; i < len; i++) {
+            key[i] = (unsigned char)rnd(&s);
+        }
+        h0 = fn(key, len, HASHSEED);
+        for (i = 0; i < bits; i++) {
+            key[i / 8] ^= (unsigned char)(1 << (i % 8));
+            d = h0 ^ fn(key, len, HASHSEED);
+            key[i / 8] ^= (unsigned char)(1 << (i % 8));
+            for (j = 0; j < HASHBITS; j++) {
+                flips[i][j] += (d >> j) & 1;
+            }
+        }
+    }
+    *worst = 0;
+    for (i = 0; i < bits; i++) {
+        for (j = 0; j < HASHBITS; j++) {
+            bias = (double)flips[i][j] / AVKEYS - 0.5;
+            bias = bias < 0 ? -bias : bias;
+            total += bias;
+            if (bias > *worst) {
+                *worst = bias;
+            }
+        }
+    }
+    *mean = total / (bits * HASHBITS);
+}
+
+static void make_key(const keyset* ks, unsigned int i, \
+unsigned char* key, unsigned int* len) {
+
+    uint32_t v32;
+    uint64_t v64, v;
+    int n = 0;
+
+    if (ks->string) {
+        v = _fmix64(i + 1);
+        do {
+            key[n++] = (unsigned char)('a' + v % BASE);
+            v /= BASE;
+        } while (v && n < WORDWIDTH - 1);
+        *len = n;
+        return;
+    }
+    if (ks->width == sizeof(uint64_t)) {
+        v64 = i;
+        memcpy(key, &v64, sizeof(v64));
+    }
+    else {
+        v32 = (ks == &keysets[1]) ? i * 1024 : i;
+        memcpy(key, &v32, sizeof(v32));
+    }
+    *len = ks->width;
+}
+
+/* chi^2/buckets and fullest bucket for one half of the hash */
+static void spread(hashfunc fn, const keyset* ks, bool high, \
+double* chi, unsigned int* fullest) {
+
+    unsigned long recip;
+    unsigned int m = _next_capacity(SPREADKEYS / PERBUCKET, &recip);
+    unsigned int* count = calloc(m, sizeof(unsigned int));
+    unsigned char key[WORDWIDTH];
+    unsigned int i, len, b;
+    uint64_t h;
+    double e = (double)SPREADKEYS / m, sum = 0;
+
+    *fullest = 0;
+    for (i = 0; i < SPREADKEYS; i++) {
+        make_key(ks, i, key, &len);
+        h = fn(key, len, HASHSEED);
+        b = _reduce(high ? h >> 32 : (uint32_t)h, m, recip);
+        count[b]++;
+    }
+    for (i = 0; i < m; i++) {
+        sum += (count[i] - e) * (count[i] - e) / e;
+        if (count[i] > *fullest) {
+            *fullest = count[i];
+        }
+    }
+    *chi = sum / m;
+    free(count);
+}
+
+int main(void) {
+
+    unsigned char* buf = malloc(BUFSIZE);
+    uint64_t s = 1;
+    unsigned int f, l, k, full[2];
+    double worst, mean, chi[2];
+
+    if (buf == NULL) {
+        fprintf(stderr, "Cannot allocate buffer\n");
+        return EXIT_FAILURE;
+    }
+    for (l = 0; l < BUFSIZE; l++) {
+        buf[l] = (unsigned char)rnd(&s);
+    }
+
+    printf("Throughput (GB/s) by key length\n%-6s", "");
+    for (l = 0; l < NLENGTHS; l++) {
+        printf("%8u", lengths[l]);
+    }
+    printf("\n");
+    for (f = 0; f < NFUNCTIONS; f++) {
+        printf("%-6s", functions[f].name);
+        for (l = 0; l < NLENGTHS; l++) {
+            if (functions[f].fixedonly && lengths[l] > sizeof(uint64_t)) {
+                printf("%8s", "-");
+            }
+            else {
+                printf("%8.2f", speed(functions[f].fn, buf, lengths[l]));
+            }
+        }
+        printf("\n");
+    }
+
+    printf("\nAvalanche, worst/mean bias from 50%% per bit pair\n");
+    for (f = 0; f < NFUNCTIONS; f++) {
+        printf("%-6s", functions[f].name);
+        for (l = 0; l < NAVLENGTHS; l++) {
+            if (functions[f].fixedonly && avlengths[l] > sizeof(uint64_t)) {
+                continue;
+            }
+            avalanche(functions[f].fn, avlengths[l], &worst, &mean);
+            printf("  %2uB %.3f/%.3f", avlengths[l], worst, mean);
+        }
+        printf("\n");
+    }
+
+    printf("\nBucket spread over %d keys, %d per bucket: "
+    "chi^2/buckets and max, low|high half\n", SPREADKEYS, PERBUCKET);
+    for (f = 0; f < NFUNCTIONS; f++) {
+        printf("%-6s", functions[f].name);
+        for (k = 0; k < NKEYSETS; k++) {
+            if (functions[f].fixedonly && keysets[k].string) {
+                continue;
+            }
+            spread(functions[f].fn, &keysets[k], false, &chi[0], &full[0]);
+            spread(functions[f].fn, &keysets[k], true, &chi[1], &full[1]);
+            printf("  %s %.2f %u|%.2f %u", keysets[k].name, chi[0], \
+            full[0], chi[1], full[1]);
+        }
+        printf("\n");
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
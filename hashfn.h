@@ -0,0 +1,159 @@
+#pragma once
+
+/* 64 bit hash functions shared by both engines
+
+   Every function has the same shape, so a table can be
+   given any of them (or the caller's own) through
+   assoc_sethash(). Both engines derive all of their cell
+   indices from one call: the low 32 bits for the first,
+   the high 32 bits for the second.
+
+   hash_wy    : word-at-a-time, after wyhash. 16 bytes per
+                round through one 64x64->128 multiply
+   hash_int   : murmur3's 64 bit finaliser over a 4 or 8
+                byte key, the default for those keysizes
+   hash_fnv1a : FNV-1a, one byte at a time
+   hash_djb2  : the djb2 both engines used to hand tune
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASHSEED 0x2d358dccaa6c78a5ULL
+#define WYP0 0xa0761d6478bd642fULL
+#define WYP1 0xe7037ed1a0b428dbULL
+#define FNVBASIS 0xcbf29ce484222325ULL
+#define FNVPRIME 0x100000001b3ULL
+
+typedef uint64_t (*hashfunc)(const void* key, unsigned int len, \
+uint64_t seed);
+
+/* Multiply to 128 bits and fold the halves together */
+static inline uint64_t _mum(uint64_t a, uint64_t b) {
+
+#ifdef __SIZEOF_INT128__
+    __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, \
+    lb = (uint32_t)b, rh = ha * hb, rm0 = ha * lb, \
+    rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), lo, hi;
+
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl);
+    lo = t + (rm1 << 32);
+    hi += (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t _read64(const unsigned char* p) {
+
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t _read32(const unsigned char* p) {
+
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_wy(const void* key, unsigned int len, \
+uint64_t seed) {
+
+    const unsigned char* p = (const unsigned char*)key;
+    uint64_t a, b;
+    unsigned int i = len;
+
+    seed ^= _mum(seed ^ WYP0, WYP1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_read32(p) << 32) | _read32(p + ((len >> 3) << 2));
+            b = (_read32(p + len - 4) << 32) | \
+            _read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | \
+            ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        while (i > 16) {
+            seed = _mum(_read64(p) ^ WYP1, _read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = _read64(p + i - 16);
+        b = _read64(p + i - 8);
+    }
+    return _mum(_mum(a ^ WYP1, b ^ seed) ^ WYP0 ^ len, \
+    seed ^ WYP1);
+}
+
+/* Bijective, so distinct 8 byte keys never collide
+   in the full 64 bits */
+static inline uint64_t _fmix64(uint64_t h) {
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_int(const void* key, unsigned int len, \
+uint64_t seed) {
+
+    if (len == sizeof(uint64_t)) {
+        return _fmix64(_read64((const unsigned char*)key) ^ seed);
+    }
+    if (len == sizeof(uint32_t)) {
+        return _fmix64(_read32((const unsigned char*)key) ^ seed);
+    }
+    return hash_wy(key, len, seed);
+}
+
+static inline uint64_t hash_fnv1a(const void* key, unsigned int len, \
+uint64_t seed) {
+
+    const unsigned char* p = (const unsigned char*)key;
+    uint64_t h = FNVBASIS ^ seed;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * FNVPRIME;
+    }
+    return h;
+}
+
+static inline uint64_t hash_djb2(const void* key, unsigned int len, \
+uint64_t seed) {
+
+    const unsigned char* p = (const unsigned char*)key;
+    uint64_t h = 5381 + seed;
+    unsigned int i;
+
+    for (i = 0; i < len; i++) {
+        h = ((h << 5) + h) + p[i];
+    }
+    return h;
+}
+
+/* What a table uses unless told otherwise */
+static inline hashfunc hash_default(int keysize) {
+
+    if (keysize == sizeof(uint32_t) || keysize == sizeof(uint64_t)) {
+        return hash_int;
+    }
+    return hash_wy;
+}
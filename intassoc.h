@@ -0,0 +1,252 @@
+#pragma once
+
+/* Engines specialised for 4 and 8 byte integer keys
+
+   The general engines hold a void* to every key and compare
+   through it with memcmp() or strcmp(), so each probe is two
+   dependent loads. Here the key sits in the slot itself and
+   a probe is one load and one integer compare. Keys are
+   mixed with hashfn.h's _fmix64 (the same hash hash_int
+   gives), and probed linearly in a power-of-two table, so
+   a miss usually ends in the cache line it started in.
+
+   INTASSOC(name, type) generates a table for an unsigned
+   integer 'type':
+     name* name_init(void);
+     void name_insert(name* a, type key, void* data);
+     void* name_lookup(name* a, type key);
+     unsigned int name_count(name* a);
+     void name_free(name* a);
+   with the same meaning as their assoc.h namesakes: a
+   duplicate insert keeps the first data, and NULL data can't
+   be told from a miss. The table grows in place, so 'a'
+   never changes. intassoc32 (uint32_t) and intassoc64
+   (uint64_t) are generated below.
+
+   Key 0 marks an empty slot, so it's kept to one side.
+
+   Link with general.c, as for the engines. No engine
+   includes this header, so _intassoc_test() is run by
+   bench.c's main() before any scenario, not with
+   _assoc_test().
+*/
+
+#include "hashfn.h"
+#include "../../ADTs/General/general.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Slots in a new table, a power of two */
+#define INTINITIAL 16
+/* Grow once more than INTLOADNUM/INTLOADDEN full */
+#define INTLOADNUM 3
+#define INTLOADDEN 4
+
+#define INTASSOC(name, type) \
+\
+typedef struct name##_slot { \
+    type key; \
+    void* data; \
+} name##_slot; \
+\
+typedef struct name { \
+    name##_slot* slots; \
+    /* a power of two */ \
+    unsigned int capacity; \
+    unsigned int size; \
+    /* key 0 lives here, not in slots[] */ \
+    bool haszero; \
+    void* zero; \
+} name; \
+\
+static inline unsigned int _##name##_home(name* a, type key) { \
+\
+    return (unsigned int)_fmix64((uint64_t)key ^ HASHSEED) & \
+    (a->capacity - 1); \
+} \
+\
+/* Place a key known not to be stored yet */ \
+static inline void _##name##_place(name* a, type key, void* data) { \
+\
+    unsigned int i = _##name##_home(a, key); \
+\
+    while (a->slots[i].key != 0) { \
+        i = (i + 1) & (a->capacity - 1); \
+    } \
+    a->slots[i].key = key; \
+    a->slots[i].data = data; \
+} \
+\
+/* Twice the slots, every key placed again */ \
+static inline void _##name##_grow(name* a) { \
+\
+    name##_slot* old = a->slots; \
+    unsigned int i, capacity = a->capacity; \
+\
+    if (capacity > UINT32_MAX / 2) { \
+        on_error("Error: Hash table too big\n"); \
+    } \
+    a->capacity = capacity * 2; \
+    a->slots = (name##_slot*) ncalloc(sizeof(name##_slot), \
+    a->capacity); \
+    for (i = 0; i < capacity; i++) { \
+        if (old[i].key != 0) { \
+            _##name##_place(a, old[i].key, old[i].data); \
+        } \
+    } \
+    free(old); \
+} \
+\
+static inline name* name##_init(void) { \
+\
+    name* a = (name*) ncalloc(1, sizeof(name)); \
+\
+    a->capacity = INTINITIAL; \
+    a->slots = (name##_slot*) ncalloc(sizeof(name##_slot), \
+    a->capacity); \
+    return a; \
+} \
+\
+static inline void* name##_lookup(name* a, type key) { \
+\
+    unsigned int i; \
+\
+    if (key == 0) { \
+        return a->zero; \
+    } \
+    for (i = _##name##_home(a, key);; i = (i + 1) & (a->capacity - 1)) { \
+        if (a->slots[i].key == key) { \
+            return a->slots[i].data; \
+        } \
+        if (a->slots[i].key == 0) { \
+            return NULL; \
+        } \
+    } \
+} \
+\
+static inline void name##_insert(name* a, type key, void* data) { \
+\
+    unsigned int i; \
+\
+    if (key == 0) { \
+        if (!a->haszero) { \
+            a->haszero = true; \
+            a->zero = data; \
+            a->size += 1; \
+        } \
+        return; \
+    } \
+    for (i = _##name##_home(a, key);; i = (i + 1) & (a->capacity - 1)) { \
+        if (a->slots[i].key == key) { \
+            return; \
+        } \
+        if (a->slots[i].key == 0) { \
+            break; \
+        } \
+    } \
+    /*Grow first if this one would go over the load*/ \
+    if ((unsigned long)(a->size + 1) * INTLOADDEN > \
+    (unsigned long)a->capacity * INTLOADNUM) { \
+        _##name##_grow(a); \
+        _##name##_place(a, key, data); \
+    } \
+    else { \
+        a->slots[i].key = key; \
+        a->slots[i].data = data; \
+    } \
+    a->size += 1; \
+} \
+\
+static inline unsigned int name##_count(name* a) { \
+\
+    return a->size; \
+} \
+\
+static inline void name##_free(name* a) { \
+\
+    free(a->slots); \
+    free(a); \
+}
+
+INTASSOC(intassoc32, uint32_t)
+INTASSOC(intassoc64, uint64_t)
+
+/* Keys the tests load, enough to grow a few times */
+#define INTTESTKEYS 1000
+
+static inline void _intassoc_test(void) {
+
+    intassoc32* a;
+    intassoc64* b;
+    unsigned int i, capacity;
+    int data[INTTESTKEYS], other;
+
+    /*Test an empty table: misses, key 0 included*/
+    a = intassoc32_init();
+    assert(a->capacity == INTINITIAL);
+    assert(intassoc32_count(a) == 0);
+    assert(intassoc32_lookup(a, 0) == NULL);
+    assert(intassoc32_lookup(a, 12345) == NULL);
+
+    /*Test key 0 is kept to one side, counted once, and
+    keeps its first data*/
+    intassoc32_insert(a, 0, &data[0]);
+    assert(a->haszero && intassoc32_count(a) == 1);
+    assert(intassoc32_lookup(a, 0) == &data[0]);
+    intassoc32_insert(a, 0, &other);
+    assert(intassoc32_count(a) == 1);
+    assert(intassoc32_lookup(a, 0) == &data[0]);
+    for (i = 0; i < a->capacity; i++) {
+        assert(a->slots[i].key == 0 && a->slots[i].data == NULL);
+    }
+
+    /*Test duplicates keep the first data*/
+    intassoc32_insert(a, 7, &data[7]);
+    intassoc32_insert(a, 7, &other);
+    assert(intassoc32_count(a) == 2);
+    assert(intassoc32_lookup(a, 7) == &data[7]);
+    assert(intassoc32_lookup(a, 8) == NULL);
+    intassoc32_free(a);
+
+    /*Test growth: no more than 3/4 full at any time, the
+    capacity doubling once the next key would go over*/
+    a = intassoc32_init();
+    for (i = 1; i < INTTESTKEYS; i++) {
+        capacity = a->capacity;
+        intassoc32_insert(a, i * 2654435761U, &data[i]);
+        assert(intassoc32_count(a) == i);
+        assert(a->size * INTLOADDEN <= a->capacity * INTLOADNUM);
+        if (i * INTLOADDEN > capacity * INTLOADNUM) {
+            assert(a->capacity == capacity * 2);
+        }
+        else {
+            assert(a->capacity == capacity);
+        }
+    }
+    assert(a->capacity > INTINITIAL);
+    /*Every key still found, and misses still miss*/
+    for (i = 1; i < INTTESTKEYS; i++) {
+        assert(intassoc32_lookup(a, i * 2654435761U) == &data[i]);
+        assert(intassoc32_lookup(a, i * 2654435761U + 1) == NULL);
+    }
+    assert(intassoc32_lookup(a, 0) == NULL);
+    intassoc32_free(a);
+
+    /*Test 64 bit keys, including ones that only differ
+    in their top half*/
+    b = intassoc64_init();
+    for (i = 0; i < INTTESTKEYS; i++) {
+        intassoc64_insert(b, (uint64_t)i << 32, &data[i]);
+    }
+    assert(intassoc64_count(b) == INTTESTKEYS);
+    assert(b->haszero && intassoc64_lookup(b, 0) == &data[0]);
+    for (i = 0; i < INTTESTKEYS; i++) {
+        intassoc64_insert(b, (uint64_t)i << 32, &other);
+        assert(intassoc64_lookup(b, (uint64_t)i << 32) == &data[i]);
+        assert(intassoc64_lookup(b, ((uint64_t)i << 32) | 1) == NULL);
+    }
+    assert(intassoc64_count(b) == INTTESTKEYS);
+    assert(intassoc64_lookup(b, (uint64_t)INTTESTKEYS << 32) == NULL);
+    intassoc64_free(b);
+}
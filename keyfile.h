@@ -0,0 +1,342 @@
+#pragma once
+
+/* String keys straight from a file of lines (keyfile_open)
+
+   The file is mapped copy-on-write and each '\n' is
+   overwritten with '\0' where it lies, so every line is a
+   string key pointing into the mapping: the one array of
+   key pointers is all that is allocated, whatever the
+   number of lines. One thread per cpu takes a slice of the
+   file and scans it SCANWIDTH bytes at a time (SSE2, or a
+   plain loop compilers vectorise). A first pass counts each
+   slice's newlines; once every slice knows where its first
+   key goes, a second pass cuts the lines and fills in the
+   pointers. The keys are then ready for
+       assoc_build((void**)kf->keys, NULL, kf->n, 0)
+   and must outlive the table, so keyfile_close() comes
+   after assoc_free().
+
+   Every line is a key, empty ones too, and a '\r' before
+   the '\n' stays part of it. A last line with no '\n' is
+   copied out, since the mapping has no byte after it to
+   cut at. Users need _POSIX_C_SOURCE, as for the benches.
+
+   Cutting writes to every page, and each write to a
+   copy-on-write page copies it, so the file ends up in
+   memory twice. keyfile_index() maps it read only instead
+   and keeps each line as an (offset, length) record in
+   kf->recs; nothing is written, the pages stay the page
+   cache's own, and keyfile_key() gives a line's bytes,
+   which are not '\0' terminated.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parallel.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Bytes of the file compared at once */
+#define SCANWIDTH 16
+
+/* A line of a read only keyfile: where it starts in the
+   file, and its length without the '\n' */
+typedef struct keyrec {
+    unsigned long off;
+    unsigned long len;
+} keyrec;
+
+typedef struct keyfile {
+    /* the lines, as strings (keyfile_open) */
+    char** keys;
+    /* or as records (keyfile_index) */
+    keyrec* recs;
+    unsigned long n;
+    char* map;
+    size_t len;
+    /* copy of a last line with no '\n', else NULL */
+    char* tail;
+} keyfile;
+
+/* Shared by the threads cutting a keyfile into lines */
+typedef struct scanctx {
+    keyfile* kf;
+    /* index of the first key each slice starts */
+    unsigned long* first;
+} scanctx;
+
+/* Bit i set <=> p[i] == '\n', for SCANWIDTH bytes
+*/
+static inline unsigned int _newlines(const char* p) {
+
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+
+    return (unsigned int)_mm_movemask_epi8( \
+    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+#else
+    unsigned int i, mask = 0;
+
+    for (i = 0; i < SCANWIDTH; i++) {
+        mask |= (unsigned int)(p[i] == '\n') << i;
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned int _scan_popcount(unsigned int mask) {
+
+#ifdef __GNUC__
+    return (unsigned int)__builtin_popcount(mask);
+#else
+    unsigned int n = 0;
+
+    for (; mask; mask &= mask - 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+static inline unsigned int _scan_lowbit(unsigned int mask) {
+
+#ifdef __GNUC__
+    return (unsigned int)__builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+/* Slices cover every byte but the last: a '\n' there
+starts no line
+*/
+static inline void _count_lines(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    scanctx* s = (scanctx*)arg;
+    const char* map = s->kf->map;
+    unsigned long i, lo, hi, c = 0;
+
+    _slice(s->kf->len - 1, t, threads, &lo, &hi);
+    for (i = lo; i + SCANWIDTH <= hi; i += SCANWIDTH) {
+        c += _scan_popcount(_newlines(map + i));
+    }
+    for (; i < hi; i++) {
+        c += map[i] == '\n';
+    }
+    s->first[t + 1] = c;
+}
+
+/* Each thread writes only inside its own slice
+*/
+static inline void _cut_lines(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    scanctx* s = (scanctx*)arg;
+    char* map = s->kf->map;
+    char** keys = s->kf->keys;
+    unsigned long i, j, lo, hi, k = s->first[t];
+    unsigned int mask;
+
+    _slice(s->kf->len - 1, t, threads, &lo, &hi);
+    for (i = lo; i + SCANWIDTH <= hi; i += SCANWIDTH) {
+        for (mask = _newlines(map + i); mask; mask &= mask - 1) {
+            j = i + _scan_lowbit(mask);
+            map[j] = '\0';
+            keys[k++] = map + j + 1;
+        }
+    }
+    for (; i < hi; i++) {
+        if (map[i] == '\n') {
+            map[i] = '\0';
+            keys[k++] = map + i + 1;
+        }
+    }
+}
+
+/* Each thread records where the lines that start in its
+slice begin, and ends the line before each one
+*/
+static inline void _index_lines(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    scanctx* s = (scanctx*)arg;
+    const char* map = s->kf->map;
+    keyrec* recs = s->kf->recs;
+    unsigned long i, j, lo, hi, k = s->first[t];
+    unsigned int mask;
+
+    _slice(s->kf->len - 1, t, threads, &lo, &hi);
+    for (i = lo; i + SCANWIDTH <= hi; i += SCANWIDTH) {
+        for (mask = _newlines(map + i); mask; mask &= mask - 1) {
+            j = i + _scan_lowbit(mask);
+            recs[k - 1].len = j - recs[k - 1].off;
+            recs[k++].off = j + 1;
+        }
+    }
+    for (; i < hi; i++) {
+        if (map[i] == '\n') {
+            recs[k - 1].len = i - recs[k - 1].off;
+            recs[k++].off = i + 1;
+        }
+    }
+}
+
+/* Unmap the file and free the keys
+*/
+static inline void keyfile_close(keyfile* kf) {
+
+    if (kf == NULL) {
+        return;
+    }
+    if (kf->map != NULL) {
+        munmap(kf->map, kf->len);
+    }
+    free(kf->keys);
+    free(kf->recs);
+    free(kf->tail);
+    free(kf);
+}
+
+/* Map the file at path, count its lines, and fill in a
+key or record for each with 'fill' on every cpu. cut =>
+mapped writable copy-on-write, for _cut_lines(). NULL => it
+can't be read, or out of memory
+*/
+static inline keyfile* _keyfile_scan(const char* path, bool cut, \
+void (*fill)(void*, unsigned int, unsigned int)) {
+
+    keyfile* kf = (keyfile*)calloc(1, sizeof(keyfile));
+    unsigned int t, threads;
+    struct stat st;
+    scanctx s;
+    void* map;
+    int fd;
+
+    if (kf == NULL) {
+        return NULL;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(kf);
+        return NULL;
+    }
+    kf->len = (size_t)st.st_size;
+    if (kf->len == 0) {
+        close(fd);
+        return kf;
+    }
+    map = cut ? mmap(NULL, kf->len, PROT_READ | PROT_WRITE, \
+    MAP_PRIVATE, fd, 0) : mmap(NULL, kf->len, PROT_READ, MAP_SHARED, \
+    fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        free(kf);
+        return NULL;
+    }
+    kf->map = (char*)map;
+
+    threads = _nthreads(kf->len / SCANWIDTH);
+    s.kf = kf;
+    s.first = (unsigned long*)calloc(threads + 1, sizeof(unsigned long));
+    if (s.first == NULL) {
+        keyfile_close(kf);
+        return NULL;
+    }
+    _parallel(_count_lines, &s, threads);
+    /*The first line starts the file, every other one
+    follows a '\n'*/
+    s.first[0] = 1;
+    for (t = 1; t <= threads; t++) {
+        s.first[t] += s.first[t - 1];
+    }
+    kf->n = s.first[threads];
+    if (cut) {
+        kf->keys = (char**)malloc(sizeof(char*) * kf->n);
+    }
+    else {
+        kf->recs = (keyrec*)malloc(sizeof(keyrec) * kf->n);
+    }
+    if (kf->keys == NULL && kf->recs == NULL) {
+        free(s.first);
+        keyfile_close(kf);
+        return NULL;
+    }
+    if (cut) {
+        kf->keys[0] = kf->map;
+    }
+    else {
+        kf->recs[0].off = 0;
+    }
+    _parallel(fill, &s, threads);
+    free(s.first);
+    return kf;
+}
+
+/* Map the file at path and cut it into keys, see above.
+NULL => it can't be read, or out of memory
+*/
+static inline keyfile* keyfile_open(const char* path) {
+
+    keyfile* kf = _keyfile_scan(path, true, _cut_lines);
+    size_t last;
+
+    if (kf == NULL || kf->len == 0) {
+        return kf;
+    }
+    if (kf->map[kf->len - 1] == '\n') {
+        kf->map[kf->len - 1] = '\0';
+        return kf;
+    }
+    last = kf->len - (size_t)(kf->keys[kf->n - 1] - kf->map);
+    kf->tail = (char*)malloc(last + 1);
+    if (kf->tail == NULL) {
+        keyfile_close(kf);
+        return NULL;
+    }
+    memcpy(kf->tail, kf->keys[kf->n - 1], last);
+    kf->tail[last] = '\0';
+    kf->keys[kf->n - 1] = kf->tail;
+    return kf;
+}
+
+/* Map the file at path read only and record where each
+line is, see above. NULL => it can't be read, or out of
+memory
+*/
+static inline keyfile* keyfile_index(const char* path) {
+
+    keyfile* kf = _keyfile_scan(path, false, _index_lines);
+    keyrec* last;
+
+    if (kf == NULL || kf->len == 0) {
+        return kf;
+    }
+    /*The last line ends the file, or the '\n' ending it*/
+    last = &kf->recs[kf->n - 1];
+    last->len = kf->len - last->off - (kf->map[kf->len - 1] == '\n');
+    return kf;
+}
+
+/* Line i of a keyfile_index() file, and its length
+*/
+static inline const char* keyfile_key(keyfile* kf, unsigned long i, \
+unsigned long* len) {
+
+    *len = kf->recs[i].len;
+    return kf->map + kf->recs[i].off;
+}
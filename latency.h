@@ -0,0 +1,367 @@
+#pragma once
+
+/* Latency histograms for the engines (assoc_latency)
+
+   Built with -DLATENCY=1 one assoc_insert() and one
+   assoc_lookup() in every LATSAMPLE (or as set by
+   assoc_latency_sample()) on each thread is timed
+   and counted in that thread's own histograms, HDR style:
+   LATSUB bins to each power of 2, so the tail keeps the
+   same relative precision as the middle. Lookups are split
+   into hits and misses. Every resize is timed as well,
+   sampled or not, so spikes in the insert tail can be put
+   down to them. Without LATENCY it all compiles to nothing.
+
+   Time is in ticks: the TSC on x86, else clock_gettime()
+   ns. rdtsc isn't serialising, so the shortest operations
+   read a few ticks out either way. Histograms are never
+   freed, so a thread's counts outlive it. In realloc.c's
+   incremental mode each insert's share of the migration is
+   timed as a resize. ccuckoo.c only sees the data a lookup
+   finds, so there a key stored with NULL data is a miss.
+
+   The state lives in function statics, so only the engine
+   including this file keeps any; a bench can include it
+   for latency_print() and latency_dump().
+*/
+
+#include "assoc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifndef LATENCY
+#define LATENCY 0
+#endif
+
+/* 1 in LATSAMPLE operations is timed until
+   assoc_latency_sample() says otherwise, a power of 2 */
+#ifndef LATSAMPLE
+#define LATSAMPLE 64
+#endif
+
+/* How long calibrating ticks against ns takes */
+#define LATCALIBRATE 1000000
+
+/* One thread's histograms */
+typedef struct lathist {
+    unsigned long count[LATOPS][LATBINS];
+    /* operations this thread began, timed or not */
+    unsigned long ops;
+    struct lathist* next;
+} lathist;
+
+/* This thread's histograms, NULL until it first times one */
+static inline lathist** _lat_mine(void) {
+
+    static __thread lathist* mine;
+
+    return &mine;
+}
+
+/* 1 in this many operations is timed, a power of 2 */
+static inline unsigned int* _lat_sample(void) {
+
+    static unsigned int sample = LATSAMPLE;
+
+    return &sample;
+}
+
+/* Every thread's histograms, newest first */
+static inline lathist** _lat_all(void) {
+
+    static lathist* all;
+
+    return &all;
+}
+
+static inline unsigned long _lat_now(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    return (unsigned long)__rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + \
+    (unsigned long)ts.tv_nsec;
+#endif
+}
+
+/* Bin of a time of t ticks
+*/
+static inline unsigned int _lat_bin(unsigned long t) {
+
+    unsigned int top;
+
+    if (t < LATSUB) {
+        return (unsigned int)t;
+    }
+    if (t >> LATBITS) {
+        return LATBINS - 1;
+    }
+    top = (unsigned int)(63 - __builtin_clzll(t));
+    return (top - LATSUBBITS + 1) * LATSUB + \
+    (unsigned int)((t >> (top - LATSUBBITS)) & (LATSUB - 1));
+}
+
+/* Fewest ticks a time in bin b took
+*/
+static inline unsigned long latency_low(unsigned int b) {
+
+    unsigned int top;
+
+    if (b < LATSUB) {
+        return b;
+    }
+    top = b / LATSUB + LATSUBBITS - 1;
+    return (unsigned long)(LATSUB + b % LATSUB) << (top - LATSUBBITS);
+}
+
+/* Give this thread histograms of its own, on the list
+for assoc_latency() to find. NULL => out of memory
+*/
+static inline lathist* _lat_join(void) {
+
+    lathist* h = (lathist*)calloc(1, sizeof(lathist));
+
+    if (h == NULL) {
+        return NULL;
+    }
+    h->next = __atomic_load_n(_lat_all(), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(_lat_all(), &h->next, h, \
+    true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    *_lat_mine() = h;
+    return h;
+}
+
+/* Count a time of t ticks for op. Other threads only
+read the counts, but may read them at any time
+*/
+static inline void _lat_record(enum latop op, unsigned long t) {
+
+    lathist* h = *_lat_mine();
+
+    if (h == NULL && (h = _lat_join()) == NULL) {
+        return;
+    }
+    __atomic_add_fetch(&h->count[op][_lat_bin(t)], 1, __ATOMIC_RELAXED);
+}
+
+/* Start of an insert or lookup: the tick to hand to
+_lat_stop() if this one is to be timed, else 0
+*/
+static inline unsigned long _lat_start(void) {
+
+#if LATENCY
+    lathist* h = *_lat_mine();
+    unsigned int sample = __atomic_load_n(_lat_sample(), __ATOMIC_RELAXED);
+
+    if (h == NULL && (h = _lat_join()) == NULL) {
+        return 0;
+    }
+    if (++h->ops & (sample - 1)) {
+        return 0;
+    }
+    return _lat_now();
+#else
+    return 0;
+#endif
+}
+
+static inline void _lat_stop(unsigned long start, enum latop op) {
+
+#if LATENCY
+    if (start) {
+        _lat_record(op, _lat_now() - start);
+    }
+#else
+    (void)start;
+    (void)op;
+#endif
+}
+
+/* Start of a resize, timed every time. 0 without
+LATENCY
+*/
+static inline unsigned long _lat_resizing(void) {
+
+#if LATENCY
+    return _lat_now();
+#else
+    return 0;
+#endif
+}
+
+static inline void _lat_resized(unsigned long start) {
+
+    _lat_stop(start, LAT_RESIZE);
+}
+
+/* ns per tick, by timing the TSC against the clock for
+LATCALIBRATE ns the first time it's asked for. Threads
+asking at once may each calibrate, and any answer will do
+*/
+static inline double _lat_ns_per_tick(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    static double cached;
+    struct timespec ts;
+    double begin, end, ns;
+    unsigned long ticks;
+
+    __atomic_load(&cached, &ns, __ATOMIC_RELAXED);
+    if (ns > 0) {
+        return ns;
+    }
+    ticks = _lat_now();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    begin = (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        end = (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+    } while (end - begin < LATCALIBRATE);
+    ns = (end - begin) / (double)(_lat_now() - ticks);
+    __atomic_store(&cached, &ns, __ATOMIC_RELAXED);
+    return ns;
+#else
+    return 1;
+#endif
+}
+
+/* The body of every engine's assoc_latency_sample()
+*/
+static inline void _lat_setsample(unsigned int n) {
+
+    unsigned int sample = 1;
+
+    if (n == 0) {
+        n = LATSAMPLE;
+    }
+    while (sample < n && sample <= UINT32_MAX / 2) {
+        sample <<= 1;
+    }
+    __atomic_store_n(_lat_sample(), sample, __ATOMIC_RELAXED);
+}
+
+/* The body of every engine's assoc_latency()
+*/
+static inline void _lat_merge(assoclatency* l) {
+
+    lathist* h = __atomic_load_n(_lat_all(), __ATOMIC_ACQUIRE);
+    unsigned int op, b;
+
+    memset(l, 0, sizeof(*l));
+    l->sample = __atomic_load_n(_lat_sample(), __ATOMIC_RELAXED);
+    if (h == NULL) {
+        return;
+    }
+    for (; h != NULL; h = h->next) {
+        for (op = 0; op < LATOPS; op++) {
+            for (b = 0; b < LATBINS; b++) {
+                l->count[op][b] += __atomic_load_n(&h->count[op][b], \
+                __ATOMIC_RELAXED);
+            }
+        }
+    }
+    l->ns_per_tick = _lat_ns_per_tick();
+}
+
+/* The body of every engine's assoc_latency_reset()
+*/
+static inline void _lat_reset(void) {
+
+    lathist* h = __atomic_load_n(_lat_all(), __ATOMIC_ACQUIRE);
+    unsigned int op, b;
+
+    for (; h != NULL; h = h->next) {
+        for (op = 0; op < LATOPS; op++) {
+            for (b = 0; b < LATBINS; b++) {
+                __atomic_store_n(&h->count[op][b], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static inline const char* latency_name(enum latop op) {
+
+    static const char* const names[LATOPS] = {
+        "insert", "hit", "miss", "resize"
+    };
+
+    return names[op];
+}
+
+/* Operations of op timed in all */
+static inline unsigned long latency_total(const assoclatency* l, \
+enum latop op) {
+
+    unsigned long n = 0;
+    unsigned int b;
+
+    for (b = 0; b < LATBINS; b++) {
+        n += l->count[op][b];
+    }
+    return n;
+}
+
+/* The time in ns fraction q (0..1) of op's timed operations
+took at most, to within a bin. 0 => none timed
+*/
+static inline double latency_quantile(const assoclatency* l, \
+enum latop op, double q) {
+
+    unsigned long n = latency_total(l, op), seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < LATBINS; b++) {
+        seen += l->count[op][b];
+        if (seen && seen >= q * n) {
+            return (double)latency_low(b) * l->ns_per_tick;
+        }
+    }
+    return 0;
+}
+
+/* One line per op: how many were timed and their
+percentiles in ns
+*/
+static inline void latency_print(FILE* f, const assoclatency* l) {
+
+    unsigned int op;
+
+    fprintf(f, "%8s %10s %9s %9s %9s %9s %9s %9s\n", "op", "timed", \
+    "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    for (op = 0; op < LATOPS; op++) {
+        fprintf(f, "%8s %10lu %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f\n", \
+        latency_name((enum latop)op), latency_total(l, (enum latop)op), \
+        latency_quantile(l, (enum latop)op, 0.5), \
+        latency_quantile(l, (enum latop)op, 0.9), \
+        latency_quantile(l, (enum latop)op, 0.99), \
+        latency_quantile(l, (enum latop)op, 0.999), \
+        latency_quantile(l, (enum latop)op, 0.9999), \
+        latency_quantile(l, (enum latop)op, 1));
+    }
+}
+
+/* Every bin with anything in it, as "op low_ns count"
+lines, for feeding elsewhere
+*/
+static inline void latency_dump(FILE* f, const assoclatency* l) {
+
+    unsigned int op, b;
+
+    for (op = 0; op < LATOPS; op++) {
+        for (b = 0; b < LATBINS; b++) {
+            if (l->count[op][b]) {
+                fprintf(f, "%s %.1f %lu\n", latency_name((enum latop)op), \
+                (double)latency_low(b) * l->ns_per_tick, l->count[op][b]);
+            }
+        }
+    }
+}
@@ -0,0 +1,184 @@
+/* Loading a file of string keys, one per line
+
+     gcc -O2 loadbench.c cuckoo.c general.c -o loadbench -lm -pthread
+   (or any other engine), then run ./loadbench [file].
+
+   Without a file, LINES random words are written to
+   loadbench.txt first (and removed after). The keys are
+   loaded two ways: the usual fgets() of each line into a
+   buffer of its own and assoc_insert(), then keyfile_open()
+   (keyfile.h) cutting the mapped file into keys in place and
+   assoc_build() on those. 'scan MB/s' is keyfile_open()
+   alone, against the file's size, and 'index MB/s' the
+   same for keyfile_index(), which writes nothing to the
+   mapping. Both tables are checked to hold the same keys,
+   and the records to match them.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "assoc.h"
+#include "keyfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LINES 5000000
+#define MINWORD 4
+#define MAXWORD 16
+#define LINEMAX 4096
+#define SCRATCH "loadbench.txt"
+
+/* splitmix64 finaliser */
+static unsigned long long mix64(unsigned long long x) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* LINES words of MINWORD..MAXWORD letters */
+static void write_words(const char* path) {
+
+    FILE* f = fopen(path, "w");
+    unsigned long long r;
+    unsigned int i, j, len;
+
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < LINES; i++) {
+        r = mix64(i);
+        len = MINWORD + (unsigned int)(r % (MAXWORD - MINWORD + 1));
+        for (j = 0; j < len; j++) {
+            r = mix64(r);
+            fputc('a' + (int)(r % 26), f);
+        }
+        fputc('\n', f);
+    }
+    fclose(f);
+}
+
+/* Today's way: a malloc'd copy of every line */
+static assoc* load_fgets(const char* path, char*** copies, \
+unsigned long* n) {
+
+    FILE* f = fopen(path, "r");
+    char line[LINEMAX];
+    unsigned long size = 1024;
+    size_t len;
+    assoc* a = assoc_init(0);
+
+    *n = 0;
+    *copies = malloc(sizeof(char*) * size);
+    if (f == NULL || *copies == NULL) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, LINEMAX, f) != NULL) {
+        len = strlen(line);
+        if (len && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (*n == size) {
+            size *= 2;
+            *copies = realloc(*copies, sizeof(char*) * size);
+        }
+        (*copies)[*n] = malloc(len + 1);
+        if (*copies == NULL || (*copies)[*n] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy((*copies)[*n], line, len + 1);
+        assoc_insert(&a, (*copies)[*n], (*copies)[*n]);
+        (*n)++;
+    }
+    fclose(f);
+    return a;
+}
+
+int main(int argc, char* argv[]) {
+
+    const char* path = argc > 1 ? argv[1] : SCRATCH;
+    double t0, tfgets, tscan, tbuild, tindex;
+    unsigned long i, n, len, errors = 0;
+    const char* key;
+    char** copies;
+    keyfile *kf, *ro;
+    assoc *a, *b;
+
+    if (argc < 2) {
+        write_words(path);
+    }
+
+    t0 = now_ns();
+    a = load_fgets(path, &copies, &n);
+    tfgets = now_ns() - t0;
+
+    t0 = now_ns();
+    kf = keyfile_open(path);
+    tscan = now_ns() - t0;
+    if (kf == NULL || kf->n > 0xffffffffUL) {
+        fprintf(stderr, "Cannot load %s\n", path);
+        return EXIT_FAILURE;
+    }
+    t0 = now_ns();
+    b = assoc_build((void**)kf->keys, (void**)kf->keys, \
+    (unsigned int)kf->n, 0);
+    tbuild = now_ns() - t0;
+
+    t0 = now_ns();
+    ro = keyfile_index(path);
+    tindex = now_ns() - t0;
+    if (ro == NULL) {
+        fprintf(stderr, "Cannot load %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (kf->n != n || ro->n != n || assoc_count(a) != assoc_count(b)) {
+        errors++;
+    }
+    for (i = 0; i < ro->n && i < kf->n; i++) {
+        key = keyfile_key(ro, i, &len);
+        if (strlen(kf->keys[i]) != len || memcmp(kf->keys[i], key, len)) {
+            errors++;
+        }
+    }
+    for (i = 0; i < kf->n; i++) {
+        if (assoc_lookup(a, kf->keys[i]) == NULL || \
+        assoc_lookup(b, copies[i]) == NULL) {
+            errors++;
+        }
+    }
+
+    printf("%10s %10s %10s %10s %10s %10s %10s\n", "lines", "keys", \
+    "fgets ms", "scan ms", "build ms", "scan MB/s", "index MB/s");
+    printf("%10lu %10u %10.1f %10.1f %10.1f %10.0f %10.0f %s\n", kf->n, \
+    assoc_count(b), tfgets / 1e6, tscan / 1e6, tbuild / 1e6, \
+    kf->len / (tscan / 1e3), ro->len / (tindex / 1e3), \
+    errors ? "WRONG" : "ok");
+
+    assoc_free(a);
+    assoc_free(b);
+    keyfile_close(kf);
+    keyfile_close(ro);
+    for (i = 0; i < n; i++) {
+        free(copies[i]);
+    }
+    free(copies);
+    if (argc < 2) {
+        remove(path);
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
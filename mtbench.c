@@ -0,0 +1,273 @@
+/* Thread scaling benchmark: one table shared by 1 up to
+   maxthreads threads.
+
+     gcc -O2 -DCONCURRENT=1 mtbench.c ccuckoo.c general.c \
+     -o mtbench_cc -lm -pthread
+     gcc -O2 mtbench.c cuckoo.c general.c -o mtbench_cuckoo -lm -pthread
+   then run ./mtbench_cc [maxthreads] [lock].
+
+   The table is preloaded with PRELOAD 8 byte keys, then every
+   thread does OPS operations: lookups of random preloaded keys
+   and, in the mixed workloads, inserts of keys of its own.
+   Only ccuckoo.c is safe without a lock, so unless built
+   with -DCONCURRENT=1 every call goes through one global
+   mutex, which is how the other engines have to be shared -
+   the baseline that ccuckoo.c has to beat. 'lock' puts
+   ccuckoo.c behind the same mutex. Throughput is total Mops across all
+   threads; 'ok' means every insert landed.
+
+   Built with -DSHARDED=1 and shard.c, e.g.
+     gcc -O2 -DSHARDED=1 mtbench.c shard.c cuckoo.c general.c \
+     -o mtbench_shard -lm -pthread
+   the table is a sharded one (shard.h), SHARDSPERCPU shards
+   to each cpu, each behind its own lock, so any
+   engine can take inserts from every thread.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "assoc.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PRELOAD (1 << 20)
+#define OPS (1 << 18)
+#define DEFAULTTHREADS 64
+#define MAXTHREADS 256
+#ifndef SHARDED
+#define SHARDED 0
+#endif
+/* 1 => the engine is safe to share without a lock */
+#ifndef CONCURRENT
+#define CONCURRENT 0
+#endif
+
+typedef struct workload {
+    const char* name;
+    /* out of 100 operations */
+    unsigned int lookups;
+} workload;
+
+typedef struct worker {
+    pthread_t id;
+    unsigned int n;
+    /* keys this thread inserts */
+    unsigned long long* own;
+    unsigned long long seed;
+    unsigned int found;
+} worker;
+
+static const workload workloads[] = {
+    {"read100", 100},
+    {"read90", 90},
+    {"mixed50", 50}
+};
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+#if SHARDED
+static sharded* shards;
+#else
+static assoc* shared;
+static bool locked;
+static pthread_mutex_t biglock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static unsigned long long* preload;
+static const workload* current;
+static pthread_barrier_t start;
+
+/* splitmix64 finaliser - a bijection, so distinct
+   inputs always give distinct keys */
+static unsigned long long mix64(unsigned long long x) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* xorshift64*, each thread its own stream */
+static unsigned long long rnd(unsigned long long* s) {
+
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545f4914f6cdd1dULL;
+}
+
+static double now_s(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* lookup(void* key) {
+
+#if SHARDED
+    return sharded_lookup(shards, key);
+#else
+    void* data;
+
+    if (!locked) {
+        return assoc_lookup(shared, key);
+    }
+    pthread_mutex_lock(&biglock);
+    data = assoc_lookup(shared, key);
+    pthread_mutex_unlock(&biglock);
+    return data;
+#endif
+}
+
+static void insert(void* key, void* data) {
+
+#if SHARDED
+    sharded_insert(shards, key, data);
+#else
+    if (!locked) {
+        assoc_insert(&shared, key, data);
+        return;
+    }
+    pthread_mutex_lock(&biglock);
+    assoc_insert(&shared, key, data);
+    pthread_mutex_unlock(&biglock);
+#endif
+}
+
+static void* work(void* arg) {
+
+    worker* w = (worker*)arg;
+    unsigned int i, k;
+    unsigned long long r;
+
+    pthread_barrier_wait(&start);
+    for (i = 0; i < OPS; i++) {
+        r = rnd(&w->seed);
+        if (r % 100 < current->lookups) {
+            k = (unsigned int)((r >> 32) % PRELOAD);
+            w->found += lookup(&preload[k]) == &preload[k];
+        }
+        else {
+            insert(&w->own[w->n], &w->own[w->n]);
+            w->n++;
+        }
+    }
+    return NULL;
+}
+
+/* Mops across all threads, or -1 if anything went missing */
+static double run(unsigned int threads, worker* w) {
+
+    unsigned int i, inserted = 0, found = 0, lookups = 0, count;
+    double t0, t;
+    bool ok;
+
+#if SHARDED
+    shards = sharded_init(sizeof(unsigned long long), 0);
+#else
+    shared = assoc_init(sizeof(unsigned long long));
+#endif
+    for (i = 0; i < PRELOAD; i++) {
+        insert(&preload[i], &preload[i]);
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        w[i].n = 0;
+        w[i].found = 0;
+        w[i].seed = mix64(i + 1);
+        pthread_create(&w[i].id, NULL, work, &w[i]);
+    }
+    t0 = now_s();
+    pthread_barrier_wait(&start);
+    for (i = 0; i < threads; i++) {
+        pthread_join(w[i].id, NULL);
+        inserted += w[i].n;
+        found += w[i].found;
+        lookups += OPS - w[i].n;
+    }
+    t = now_s() - t0;
+    pthread_barrier_destroy(&start);
+#if SHARDED
+    count = sharded_count(shards);
+#else
+    count = assoc_count(shared);
+#endif
+    ok = found == lookups && count == PRELOAD + inserted;
+    for (i = 0; ok && i < threads; i++) {
+        ok = w[i].n == 0 || \
+        lookup(&w[i].own[w[i].n - 1]) == &w[i].own[w[i].n - 1];
+    }
+#if SHARDED
+    sharded_free(shards);
+#else
+    assoc_free(shared);
+#endif
+    return ok ? (double)threads * OPS / t / 1e6 : -1;
+}
+
+int main(int argc, char* argv[]) {
+
+    unsigned int maxthreads = DEFAULTTHREADS, threads, i, j;
+    worker* w;
+    double mops;
+
+    if (argc > 1) {
+        maxthreads = (unsigned int)atoi(argv[1]);
+    }
+    if (maxthreads < 1 || maxthreads > MAXTHREADS) {
+        fprintf(stderr, "Usage: %s [maxthreads 1..%d] [lock]\n", \
+        argv[0], MAXTHREADS);
+        return EXIT_FAILURE;
+    }
+#if !SHARDED
+    locked = !CONCURRENT || (argc > 2 && !strcmp(argv[2], "lock"));
+#endif
+
+    preload = malloc(sizeof(unsigned long long) * \
+    (PRELOAD + (size_t)maxthreads * OPS));
+    w = calloc(maxthreads, sizeof(worker));
+    if (preload == NULL || w == NULL) {
+        fprintf(stderr, "Cannot allocate keys\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < PRELOAD + maxthreads * OPS; i++) {
+        preload[i] = mix64(i);
+    }
+    for (i = 0; i < maxthreads; i++) {
+        w[i].own = &preload[PRELOAD + (size_t)i * OPS];
+    }
+
+#if SHARDED
+    printf("engine: %s (sharded)\n%-10s", argv[0], "threads");
+#else
+    printf("engine: %s%s\n%-10s", argv[0], \
+    locked ? " (global mutex)" : "", "threads");
+#endif
+    for (threads = 1; threads <= maxthreads; threads *= 2) {
+        printf("%9u", threads);
+    }
+    printf("   Mops\n");
+    for (j = 0; j < NWORKLOADS; j++) {
+        current = &workloads[j];
+        printf("%-10s", current->name);
+        fflush(stdout);
+        for (threads = 1; threads <= maxthreads; threads *= 2) {
+            mops = run(threads, w);
+            if (mops < 0) {
+                printf("%9s", "WRONG");
+            }
+            else {
+                printf("%9.2f", mops);
+            }
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    free(w);
+    free(preload);
+    return EXIT_SUCCESS;
+}
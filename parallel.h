@@ -0,0 +1,254 @@
+#pragma once
+
+/* Fork/join helpers for the bulk operations (assoc_build,
+   and resizes of big tables)
+
+   _parallel() runs fn(ctx, t, threads) for t = 0..threads-1,
+   the last on the calling thread, and returns once all have
+   finished. _partition() is a parallel stable counting sort:
+   it groups the indices 0..n-1 by partition number, keeping
+   input order within each group, so a key and its
+   duplicates always land with the same thread. _gather()
+   numbers the indices that pass a test, in order, so each
+   thread can copy its share of a table's keys out to where
+   they go in one array.
+*/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAXTHREADS 64
+/* Fewer items than this per thread isn't worth a thread */
+#define MINWORK 16384
+/* Resizes of tables big enough to share out (see
+_nthreads) rehash on a thread per cpu as well. 0 => always
+on the inserting thread */
+#ifndef PARREHASH
+#define PARREHASH 1
+#endif
+
+typedef void (*task)(void* ctx, unsigned int t, unsigned int threads);
+typedef unsigned int (*partfn)(void* ctx, unsigned long i);
+typedef bool (*keepfn)(void* ctx, unsigned long i);
+typedef void (*putfn)(void* ctx, unsigned long i, unsigned long k);
+
+typedef struct worker {
+    task fn;
+    void* ctx;
+    unsigned int t;
+    unsigned int threads;
+} worker;
+
+typedef struct sortctx {
+    partfn part;
+    void* ctx;
+    unsigned long n;
+    unsigned int parts;
+    /* threads x parts counts, then write positions */
+    unsigned long* counts;
+    unsigned int* order;
+} sortctx;
+
+typedef struct gatherctx {
+    keepfn keep;
+    putfn put;
+    void* ctx;
+    unsigned long n;
+    /* kept items before each thread's slice */
+    unsigned long* first;
+} gatherctx;
+
+static inline void* _run_worker(void* arg) {
+
+    worker* w = (worker*)arg;
+
+    w->fn(w->ctx, w->t, w->threads);
+    return NULL;
+}
+
+/* Threads to use for 'work' items: one per online cpu,
+but never so many that each gets less than MINWORK
+*/
+static inline unsigned int _nthreads(unsigned long work) {
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long most = work / MINWORK;
+
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    if ((unsigned long)cpus > most) {
+        cpus = most ? (long)most : 1;
+    }
+    return cpus > MAXTHREADS ? MAXTHREADS : (unsigned int)cpus;
+}
+
+/* Thread t's share [*lo, *hi) of n items
+*/
+static inline void _slice(unsigned long n, unsigned int t, \
+unsigned int threads, unsigned long* lo, unsigned long* hi) {
+
+    *lo = n * t / threads;
+    *hi = n * (t + 1) / threads;
+}
+
+static inline void _parallel(task fn, void* ctx, unsigned int threads) {
+
+    pthread_t id[MAXTHREADS];
+    worker w[MAXTHREADS];
+    unsigned int t, started = 0;
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAXTHREADS) {
+        threads = MAXTHREADS;
+    }
+    for (t = 0; t < threads; t++) {
+        w[t].fn = fn;
+        w[t].ctx = ctx;
+        w[t].t = t;
+        w[t].threads = threads;
+    }
+    /*If a thread can't be had, do its share here*/
+    for (t = 0; t + 1 < threads; t++) {
+        if (pthread_create(&id[t], NULL, _run_worker, &w[t])) {
+            break;
+        }
+        started++;
+    }
+    for (t = started; t < threads; t++) {
+        _run_worker(&w[t]);
+    }
+    for (t = 0; t < started; t++) {
+        pthread_join(id[t], NULL);
+    }
+}
+
+static inline void _count_parts(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    sortctx* s = (sortctx*)arg;
+    unsigned long i, lo, hi, *c = &s->counts[(unsigned long)t * s->parts];
+
+    _slice(s->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        c[s->part(s->ctx, i)]++;
+    }
+}
+
+static inline void _scatter_parts(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    sortctx* s = (sortctx*)arg;
+    unsigned long i, lo, hi, *c = &s->counts[(unsigned long)t * s->parts];
+
+    _slice(s->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        s->order[c[s->part(s->ctx, i)]++] = (unsigned int)i;
+    }
+}
+
+/* Fill order[] with 0..n-1 grouped by part(ctx, i) < parts,
+partition p being order[start[p]] up to order[start[p + 1]].
+start has parts + 1 entries. false => out of memory
+*/
+static inline bool _partition(unsigned long n, unsigned int parts, \
+partfn part, void* ctx, unsigned int threads, unsigned int* order, \
+unsigned long* start) {
+
+    sortctx s;
+    unsigned long sum = 0, c;
+    unsigned int t, p;
+
+    s.part = part;
+    s.ctx = ctx;
+    s.n = n;
+    s.parts = parts;
+    s.order = order;
+    s.counts = calloc((unsigned long)threads * parts, sizeof(unsigned long));
+    if (s.counts == NULL) {
+        return false;
+    }
+    _parallel(_count_parts, &s, threads);
+    /*Partition by partition, thread by thread, so each
+    thread's slice lands in input order*/
+    for (p = 0; p < parts; p++) {
+        start[p] = sum;
+        for (t = 0; t < threads; t++) {
+            c = s.counts[(unsigned long)t * parts + p];
+            s.counts[(unsigned long)t * parts + p] = sum;
+            sum += c;
+        }
+    }
+    start[parts] = sum;
+    _parallel(_scatter_parts, &s, threads);
+    free(s.counts);
+    return true;
+}
+
+/* Threads to rehash a table of n keys with
+*/
+static inline unsigned int _rehash_threads(unsigned long n) {
+
+    return PARREHASH ? _nthreads(n) : 1;
+}
+
+static inline void _count_kept(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    gatherctx* g = (gatherctx*)arg;
+    unsigned long i, lo, hi, c = 0;
+
+    _slice(g->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        c += g->keep(g->ctx, i);
+    }
+    g->first[t + 1] = c;
+}
+
+static inline void _put_kept(void* arg, unsigned int t, \
+unsigned int threads) {
+
+    gatherctx* g = (gatherctx*)arg;
+    unsigned long i, lo, hi, k = g->first[t];
+
+    _slice(g->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (g->keep(g->ctx, i)) {
+            g->put(g->ctx, i, k);
+            k++;
+        }
+    }
+}
+
+/* put(ctx, i, k) for each i in 0..n-1 that keep(ctx, i),
+k counting them from 0 in order. Returns how many were
+kept, or -1 => out of memory
+*/
+static inline long _gather(unsigned long n, keepfn keep, putfn put, \
+void* ctx, unsigned int threads) {
+
+    gatherctx g;
+    unsigned int t;
+    long kept;
+
+    g.keep = keep;
+    g.put = put;
+    g.ctx = ctx;
+    g.n = n;
+    g.first = calloc(threads + 1, sizeof(unsigned long));
+    if (g.first == NULL) {
+        return -1;
+    }
+    _parallel(_count_kept, &g, threads);
+    for (t = 1; t <= threads; t++) {
+        g.first[t] += g.first[t - 1];
+    }
+    _parallel(_put_kept, &g, threads);
+    kept = (long)g.first[threads];
+    free(g.first);
+    return kept;
+}
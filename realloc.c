@@ -1,4 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "specific.h"
+#include "sizing.h"
+#include "parallel.h"
 #include "../../ADTs/General/general.h"
 #include <assert.h>
 #include <stdlib.h>
@@ -6,22 +10,144 @@
 
 #define INITIALSIZE 17
 #define PRIME 13
+/* Default growth factor and maximum load, see
+   assoc_setgrowth() */
 #define SCALEFACTOR 4
-#define HASH1 5
-#define HASH2 3
 #define TWOTHIRDS /1.5
-
-void _hash(assoc* a, unsigned int* hash);
-void _hash_two(assoc* a, unsigned int* hash);
-bool _add_hash(assoc* a);
-bool _probe(assoc* a, unsigned int* hash);
-void _add_data(assoc* a, unsigned int hash);
+#define MAXLOAD (2.0 / 3)
+/* Cells of the old table moved per insert while
+   resizing incrementally, at least; 0 => rehash all in
+   one go. More are moved if the next resize would come
+   before the old table is empty (_begin_migrate) */
+#ifndef MIGRATEBATCH
+#define MIGRATEBATCH 0
+#endif
+/* Single writer, many readers: assoc_lookup() may run in
+   any number of threads alongside one thread inserting.
+   Resizes happen in place and are published to readers
+   as a whole, old tables are freed once no reader can
+   still be in them. 'a' never changes in this mode */
+#ifndef SWMR
+#define SWMR 0
+#endif
+/* Reader counts are spread over this many cache lines,
+   picked by the key's hash */
+#define READSLOTS 16
+#define CACHELINE 64
+/* Lookups interleaved by assoc_lookup_batch */
+#define BATCH 16
+#define TESTREADERS 4
+#define BUILDKEYS 50000
+#define TESTKEYS 50000
+
+#if SWMR
+#include <pthread.h>
+#endif
+
+/* SWMR : everything a reader needs, swapped in whole */
+typedef struct snapshot {
+    hash* table;
+    unsigned int capacity;
+    unsigned long recip;
+    hash* old_table;
+    unsigned int old_capacity;
+    unsigned long old_recip;
+} snapshot;
+
+/* SWMR : something to free once readers have moved on */
+typedef struct retired {
+    void* ptr;
+    struct retired* next;
+} retired;
+
+typedef struct counter {
+    unsigned long n;
+    char pad[CACHELINE - sizeof(unsigned long)];
+} counter;
+
+/* SWMR : epoch based reclamation. A reader counts itself
+   in under the epoch's parity for the length of a lookup.
+   Garbage is kept by the epoch it was retired in, and freed
+   two epochs later once the count for its parity is zero.
+   Only the writer frees, at the start of each insert, so
+   once inserts stop whatever the last two epochs retired
+   (the tables and snapshots the last resizes replaced)
+   stays allocated until the next insert or assoc_free() */
+typedef struct reclaim {
+    unsigned long epoch;
+    counter readers[2][READSLOTS];
+    retired* garbage[2];
+} reclaim;
+
+/* Shared by the threads of assoc_build. Thread p takes
+the keys whose home cells are from capacity*p/parts up to
+capacity*(p+1)/parts */
+typedef struct build {
+    assoc* a;
+    void** keys;
+    void** data;
+    unsigned int n;
+    unsigned long* h;
+    unsigned int* len;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 1];
+    unsigned int parts;
+    unsigned int added[MAXTHREADS];
+} build;
+
+/* Shared by the threads of a parallel rehash: the old table
+and the build its keys are gathered into */
+typedef struct rehash {
+    assoc* a;
+    build* b;
+} rehash;
+
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads);
+void _build_hash(void* ctx, unsigned int t, unsigned int threads);
+unsigned int _build_part(void* ctx, unsigned long i);
+void _build_place(void* ctx, unsigned int t, unsigned int threads);
+bool _claim(assoc* a, hash* item, unsigned long h);
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len);
+unsigned long _cellhash(assoc* a, hash* cell);
+void _makecell(assoc* a, hash* cell, void* key, void* data);
+void _ownkey(assoc* a, hash* item);
+void _hash(assoc* a, unsigned long h, unsigned int* hash);
+void _hash_two(assoc* a, unsigned long h, unsigned int* hash);
+hash* _add_hash(assoc* a, hash* item);
+hash* _upsert(assoc** a, void* key, void* data, bool* inserted);
+bool _probe(assoc* a, hash* item, unsigned int* hash);
+void _add_data(assoc* a, hash* item, unsigned int hash);
 assoc* _realloc(assoc* a);
-unsigned int _primetable(assoc* a);
-bool _isprime(unsigned int c); 
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip);
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip);
+unsigned int _primetable(assoc* a, unsigned long* recip);
+unsigned int _limit(assoc* a, unsigned int capacity);
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip);
 bool _rehash(assoc* a, assoc* b);
-bool _isduplicate(assoc* a);
-hash _search(assoc* a);
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads);
+bool _old_kept(void* ctx, unsigned long i);
+void _old_put(void* ctx, unsigned long i, unsigned long k);
+void _begin_migrate(assoc* a);
+void _migrate(assoc* a, unsigned int cells);
+bool _isduplicate(assoc* a, hash* item);
+hash _search(assoc* a, hash* item);
+void _snapshot(assoc* a, snapshot* s);
+hash _search_snapshot(assoc* a, snapshot* s, hash* item);
+hash _search_table(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, hash* item);
+hash* _locate(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, hash* item, unsigned int* end);
+bool _cellmatch(assoc* a, hash* cell, hash* item, unsigned long h);
+unsigned int _chainpos(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, unsigned int cell);
+void _lookup_batch(assoc* a, snapshot* s, void** keys, \
+unsigned int n, void** out);
+void _publish(assoc* a);
+void _retire(assoc* a, void* ptr);
+void _reclaim(assoc* a);
+unsigned long _enter(assoc* a, unsigned int slot);
+void _leave(assoc* a, unsigned long epoch, unsigned int slot);
 
 /*
    Initialise the Associative array
@@ -34,10 +160,17 @@ assoc* assoc_init(int keysize) {
 
     assoc *a =  ncalloc(1, sizeof(assoc));
     
+    a->capacity = _next_capacity(INITIALSIZE, &a->recip);
     a->hash_table = (hash*) ncalloc(sizeof(hash), \
-    INITIALSIZE);
-    a->capacity = INITIALSIZE;
+    a->capacity);
     a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    if (SWMR) {
+        a->ebr = ncalloc(1, sizeof(reclaim));
+        _publish(a);
+    }
 
     return a; 
 }
@@ -46,41 +179,78 @@ assoc* assoc_init(int keysize) {
    Insert key/data pair
    - may cause resize, therefore 'a' might
    be changed due to a realloc() etc.
+   In SWMR mode only one thread may insert
 */
 
 void assoc_insert(assoc** a, void* key, void* data) {
 
-    assoc *p, *b;
-    p = *a;
+    unsigned long lat = _lat_start();
+    bool inserted;
 
-    p->cdata = data;
-    p->ckey = key;
-    
-    /*Check for duplicates*/
-    if (_isduplicate(p)) {
+    _upsert(a, key, data, &inserted);
+    _lat_stop(lat, LAT_INSERT);
+}
+
+/* Find or insert key, one hash and one walk of its probe
+chain, see _upsert()
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted) {
+
+    bool fresh;
+    hash* cell = _upsert(a, key, NULL, &fresh);
+
+    if (inserted != NULL) {
+        *inserted = fresh;
     }
-    else {
-        /* If 2/3 capacity: realloc, rehash, add hash,
-         re-direct pointer and free old structure*/
-        if (p->size == (unsigned int)\
-        (p->capacity TWOTHIRDS)) {
-            b = _realloc(p);
-            assert(_rehash(p, b));
-            *a = b;
-            if (!_add_hash(b)) {
-                on_error("Error: Null pointer\n");
-            }
-            free(p->hash_table);
-            free(p);
-        }
-        else {
-            if (!_add_hash(p)) {
-                on_error("Error: Null pointer\n");
-            }
-        }
+    return &cell->data;
+}
+
+/* assoc_upsert(), then the new data stored through the
+cell it found
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg) {
+
+    bool fresh;
+    void** data = assoc_upsert(a, key, &fresh);
+
+    *data = fn(*data, fresh, arg);
+    return *data;
+}
+
+/* Make room for n keys in all. Finishes any incremental
+   resize first, so nothing is left migrating
+*/
+void assoc_reserve(assoc** a, unsigned int n) {
+
+    unsigned long recip;
+    unsigned int capacity;
+
+    if (n > _limit(*a, (*a)->capacity)) {
+        capacity = _fit(*a, n, &recip);
+        _resize(a, capacity, recip);
+    }
+}
+
+/* Down to the smallest rung the keys fit in at maxload
+*/
+void assoc_shrink_to_fit(assoc** a) {
+
+    unsigned long recip;
+    unsigned int capacity = _fit(*a, (*a)->size, &recip);
+
+    if (capacity < (*a)->capacity) {
+        _resize(a, capacity, recip);
     }
 }
 
+/* Resize policy for this table. maxload is capped so
+   at least one cell is always empty to end a probe
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload) {
+
+    _setgrowth(&a->growth, &a->maxload, growth, maxload);
+}
+
 /*   Returns the number of key/data pairs 
    currently stored in the table
 */
@@ -91,17 +261,63 @@ unsigned int assoc_count(assoc* a) {
 }
 
 /*   Returns a pointer to the data, given a key
-   NULL => not found
+   NULL => not found. Never changes 'a', so lookups
+   can run side by side (and, in SWMR mode, alongside
+   an insert)
 */
 
 void* assoc_lookup(assoc* a, void* key) {
     
-    hash hash1;
-
-    a->ckey = key;
-    hash1 = _search(a);
+    unsigned long epoch, lat = _lat_start();
+    hash item, found;
+    unsigned int slot;
+
+    STAT_ADD(a->stats.searches, 1);
+    _makecell(a, &item, key, NULL);
+    if (!SWMR) {
+        found = _search(a, &item);
+        _lat_stop(lat, found.flag ? LAT_HIT : LAT_MISS);
+        return found.data;
+    }
+    slot = _cellhash(a, &item) % READSLOTS;
+    epoch = _enter(a, slot);
+    found = _search_snapshot(a, \
+    __atomic_load_n(&a->live, __ATOMIC_ACQUIRE), &item);
+    _leave(a, epoch, slot);
+    _lat_stop(lat, found.flag ? LAT_HIT : LAT_MISS);
     
-    return hash1.data;
+    return found.data;
+}
+
+/* Look up keys a batch at a time, see _lookup_batch()
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out) {
+
+    snapshot s;
+    unsigned long epoch;
+    unsigned int slot;
+
+    STAT_ADD(a->stats.searches, n);
+    if (!SWMR) {
+        _snapshot(a, &s);
+        _lookup_batch(a, &s, keys, n, out);
+        return;
+    }
+    /*Spread batches over the reader counts by caller*/
+    slot = (unsigned int)(((unsigned long)keys / CACHELINE) % READSLOTS);
+    epoch = _enter(a, slot);
+    _lookup_batch(a, __atomic_load_n(&a->live, __ATOMIC_ACQUIRE), \
+    keys, n, out);
+    _leave(a, epoch, slot);
+}
+
+/* Bulk load, sized once, one thread per cpu
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize) {
+
+    return _build(keys, data, n, keysize, _nthreads(n));
 }
 
 /*
@@ -110,93 +326,425 @@ void assoc_todot(assoc* a) {
 }
 */
 
-/*Free up all allocated space from 'a'
+/* Copy keys into a table owned arena from now on,
+   including any already stored. Finishes an incremental
+   resize first so there is only one table to walk. In
+   SWMR mode no reader may be running
+*/
+void assoc_ownkeys(assoc* a) {
+
+    unsigned int i;
+
+    if (a->owned != NULL) {
+        return;
+    }
+    _migrate(a, a->old_capacity);
+    a->owned = arena_init();
+    if (a->owned == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    for (i = 0; i < a->capacity; i++) {
+        if (a->hash_table[i].flag) {
+            _ownkey(a, &a->hash_table[i]);
+        }
+    }
+}
+
+/* Choose the hash function while the table is empty
+*/
+void assoc_sethash(assoc* a, hashfunc fn) {
+
+    if (a->size) {
+        on_error("Error: Hash function can't change once keys "
+        "are stored\n");
+    }
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+}
+
+/* Load, how far down its probe chain each key sits and
+   the counters. Mid-migration the old table's keys not yet
+   moved are binned by their place in its chains. In SWMR
+   mode only the writer may ask
+*/
+void assoc_stats(assoc* a, assocstats* st) {
+
+    unsigned int i;
+
+    _stat_begin(st, a->size, a->capacity);
+    for (i = 0; i < a->capacity; i++) {
+        if (a->hash_table[i].flag) {
+            _stat_probe(st, _chainpos(a, a->hash_table, a->capacity, \
+            a->recip, i));
+        }
+    }
+    for (i = a->migrated; a->old_table != NULL && i < a->old_capacity; \
+    i++) {
+        if (a->old_table[i].flag) {
+            _stat_probe(st, _chainpos(a, a->old_table, a->old_capacity, \
+            a->old_recip, i));
+        }
+    }
+    _stat_end(st, sizeof(assoc) + \
+    ((unsigned long)a->capacity + a->old_capacity) * sizeof(hash) + \
+    (a->owned ? a->owned->bytes : 0), &a->stats);
+}
+
+void assoc_latency(assoclatency* l) {
+
+    _lat_merge(l);
+}
+
+void assoc_latency_reset(void) {
+
+    _lat_reset();
+}
+
+void assoc_latency_sample(unsigned int n) {
+
+    _lat_setsample(n);
+}
+
+/*Free up all allocated space from 'a'. In SWMR mode no 
+reader may still be using it
 */ 
 void assoc_free(assoc* a) {
 
+    retired* r;
+    int i;
+
+    if (a->ebr != NULL) {
+        for (i = 0; i < 2; i++) {
+            while ((r = a->ebr->garbage[i]) != NULL) {
+                a->ebr->garbage[i] = r->next;
+                free(r->ptr);
+                free(r);
+            }
+        }
+        free(a->ebr);
+    }
+    arena_free(a->owned);
+    free(a->live);
     free(a->hash_table);
+    free(a->old_table);
     free(a);
 }
 
-/* Two variations of djb2 hash function edited from: \
-https://gist.github.com/MohamedTaha98/ccdf734f13299efb73ff0b12f7ce429f 
+void _assoc_test(void);
+
+/* Size the table so n keys stay under the maximum load,
+   then hash every key and sort them by home cell so each
+   thread starts its probes in a run of cells of its own.
+   Probe chains still wander into other threads' runs, so
+   cells are claimed by a compare and swap on the key.
+   A key's duplicates share its home cell, and so its
+   thread, and are met in input order: the first one wins
 */
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads) {
 
-void _hash(assoc* a, unsigned int* hash) {
+    assoc* a = ncalloc(1, sizeof(assoc));
+    unsigned int p;
+    build b;
 
-    unsigned long h = 5381;
-    char *str;
-    unsigned int count = 0; 
-    str = (char*)a->ckey;
+    a->keysize = keysize;
+    a->hashfn = hash_default(keysize);
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+    a->capacity = _fit(a, n, &a->recip);
+    a->hash_table = (hash*) ncalloc(sizeof(hash), a->capacity);
+    if (n) {
+        memset(&b, 0, sizeof(b));
+        b.a = a;
+        b.keys = keys;
+        b.data = data;
+        b.n = n;
+        b.parts = threads;
+        b.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+        b.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+        b.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+        _parallel(_build_hash, &b, threads);
+        if (!_partition(n, threads, _build_part, &b, threads, \
+        b.order, b.start)) {
+            on_error("Error: Cannot allocate partition counts\n");
+        }
+        _parallel(_build_place, &b, threads);
+        for (p = 0; p < threads; p++) {
+            a->size += b.added[p];
+        }
+        free(b.h);
+        free(b.len);
+        free(b.order);
+    }
+    if (SWMR) {
+        a->ebr = ncalloc(1, sizeof(reclaim));
+        _publish(a);
+    }
+    return a;
+}
+
+/* Hash thread t's share of the keys
+*/
+void _build_hash(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long i, lo, hi;
 
-    if (a->keysize) {
-        while ((count < a->keysize)) {
-            h = ((h << HASH1) + h) + *str;
-            count++;
+    _slice(b->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (b->keys[i] == NULL) {
+            on_error("Error: Null pointer\n");
         }
+        b->h[i] = _hashkey(b->a, b->keys[i], &b->len[i]);
     }
-    else {
-        while ((*str++)) {
-            h = ((h << HASH1) + h) + *str;
+}
+
+/* Which thread's run of cells key i's home is in
+*/
+unsigned int _build_part(void* ctx, unsigned long i) {
+
+    build* b = (build*)ctx;
+    unsigned int home;
+
+    _hash(b->a, b->h[i], &home);
+    return (unsigned int)((unsigned long)home * b->parts / \
+    b->a->capacity);
+}
+
+/* Thread t places its keys in input order
+*/
+void _build_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long k;
+    unsigned int i;
+    hash item;
+
+    (void)threads;
+    for (k = b->start[t]; k < b->start[t + 1]; k++) {
+        i = b->order[k];
+        item.key = b->keys[i];
+        item.data = b->data ? b->data[i] : NULL;
+#if CACHEHASH
+        item.fullhash = b->h[i];
+        item.keylen = b->len[i];
+#endif
+        if (_claim(b->a, &item, b->h[i])) {
+            b->added[t]++;
         }
     }
-    *hash = h % a->capacity;
 }
 
-void _hash_two(assoc* a, unsigned int* hash) {
+/* Walk item's probe chain, as _add_hash() would, and take
+   the first empty cell unless the key turns up first.
+   A cell whose key is set but flag isn't yet is being
+   filled by another thread, so can't hold this key.
+   false => duplicate
+*/
+bool _claim(assoc* a, hash* item, unsigned long h) {
 
-    unsigned long h = 599;
-    unsigned int count = 0; 
-    char *str;
-    str = (char*)a->ckey;
-   
-    if (a->keysize) {
-        while ((count < a->keysize)) {
-            h = ((h << HASH2) + h) + *str;
-            count++;
+    hash* cell;
+    void* empty;
+    unsigned int i, index, step;
+
+    _hash(a, h, &index);
+    _hash_two(a, h, &step);
+    step = PRIME - (step % PRIME);
+    if (POW2) {
+        step |= 1;
+    }
+    for (i = 0; i < a->capacity; i++) {
+        cell = &a->hash_table[index];
+        empty = NULL;
+        /*Look before trying to take it, most cells are full*/
+        if (__atomic_load_n(&cell->key, __ATOMIC_ACQUIRE) == NULL && \
+        __atomic_compare_exchange_n(&cell->key, &empty, item->key, \
+        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            cell->data = item->data;
+#if CACHEHASH
+            cell->fullhash = item->fullhash;
+            cell->keylen = item->keylen;
+#endif
+            __atomic_store_n(&cell->flag, true, __ATOMIC_RELEASE);
+            return true;
+        }
+        if (__atomic_load_n(&cell->flag, __ATOMIC_ACQUIRE) && \
+        _cellmatch(a, cell, item, h)) {
+            return false;
+        }
+        index += step;
+        if (index >= a->capacity) {
+            index -= a->capacity;
         }
     }
-    else {
-        while ((*str++)) {
-            h = ((h << HASH2) + h) + *str;
-       }
+    on_error("Error finding a hash code\n");
+    return false;
+}
+
+/* One 64 bit hash per key, from whichever function the
+table was given (see hashfn.h). len is the key's length
+*/
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len) {
+
+    *len = a->keysize;
+    if (!*len) {
+        *len = strlen((char*)key);
     }
-    *hash = h % a->capacity;
+    return a->hashfn(key, *len, HASHSEED);
 }
 
+/* Hash of a key held in a cell: cached unless built
+with CACHEHASH=0
+*/
+unsigned long _cellhash(assoc* a, hash* cell) {
+
+#if CACHEHASH
+    (void)a;
+    return cell->fullhash;
+#else
+    unsigned int len;
 
-bool _add_hash(assoc* a) {
+    return _hashkey(a, cell->key, &len);
+#endif
+}
+
+/* Fill in a cell for key/data, hashing the key once
+for the whole insert or lookup
+*/
+void _makecell(assoc* a, hash* cell, void* key, void* data) {
+
+#if CACHEHASH
+    cell->fullhash = _hashkey(a, key, &cell->keylen);
+#else
+    (void)a;
+#endif
+    cell->key = key;
+    cell->data = data;
+    cell->flag = true;
+}
+
+/* Point a new key at the table's own copy of it
+*/
+void _ownkey(assoc* a, hash* item) {
+
+    size_t len = a->keysize;
+
+    if (!len) {
+        len = strlen((char*)item->key) + 1;
+    }
+    item->key = arena_copy(a->owned, item->key, len, \
+    arena_align(len, !a->keysize));
+    if (item->key == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+}
+
+/* Low half of the hash is the home cell
+*/
+void _hash(assoc* a, unsigned long h, unsigned int* hash) {
+
+    *hash = _reduce((uint32_t)h, a->capacity, a->recip);
+}
+
+/* High half sets the double hashing step
+*/
+void _hash_two(assoc* a, unsigned long h, unsigned int* hash) {
+
+    *hash = _reduce(h >> 32, a->capacity, a->recip);
+}
+
+/* The cell holding key. The walk down its probe chain that
+   looks for it ends at the empty cell a new key goes in, so
+   that's used unless a resize has to come first. A new key
+   gets 'data', an old one keeps its own. Mid-migration a key
+   not in the new table may still be in the old one, and its
+   cell there is returned; migrating copies it across later
+*/
+hash* _upsert(assoc** a, void* key, void* data, bool* inserted) {
+
+    assoc* p = *a;
+    hash item, *cell;
+    unsigned long recip;
+    unsigned int capacity, end, old;
+
+    if (SWMR) {
+        _reclaim(p);
+    }
+    _migrate(p, p->batch);
+    STAT_ADD(p->stats.searches, 1);
+    _makecell(p, &item, key, data);
+    cell = _locate(p, p->hash_table, p->capacity, p->recip, &item, &end);
+    if (cell == NULL && p->old_table != NULL) {
+        cell = _locate(p, p->old_table, p->old_capacity, p->old_recip, \
+        &item, &old);
+    }
+    if (cell != NULL) {
+        *inserted = false;
+        return cell;
+    }
+    *inserted = true;
+    if (p->owned != NULL) {
+        _ownkey(p, &item);
+    }
+    /* If at the maximum load and migrating, start
+    moving into a bigger table a batch at a time*/
+    if (MIGRATEBATCH && p->size >= _limit(p, p->capacity)) {
+        _begin_migrate(p);
+        cell = _add_hash(p, &item);
+    }
+    /* Otherwise realloc, rehash, add hash */
+    else if (p->size >= _limit(p, p->capacity)) {
+        capacity = _primetable(p, &recip);
+        cell = _add_hash(_resize(a, capacity, recip), &item);
+    }
+    else {
+        _add_data(p, &item, end);
+        cell = &p->hash_table[end];
+    }
+    if (cell == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    return cell;
+}
+
+/* Put item in the first empty cell of its probe chain,
+returning the cell, NULL => no key
+*/
+hash* _add_hash(assoc* a, hash* item) {
 
     unsigned int hash = 0;
 
-    if (a == NULL || a->ckey == NULL) {
-        return false;
+    if (a == NULL || item->key == NULL) {
+        return NULL;
     }
 
-    _hash(a, &hash);
+    _hash(a, _cellhash(a, item), &hash);
     
     /*If collision, get new hash code*/
     if (a->hash_table[hash].flag) {
-        if (!_probe(a, &hash)){
+        if (!_probe(a, item, &hash)){
             on_error("Error finding a hash code\n");
         }
     }
 
-    _add_data(a, hash);
+    _add_data(a, item, hash);
     
-    return true;
+    return &a->hash_table[hash];
 }
 
-bool _probe(assoc* a, unsigned int* hash) {
+bool _probe(assoc* a, hash* item, unsigned int* hash) {
                                    
     int i, step, size, new_hash;
     unsigned int hashtwo = 0;
 
-    _hash_two(a, &hashtwo);
+    _hash_two(a, _cellhash(a, item), &hashtwo);
 
     /*https://www.geeksforgeeks.org/double-hashing/ 
     Use hashtwo to create step to probe*/
     step = PRIME - (hashtwo % PRIME);
+    /*Any odd step visits every cell of a power-of-two table*/
+    if (POW2) {
+        step |= 1;
+    }
     size = a->capacity, new_hash = *(hash) + step;
 
     for (i = 0; i < size; i++) {
@@ -214,73 +762,316 @@ bool _probe(assoc* a, unsigned int* hash) {
     return false;
 }
 
-void _add_data(assoc *a, unsigned int hash) {
-
-    a->hash_table[hash].data = a->cdata;
-    a->hash_table[hash].flag = true;
-    a->hash_table[hash].key = a->ckey;
+/* Fill a cell, setting the flag last so a reader that
+sees it set sees the rest of the cell too
+*/
+void _add_data(assoc *a, hash* item, unsigned int hash) {
+
+    a->hash_table[hash].data = item->data;
+    a->hash_table[hash].key = item->key;
+#if CACHEHASH
+    a->hash_table[hash].fullhash = item->fullhash;
+    a->hash_table[hash].keylen = item->keylen;
+#endif
+    __atomic_store_n(&a->hash_table[hash].flag, true, __ATOMIC_RELEASE);
     a->size += 1;
 }
 
+/* An empty table one growth step bigger, ready for
+SWMR readers of its own
+*/
 assoc* _realloc(assoc* a) {
 
+    unsigned long recip;
+    unsigned int capacity = _primetable(a, &recip);
+    assoc* b = _alloc(a, capacity, recip);
+
+    if (SWMR) {
+        b->ebr = ncalloc(1, sizeof(reclaim));
+        _publish(b);
+    }
+    return b;
+}
+
+/* An empty table of the given capacity, with a's
+settings. Nothing for SWMR readers yet: _resize() only
+wants its cells
+*/
+assoc* _alloc(assoc* a, unsigned int capacity, unsigned long recip) {
+
     assoc* b = ncalloc(1, sizeof(assoc));
 
+    b->capacity = capacity;
+    b->recip = recip;
     b->hash_table = (hash*) ncalloc(sizeof(hash), \
-    _primetable(a));
-    b->capacity = _primetable(a);
+    b->capacity);
     b->keysize = a->keysize;
+    b->hashfn = a->hashfn;
+    b->growth = a->growth;
+    b->maxload = a->maxload;
+    b->owned = a->owned;
+    _stat_copy(&b->stats, &a->stats);
     
     return b;
 }
 
-unsigned int _primetable(assoc* a) {
+/* Rehash everything into a table of 'capacity' and
+   re-direct *a to it, freeing the old structure. Readers
+   in SWMR mode hold the old pointer, so there the new
+   table is swapped into it instead and the old one freed
+   once they're done. Returns the table now in use
+*/
+assoc* _resize(assoc** a, unsigned int capacity, unsigned long recip) {
+
+    assoc *p = *a, *b;
+    hash* old;
+    unsigned long since, lat;
+
+    /*Never more than one resize in flight*/
+    _migrate(p, p->old_capacity);
+    since = _stat_clock();
+    lat = _lat_resizing();
+    b = _alloc(p, capacity, recip);
+    if (!_rehash(p, b)) {
+        on_error("Error: Null pointer\n");
+    }
+    if (SWMR) {
+        old = p->hash_table;
+        p->hash_table = b->hash_table;
+        p->capacity = b->capacity;
+        p->recip = b->recip;
+        free(b);
+        _publish(p);
+        _retire(p, old);
+        _stat_resized(&p->stats, since);
+        _lat_resized(lat);
+        return p;
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    *a = b;
+    free(p->hash_table);
+    free(p);
+    return b;
+}
+
+/* Next capacity up the prime ladder (see sizing.h) 
+using the growth factor to size the new hash table
+*/
+unsigned int _primetable(assoc* a, unsigned long* recip) {
 
     unsigned int prime;
+    double want = a->capacity * a->growth;
 
-    prime = a->capacity*SCALEFACTOR;
-
-    while (!_isprime(prime)) {
-        prime += 1;
+    /*However small the factor, always go up a rung*/
+    if (want < a->capacity + 1.0) {
+        want = a->capacity + 1.0;
+    }
+    prime = want > UINT32_MAX ? 0 : \
+    _next_capacity((unsigned long)ceil(want), recip);
+    if (!prime) {
+        on_error("Error: Hash table too big\n");
     }
     return prime;
 }
 
-bool _isprime(unsigned int c) {
-   
-   unsigned int i; 
-   bool flag = true;
-   
-   for (i = 2; i <= c/2; i++) {
-      
-      if (c % i == 0) {
-         flag = false;
-      }
-   }   
-   return flag; 
-}   
+/* Keys a table of 'capacity' takes before it resizes.
+The epsilon stops 2/3 of a multiple of 3 rounding down
+*/
+unsigned int _limit(assoc* a, unsigned int capacity) {
+
+    unsigned int limit = (unsigned int)(capacity * a->maxload + 1e-6);
 
+    return limit < capacity ? limit : capacity - 1;
+}
+
+/* Smallest capacity, at least INITIALSIZE, that takes n
+keys before it resizes
+*/
+unsigned int _fit(assoc* a, unsigned long n, unsigned long* recip) {
+
+    unsigned long min = (unsigned long)ceil(n / a->maxload);
+    unsigned int capacity;
+
+    if (min < INITIALSIZE) {
+        min = INITIALSIZE;
+    }
+    for (;;) {
+        capacity = _next_capacity(min, recip);
+        if (!capacity) {
+            on_error("Error: Hash table too big\n");
+        }
+        if (_limit(a, capacity) >= n) {
+            return capacity;
+        }
+        min = (unsigned long)capacity + 1;
+    }
+}
+
+/* Move every cell of 'a' into 'b'; cached hashes mean
+nothing is hashed again. Tables big enough to share out go
+through _rehash_parallel()
+*/
 bool _rehash(assoc* a, assoc* b) {
 
-    unsigned int i = 0, size = a->capacity;
+    unsigned int i = 0, size;
 
     if (a == NULL || b == NULL) {
         return false;
     }
+    if (_rehash_threads(a->size) > 1) {
+        return _rehash_parallel(a, b, _rehash_threads(a->size));
+    }
+    size = a->capacity;
 
     for (i = 0; i < size; i++) {
         if (a->hash_table[i].flag) {
-            b->ckey = a->hash_table[i].key;
-            b->cdata = a->hash_table[i].data;
-            _add_hash(b);
+            _add_hash(b, &a->hash_table[i]);
         }
     }
     return true;
 }
 
-bool _isduplicate(assoc* a) {
+/* _rehash() over threads: every key is gathered with its
+hash, then placed as assoc_build() places keys, each thread
+starting from its own run of home cells and claiming cells
+by compare and swap
+*/
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads) {
+
+    unsigned int p, n = a->size;
+    rehash r;
+    build bd;
+
+    memset(&bd, 0, sizeof(bd));
+    bd.a = b;
+    bd.n = n;
+    bd.parts = threads;
+    bd.keys = (void**) ncalloc(sizeof(void*), n);
+    bd.data = (void**) ncalloc(sizeof(void*), n);
+    bd.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+    bd.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    bd.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    r.a = a;
+    r.b = &bd;
+    if (_gather(a->capacity, _old_kept, _old_put, &r, threads) < 0 || \
+    !_partition(n, threads, _build_part, &bd, threads, bd.order, \
+    bd.start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    _parallel(_build_place, &bd, threads);
+    for (p = 0; p < threads; p++) {
+        b->size += bd.added[p];
+    }
+    free(bd.keys);
+    free(bd.data);
+    free(bd.h);
+    free(bd.len);
+    free(bd.order);
+    return true;
+}
+
+bool _old_kept(void* ctx, unsigned long i) {
+
+    return ((rehash*)ctx)->a->hash_table[i].flag;
+}
+
+/* Key k of the rehash is in old cell i
+*/
+void _old_put(void* ctx, unsigned long i, unsigned long k) {
+
+    rehash* r = (rehash*)ctx;
+    hash* cell = &r->a->hash_table[i];
+
+    r->b->keys[k] = cell->key;
+    r->b->data[k] = cell->data;
+#if CACHEHASH
+    r->b->h[k] = cell->fullhash;
+    r->b->len[k] = cell->keylen;
+#else
+    r->b->h[k] = _hashkey(r->a, cell->key, &r->b->len[k]);
+#endif
+}
+
+/* Keep the current table as the old one and start
+   filling a bigger one; _migrate() moves the old
+   entries across a batch at a time. The batch is sized
+   so the old table is empty by the time the new one is
+   full, however small the growth factor
+*/
+void _begin_migrate(assoc* a) {
+
+    unsigned int limit, room, batch;
+
+    /*Never more than one resize in flight, only
+    a direct call can find one unfinished*/
+    _migrate(a, a->old_capacity);
+
+    STAT_ADD(a->stats.resizes, 1);
+    a->old_table = a->hash_table;
+    a->old_capacity = a->capacity;
+    a->old_recip = a->recip;
+    a->migrated = 0;
+    a->capacity = _primetable(a, &a->recip);
+    a->hash_table = (hash*) ncalloc(sizeof(hash), \
+    a->capacity);
+    /*Inserts left before the new table is at its limit,
+    each of which migrates first*/
+    limit = _limit(a, a->capacity);
+    room = (limit > a->size) ? limit - a->size : 1;
+    batch = a->old_capacity / room + 1;
+    a->batch = (batch > MIGRATEBATCH) ? batch : MIGRATEBATCH;
+    if (SWMR) {
+        _publish(a);
+    }
+}
+
+/* Move the next 'cells' cells of the old table into
+   the new one. Old cells are left in place so probe
+   chains in the old table stay unbroken until it is 
+   freed
+*/
+void _migrate(assoc* a, unsigned int cells) {
+
+    unsigned int moved = 0;
+    unsigned long since, lat;
+    hash* old;
+
+    if (a->old_table == NULL) {
+        return;
+    }
+    /*The time a resize takes is spread over these*/
+    since = _stat_clock();
+    lat = _lat_resizing();
+    while (moved < cells && a->migrated < a->old_capacity) {
+        if (a->old_table[a->migrated].flag) {
+            _add_hash(a, &a->old_table[a->migrated]);
+            /*Already counted when first inserted*/
+            a->size -= 1;
+        }
+        a->migrated += 1;
+        moved += 1;
+    }
+    _stat_rehashed(&a->stats, since);
+    _lat_resized(lat);
+    if (a->migrated == a->old_capacity) {
+        old = a->old_table;
+        a->old_table = NULL;
+        a->old_capacity = 0;
+        a->old_recip = 0;
+        if (SWMR) {
+            _publish(a);
+            _retire(a, old);
+        }
+        else {
+            free(old);
+        }
+    }
+}
+
+bool _isduplicate(assoc* a, hash* item) {
 
-    hash hash1 = _search(a);
+    hash hash1 = _search(a, item);
 
     if (hash1.flag) {
         return true;
@@ -288,62 +1079,379 @@ bool _isduplicate(assoc* a) {
     return false;
 }
 
-hash _search(assoc* a) {
+/* Search the tables as the writer sees them
+*/
+hash _search(assoc* a, hash* item) {
+
+    snapshot s;
+
+    _snapshot(a, &s);
+    return _search_snapshot(a, &s, item);
+}
+
+/* The tables as the writer sees them
+*/
+void _snapshot(assoc* a, snapshot* s) {
+
+    s->table = a->hash_table;
+    s->capacity = a->capacity;
+    s->recip = a->recip;
+    s->old_table = a->old_table;
+    s->old_capacity = a->old_capacity;
+    s->old_recip = a->old_recip;
+}
+
+/* Search the current table and, mid-resize, the old
+   one it is being migrated out of
+*/
+hash _search_snapshot(assoc* a, snapshot* s, hash* item) {
+
+    hash hash1 = _search_table(a, s->table, s->capacity, \
+    s->recip, item);
+
+    if (!hash1.flag && s->old_table != NULL) {
+        hash1 = _search_table(a, s->old_table, s->old_capacity, \
+        s->old_recip, item);
+    }
+    return hash1;
+}
+
+hash _search_table(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, hash* item) {
     
     hash empty_hash;
-    unsigned int hashone = 0, hashtwo = 0, step, \
-    size = a->capacity;
-    _hash(a, &hashone); 
+    unsigned int end;
+    hash* cell = _locate(a, table, capacity, recip, item, &end);
+
+    if (cell != NULL) {
+        return *cell;
+    }
+    empty_hash.flag = false; 
+    empty_hash.data = NULL;
+    empty_hash.key = NULL;
+    return empty_hash;
+}
+
+/* The cell of table holding item's key, NULL => none, in
+which case *end is the empty cell its probe chain ends at
+*/
+hash* _locate(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, hash* item, unsigned int* end) {
+
+    unsigned long h = _cellhash(a, item);
+    unsigned int hashone, hashtwo, step, size = capacity;
+
+    hashone = _reduce((uint32_t)h, capacity, recip);
+    hashtwo = _reduce(h >> 32, capacity, recip);
+    step = PRIME - (hashtwo % PRIME);
+    if (POW2) {
+        step |= 1;
+    }
     
     /*Check single and double hashes for duplicates*/
-    while (a->hash_table[hashone].flag) {
-        if (!a->keysize) {
-            if (!strcmp((char*)a->hash_table[hashone].key, \
-            (char*)a->ckey)) {
-                return a->hash_table[hashone];
-            }
+    while (__atomic_load_n(&table[hashone].flag, __ATOMIC_ACQUIRE)) {
+        if (_cellmatch(a, &table[hashone], item, h)) {
+            return &table[hashone];
         }
-        else {
-            if (!memcmp(a->hash_table[hashone].key, \
-            a->ckey, a->keysize)) {
-                return a->hash_table[hashone];
-            }
-        }
-        _hash_two(a, &hashtwo);
-        step = PRIME - (hashtwo % PRIME); 
         hashone += step;
         /*Wrap around hash table*/
         if (hashone >= size) {
             hashone = hashone -size;
         }
     }
-   empty_hash.flag = false; 
-   empty_hash.data = NULL;
-   empty_hash.key = NULL;
-   return empty_hash;
+    *end = hashone;
+    return NULL;
+}
+
+/* Does a full cell hold item's key? h is item's hash
+*/
+bool _cellmatch(assoc* a, hash* cell, hash* item, unsigned long h) {
+
+#if CACHEHASH
+    /*Cached hash and length turn away nearly every
+    mismatch without following the key pointer*/
+    (void)a;
+    if (cell->fullhash != h || cell->keylen != item->keylen) {
+        return false;
+    }
+    STAT_ADD(a->stats.compares, 1);
+    return !memcmp(cell->key, item->key, item->keylen);
+#else
+    (void)h;
+    STAT_ADD(a->stats.compares, 1);
+    if (!a->keysize) {
+        return !strcmp((char*)cell->key, (char*)item->key);
+    }
+    return !memcmp(cell->key, item->key, a->keysize);
+#endif
+}
+
+/* Cells of its probe chain before the one a stored key
+is in, walked as _locate() does
+*/
+unsigned int _chainpos(assoc* a, hash* table, unsigned int capacity, \
+unsigned long recip, unsigned int cell) {
+
+    unsigned long h = _cellhash(a, &table[cell]);
+    unsigned int at, step, n;
+
+    at = _reduce((uint32_t)h, capacity, recip);
+    step = PRIME - (_reduce(h >> 32, capacity, recip) % PRIME);
+    if (POW2) {
+        step |= 1;
+    }
+    for (n = 0; at != cell && n < capacity; n++) {
+        at += step;
+        if (at >= capacity) {
+            at -= capacity;
+        }
+    }
+    return n;
+}
+
+/* Up to BATCH lookups walk their probe chains together,
+   AMAC style: each round takes every unfinished lookup one
+   cell further and prefetches the cell it will look at
+   next, so while one waits on memory the others get on
+   with theirs. Keys not in the new table mid-migration
+   are looked for in the old one afterwards
+*/
+void _lookup_batch(assoc* a, snapshot* s, void** keys, \
+unsigned int n, void** out) {
+
+    hash item[BATCH];
+    hash* cell;
+    unsigned long h[BATCH];
+    unsigned int index[BATCH], step[BATCH], live[BATCH], \
+    i, j, k, m, left;
+
+    for (i = 0; i < n; i += BATCH) {
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for (j = 0; j < m; j++) {
+            _makecell(a, &item[j], keys[i + j], NULL);
+            h[j] = _cellhash(a, &item[j]);
+            index[j] = _reduce((uint32_t)h[j], s->capacity, s->recip);
+            step[j] = PRIME - (_reduce(h[j] >> 32, s->capacity, \
+            s->recip) % PRIME);
+            if (POW2) {
+                step[j] |= 1;
+            }
+            _prefetch(&s->table[index[j]]);
+            out[i + j] = NULL;
+            live[j] = j;
+        }
+        left = m;
+        while (left) {
+            for (k = 0; k < left; ) {
+                j = live[k];
+                cell = &s->table[index[j]];
+                if (!__atomic_load_n(&cell->flag, __ATOMIC_ACQUIRE) || \
+                _cellmatch(a, cell, &item[j], h[j])) {
+                    if (cell->flag) {
+                        out[i + j] = cell->data;
+                    }
+                    /*Done, its slot goes to the last one live*/
+                    live[k] = live[--left];
+                    continue;
+                }
+                index[j] += step[j];
+                if (index[j] >= s->capacity) {
+                    index[j] -= s->capacity;
+                }
+                _prefetch(&s->table[index[j]]);
+                k++;
+            }
+        }
+        if (s->old_table != NULL) {
+            for (j = 0; j < m; j++) {
+                if (out[i + j] == NULL) {
+                    out[i + j] = _search_table(a, s->old_table, \
+                    s->old_capacity, s->old_recip, &item[j]).data;
+                }
+            }
+        }
+    }
+}
+
+/* SWMR : hand readers the tables as they are now. The
+snapshot they had is retired, not freed
+*/
+void _publish(assoc* a) {
+
+    snapshot *s = ncalloc(1, sizeof(snapshot)), *old = a->live;
+
+    s->table = a->hash_table;
+    s->capacity = a->capacity;
+    s->recip = a->recip;
+    s->old_table = a->old_table;
+    s->old_capacity = a->old_capacity;
+    s->old_recip = a->old_recip;
+    __atomic_store_n(&a->live, s, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        _retire(a, old);
+    }
+}
+
+/* SWMR : free ptr once no reader can be looking at it
+*/
+void _retire(assoc* a, void* ptr) {
+
+    retired* r = ncalloc(1, sizeof(retired));
+    unsigned long e = a->ebr->epoch & 1;
+
+    r->ptr = ptr;
+    r->next = a->ebr->garbage[e];
+    a->ebr->garbage[e] = r;
+}
+
+/* SWMR : called by the writer, never waits. Readers in a
+lookup are counted under epoch e or e-1. Once the e-1
+count is zero, whatever was retired in e-1 can't be seen
+by anyone, so free it and move to e+1 (which reuses e-1's
+parity)
+*/
+void _reclaim(assoc* a) {
+
+    reclaim* r = a->ebr;
+    unsigned long e = r->epoch, old = (e + 1) & 1;
+    retired* g;
+    int i;
+
+    if (r->garbage[0] == NULL && r->garbage[1] == NULL) {
+        return;
+    }
+    for (i = 0; i < READSLOTS; i++) {
+        if (__atomic_load_n(&r->readers[old][i].n, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+    }
+    while ((g = r->garbage[old]) != NULL) {
+        r->garbage[old] = g->next;
+        free(g->ptr);
+        free(g);
+    }
+    __atomic_store_n(&r->epoch, e + 1, __ATOMIC_SEQ_CST);
+}
+
+/* SWMR : count a reader in under the current epoch. If
+the epoch moved meanwhile, the writer may not have seen
+us, so count in again under the new one
+*/
+unsigned long _enter(assoc* a, unsigned int slot) {
+
+    reclaim* r = a->ebr;
+    unsigned long e;
+
+    for (;;) {
+        e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r->readers[e & 1][slot].n, 1, \
+        __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST) == e) {
+            return e;
+        }
+        __atomic_sub_fetch(&r->readers[e & 1][slot].n, 1, \
+        __ATOMIC_SEQ_CST);
+    }
+}
+
+void _leave(assoc* a, unsigned long epoch, unsigned int slot) {
+
+    __atomic_sub_fetch(&a->ebr->readers[epoch & 1][slot].n, 1, \
+    __ATOMIC_RELEASE);
+}
+
+#if SWMR
+typedef struct testreader {
+    assoc* a;
+    int* keys;
+    unsigned int* done;
+} testreader;
+
+/* Look up keys the writer has finished with, while it
+carries on inserting (and resizing) */
+static void* _testreader(void* arg) {
+
+    testreader* r = (testreader*)arg;
+    unsigned int n, k = 0, seen = 0;
+
+    while ((n = __atomic_load_n(r->done, __ATOMIC_ACQUIRE)) < \
+    TESTKEYS || seen < TESTKEYS) {
+        if (n) {
+            k = (k * 7 + 13) % n;
+            assert(assoc_lookup(r->a, &r->keys[k]) == &r->keys[k]);
+        }
+        seen += n == TESTKEYS;
+    }
+    return NULL;
+}
+#endif
+
+/* The cell item hashes to in 'a', as _hash() has it
+*/
+static unsigned int _testhome(assoc* a, hash* item) {
+
+    return _reduce((uint32_t)_cellhash(a, item), a->capacity, \
+    a->recip);
+}
+
+/* The empty cell _probe() should find for item, stepping
+on from 'start' by the same step as _chainpos()
+*/
+static unsigned int _testprobe(assoc* a, hash* item, \
+unsigned int start) {
+
+    unsigned long h = _cellhash(a, item);
+    unsigned int at = start, step;
+
+    step = PRIME - (_reduce(h >> 32, a->capacity, a->recip) % PRIME);
+    if (POW2) {
+        step |= 1;
+    }
+    do {
+        at = (at + step) % a->capacity;
+    } while (a->hash_table[at].flag);
+    return at;
+}
+
+/* Count a key up by one, its data being the count
+*/
+static void* _testcount(void* data, bool inserted, void* arg) {
+
+    (void)arg;
+    assert(inserted == (data == NULL));
+    return (void*)((uintptr_t)data + 1);
 }
 
 void _assoc_test(void) {
 
-    hash hash1;
-    int key, data, cc, ee, ff, gg, hh, ii; 
-    unsigned int num, hash;
-    unsigned long nn;
+    hash hash1, item;
+    void *keys[12], *out[12];
+    void** pairs;
+    int key, data, cc, ee, ff, gg, hh, ii, ints[32], *vals; 
+    unsigned int num, hash, len, threads, initial;
+    unsigned long nn, rr;
     double jj, kk;
     float ll, mm; 
     void *p, *d, *c, *e, *f, *g, *h, *i;
+    void** slot;
+    bool fresh;
+    assocstats st;
+    assoclatency lat;
     char *str = (char *)ncalloc(sizeof(char), 100);
     char str2[1000], str3[1000], str4[1000], str5[1000], \
     str6[1000], str7[1000];
     assoc *a, *b;
     
 
-    /* Test assoc_init function*/
+    /* Test assoc_init function: the first table is the
+    smallest capacity the build's sizing allows*/
+    initial = _next_capacity(INITIALSIZE, &rr);
+    assert(initial == (POW2 ? 32 : INITIALSIZE));
     a = assoc_init(sizeof(int));
     
     assert(a->size == 0);
     assert(a->keysize == sizeof(int));
-    assert(a->capacity = INITIALSIZE);
+    assert(a->capacity == initial);
     assert(a->hash_table[0].key == 0);
     assert(a->hash_table[0].data == 0);
 
@@ -366,7 +1474,7 @@ void _assoc_test(void) {
 
     assert(b->size == 0);
     assert(b->keysize == 0);
-    assert(b->capacity = INITIALSIZE);
+    assert(b->capacity == initial);
     assert(b->hash_table[0].key == 0);
     assert(b->hash_table[0].data == 0);
 
@@ -380,21 +1488,17 @@ void _assoc_test(void) {
     assert(strcmp(str,*(char **)b->hash_table[6].key) == 0);
 
     /*Test _hash function*/
-    b->ckey = str;
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
     strcpy(str, "Test 1");
-    b->ckey = str;
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
     strcpy(str, "A second test");
-    b->ckey = str;
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
     strcpy(str, "Third test");
-     b->ckey = str;   
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
 
     assoc_free(b);
 
@@ -404,48 +1508,39 @@ void _assoc_test(void) {
     ff = 33839;
     gg = 393933;
     hash = 0;
-     a->ckey = &cc;    
-    _hash(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &ee;   
-    _hash(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &ff;   
-    _hash(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &gg;   
-    _hash(a, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(a, _hashkey(a, &cc, &len), &hash);
+    assert(hash < initial);
+    _hash(a, _hashkey(a, &ee, &len), &hash);
+    assert(hash < initial);
+    _hash(a, _hashkey(a, &ff, &len), &hash);
+    assert(hash < initial);
+    _hash(a, _hashkey(a, &gg, &len), &hash);
+    assert(hash < initial);
 
     /*Test for doubles, floats, longs*/
     b = assoc_init(sizeof(double));
     jj = 4829.6176;
     kk = 16262.0843;
     hash = 0; 
-     b->ckey = &jj;   
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
-     b->ckey = &kk;  
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, &jj, &len), &hash);
+    assert(hash < initial);
+    _hash(b, _hashkey(b, &kk, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     b = assoc_init(sizeof(float));
     ll = 15162.1626;
     mm = 37386.122;
-     b->ckey = &ll;  
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
-     b->ckey = &mm;  
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, &ll, &len), &hash);
+    assert(hash < initial);
+    _hash(b, _hashkey(b, &mm, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     b = assoc_init(sizeof(unsigned long));
     nn = 8127282839916836;
-     b->ckey = &nn;  
-    _hash(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash(b, _hashkey(b, &nn, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     /* Test assoc_free function*/
@@ -455,17 +1550,14 @@ void _assoc_test(void) {
     /* Test _hash_two function*/
     b = assoc_init(0);
     strcpy(str, "Test 1");
-     b->ckey = str;  
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
     strcpy(str, "A second test");
-     b->ckey = str;  
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
     strcpy(str, "Third test");
-     b->ckey = str;  
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, str, &len), &hash);
+    assert(hash < initial);
 
     assoc_free(b);
 
@@ -476,48 +1568,39 @@ void _assoc_test(void) {
     ff = 33839;
     gg = 393933;
     hash = 0; 
-     a->ckey = &cc;  
-    _hash_two(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &ee;  
-    _hash_two(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &ff;  
-    _hash_two(a, &hash);
-    assert(hash < INITIALSIZE);
-     a->ckey = &gg;  
-    _hash_two(a, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(a, _hashkey(a, &cc, &len), &hash);
+    assert(hash < initial);
+    _hash_two(a, _hashkey(a, &ee, &len), &hash);
+    assert(hash < initial);
+    _hash_two(a, _hashkey(a, &ff, &len), &hash);
+    assert(hash < initial);
+    _hash_two(a, _hashkey(a, &gg, &len), &hash);
+    assert(hash < initial);
 
     /*Test for doubles, floats, longs*/
     b = assoc_init(sizeof(double));
     jj = 4829.6176;
     kk = 16262.0843;
     hash = 0; 
-    b->ckey = &jj;
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
-    b->ckey = &kk;
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, &jj, &len), &hash);
+    assert(hash < initial);
+    _hash_two(b, _hashkey(b, &kk, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     b = assoc_init(sizeof(float));
     ll = 15162.1626;
     mm = 37386.122;
-    b->ckey = &ll;
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
-    b->ckey = &mm;
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, &ll, &len), &hash);
+    assert(hash < initial);
+    _hash_two(b, _hashkey(b, &mm, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     b = assoc_init(sizeof(unsigned long));
     nn = 8127282839916836;
-    b->ckey = &nn;
-    _hash_two(b, &hash);
-    assert(hash < INITIALSIZE);
+    _hash_two(b, _hashkey(b, &nn, &len), &hash);
+    assert(hash < initial);
     assoc_free(b);
 
     /* Test assoc_free function*/
@@ -529,33 +1612,37 @@ void _assoc_test(void) {
     hash = 2;
     cc = 7353;
     p = &hash;
-    a->ckey = &cc;
-    _probe(a, p);
-    assert(*(int*)p == 13);
+    _makecell(a, &item, &cc, NULL);
+    _probe(a, &item, p);
+    assert(hash == _testprobe(a, &item, 2));
+    assert(POW2 || *(int*)p == 12);
     
-    a->hash_table[13].flag = true;
+    a->hash_table[12].flag = true;
     hash = 2;
     ee = 37363;
     p = &hash;
-    a->ckey = &ee;
-    _probe(a, p);
-    assert(*(int*)p == 10);
+    _makecell(a, &item, &ee, NULL);
+    _probe(a, &item, p);
+    assert(hash == _testprobe(a, &item, 2));
+    assert(POW2 || *(int*)p == 13);
     
     a->hash_table[5].flag = true;
     hash = 5;
     ff = 2282;
     p = &hash;
-    a->ckey = &ff;
-    _probe(a, p);
-    assert(*(int*)p == 4);
+    _makecell(a, &item, &ff, NULL);
+    _probe(a, &item, p);
+    assert(hash == _testprobe(a, &item, 5));
+    assert(POW2 || *(int*)p == 0);
 
     a->hash_table[16].flag = true;
     hash = 16;
     hh = 272728;
     p = &hash;
-    a->ckey = &hh;
-    _probe(a, p);
-    assert(*(int*)p == 12);
+    _makecell(a, &item, &hh, NULL);
+    _probe(a, &item, p);
+    assert(hash == _testprobe(a, &item, 16));
+    assert(POW2 || *(int*)p == 11);
 
     assoc_free(a);
 
@@ -564,9 +1651,8 @@ void _assoc_test(void) {
     key = 7261537;
     p = &key;
     hash = 13;
-    a->ckey = p;
-    a->cdata = NULL;
-    _add_data(a, hash);
+    _makecell(a, &item, p, NULL);
+    _add_data(a, &item, hash);
     assert(*(int*)(a->hash_table[hash].key) == key);
     assert(a->hash_table[hash].flag == true);
 
@@ -574,9 +1660,8 @@ void _assoc_test(void) {
     d = &data;
     hh = 12;
     hash = 11;
-    a->ckey = d;
-    a->cdata = &hh;  
-    _add_data(a, hash);
+    _makecell(a, &item, d, &hh);
+    _add_data(a, &item, hash);
     assert(*(int*)(a->hash_table[hash].key) == data);
     assert(*(int*)(a->hash_table[hash].data) == 12);
     assert(a->hash_table[hash].flag == true);
@@ -585,47 +1670,51 @@ void _assoc_test(void) {
 
     strcpy(str, "Hello, World!");
     hash = 16;
-    b->ckey = str;
-    b->cdata = NULL;
-    _add_data(b, hash);
+    _makecell(b, &item, str, NULL);
+    _add_data(b, &item, hash);
     assert(strcmp(str, (char *)b->hash_table[hash].key) == 0);
 
     assoc_free(a);
     assoc_free(b);
 
-    /* Test _add_hash function*/
+    /* Test _add_hash function: a key goes in its home
+    cell while that's empty*/
     a = assoc_init(sizeof(int));
     num = 2333289;
     p = &num;
-    a->ckey = p;
-    a->cdata = NULL;
-    assert(_add_hash(a));
-    assert(a->hash_table[9].flag == true);
-    assert(*(unsigned int*)(a->hash_table[9].key) == num);
+    _makecell(a, &item, p, NULL);
+    hash = _testhome(a, &item);
+    assert(POW2 || hash == 5);
+    assert(_add_hash(a, &item) == &a->hash_table[hash]);
+    assert(a->hash_table[hash].flag == true);
+    assert(*(unsigned int*)(a->hash_table[hash].key) == num);
     key = 4701931;
     d = &key;
-    a->ckey = d;
-    a->cdata = NULL;
-    assert(_add_hash(a));
-    assert(a->hash_table[4].flag == true);
-    assert(*(int*)(a->hash_table[4].key) == key);
+    _makecell(a, &item, d, NULL);
+    hash = _testhome(a, &item);
+    assert(POW2 || hash == 3);
+    assert(_add_hash(a, &item) == &a->hash_table[hash]);
+    assert(a->hash_table[hash].flag == true);
+    assert(*(int*)(a->hash_table[hash].key) == key);
 
     b = assoc_init(0);
     strcpy(str2, "I hate C");
     p = &str2;
-    b->ckey = p;
-    b->cdata = NULL;
-    assert(_add_hash(b));
-    assert(b->hash_table[15].flag == true);
-    assert(strcmp(str2, (char*)b->hash_table[15].key)== 0);
+    _makecell(b, &item, p, NULL);
+    hash = _testhome(b, &item);
+    assert(POW2 || hash == 12);
+    assert(_add_hash(b, &item) == &b->hash_table[hash]);
+    assert(b->hash_table[hash].flag == true);
+    assert(strcmp(str2, (char*)b->hash_table[hash].key)== 0);
 
     strcpy(str2, "I actually love C");
     p = &str2;
-    b->ckey = p;
-    b->cdata = NULL;
-    assert(_add_hash(b));
-    assert(b->hash_table[0].flag == true);
-    assert(strcmp(str2, (char*)b->hash_table[0].key)== 0);
+    _makecell(b, &item, p, NULL);
+    hash = _testhome(b, &item);
+    assert(POW2 || hash == 5);
+    assert(_add_hash(b, &item) == &b->hash_table[hash]);
+    assert(b->hash_table[hash].flag == true);
+    assert(strcmp(str2, (char*)b->hash_table[hash].key)== 0);
 
     assoc_free(a);
     assoc_free(b);    
@@ -641,12 +1730,40 @@ void _assoc_test(void) {
 
     /*Test _primetable */
     a = assoc_init(0);
-    assert(_primetable(a) == 71);
-    a->capacity = 71;
-    assert(_primetable(a) == 293);
-    a->capacity = 293;
-    assert(_primetable(a) == 1181);
-    assert(_primetable(a) != 167);
+    hash = _next_capacity(initial * SCALEFACTOR, &rr);
+    assert(POW2 || hash == 71);
+    assert(_primetable(a, &nn) == hash && nn == rr);
+    a->capacity = hash;
+    hash = _next_capacity(hash * SCALEFACTOR, &rr);
+    assert(POW2 || hash == 307);
+    assert(_primetable(a, &nn) == hash && nn == rr);
+    a->capacity = hash;
+    hash = _next_capacity(hash * SCALEFACTOR, &rr);
+    assert(POW2 || hash == 1361);
+    assert(_primetable(a, &nn) == hash);
+    assert(_primetable(a, &nn) != 167);
+    /*Every rung is prime, roughly 9% above the last, and
+    _reduce agrees with % using its reciprocal*/
+    for (num = 0; num < LADDERSIZE; num++) {
+        assert(_isprime(_ladder[num].prime));
+        if (num) {
+            assert(_ladder[num].prime > _ladder[num - 1].prime);
+            assert(_ladder[num].prime < \
+            _ladder[num - 1].prime * 1.2 + 2);
+        }
+        nn = 0x9e3779b97f4a7c15UL * (num + 1);
+        if (!POW2) {
+            assert(_reduce(nn, _ladder[num].prime, \
+            _ladder[num].recip) == (unsigned int)((nn ^ (nn >> 32)) \
+            & 0xffffffffUL) % _ladder[num].prime);
+        }
+    }
+    /*Power-of-two capacities take the top bits instead*/
+    for (num = 1; POW2 && num < 32; num++) {
+        nn = 0x9e3779b97f4a7c15UL * num;
+        assert(_reduce(nn, 1U << num, 0) == \
+        (unsigned int)((nn ^ (nn >> 32)) & 0xffffffffUL) >> (32 - num));
+    }
 
     assoc_free(a);
 
@@ -654,11 +1771,13 @@ void _assoc_test(void) {
     a = assoc_init(0);
     a->size = 16;
     b = _realloc(a);
-    assert(b->capacity == 71);
+    hash = _next_capacity(initial * SCALEFACTOR, &rr);
+    assert(b->capacity == hash && (POW2 || hash == 71));
     assert(b->size == 0);
     assoc_free(a);
     a = _realloc(b);
-    assert(a->capacity == 293);
+    hash = _next_capacity(hash * SCALEFACTOR, &rr);
+    assert(a->capacity == hash && (POW2 || hash == 307));
 
     assoc_free(a);
     assoc_free(b);
@@ -675,55 +1794,56 @@ void _assoc_test(void) {
     f = &ff;
     g = &gg;
     h = &hh;
-    a->ckey = c;
-    a->cdata = NULL;
-    _add_hash(a);
-    a->ckey = e;
-    _add_hash(a);
-    a->ckey = f;
-    _add_hash(a);
-    a->ckey = g;
-    _add_hash(a);
-    a->ckey = h;
-    _add_hash(a);
+    _makecell(a, &item, c, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, e, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, f, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, g, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, h, NULL);
+    _add_hash(a, &item);
     b = _realloc(a);
     assert(_rehash(a, b));
 
     /*Show hashed into different position*/
-    assert(*(int*)a->hash_table[9].key == cc);
-    assert(*(int*)b->hash_table[62].key == cc);
-    assert(*(int*)a->hash_table[10].key == ee);
-    assert(*(int*)b->hash_table[8].key == ee);
-    assert(*(int*)a->hash_table[11].key == ff);
-    assert(*(int*)b->hash_table[46].key == ff);
-    assert(*(int*)a->hash_table[16].key == gg);
-    assert(*(int*)b->hash_table[25].key == gg);
-    assert(*(int*)a->hash_table[15].key == hh);
-    assert(*(int*)b->hash_table[48].key == hh);
+    if (!POW2) {
+        assert(*(int*)a->hash_table[5].key == cc);
+        assert(*(int*)b->hash_table[42].key == cc);
+        assert(*(int*)a->hash_table[11].key == ee);
+        assert(*(int*)b->hash_table[16].key == ee);
+        assert(*(int*)a->hash_table[10].key == ff);
+        assert(*(int*)b->hash_table[43].key == ff);
+        assert(*(int*)a->hash_table[8].key == gg);
+        assert(*(int*)b->hash_table[23].key == gg);
+        assert(*(int*)a->hash_table[16].key == hh);
+        assert(*(int*)b->hash_table[8].key == hh);
+    }
+    keys[0] = c, keys[1] = e, keys[2] = f, keys[3] = g, keys[4] = h;
+    for (num = 0; num < 5; num++) {
+        _makecell(b, &item, keys[num], NULL);
+        assert(_search(b, &item).key == keys[num]);
+    }
     
     ii = 52;
     i = &ii;
-    b->ckey = i;
-    b->cdata = NULL;
-    _add_hash(b);
+    _makecell(b, &item, i, NULL);
+    _add_hash(b, &item);
 
     assoc_free(a);
     assoc_free(b);
 
     /*Test assoc_insert, assoc_search and assoc_count*/
     a = assoc_init(sizeof(int));
-    a->ckey = e;
-    a->cdata = NULL;
-    _add_hash(a);
-    a->ckey = f;
-    a->cdata = NULL;
-    _add_hash(a);
-    a->ckey = g;
-    a->cdata = NULL;
-    _add_hash(a);
-    a->ckey = h;
-    a->cdata = NULL;
-    _add_hash(a);
+    _makecell(a, &item, e, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, f, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, g, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, h, NULL);
+    _add_hash(a, &item);
     a->size = 11;
     assoc_insert(&a, c, NULL);
     assoc_free(a);
@@ -752,23 +1872,23 @@ void _assoc_test(void) {
     assoc_insert(&b, f, &ff);
     assoc_insert(&b, g, &gg);
 
-    b->ckey = c;
-    hash1 = _search(b);
+    _makecell(b, &item, c, NULL);
+    hash1 = _search(b, &item);
     assert(!strcmp(hash1.key, c));
-    b->ckey = d;
-    hash1 = _search(b);
+    _makecell(b, &item, d, NULL);
+    hash1 = _search(b, &item);
     assert(!strcmp(hash1.key, d));
-    b->ckey = e;
-    hash1 = _search(b);
+    _makecell(b, &item, e, NULL);
+    hash1 = _search(b, &item);
     assert(!strcmp(hash1.key, e));
-    b->ckey = f;
-    hash1 = _search(b);
+    _makecell(b, &item, f, NULL);
+    hash1 = _search(b, &item);
     assert(!strcmp(hash1.key, f));
-    b->ckey = g;
-    hash1 = _search(b);
+    _makecell(b, &item, g, NULL);
+    hash1 = _search(b, &item);
     assert(!strcmp(hash1.key, g));
-    b->ckey = h;
-    hash1 = _search(b);
+    _makecell(b, &item, h, NULL);
+    hash1 = _search(b, &item);
     assert(!hash1.flag);
 
     assert(assoc_count(b) == 5);
@@ -849,32 +1969,32 @@ void _assoc_test(void) {
     assoc_insert(&b, g, &gg);
     assoc_insert(&b, h, &hh);
 
-    b->ckey = &str2;
-    assert(_isduplicate(b));
-    b->ckey = e;
-    assert(_isduplicate(b));
-    b->ckey = f;
-    assert(_isduplicate(b));
-    b->ckey = g;
-    assert(_isduplicate(b));
+    _makecell(b, &item, &str2, NULL);
+    assert(_isduplicate(b, &item));
+    _makecell(b, &item, e, NULL);
+    assert(_isduplicate(b, &item));
+    _makecell(b, &item, f, NULL);
+    assert(_isduplicate(b, &item));
+    _makecell(b, &item, g, NULL);
+    assert(_isduplicate(b, &item));
 
     a = _realloc(b);
-    a->ckey = c;
-    assert(!_isduplicate(a));
-    a->ckey = d;
-    assert(!_isduplicate(a));
-    a->ckey = e;
-    assert(!_isduplicate(a));
+    _makecell(a, &item, c, NULL);
+    assert(!_isduplicate(a, &item));
+    _makecell(a, &item, d, NULL);
+    assert(!_isduplicate(a, &item));
+    _makecell(a, &item, e, NULL);
+    assert(!_isduplicate(a, &item));
 
     _rehash(b, a);
-    a->ckey = c;
-    assert(_isduplicate(a));
-    a->ckey = e;
-    assert(_isduplicate(a));
-    a->ckey = f;
-    assert(_isduplicate(a));
-    a->ckey = g;
-    assert(_isduplicate(a));
+    _makecell(a, &item, c, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, e, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, f, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, g, NULL);
+    assert(_isduplicate(a, &item));
 
     assoc_free(a);
     assoc_free(b);
@@ -890,35 +2010,34 @@ void _assoc_test(void) {
     f = &ff;
     g = &gg;
     h = &hh;
-    a->cdata = NULL;
-    a->ckey = c;
-    _add_hash(a);
-    a->ckey = e;
-    _add_hash(a);
-    a->ckey = f;
-    _add_hash(a);
-    a->ckey = g;
-    _add_hash(a);
-    a->ckey = h;
-    _add_hash(a);
+    _makecell(a, &item, c, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, e, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, f, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, g, NULL);
+    _add_hash(a, &item);
+    _makecell(a, &item, h, NULL);
+    _add_hash(a, &item);
     b = _realloc(a);
     assert(_rehash(a, b));
 
-    a->ckey = c;
-    assert(_isduplicate(a));
-    a->ckey = e;
-    assert(_isduplicate(a));
-    a->ckey = f;
-    assert(_isduplicate(a));
-    a->ckey = g;
-    assert(_isduplicate(a));
-
-    b->ckey = c;
-    assert(_isduplicate(b));
-    b->ckey = e;
-    assert(_isduplicate(b));
-    a->ckey = f;
-    assert(_isduplicate(b));
+    _makecell(a, &item, c, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, e, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, f, NULL);
+    assert(_isduplicate(a, &item));
+    _makecell(a, &item, g, NULL);
+    assert(_isduplicate(a, &item));
+
+    _makecell(b, &item, c, NULL);
+    assert(_isduplicate(b, &item));
+    _makecell(b, &item, e, NULL);
+    assert(_isduplicate(b, &item));
+    _makecell(b, &item, f, NULL);
+    assert(_isduplicate(b, &item));
     g = &ff;
     assoc_insert(&b, g, &gg);
 
@@ -954,6 +2073,465 @@ void _assoc_test(void) {
 
     assoc_free(b);
 
+    /*Test hash function defaults and assoc_sethash*/
+    a = assoc_init(sizeof(int));
+    assert(a->hashfn == hash_int);
+    assoc_sethash(a, hash_djb2);
+    assert(a->hashfn == hash_djb2);
+    assoc_sethash(a, NULL);
+    assert(a->hashfn == hash_int);
+    assoc_free(a);
+    a = assoc_init(0);
+    assert(a->hashfn == hash_wy);
+    assoc_free(a);
+
+    /*Test incremental migration: both tables searched
+    until the old one has been moved across and freed*/
+    a = assoc_init(sizeof(int));
+    for (num = 0; num < 11; num++) {
+        ints[num] = num * 4099;
+        assoc_insert(&a, &ints[num], &ints[num]);
+    }
+    _begin_migrate(a);
+    assert(a->old_table != NULL);
+    assert(a->old_capacity == initial);
+    assert(a->capacity == _next_capacity(initial * SCALEFACTOR, &rr));
+    assert(assoc_count(a) == 11);
+    for (num = 0; num < 11; num++) {
+        _makecell(a, &item, &ints[num], NULL);
+        assert(_search(a, &item).data == &ints[num]);
+    }
+    _migrate(a, 5);
+    assert(a->migrated == 5);
+    for (num = 0; num < 11; num++) {
+        _makecell(a, &item, &ints[num], NULL);
+        assert(_search(a, &item).data == &ints[num]);
+    }
+    /*New keys go into the new table mid-migration*/
+    ints[11] = 99;
+    _makecell(a, &item, &ints[11], &ints[11]);
+    assert(!_isduplicate(a, &item));
+    assert(_add_hash(a, &item));
+    _migrate(a, initial);
+    assert(a->old_table == NULL);
+    assert(assoc_count(a) == 12);
+    for (num = 0; num < 12; num++) {
+        _makecell(a, &item, &ints[num], NULL);
+        assert(_search_table(a, a->hash_table, a->capacity, \
+        a->recip, &item).data == &ints[num]);
+    }
+    assoc_free(a);
+
+    /*Test assoc_upsert finds keys in either table mid-
+    migration, and data replaced in the old one is what
+    gets moved across*/
+    a = assoc_init(sizeof(int));
+    for (num = 0; num < 11; num++) {
+        ints[num] = num * 4099;
+        assoc_insert(&a, &ints[num], &ints[num]);
+    }
+    _begin_migrate(a);
+    _migrate(a, 5);
+    for (num = 0; num < 11; num++) {
+        slot = assoc_upsert(&a, &ints[num], &fresh);
+        assert(!fresh && *slot == &ints[num]);
+        *slot = &ints[(num + 1) % 11];
+    }
+    ints[11] = 99;
+    slot = assoc_upsert(&a, &ints[11], &fresh);
+    assert(fresh && *slot == NULL);
+    *slot = &ints[11];
+    _migrate(a, initial);
+    assert(a->old_table == NULL);
+    assert(assoc_count(a) == 12);
+    for (num = 0; num < 11; num++) {
+        assert(assoc_lookup(a, &ints[num]) == &ints[(num + 1) % 11]);
+    }
+    assert(assoc_lookup(a, &ints[11]) == &ints[11]);
+    assoc_free(a);
+
+    /*Test a migration always ends before the next one is
+    due, even growing by as little as 1.1 a time*/
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 1.1, 0);
+    vals = (int*) ncalloc(sizeof(int), 5000);
+    for (num = 0; num < 5000; num++) {
+        vals[num] = (int)num;
+        assoc_insert(&a, &vals[num], &vals[num]);
+        if (a->old_table != NULL) {
+            assert((unsigned long)a->batch * (_limit(a, a->capacity) - \
+            a->size + 1) >= a->old_capacity - a->migrated);
+        }
+    }
+    _begin_migrate(a);
+    assert(a->batch * (_limit(a, a->capacity) - a->size) >= \
+    a->old_capacity);
+    for (num = 0; num < 5000; num++) {
+        assert(assoc_lookup(a, &vals[num]) == &vals[num]);
+    }
+    assoc_free(a);
+    free(vals);
+
+    /*Test counting with assoc_upsert through resizes: new
+    keys come back with NULL data, and are only copied then*/
+    a = assoc_init(sizeof(int));
+    assoc_ownkeys(a);
+    vals = (int*) ncalloc(sizeof(int), 500);
+    for (num = 0; num < 2000; num++) {
+        key = (int)(num % 500);
+        slot = assoc_upsert(&a, &key, &fresh);
+        assert(fresh == (num < 500));
+        if (fresh) {
+            assert(*slot == NULL);
+            *slot = &vals[key];
+        }
+        (*(int*)*slot)++;
+    }
+    assert(assoc_count(a) == 500);
+    assert(a->owned->bytes == 500 * sizeof(int));
+    for (num = 0; num < 500; num++) {
+        key = (int)num;
+        assert(assoc_lookup(a, &key) == &vals[num]);
+        assert(vals[num] == 4);
+    }
+    assert(assoc_upsert(&a, &key, NULL) != NULL);
+    assoc_free(a);
+    free(vals);
+
+    /*Test assoc_update counts in the same step, through
+    resizes*/
+    a = assoc_init(sizeof(int));
+    assoc_ownkeys(a);
+    for (num = 0; num < 2000; num++) {
+        key = (int)(num % 500);
+        assert((uintptr_t)assoc_update(&a, &key, _testcount, NULL) == \
+        num / 500 + 1);
+    }
+    assert(assoc_count(a) == 500);
+    for (num = 0; num < 500; num++) {
+        key = (int)num;
+        assert((uintptr_t)assoc_lookup(a, &key) == 4);
+    }
+    assoc_free(a);
+
+    /*Test batched lookups agree with single ones, misses
+    included, in batches that don't divide evenly, and
+    mid-migration when keys may be in either table*/
+    a = assoc_init(sizeof(int));
+    for (num = 0; num < 11; num++) {
+        ints[num] = num * 4099;
+        assoc_insert(&a, &ints[num], &ints[num]);
+    }
+    keys[11] = &hh;
+    hh = -5;
+    for (num = 0; num < 2; num++) {
+        for (len = 0; len < 11; len++) {
+            keys[len] = &ints[len];
+        }
+        assoc_lookup_batch(a, keys, 12, out);
+        for (len = 0; len < 12; len++) {
+            assert(out[len] == (len < 11 ? keys[len] : NULL));
+            assert(out[len] == assoc_lookup(a, keys[len]));
+        }
+        assoc_lookup_batch(a, &keys[3], 5, out);
+        for (len = 0; len < 5; len++) {
+            assert(out[len] == &ints[len + 3]);
+        }
+        _begin_migrate(a);
+        _migrate(a, 6);
+    }
+    assoc_free(a);
+
+    /*The key that triggers a resize must not be lost*/
+    a = assoc_init(sizeof(int));
+    len = _limit(a, a->capacity) + 1;
+    for (num = 0; num < len; num++) {
+        ints[num] = num * 4099 + 1;
+        assoc_insert(&a, &ints[num], &ints[num]);
+    }
+    assert(a->capacity == _next_capacity(initial * SCALEFACTOR, &rr));
+    for (num = 0; num < len; num++) {
+        assert(assoc_lookup(a, &ints[num]) == &ints[num]);
+    }
+    assoc_free(a);
+
+    /*Test a reserve takes n keys without resizing, and a
+    shrink comes back down to fit what's there*/
+    vals = (int*) ncalloc(sizeof(int), 1000);
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, 1000);
+    assert(_limit(a, a->capacity) >= 1000);
+    b = a;
+    hash = a->capacity;
+    for (num = 0; num < 1000; num++) {
+        vals[num] = (int)num * 7919;
+        assoc_insert(&a, &vals[num], &vals[num]);
+    }
+    assert(a == b && a->capacity == hash);
+    assoc_reserve(&a, 500);
+    assert(a == b);
+    assoc_reserve(&a, 100000);
+    assert(_limit(a, a->capacity) >= 100000);
+    assoc_shrink_to_fit(&a);
+    assert(a->capacity == _fit(a, 1000, &nn) && a->capacity <= hash);
+    assert(assoc_count(a) == 1000);
+    for (num = 0; num < 1000; num++) {
+        assert(assoc_lookup(a, &vals[num]) == &vals[num]);
+    }
+    assoc_free(a);
+
+    /*Test a gentler policy: resizes at maxload, each one
+    only about growth times bigger*/
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 1.5, 0.5);
+    assert(fabs(a->growth - 1.5) < 1e-9 && \
+    fabs(a->maxload - 0.5) < 1e-9);
+    assoc_setgrowth(a, 0, 0);
+    assert(fabs(a->growth - 1.5) < 1e-9 && \
+    fabs(a->maxload - 0.5) < 1e-9);
+    len = 0;
+    for (num = 0; num < 1000; num++) {
+        hash = a->capacity;
+        assoc_insert(&a, &vals[num], &vals[num]);
+        if (a->capacity != hash) {
+            assert(assoc_count(a) - 1 == _limit(a, hash));
+            assert(_limit(a, hash) == hash / 2);
+            /*Next rung up, or power of two*/
+            assert(a->capacity >= hash * 1.5 && a->capacity <= \
+            (POW2 ? hash * 2 : hash * 1.5 * 1.2 + 2));
+            len++;
+        }
+    }
+    assert(len > 5);
+    for (num = 0; num < 1000; num++) {
+        assert(assoc_lookup(a, &vals[num]) == &vals[num]);
+    }
+    /*However small the factor, a resize goes up a rung*/
+    assoc_setgrowth(a, 1.0001, 0);
+    hash = a->capacity;
+    assert(_primetable(a, &nn) > hash);
+    assoc_free(a);
+    free(vals);
+
+    /*Test a build matches inserting in order: duplicates
+    keep the first data, whatever thread they went to, and
+    the table is never resized*/
+    vals = (int*) ncalloc(sizeof(int), BUILDKEYS * 2);
+    pairs = (void**) ncalloc(sizeof(void*), BUILDKEYS * 2);
+    for (num = 0; num < BUILDKEYS; num++) {
+        vals[num] = (int)num * 7919;
+        /*Every fifth key comes round again later*/
+        pairs[num] = &vals[num % 5 ? num : num / 5];
+        pairs[BUILDKEYS + num] = &vals[num];
+    }
+    for (threads = 1; threads <= 4; threads += 3) {
+        a = _build(pairs, &pairs[BUILDKEYS], BUILDKEYS, sizeof(int), \
+        threads);
+        assert(a->capacity == _fit(a, BUILDKEYS, &nn));
+        b = assoc_init(sizeof(int));
+        for (num = 0; num < BUILDKEYS; num++) {
+            assoc_insert(&b, pairs[num], pairs[BUILDKEYS + num]);
+        }
+        assert(assoc_count(a) == assoc_count(b));
+        for (num = 0; num < BUILDKEYS; num++) {
+            assert(assoc_lookup(a, &vals[num]) == \
+            assoc_lookup(b, &vals[num]));
+        }
+        /*...and grows as usual once past two thirds*/
+        hash = a->capacity;
+        for (num = 0; a->capacity == hash; num++) {
+            vals[BUILDKEYS + num] = -1 - (int)num;
+            assoc_insert(&a, &vals[BUILDKEYS + num], &vals[num]);
+        }
+        assert(assoc_count(b) + num == \
+        (unsigned int)(hash TWOTHIRDS) + 1);
+        assert(assoc_lookup(a, &vals[BUILDKEYS]) == &vals[0]);
+        assert(assoc_lookup(a, &vals[1]) == pairs[BUILDKEYS + 1]);
+        assoc_free(a);
+        assoc_free(b);
+    }
+    free(vals);
+    free(pairs);
+
+    /*Test strings, no data and an empty build*/
+    pairs = (void**) ncalloc(sizeof(void*), 3);
+    pairs[0] = "cat";
+    pairs[1] = "dog";
+    pairs[2] = "cat";
+    a = _build(pairs, NULL, 3, 0, 2);
+    assert(assoc_count(a) == 2);
+    assert(assoc_lookup(a, "dog") == NULL);
+    assoc_insert(&a, "emu", "emu");
+    assert(assoc_lookup(a, "emu") != NULL);
+    assoc_free(a);
+    a = assoc_build(pairs, NULL, 0, 0);
+    assert(assoc_count(a) == 0);
+    assert(a->capacity == initial);
+    assoc_free(a);
+    free(pairs);
+
+#if SWMR
+    /*Test readers alongside a writer through many resizes,
+    and that everything retired is freed once they stop*/
+    {
+        pthread_t th[TESTREADERS];
+        testreader r[TESTREADERS];
+        unsigned int done = 0;
+        int* many = ncalloc(sizeof(int), TESTKEYS);
+
+        a = assoc_init(sizeof(int));
+        b = a;
+        for (num = 0; num < TESTREADERS; num++) {
+            r[num].a = a;
+            r[num].keys = many;
+            r[num].done = &done;
+            pthread_create(&th[num], NULL, _testreader, &r[num]);
+        }
+        for (num = 0; num < TESTKEYS; num++) {
+            many[num] = num;
+            assoc_insert(&a, &many[num], &many[num]);
+            __atomic_store_n(&done, num + 1, __ATOMIC_RELEASE);
+        }
+        for (num = 0; num < TESTREADERS; num++) {
+            pthread_join(th[num], NULL);
+        }
+        assert(a == b);
+        assert(assoc_count(a) == TESTKEYS);
+        for (num = 0; num < 3; num++) {
+            many[num] = -1 - (int)num;
+            assoc_insert(&a, &many[num], NULL);
+        }
+        assert(a->ebr->garbage[0] == NULL && \
+        a->ebr->garbage[1] == NULL);
+        free(many);
+        assoc_free(a);
+    }
+#endif
+
+    /*Test owned keys: copies sit back to back in insert
+    order, outlive the caller's buffer, and a duplicate
+    copies nothing*/
+    a = assoc_init(0);
+    assoc_ownkeys(a);
+    for (num = 0; num < 1000; num++) {
+        sprintf(str2, "own%u", num);
+        assoc_insert(&a, str2, &ints[num % 12]);
+    }
+    nn = a->owned->bytes;
+    strcpy(str2, "own7");
+    assoc_insert(&a, str2, NULL);
+    assert(a->owned->bytes == nn);
+    assert(assoc_count(a) == 1000);
+    for (num = 0; num < 1000; num++) {
+        sprintf(str3, "own%u", num);
+        assert(assoc_lookup(a, str3) == &ints[num % 12]);
+    }
+    _makecell(a, &item, "own0", NULL);
+    hash1 = _search(a, &item);
+    _makecell(a, &item, "own1", NULL);
+    assert(_search(a, &item).key == (char*)hash1.key + 5);
+    assoc_free(a);
+
+    /*Test owning keys after a build, aligned for their size*/
+    for (num = 0; num < 12; num++) {
+        ints[num] = (int)num * 3;
+        keys[num] = &ints[num];
+    }
+    a = assoc_build(keys, keys, 12, sizeof(int));
+    assoc_ownkeys(a);
+    assoc_ownkeys(a);
+    assert(a->owned->bytes == 12 * sizeof(int));
+    for (num = 0; num < 12; num++) {
+        key = (int)num * 3;
+        ints[num] = -1;
+        assert(assoc_lookup(a, &key) == &ints[num]);
+        _makecell(a, &item, &key, NULL);
+        assert((unsigned long)_search(a, &item).key % sizeof(int) == 0);
+    }
+    assoc_free(a);
+
+    /*Test stats: every key binned once by its place in its
+    probe chain, mid-migration too, and counters that only
+    move with STATS*/
+    vals = (int*) ncalloc(sizeof(int), 1000);
+    a = assoc_init(sizeof(int));
+    for (num = 0; num < 1000; num++) {
+        vals[num] = (int)num * 7;
+        assoc_insert(&a, &vals[num], &vals[num]);
+    }
+    assert(assoc_lookup(a, &vals[3]) == &vals[3]);
+    assoc_stats(a, &st);
+    assert(st.size == 1000 && st.slots == a->capacity);
+    for (num = 0, nn = 0; num < STATBINS; num++) {
+        nn += st.probes[num];
+    }
+    assert(nn == 1000);
+    assert(st.probes[0] > st.probes[1]);
+    assert(st.bytes >= a->capacity * sizeof(hash));
+#if STATS
+    assert(st.resizes >= 1 && st.searches == 1001 && st.compares >= 1);
+#else
+    assert(!st.resizes && !st.searches && !st.compares);
+    assert(st.rehash_ms <= 0);
+#endif
+    assoc_free(a);
+
+    /*Test latency: 1 in LATSAMPLE inserts and lookups timed,
+    and the resizes (or migration steps)*/
+    assoc_latency_reset();
+    a = assoc_init(sizeof(int));
+    for (num = 0; num < 1000; num++) {
+        vals[num] = (int)num * 7;
+        assoc_insert(&a, &vals[num], &vals[num]);
+    }
+    for (num = 0; num < 1000; num++) {
+        key = (int)(num * 7 + (num & 1));
+        assert((assoc_lookup(a, &key) != NULL) == !(num & 1));
+    }
+    assoc_latency(&lat);
+    nn = latency_total(&lat, LAT_INSERT) + \
+    latency_total(&lat, LAT_HIT) + latency_total(&lat, LAT_MISS);
+#if LATENCY
+    assert(nn >= 2000 / LATSAMPLE && nn <= 2000 / LATSAMPLE + 1);
+    assert(latency_total(&lat, LAT_RESIZE) >= 1);
+#else
+    assert(nn == 0 && latency_total(&lat, LAT_RESIZE) == 0);
+#endif
+    /*...or 1 in however many are asked for, rounded up to
+    a power of 2, and the calibration is kept*/
+    assoc_latency_sample(5);
+    assoc_latency_reset();
+    for (num = 0; num < 1000; num++) {
+        assert(assoc_lookup(a, &vals[num]) == &vals[num]);
+    }
+    jj = lat.ns_per_tick;
+    assoc_latency(&lat);
+    nn = latency_total(&lat, LAT_HIT);
+#if LATENCY
+    assert(lat.sample == 8 && nn >= 1000 / 8 && nn <= 1000 / 8 + 1);
+    assert(fabs(lat.ns_per_tick - jj) < 1e-12);
+#else
+    assert(nn == 0);
+#endif
+    assoc_latency_sample(0);
+    assoc_latency(&lat);
+    assert(lat.sample == LATSAMPLE || !LATENCY);
+
+    /*Test a rehash on several threads: every key kept with
+    its data, found along its probe chain*/
+    _migrate(a, a->old_capacity);
+    b = _realloc(a);
+    assert(_rehash_parallel(a, b, 4));
+    assert(b->size == 1000);
+    for (num = 0; num < 1000; num++) {
+        assert(assoc_lookup(b, &vals[num]) == &vals[num]);
+        key = (int)(num * 7 + 1);
+        assert(assoc_lookup(b, &key) == NULL);
+    }
+    assoc_free(b);
+    assoc_free(a);
+    free(vals);
+
     free(str);
 
 }
@@ -0,0 +1,583 @@
+/* Sharded front end for any one engine, see shard.h
+
+     gcc -O2 prog.c shard.c cuckoo.c general.c -o prog -lm -pthread
+
+   Each shard is a plain assoc table behind a read/write lock,
+   padded to SHARDLINE bytes so no two shards' locks share a
+   cache line. Only the shard array and the routing hash are
+   shared, and neither changes once made, so a resize (which
+   may hand back a new assoc*) is private to its shard.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "shard.h"
+#include "parallel.h"
+#include "../../ADTs/General/general.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+/* Shards per online cpu when none are asked for, and the
+most there can be */
+#define SHARDSPERCPU 4
+#define MAXSHARDS 4096
+/* Seed of the routing hash, unlike the tables' HASHSEED so
+a shard's keys don't all share hash bits */
+#define SHARDSEED 0x9fb21c651e98df25ULL
+/* Keys sorted by shard at once in sharded_lookup_batch */
+#define SHARDBATCH 64
+#define SHARDLINE 128
+/* sharded_reserve's margin: standard deviations of a shard's
+share of the keys */
+#define SPREAD 4
+#define TESTSHARDS 8
+#define TESTTHREADS 4
+#define TESTKEYS 20000
+
+typedef struct shard {
+    pthread_rwlock_t lock;
+    assoc* a;
+} shard;
+
+typedef union padded {
+    shard s;
+    char line[SHARDLINE];
+} padded;
+
+struct sharded {
+    padded* shards;
+    unsigned int n;
+    int keysize;
+    hashfunc route;
+};
+
+/* Shared by the threads grouping sharded_build's keys */
+typedef struct split {
+    sharded* s;
+    void** keys;
+} split;
+
+sharded* _shard_new(int keysize, unsigned int n);
+unsigned int _shardof(sharded* s, void* key);
+shard* _shard(sharded* s, void* key);
+unsigned int _shard_part(void* ctx, unsigned long i);
+void _sharded_test(void);
+
+sharded* sharded_init(int keysize, unsigned int n) {
+
+    sharded* s = _shard_new(keysize, n);
+    unsigned int i;
+
+    for (i = 0; i < s->n; i++) {
+        s->shards[i].s.a = assoc_init(keysize);
+    }
+    return s;
+}
+
+void sharded_insert(sharded* s, void* key, void* data) {
+
+    shard* p = _shard(s, key);
+
+    pthread_rwlock_wrlock(&p->lock);
+    assoc_insert(&p->a, key, data);
+    pthread_rwlock_unlock(&p->lock);
+}
+
+void* sharded_update(sharded* s, void* key, updatefunc fn, void* arg) {
+
+    shard* p = _shard(s, key);
+    void* data;
+
+    pthread_rwlock_wrlock(&p->lock);
+    data = assoc_update(&p->a, key, fn, arg);
+    pthread_rwlock_unlock(&p->lock);
+    return data;
+}
+
+/* Group the pairs by shard, keeping input order within a
+shard so the first of any duplicates still wins
+*/
+sharded* sharded_build(void** keys, void** data, unsigned int n, \
+int keysize, unsigned int shards) {
+
+    sharded* s = _shard_new(keysize, shards);
+    unsigned long* start = ncalloc(s->n + 1, sizeof(unsigned long));
+    unsigned int* order = ncalloc(n ? n : 1, sizeof(unsigned int));
+    void** k = ncalloc(n ? n : 1, sizeof(void*));
+    void** d = data ? ncalloc(n ? n : 1, sizeof(void*)) : NULL;
+    unsigned int p, i, m;
+    split sp;
+
+    sp.s = s;
+    sp.keys = keys;
+    if (!_partition(n, s->n, _shard_part, &sp, _nthreads(n), order, \
+    start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    for (p = 0; p < s->n; p++) {
+        m = (unsigned int)(start[p + 1] - start[p]);
+        for (i = 0; i < m; i++) {
+            k[i] = keys[order[start[p] + i]];
+            if (d) {
+                d[i] = data[order[start[p] + i]];
+            }
+        }
+        s->shards[p].s.a = assoc_build(k, d, m, keysize);
+    }
+    free(start);
+    free(order);
+    free(k);
+    free(d);
+    return s;
+}
+
+void sharded_reserve(sharded* s, unsigned int n) {
+
+    double share = (double)n / s->n;
+    unsigned int i;
+    shard* p;
+
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_wrlock(&p->lock);
+        assoc_reserve(&p->a, (unsigned int)(share + SPREAD * sqrt(share)) \
+        + 1);
+        pthread_rwlock_unlock(&p->lock);
+    }
+}
+
+void sharded_shrink_to_fit(sharded* s) {
+
+    unsigned int i;
+    shard* p;
+
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_wrlock(&p->lock);
+        assoc_shrink_to_fit(&p->a);
+        pthread_rwlock_unlock(&p->lock);
+    }
+}
+
+void sharded_setgrowth(sharded* s, double growth, double maxload) {
+
+    unsigned int i;
+    shard* p;
+
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_wrlock(&p->lock);
+        assoc_setgrowth(p->a, growth, maxload);
+        pthread_rwlock_unlock(&p->lock);
+    }
+}
+
+unsigned int sharded_count(sharded* s) {
+
+    unsigned int i, n = 0;
+    shard* p;
+
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_rdlock(&p->lock);
+        n += assoc_count(p->a);
+        pthread_rwlock_unlock(&p->lock);
+    }
+    return n;
+}
+
+void* sharded_lookup(sharded* s, void* key) {
+
+    shard* p = _shard(s, key);
+    void* data;
+
+    pthread_rwlock_rdlock(&p->lock);
+    data = assoc_lookup(p->a, key);
+    pthread_rwlock_unlock(&p->lock);
+    return data;
+}
+
+/* Stable insertion sort of each SHARDBATCH keys by shard,
+then one assoc_lookup_batch() per run of a shard
+*/
+void sharded_lookup_batch(sharded* s, void** keys, unsigned int n, \
+void** out) {
+
+    unsigned int i, j, k, r, m, at[SHARDBATCH], idx[SHARDBATCH];
+    void *run[SHARDBATCH], *found[SHARDBATCH];
+    shard* p;
+
+    for (i = 0; i < n; i += m) {
+        m = (n - i < SHARDBATCH) ? n - i : SHARDBATCH;
+        for (j = 0; j < m; j++) {
+            r = _shardof(s, keys[i + j]);
+            for (k = j; k > 0 && at[k - 1] > r; k--) {
+                at[k] = at[k - 1];
+                idx[k] = idx[k - 1];
+            }
+            at[k] = r;
+            idx[k] = j;
+        }
+        for (j = 0; j < m; j = k) {
+            for (k = j; k < m && at[k] == at[j]; k++) {
+                run[k - j] = keys[i + idx[k]];
+            }
+            p = &s->shards[at[j]].s;
+            pthread_rwlock_rdlock(&p->lock);
+            assoc_lookup_batch(p->a, run, k - j, found);
+            pthread_rwlock_unlock(&p->lock);
+            for (r = j; r < k; r++) {
+                out[i + idx[r]] = found[r - j];
+            }
+        }
+    }
+}
+
+void sharded_ownkeys(sharded* s) {
+
+    unsigned int i;
+    shard* p;
+
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_wrlock(&p->lock);
+        assoc_ownkeys(p->a);
+        pthread_rwlock_unlock(&p->lock);
+    }
+}
+
+void sharded_sethash(sharded* s, hashfunc fn) {
+
+    unsigned int i;
+
+    for (i = 0; i < s->n; i++) {
+        assoc_sethash(s->shards[i].s.a, fn);
+    }
+    s->route = fn ? fn : hash_default(s->keysize);
+}
+
+void sharded_stats(sharded* s, assocstats* st) {
+
+    unsigned int i, b;
+    assocstats one;
+    shard* p;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < s->n; i++) {
+        p = &s->shards[i].s;
+        pthread_rwlock_rdlock(&p->lock);
+        assoc_stats(p->a, &one);
+        pthread_rwlock_unlock(&p->lock);
+        st->size += one.size;
+        st->slots += one.slots;
+        for (b = 0; b < STATBINS; b++) {
+            st->probes[b] += one.probes[b];
+        }
+        st->bytes += one.bytes;
+        st->resizes += one.resizes;
+        st->rehash_ms += one.rehash_ms;
+        st->searches += one.searches;
+        st->compares += one.compares;
+    }
+    st->bytes += sizeof(sharded) + s->n * sizeof(padded);
+    st->load = st->slots ? (double)st->size / st->slots : 0;
+    st->bytes_per_key = st->size ? (double)st->bytes / st->size : 0;
+}
+
+unsigned int sharded_shards(sharded* s) {
+
+    return s->n;
+}
+
+void sharded_free(sharded* s) {
+
+    unsigned int i;
+
+    for (i = 0; i < s->n; i++) {
+        if (s->shards[i].s.a != NULL) {
+            assoc_free(s->shards[i].s.a);
+        }
+        pthread_rwlock_destroy(&s->shards[i].s.lock);
+    }
+    free(s->shards);
+    free(s);
+}
+
+/* n shards with their locks but no tables yet
+*/
+sharded* _shard_new(int keysize, unsigned int n) {
+
+    sharded* s = ncalloc(1, sizeof(sharded));
+    long cpus;
+    unsigned int i;
+
+    if (n == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus < 1 ? SHARDSPERCPU : (unsigned int)cpus * SHARDSPERCPU;
+    }
+    s->n = n > MAXSHARDS ? MAXSHARDS : n;
+    s->keysize = keysize;
+    s->route = hash_default(keysize);
+    s->shards = ncalloc(s->n, sizeof(padded));
+    for (i = 0; i < s->n; i++) {
+        if (pthread_rwlock_init(&s->shards[i].s.lock, NULL)) {
+            on_error("Error: Cannot create shard lock\n");
+        }
+    }
+    return s;
+}
+
+/* The shard a key goes to, from the high 32 bits of its
+routing hash scaled down to 0..n-1. NULL keys go to shard 0
+and on to its table, which deals with them as it would
+*/
+unsigned int _shardof(sharded* s, void* key) {
+
+    unsigned int len;
+    uint64_t h;
+
+    if (key == NULL) {
+        return 0;
+    }
+    len = s->keysize ? (unsigned int)s->keysize : \
+    (unsigned int)strlen((char*)key);
+    h = s->route(key, len, SHARDSEED);
+    return (unsigned int)(((h >> 32) * s->n) >> 32);
+}
+
+shard* _shard(sharded* s, void* key) {
+
+    return &s->shards[_shardof(s, key)].s;
+}
+
+unsigned int _shard_part(void* ctx, unsigned long i) {
+
+    split* sp = (split*)ctx;
+
+    return _shardof(sp->s, sp->keys[i]);
+}
+
+/* Keys every test thread counts up through sharded_update */
+#define UPDATEKEYS 100
+
+typedef struct testarg {
+    sharded* s;
+    int* keys;
+    int first;
+    int n;
+    /* UPDATEKEYS keys shared by every thread */
+    int* counted;
+} testarg;
+
+/* Insert a run of keys, each one found straight after
+*/
+static void* _testworker(void* arg) {
+
+    testarg* w = (testarg*)arg;
+    int i;
+
+    for (i = w->first; i < w->first + w->n; i++) {
+        sharded_insert(w->s, &w->keys[i], &w->keys[i]);
+        assert(sharded_lookup(w->s, &w->keys[i]) == &w->keys[i]);
+    }
+    return NULL;
+}
+
+/* Set a key's data to arg
+*/
+static void* _testset(void* data, bool inserted, void* arg) {
+
+    (void)data;
+    (void)inserted;
+    return arg;
+}
+
+/* Count a key up by one, its data being the count
+*/
+static void* _testcount(void* data, bool inserted, void* arg) {
+
+    (void)arg;
+    assert(inserted == (data == NULL));
+    return (void*)((uintptr_t)data + 1);
+}
+
+/* Insert a run of keys, counting up the shared keys as
+they go, so the shards resize under the counts
+*/
+static void* _testupdater(void* arg) {
+
+    testarg* w = (testarg*)arg;
+    int i;
+
+    for (i = w->first; i < w->first + w->n; i++) {
+        sharded_insert(w->s, &w->keys[i], &w->keys[i]);
+        sharded_update(w->s, &w->counted[i % UPDATEKEYS], _testcount, \
+        NULL);
+    }
+    return NULL;
+}
+
+void _sharded_test(void) {
+
+    int i, j, ints[1000], *many;
+    unsigned int per[TESTSHARDS], n;
+    void *keys[1000], *out[1000];
+    char words[100][8];
+    assocstats st;
+    pthread_t th[TESTTHREADS];
+    testarg w[TESTTHREADS];
+    sharded* s;
+
+    /*Test routing: every key to the same shard each time,
+    and every shard used*/
+    s = sharded_init(sizeof(int), TESTSHARDS);
+    assert(sharded_shards(s) == TESTSHARDS);
+    memset(per, 0, sizeof(per));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 3;
+        n = _shardof(s, &ints[i]);
+        assert(n < TESTSHARDS && n == _shardof(s, &ints[i]));
+        per[n]++;
+    }
+    for (n = 0; n < TESTSHARDS; n++) {
+        assert(per[n] > 1000 / TESTSHARDS / 2);
+    }
+
+    /*Test insert, lookup and count across shards*/
+    for (i = 0; i < 1000; i++) {
+        sharded_insert(s, &ints[i], &ints[i]);
+    }
+    /*Duplicates ignored*/
+    sharded_insert(s, &ints[5], NULL);
+    assert(sharded_count(s) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(sharded_lookup(s, &ints[i]) == &ints[i]);
+        j = i * 3 + 1;
+        assert(sharded_lookup(s, &j) == NULL);
+    }
+    for (n = 0; n < TESTSHARDS; n++) {
+        assert(assoc_count(s->shards[n].s.a) == per[n]);
+    }
+
+    /*Test update: the old key's data replaced, a new one
+    added with its data*/
+    assert(sharded_update(s, &ints[9], _testset, &ints[8]) == &ints[8]);
+    assert(sharded_lookup(s, &ints[9]) == &ints[8]);
+    j = 1;
+    assert(sharded_update(s, &j, _testset, &ints[0]) == &ints[0]);
+    assert(sharded_lookup(s, &j) == &ints[0]);
+    assert(sharded_count(s) == 1001);
+
+    /*Test batch lookup against one at a time, with misses
+    and a part batch at the end*/
+    for (i = 0; i < 1000; i++) {
+        keys[i] = &ints[(i * 7) % 1000];
+    }
+    j = 2;
+    keys[999] = &j;
+    sharded_lookup_batch(s, keys, 1000, out);
+    for (i = 0; i < 1000; i++) {
+        assert(out[i] == sharded_lookup(s, keys[i]));
+    }
+    assert(out[999] == NULL);
+
+    /*Test stats summed over the shards*/
+    sharded_stats(s, &st);
+    assert(st.size == 1001);
+    for (n = 0, i = 0; n < STATBINS; n++) {
+        i += (int)st.probes[n];
+    }
+    assert(i == 1001);
+    assert(st.load > 0 && st.load <= 1);
+    assert(st.bytes > 1001 * sizeof(void*));
+    sharded_free(s);
+
+    /*Test build: the same as inserting in order, the first
+    of any duplicates winning*/
+    for (i = 0; i < 1000; i++) {
+        ints[i] = (i % 500) * 3;
+        keys[i] = &ints[i];
+    }
+    s = sharded_build(keys, keys, 1000, sizeof(int), TESTSHARDS);
+    assert(sharded_count(s) == 500);
+    for (i = 0; i < 500; i++) {
+        assert(sharded_lookup(s, &ints[i]) == &ints[i]);
+        assert(sharded_lookup(s, &ints[i + 500]) == &ints[i]);
+    }
+    sharded_free(s);
+    s = sharded_build(keys, NULL, 0, sizeof(int), 0);
+    assert(sharded_count(s) == 0 && sharded_shards(s) >= SHARDSPERCPU);
+    sharded_free(s);
+
+    /*Test string keys, owned by the table*/
+    s = sharded_init(0, TESTSHARDS);
+    sharded_ownkeys(s);
+    for (i = 0; i < 100; i++) {
+        sprintf(words[i], "w%d", i);
+        sharded_insert(s, words[i], &ints[i]);
+    }
+    for (i = 0; i < 100; i++) {
+        sprintf(words[i], "w%d", i);
+        assert(sharded_lookup(s, words[i]) == &ints[i]);
+    }
+    assert(sharded_lookup(s, "w100") == NULL);
+    sharded_free(s);
+
+    /*Test writers on several threads at once, with room
+    made first*/
+    many = ncalloc(TESTKEYS, sizeof(int));
+    for (i = 0; i < TESTKEYS; i++) {
+        many[i] = i * 7;
+    }
+    s = sharded_init(sizeof(int), TESTSHARDS);
+    sharded_reserve(s, TESTKEYS);
+    for (i = 0; i < TESTTHREADS; i++) {
+        w[i].s = s;
+        w[i].keys = many;
+        w[i].first = i * (TESTKEYS / TESTTHREADS);
+        w[i].n = TESTKEYS / TESTTHREADS;
+        pthread_create(&th[i], NULL, _testworker, &w[i]);
+    }
+    sharded_stats(s, &st);
+    assert(st.size <= TESTKEYS);
+    for (i = 0; i < TESTTHREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    assert(sharded_count(s) == TESTKEYS);
+    for (i = 0; i < TESTKEYS; i++) {
+        assert(sharded_lookup(s, &many[i]) == &many[i]);
+    }
+    sharded_shrink_to_fit(s);
+    assert(sharded_count(s) == TESTKEYS);
+    assert(sharded_lookup(s, &many[TESTKEYS - 1]) == &many[TESTKEYS - 1]);
+    sharded_free(s);
+
+    /*Test updates alongside inserts into the same shards
+    through their resizes: every count is kept*/
+    s = sharded_init(sizeof(int), TESTSHARDS);
+    for (i = 0; i < UPDATEKEYS; i++) {
+        ints[i] = -1 - i;
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        w[i].s = s;
+        w[i].keys = many;
+        w[i].first = i * (TESTKEYS / TESTTHREADS);
+        w[i].n = TESTKEYS / TESTTHREADS;
+        w[i].counted = ints;
+        pthread_create(&th[i], NULL, _testupdater, &w[i]);
+    }
+    for (i = 0; i < TESTTHREADS; i++) {
+        pthread_join(th[i], NULL);
+    }
+    assert(sharded_count(s) == TESTKEYS + UPDATEKEYS);
+    for (i = 0; i < UPDATEKEYS; i++) {
+        assert((uintptr_t)sharded_lookup(s, &ints[i]) == \
+        TESTKEYS / UPDATEKEYS);
+    }
+    sharded_free(s);
+    free(many);
+}
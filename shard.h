@@ -0,0 +1,80 @@
+#pragma once
+
+/* A table split into shards that many threads can write
+
+   shard.c is linked alongside any one engine, like bench.c.
+   Each key goes to one of n independent assoc tables by the
+   high bits of a hash of its own (a different seed from the
+   tables', so a shard's keys still spread over its cells),
+   and each shard has its own lock: inserts into different
+   shards run at once, and a shard that resizes only holds
+   up the keys that hash to it. Lookups take their shard's
+   lock shared, so they wait only for an insert into the same
+   shard. The functions are assoc.h's, with a sharded* that
+   never changes in place of the assoc**.
+*/
+
+#include "assoc.h"
+
+typedef struct sharded sharded;
+
+/* n shards of keysize byte keys (0 => strings).
+   n 0 => SHARDSPERCPU for each online cpu
+*/
+sharded* sharded_init(int keysize, unsigned int n);
+
+void sharded_insert(sharded* s, void* key, void* data);
+
+/* As assoc_update(), with the key's shard locked until
+   fn's data is stored, so it is safe alongside any other
+   thread's inserts. fn must not use the table itself
+*/
+void* sharded_update(sharded* s, void* key, updatefunc fn, void* arg);
+
+/* As assoc_build(): the pairs are grouped by shard, then each
+   shard is built in one go
+*/
+sharded* sharded_build(void** keys, void** data, unsigned int n, \
+int keysize, unsigned int shards);
+
+/* Room for about n keys in all, each shard taking its share
+   and a margin for keys not spreading evenly
+*/
+void sharded_reserve(sharded* s, unsigned int n);
+
+/* One shard at a time, each under its lock */
+void sharded_shrink_to_fit(sharded* s);
+
+void sharded_setgrowth(sharded* s, double growth, double maxload);
+
+/* Keys stored across all shards */
+unsigned int sharded_count(sharded* s);
+
+void* sharded_lookup(sharded* s, void* key);
+
+/* As assoc_lookup_batch(). Keys are grouped by shard
+   SHARDBATCH at a time, so each shard's run is looked up
+   under one lock through assoc_lookup_batch()
+*/
+void sharded_lookup_batch(sharded* s, void** keys, unsigned int n, \
+void** out);
+
+/* Every shard keeps its own copies, see assoc_ownkeys() */
+void sharded_ownkeys(sharded* s);
+
+/* The tables and the shard routing both hash with fn. Only
+   while the table is empty; NULL => the default
+*/
+void sharded_sethash(sharded* s, hashfunc fn);
+
+/* assoc_stats() summed over the shards: sizes, slots,
+   probes, bytes and counters add up, load and bytes per
+   key are for the whole. Each shard is read under its lock,
+   so inserts may land between one shard and the next
+*/
+void sharded_stats(sharded* s, assocstats* st);
+
+/* The number of shards */
+unsigned int sharded_shards(sharded* s);
+
+void sharded_free(sharded* s);
@@ -0,0 +1,246 @@
+#pragma once
+
+/* Table sizing shared by the engines
+
+   Capacities come off a built-in ladder of primes, about
+   eight to every doubling from 17 up to 2^32, each stored 
+   with its reciprocal M = 2^64/p rounded up. A hash is then
+   reduced with Lemire's fastmod: x % p == ((M*x) * p) >> 64
+   for any 32 bit x, two multiplies and no divide.
+
+   Build with -DPOW2=1 for power-of-two capacities instead.
+   A hash then maps to a cell by (x * capacity) >> 32, i.e.
+   its top log2(capacity) bits.
+*/
+
+#include "../../ADTs/General/general.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef POW2
+#define POW2 0
+#endif
+
+#define LADDERSIZE (sizeof(_ladder) / sizeof(_ladder[0]))
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 wide;
+#endif
+
+typedef struct rung {
+    uint32_t prime;
+    uint64_t recip;
+} rung;
+
+static const rung _ladder[] = {
+    {17U, 0x0f0f0f0f0f0f0f10ULL}, {19U, 0x0d79435e50d79436ULL},
+    {23U, 0x0b21642c8590b217ULL}, {29U, 0x08d3dcb08d3dcb09ULL},
+    {31U, 0x0842108421084211ULL}, {37U, 0x06eb3e45306eb3e5ULL},
+    {41U, 0x063e7063e7063e71ULL}, {43U, 0x05f417d05f417d06ULL},
+    {47U, 0x0572620ae4c415caULL}, {53U, 0x04d4873ecade304eULL},
+    {59U, 0x0456c797dd49c342ULL}, {67U, 0x03d226357e16ece6ULL},
+    {71U, 0x039b0ad12073615bULL}, {79U, 0x033d91d2a2067b24ULL},
+    {83U, 0x03159721ed7e7535ULL}, {97U, 0x02a3a0fd5c5f02a4ULL},
+    {101U, 0x0288df0cac5b3f5eULL}, {109U, 0x02593f69b02593f7ULL},
+    {127U, 0x0204081020408103ULL}, {131U, 0x01f44659e4a42716ULL},
+    {149U, 0x01b7d6c3dda338b3ULL}, {157U, 0x01a16d3f97a4b01bULL},
+    {167U, 0x01886e5f0abb049aULL}, {191U, 0x01571ed3c506b39bULL},
+    {199U, 0x0149539e3b2d066fULL}, {223U, 0x0125e22708092f12ULL},
+    {239U, 0x0112358e75d30337ULL}, {257U, 0x00ff00ff00ff0100ULL},
+    {281U, 0x00e939651fe2d8d4ULL}, {307U, 0x00d578e97c3f5fe6ULL},
+    {337U, 0x00c2780613c0309fULL}, {367U, 0x00b2927c29da551aULL},
+    {397U, 0x00a513fd6bb00a52ULL}, {431U, 0x00980e4156201302ULL},
+    {479U, 0x0088d180cd3a4134ULL}, {521U, 0x007dc9f3397d4c2aULL},
+    {563U, 0x007467ac557c228fULL}, {613U, 0x006ae907ef4b96c3ULL},
+    {673U, 0x006160ff9e9f0062ULL}, {727U, 0x005a2553748e42e8ULL},
+    {797U, 0x00523a758f941346ULL}, {863U, 0x004bf093221d1219ULL},
+    {941U, 0x0045a5228cec23eaULL}, {1031U, 0x003f90c2ab542cb2ULL},
+    {1117U, 0x003aabe394bdc3f5ULL}, {1223U, 0x0035961559cc81c8ULL},
+    {1361U, 0x0030271fc9d3fc3dULL}, {1451U, 0x002d2a85073bcf4fULL},
+    {1583U, 0x0029665e1eb9f9dbULL}, {1723U, 0x002609363b225250ULL},
+    {1879U, 0x0022e0cce8b3d721ULL}, {2053U, 0x001fec0c7834def5ULL},
+    {2237U, 0x001d4bdf7fd40e31ULL}, {2437U, 0x001ae45f62024fa1ULL},
+    {2657U, 0x0018aa5872d92bd7ULL}, {2897U, 0x00169f3ce292ddceULL},
+    {3163U, 0x0014b835bdcb6448ULL}, {3449U, 0x0013005f01db0948ULL},
+    {3761U, 0x00116cd6d1c8523aULL}, {4099U, 0x000ffd008fe50510ULL},
+    {4481U, 0x000ea0141c1ba6a7ULL}, {4871U, 0x000d744e69d900e5ULL},
+    {5323U, 0x000c4fd5ad917b5cULL}, {5801U, 0x000b4c1ff34a5c0fULL},
+    {6317U, 0x000a5fe22c55c08aULL}, {6899U, 0x00097fd540c05c9fULL},
+    {7517U, 0x0008b7e735068136ULL}, {8209U, 0x0007fbc240cd92cbULL},
+    {8941U, 0x0007546faa5526eaULL}, {9743U, 0x0006b9f9f4e96df7ULL},
+    {10627U, 0x00062abc23bfbaa0ULL}, {11587U, 0x0005a7ef3571d957ULL},
+    {12637U, 0x00052fa061e2f338ULL}, {13781U, 0x0004c16a9c00f74aULL},
+    {15031U, 0x00045c2c9f58aed0ULL}, {16411U, 0x0003fe50b5f33d63ULL},
+    {17881U, 0x0003aa4543d90037ULL}, {19489U, 0x00035cdb0cad05b7ULL},
+    {21269U, 0x000314cf8dccb389ULL}, {23173U, 0x0002d3ff9a300e52ULL},
+    {25301U, 0x0002971ad7f12fdfULL}, {27581U, 0x00026049f4fde95fULL},
+    {30059U, 0x00022e2491f9687eULL}, {32771U, 0x0001fff40047fe51ULL},
+    {35747U, 0x0001d555071c7ed1ULL}, {38971U, 0x0001ae81512c4814ULL},
+    {42499U, 0x00018ac46e920cc9ULL}, {46349U, 0x000169f9cd872936ULL},
+    {50539U, 0x00014bf73a0b5b4cULL}, {55109U, 0x0001306fdc19cf3cULL},
+    {60101U, 0x000117267e39d5e0ULL}, {65537U, 0x0000ffff00010000ULL},
+    {71471U, 0x0000eabdd8ad9edbULL}, {77951U, 0x0000d73a4bdb41e1ULL},
+    {84991U, 0x0000c56660b1a402ULL}, {92683U, 0x0000b50466686140ULL},
+    {101081U, 0x0000a5fa5a2d327bULL}, {110221U, 0x00009836de876740ULL},
+    {120199U, 0x00008b94236a120dULL}, {131101U, 0x00007ff8c0691a0dULL},
+    {142939U, 0x0000755f8dc76328ULL}, {155887U, 0x00006b9fcc8d7c98ULL},
+    {169987U, 0x000062b27215d894ULL}, {185369U, 0x00005a81d3352bc7ULL},
+    {202183U, 0x000052faf82f124eULL}, {220447U, 0x00004c1afe22dac5ULL},
+    {240421U, 0x000045c85c291477ULL}, {262147U, 0x00003fffd0002400ULL},
+    {285871U, 0x00003ab02511206aULL}, {311747U, 0x000035d117b692d0ULL},
+    {339959U, 0x00003159c7bdb0e7ULL}, {370759U, 0x00002d40419f6f2bULL},
+    {404291U, 0x0000297f748314deULL}, {440893U, 0x0000260d84b970a9ULL},
+    {480787U, 0x000022e533a97662ULL}, {524309U, 0x00001fffac00dc7eULL},
+    {571741U, 0x00001d5815e5a318ULL}, {623521U, 0x00001ae83f7e7b95ULL},
+    {679919U, 0x000018ace17df932ULL}, {741457U, 0x000016a09accff0bULL},
+    {808579U, 0x000014bfbf4d19beULL}, {881779U, 0x00001306cc42c4afULL},
+    {961549U, 0x00001172b78f732bULL}, {1048583U, 0x00000ffff9000310ULL},
+    {1143481U, 0x00000eac0bca166aULL}, {1246997U, 0x00000d743f908481ULL},
+    {1359857U, 0x00000c566572e38eULL}, {1482919U, 0x00000b504ae680dfULL},
+    {1617137U, 0x00000a5fe87ad153ULL}, {1763491U, 0x000009837dd14734ULL},
+    {1923107U, 0x000008b9591abee4ULL}, {2097169U, 0x000007fffbc00242ULL},
+    {2286961U, 0x00000756061adc71ULL}, {2493949U, 0x000006ba27bcb026ULL},
+    {2719699U, 0x0000062b34f43f97ULL}, {2965847U, 0x000005a824534184ULL},
+    {3234251U, 0x0000052ff6a84dd4ULL}, {3526987U, 0x000004c1be7780a9ULL},
+    {3846197U, 0x0000045cadd0d5cfULL}, {4194319U, 0x000003ffff100039ULL},
+    {4573931U, 0x000003ab0294577eULL}, {4987901U, 0x0000035d13bc6729ULL},
+    {5439341U, 0x000003159c98658aULL}, {5931649U, 0x000002d413919fd4ULL},
+    {6468509U, 0x00000297fb250fd7ULL}, {7053971U, 0x00000260df4cb8c5ULL},
+    {7692389U, 0x0000022e570033a4ULL}, {8388617U, 0x000001ffffdc0003ULL},
+    {9147857U, 0x000001d5815afd1fULL}, {9975803U, 0x000001ae89db5f81ULL},
+    {10878709U, 0x0000018ace0bfb39ULL}, {11863289U, 0x0000016a09dacfe8ULL},
+    {12937007U, 0x0000014bfda507d8ULL}, {14107921U, 0x000001306fc40f2aULL},
+    {15384821U, 0x000001172b4cf712ULL}, {16777259U, 0x000000ffffd50008ULL},
+    {18295687U, 0x000000eac0c432d4ULL}, {19951597U, 0x000000d744f40cedULL},
+    {21757361U, 0x000000c56727e20bULL}, {23726569U, 0x000000b504f1e7f4ULL},
+    {25874027U, 0x000000a5fecd0cacULL}, {28215809U, 0x0000009837edb266ULL},
+    {30769567U, 0x0000008b95bcc7b6ULL}, {33554467U, 0x0000007ffff74001ULL},
+    {36591383U, 0x000000756060350fULL}, {39903197U, 0x0000006ba2797eb3ULL},
+    {43514717U, 0x00000062b394af4bULL}, {47453149U, 0x0000005a827793faULL},
+    {51748043U, 0x00000052ff67ae55ULL}, {56431657U, 0x0000004c1bf366bbULL},
+    {61539113U, 0x00000045cadff36eULL}, {67108879U, 0x0000003fffff1001ULL},
+    {73182743U, 0x0000003ab0314ffbULL}, {79806341U, 0x00000035d13f16faULL},
+    {87029471U, 0x0000003159c8f7a5ULL}, {94906297U, 0x0000002d413bd1fdULL},
+    {103496027U, 0x000000297fb56412ULL}, {112863217U, 0x000000260dfbd815ULL},
+    {123078209U, 0x00000022e5704a95ULL}, {134217757U, 0x0000001fffff8c01ULL},
+    {146365487U, 0x0000001d5818a4a1ULL}, {159612679U, 0x0000001ae89f93f9ULL},
+    {174058861U, 0x00000018ace53c79ULL}, {189812533U, 0x00000016a09e62ffULL},
+    {206992043U, 0x00000014bfdac489ULL}, {225726419U, 0x0000001306fe0141ULL},
+    {246156401U, 0x0000001172b83982ULL}, {268435459U, 0x0000000ffffffd01ULL},
+    {292730989U, 0x0000000eac0c45b3ULL}, {319225391U, 0x0000000d744fb2a7ULL},
+    {348117739U, 0x0000000c56729421ULL}, {379625083U, 0x0000000b504f2900ULL},
+    {413984099U, 0x0000000a5fed5cceULL}, {451452839U, 0x00000009837f0046ULL},
+    {492312797U, 0x00000008b95c1e3eULL}, {536870923U, 0x00000007fffffd41ULL},
+    {585461917U, 0x0000000756062fadULL}, {638450719U, 0x00000006ba27e477ULL},
+    {696235447U, 0x000000062b394eadULL}, {759250133U, 0x00000005a82798a0ULL},
+    {827968151U, 0x000000052ff6b358ULL}, {902905657U, 0x00000004c1bf81ffULL},
+    {984625687U, 0x000000045cae0836ULL}, {1073741827U, 0x00000003ffffffd1ULL},
+    {1170923777U, 0x00000003ab031ad6ULL}, {1276901429U, 0x000000035d13f2a2ULL},
+    {1392470869U, 0x00000003159ca844ULL}, {1518500279U, 0x00000002d413cbe8ULL},
+    {1655936281U, 0x0000000297fb5a39ULL}, {1805811341U, 0x0000000260dfc067ULL},
+    {1969251217U, 0x000000022e570706ULL}, {2147483659U, 0x00000001ffffffd5ULL},
+    {2341847531U, 0x00000001d5818db8ULL}, {2553802871U, 0x00000001ae89f92cULL},
+    {2784941749U, 0x000000018ace5408ULL}, {3037000507U, 0x000000016a09e65aULL},
+    {3311872549U, 0x000000014bfdad33ULL}, {3611622607U, 0x00000001306fe09eULL},
+    {3938502391U, 0x00000001172b83b6ULL}
+};
+
+/* Smallest capacity >= min, along with the reciprocal
+   _reduce() needs for it. 0 => too big for the ladder
+*/
+static inline unsigned int _next_capacity(unsigned long min, \
+unsigned long* recip) {
+
+    unsigned int lo = 0, hi = LADDERSIZE, mid;
+    unsigned long pow = 1;
+
+    *recip = 0;
+    if (POW2) {
+        while (pow < min) {
+            pow <<= 1;
+        }
+        return (pow > UINT32_MAX) ? 0 : (unsigned int)pow;
+    }
+    /*Binary search for the first rung >= min*/
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (_ladder[mid].prime < min) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo == LADDERSIZE) {
+        return 0;
+    }
+    *recip = _ladder[lo].recip;
+    return _ladder[lo].prime;
+}
+
+/* Map a hash onto [0, capacity) without dividing
+*/
+static inline unsigned int _reduce(unsigned long h, \
+unsigned int capacity, unsigned long recip) {
+
+    /*Fold the top half in so every bit counts*/
+    uint32_t x = (uint32_t)(h ^ (h >> 32));
+
+    if (POW2) {
+        return (uint32_t)(((uint64_t)x * capacity) >> 32);
+    }
+#ifdef __SIZEOF_INT128__
+    return (uint32_t)(((wide)(recip * x) * capacity) >> 64);
+#else
+    (void)recip;
+    return x % capacity;
+#endif
+}
+
+/* Start fetching the cache line holding p. Batched
+lookups issue these for a whole batch before touching
+any of it, so the misses overlap
+*/
+static inline void _prefetch(const void* p) {
+
+#ifdef __GNUC__
+    __builtin_prefetch(p, 0, 3);
+#else
+    (void)p;
+#endif
+}
+
+/*Check whether a number is prime
+*/
+static inline bool _isprime(unsigned int c) {
+   
+   unsigned int i; 
+   
+   if (c < 2) {
+      return false;
+   }
+   for (i = 2; i <= c / i; i++) {
+      if (c % i == 0) {
+         return false;
+      }
+   }   
+   return true; 
+}
+
+/* assoc_setgrowth() for every engine: 0 leaves a setting
+   as it is
+*/
+static inline void _setgrowth(double* growth, double* maxload, \
+double newgrowth, double newmaxload) {
+
+    if (newgrowth < 0 || (newgrowth > 0 && newgrowth <= 1) || \
+    newmaxload < 0 || newmaxload > 1) {
+        on_error("Error: Growth must be > 1, maxload 0..1\n");
+    }
+    if (newgrowth > 0) {
+        *growth = newgrowth;
+    }
+    if (newmaxload > 0) {
+        *maxload = newmaxload;
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+/* Table layout shared by cuckoo.c and realloc.c */
+
+#include "assoc.h"
+#include "arena.h"
+#include "stats.h"
+#include "latency.h"
+
+/* Keep each key's full hash and length in its cell, so
+   resizes never rehash and most mismatches are turned away
+   without touching the key. -DCACHEHASH=0 for the smaller
+   cell
+*/
+#ifndef CACHEHASH
+#define CACHEHASH 1
+#endif
+
+/* One cell of a hash table */
+typedef struct hash {
+    void* key;
+    void* data;
+#if CACHEHASH
+    unsigned long fullhash;
+    unsigned int keylen;
+#endif
+    bool flag;
+} hash;
+
+struct assoc {
+    hash* hash_table;
+    /* cuckoo.c : second table, same capacity */
+    hash* hash_table2;
+    /* cuckoo.c : the few keys no displacement path could
+       place, searched after both tables */
+    hash* stash;
+    unsigned int stashed;
+    unsigned int capacity;
+    /* reciprocal of capacity, see sizing.h */
+    unsigned long recip;
+    unsigned int size;
+    unsigned int keysize;
+    hashfunc hashfn;
+    /* capacity multiplier on a resize, and the share of
+       the table that may fill first (assoc_setgrowth) */
+    double growth;
+    double maxload;
+    /* cuckoo.c : buckets each key may use (assoc_ways) */
+    unsigned int ways;
+    /* copies of the keys, NULL => the caller's own
+       (assoc_ownkeys) */
+    arena* owned;
+    /* realloc.c : table being migrated out of during
+       an incremental resize, NULL otherwise */
+    hash* old_table;
+    unsigned int old_capacity;
+    unsigned long old_recip;
+    unsigned int migrated;
+    /* old cells moved per insert, enough to finish before
+       the new table reaches its own limit */
+    unsigned int batch;
+    /* realloc.c, SWMR mode : the tables as readers see
+       them, and what readers might still be looking at */
+    struct snapshot* live;
+    struct reclaim* ebr;
+    /* see stats.h */
+    counters stats;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+/* Counters behind assoc_stats(), shared by the engines
+
+   Built with -DSTATS=1 each table keeps a counters struct
+   that survives its resizes, bumped with relaxed atomic adds
+   so engines that look up from several threads at once
+   (ccuckoo.c, realloc.c in SWMR mode) count safely. Without
+   it STAT_ADD() and the clock compile to nothing, and
+   assoc_stats() reports the counters as 0. Timing needs
+   clock_gettime(), so engines define _POSIX_C_SOURCE.
+*/
+
+#include "assoc.h"
+#include <string.h>
+#include <time.h>
+
+#ifndef STATS
+#define STATS 0
+#endif
+
+#if STATS
+#define STAT_ADD(c, n) ((void)__atomic_add_fetch(&(c), (n), \
+__ATOMIC_RELAXED))
+#else
+#define STAT_ADD(c, n) ((void)0)
+#endif
+
+typedef struct counters {
+    unsigned long resizes;
+    unsigned long rehash_ns;
+    unsigned long searches;
+    unsigned long compares;
+} counters;
+
+/* Now in ns, for timing resizes. 0 without STATS */
+static inline unsigned long _stat_clock(void) {
+
+#if STATS
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + \
+    (unsigned long)ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/* Hand counters on to a table's replacement. Readers may
+still be bumping them
+*/
+static inline void _stat_copy(counters* to, counters* from) {
+
+    to->resizes = __atomic_load_n(&from->resizes, __ATOMIC_RELAXED);
+    to->rehash_ns = __atomic_load_n(&from->rehash_ns, __ATOMIC_RELAXED);
+    to->searches = __atomic_load_n(&from->searches, __ATOMIC_RELAXED);
+    to->compares = __atomic_load_n(&from->compares, __ATOMIC_RELAXED);
+}
+
+/* Rehashing that began at 'since' is over, as a batch
+of an incremental resize is
+*/
+static inline void _stat_rehashed(counters* c, unsigned long since) {
+
+    (void)c;
+    (void)since;
+    STAT_ADD(c->rehash_ns, _stat_clock() - since);
+}
+
+/* A resize that began at 'since' is over */
+static inline void _stat_resized(counters* c, unsigned long since) {
+
+    STAT_ADD(c->resizes, 1);
+    _stat_rehashed(c, since);
+}
+
+/* One more key found at probe 'probe' (0 => first place
+looked)
+*/
+static inline void _stat_probe(assocstats* st, unsigned long probe) {
+
+    st->probes[probe < STATBINS ? probe : STATBINS - 1]++;
+}
+
+/* Start st off for a table of 'size' keys in 'slots'
+cells
+*/
+static inline void _stat_begin(assocstats* st, unsigned int size, \
+unsigned long slots) {
+
+    memset(st, 0, sizeof(*st));
+    st->size = size;
+    st->slots = slots;
+    st->load = slots ? (double)size / slots : 0;
+}
+
+/* Finish st off with the table's memory and counters
+*/
+static inline void _stat_end(assocstats* st, unsigned long bytes, \
+counters* c) {
+
+    st->bytes = bytes;
+    st->bytes_per_key = st->size ? (double)bytes / st->size : 0;
+    st->resizes = __atomic_load_n(&c->resizes, __ATOMIC_RELAXED);
+    st->rehash_ms = __atomic_load_n(&c->rehash_ns, __ATOMIC_RELAXED) / 1e6;
+    st->searches = __atomic_load_n(&c->searches, __ATOMIC_RELAXED);
+    st->compares = __atomic_load_n(&c->compares, __ATOMIC_RELAXED);
+}
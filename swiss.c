@@ -0,0 +1,1225 @@
+/* Open addressing in the style of Google's Swiss tables.
+
+   realloc.c probes cell by cell, and every step loads a whole
+   cell just to read its flag. Here each slot has a one byte
+   control tag in a separate array: EMPTY, or the low 7 bits
+   of the key's hash (keys are never deleted, so there are
+   no tombstones). Slots are probed GROUPSIZE at a time -
+   one SSE2 compare and movemask finds every tag in a group
+   that matches, and the key array is only touched for
+   those. Groups are probed triangularly (g, g+1, g+3, g+6...)
+   which visits every group of a power-of-two table.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "assoc.h"
+#include "sizing.h"
+#include "parallel.h"
+#include "arena.h"
+#include "stats.h"
+#include "latency.h"
+#include "../../ADTs/General/general.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUPSIZE 16
+/* Groups in a new table */
+#define INITIALGROUPS 2
+/* Default growth factor and maximum load, see
+   assoc_setgrowth(). Capacities stay powers of two, so any
+   factor is rounded up to one. Grow at 7/8 full, the tags
+   keep probes short up to there */
+#define SCALEFACTOR 2
+#define MAXLOAD (7.0 / 8)
+/* Control tags. A full slot holds 7 hash bits, so its high
+   bit is clear */
+#define EMPTY 0x80
+/* Taken by a thread of assoc_build, slot not yet written */
+#define BUSY 0xff
+#define TAGBITS 7
+/* Keys hashed and prefetched ahead in assoc_lookup_batch */
+#define BATCH 16
+#define BUILDKEYS 50000
+
+/* One slot, the tag lives in ctrl[] */
+typedef struct slot {
+    void* key;
+    void* data;
+} slot;
+
+struct assoc {
+    /* capacity tags, one per slot */
+    unsigned char* ctrl;
+    slot* slots;
+    /* a power of two, multiple of GROUPSIZE */
+    unsigned int capacity;
+    unsigned int size;
+    unsigned int keysize;
+    hashfunc hashfn;
+    /* see assoc_setgrowth() */
+    double growth;
+    double maxload;
+    /* copies of the keys, NULL => the caller's own
+       (assoc_ownkeys) */
+    arena* owned;
+    /* see stats.h */
+    counters stats;
+};
+
+/* Shared by the threads of assoc_build. Thread p takes
+the keys whose first group is from groups*p/parts up to
+groups*(p+1)/parts */
+typedef struct build {
+    assoc* a;
+    void** keys;
+    void** data;
+    unsigned int n;
+    unsigned long* h;
+    unsigned int* len;
+    unsigned int* order;
+    unsigned long start[MAXTHREADS + 1];
+    unsigned int parts;
+    unsigned int added[MAXTHREADS];
+} build;
+
+/* Shared by the threads of a parallel rehash: the old table
+and the build its keys are gathered into */
+typedef struct rehash {
+    assoc* a;
+    build* b;
+} rehash;
+
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads);
+void _build_hash(void* ctx, unsigned int t, unsigned int threads);
+unsigned int _build_part(void* ctx, unsigned long i);
+void _build_place(void* ctx, unsigned int t, unsigned int threads);
+bool _claim(assoc* a, void* key, void* data, unsigned long h, \
+unsigned int len);
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len);
+unsigned int _match(const unsigned char* group, unsigned char tag);
+unsigned int _lowbit(unsigned int mask);
+assoc* _alloc(unsigned int capacity, unsigned int keysize, \
+hashfunc fn);
+void _drop(assoc* a);
+void* _ownkey(assoc* a, void* key);
+unsigned long _grown(assoc* a);
+assoc* _like(assoc* a, unsigned long capacity);
+assoc* _resize(assoc** a, unsigned long capacity);
+unsigned long _limit(assoc* a, unsigned long capacity);
+unsigned long _fit(assoc* a, unsigned long n);
+bool _rehash(assoc* a, assoc* b);
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads);
+bool _old_kept(void* ctx, unsigned long i);
+void _old_put(void* ctx, unsigned long i, unsigned long k);
+slot* _add_data(assoc* a, void* key, void* data, unsigned long h);
+slot* _upsert(assoc** a, void* key, void* data, bool* inserted);
+slot* _search(assoc* a, void* key);
+slot* _search_hashed(assoc* a, void* key, unsigned long h, \
+unsigned int len);
+bool _keymatch(assoc* a, void* stored, void* key, unsigned int len);
+unsigned int _groupsteps(assoc* a, unsigned int i);
+
+/*
+   Initialise the Associative array
+   keysize : number of bytes (or 0 => string)
+*/
+
+assoc* assoc_init(int keysize) {
+
+    return _alloc(INITIALGROUPS * GROUPSIZE, keysize, \
+    hash_default(keysize));
+}
+
+/*
+   Insert key/data pair
+   - may cause resize, therefore 'a' might
+   be changed due to a realloc() etc.
+*/
+
+void assoc_insert(assoc** a, void* key, void* data) {
+
+    unsigned long lat;
+    bool inserted;
+
+    if (key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    lat = _lat_start();
+    _upsert(a, key, data, &inserted);
+    _lat_stop(lat, LAT_INSERT);
+}
+
+/* Find or insert key, one hash and one probe, see
+_upsert()
+*/
+void** assoc_upsert(assoc** a, void* key, bool* inserted) {
+
+    bool fresh;
+    slot* s;
+
+    if (key == NULL) {
+        on_error("Error: Null pointer\n");
+    }
+    s = _upsert(a, key, NULL, &fresh);
+    if (inserted != NULL) {
+        *inserted = fresh;
+    }
+    return &s->data;
+}
+
+/* assoc_upsert(), then the new data stored through the
+cell it found
+*/
+void* assoc_update(assoc** a, void* key, updatefunc fn, void* arg) {
+
+    bool fresh;
+    void** data = assoc_upsert(a, key, &fresh);
+
+    *data = fn(*data, fresh, arg);
+    return *data;
+}
+
+/* Make room for n keys in all
+*/
+void assoc_reserve(assoc** a, unsigned int n) {
+
+    unsigned long capacity = _fit(*a, n);
+
+    if (capacity > (*a)->capacity) {
+        _resize(a, capacity);
+    }
+}
+
+/* Down to the smallest power of two the keys fit in
+*/
+void assoc_shrink_to_fit(assoc** a) {
+
+    unsigned long capacity = _fit(*a, (*a)->size);
+
+    if (capacity < (*a)->capacity) {
+        _resize(a, capacity);
+    }
+}
+
+/* Resize policy for this table. maxload is capped so
+   at least one slot is always EMPTY to end a probe
+*/
+void assoc_setgrowth(assoc* a, double growth, double maxload) {
+
+    _setgrowth(&a->growth, &a->maxload, growth, maxload);
+}
+
+/* Bulk load, sized once, one thread per cpu
+*/
+assoc* assoc_build(void** keys, void** data, unsigned int n, \
+int keysize) {
+
+    return _build(keys, data, n, keysize, _nthreads(n));
+}
+
+/*   Returns the number of key/data pairs
+   currently stored in the table
+*/
+
+unsigned int assoc_count(assoc* a) {
+
+    return a->size;
+}
+
+/*   Returns a pointer to the data, given a key
+   NULL => not found
+*/
+
+void* assoc_lookup(assoc* a, void* key) {
+
+    unsigned long lat = _lat_start();
+    slot* s;
+
+    STAT_ADD(a->stats.searches, 1);
+    s = _search(a, key);
+    _lat_stop(lat, s ? LAT_HIT : LAT_MISS);
+    return s ? s->data : NULL;
+}
+
+/* Hash a batch of keys and prefetch each one's first
+group of tags, then search them once the lines have
+arrived
+*/
+void assoc_lookup_batch(assoc* a, void** keys, unsigned int n, \
+void** out) {
+
+    unsigned long h[BATCH];
+    unsigned int len[BATCH], groups = a->capacity / GROUPSIZE, \
+    i, j, m;
+    slot* s;
+
+    STAT_ADD(a->stats.searches, n);
+    for (i = 0; i < n; i += BATCH) {
+        m = (n - i < BATCH) ? n - i : BATCH;
+        for (j = 0; j < m; j++) {
+            h[j] = _hashkey(a, keys[i + j], &len[j]);
+            _prefetch(&a->ctrl[((unsigned int)(h[j] >> TAGBITS) & \
+            (groups - 1)) * GROUPSIZE]);
+        }
+        for (j = 0; j < m; j++) {
+            s = _search_hashed(a, keys[i + j], h[j], len[j]);
+            out[i + j] = s ? s->data : NULL;
+        }
+    }
+}
+
+/* Choose the hash function while the table is empty
+*/
+void assoc_sethash(assoc* a, hashfunc fn) {
+
+    if (a->size) {
+        on_error("Error: Hash function can't change once keys "
+        "are stored\n");
+    }
+    a->hashfn = fn ? fn : hash_default(a->keysize);
+}
+
+/* Copy keys into a table owned arena from now on,
+   including any already stored
+*/
+void assoc_ownkeys(assoc* a) {
+
+    unsigned int i;
+
+    if (a->owned != NULL) {
+        return;
+    }
+    a->owned = arena_init();
+    if (a->owned == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    for (i = 0; i < a->capacity; i++) {
+        if (!(a->ctrl[i] & EMPTY)) {
+            a->slots[i].key = _ownkey(a, a->slots[i].key);
+        }
+    }
+}
+
+/* Load, how many groups along its probe sequence each key
+sits and the counters
+*/
+void assoc_stats(assoc* a, assocstats* st) {
+
+    unsigned int i;
+
+    _stat_begin(st, a->size, a->capacity);
+    for (i = 0; i < a->capacity; i++) {
+        if (!(a->ctrl[i] & EMPTY)) {
+            _stat_probe(st, _groupsteps(a, i));
+        }
+    }
+    _stat_end(st, sizeof(assoc) + (unsigned long)a->capacity * \
+    (1 + sizeof(slot)) + (a->owned ? a->owned->bytes : 0), &a->stats);
+}
+
+void assoc_latency(assoclatency* l) {
+
+    _lat_merge(l);
+}
+
+void assoc_latency_reset(void) {
+
+    _lat_reset();
+}
+
+void assoc_latency_sample(unsigned int n) {
+
+    _lat_setsample(n);
+}
+
+/*Free up all allocated space from 'a'
+*/
+void assoc_free(assoc* a) {
+
+    arena_free(a->owned);
+    _drop(a);
+}
+
+void _assoc_test(void);
+
+/* The smallest table n keys fit in below maxload. Keys
+   are hashed, then sorted by first group so each thread
+   starts its probes in a run of groups of its own. Probes
+   still cross into other threads' runs, so a slot is
+   claimed by swapping its tag from EMPTY to BUSY. A key's
+   duplicates share its first group, and so its thread, and
+   are met in input order: the first one wins
+*/
+assoc* _build(void** keys, void** data, unsigned int n, int keysize, \
+unsigned int threads) {
+
+    unsigned int p;
+    assoc* a;
+    build b;
+
+    a = _alloc(INITIALGROUPS * GROUPSIZE, keysize, hash_default(keysize));
+    if (_fit(a, n) > a->capacity) {
+        _resize(&a, _fit(a, n));
+    }
+    if (n == 0) {
+        return a;
+    }
+    memset(&b, 0, sizeof(b));
+    b.a = a;
+    b.keys = keys;
+    b.data = data;
+    b.n = n;
+    b.parts = threads;
+    b.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+    b.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    b.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    _parallel(_build_hash, &b, threads);
+    if (!_partition(n, threads, _build_part, &b, threads, b.order, \
+    b.start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    _parallel(_build_place, &b, threads);
+    for (p = 0; p < threads; p++) {
+        a->size += b.added[p];
+    }
+    free(b.h);
+    free(b.len);
+    free(b.order);
+    return a;
+}
+
+/* Hash thread t's share of the keys
+*/
+void _build_hash(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long i, lo, hi;
+
+    _slice(b->n, t, threads, &lo, &hi);
+    for (i = lo; i < hi; i++) {
+        if (b->keys[i] == NULL) {
+            on_error("Error: Null pointer\n");
+        }
+        b->h[i] = _hashkey(b->a, b->keys[i], &b->len[i]);
+    }
+}
+
+/* Which thread's run of groups key i's first group is in
+*/
+unsigned int _build_part(void* ctx, unsigned long i) {
+
+    build* b = (build*)ctx;
+    unsigned long groups = b->a->capacity / GROUPSIZE;
+
+    return (unsigned int)(((b->h[i] >> TAGBITS) & (groups - 1)) * \
+    b->parts / groups);
+}
+
+/* Thread t places its keys in input order
+*/
+void _build_place(void* ctx, unsigned int t, unsigned int threads) {
+
+    build* b = (build*)ctx;
+    unsigned long k;
+    unsigned int i;
+
+    (void)threads;
+    for (k = b->start[t]; k < b->start[t + 1]; k++) {
+        i = b->order[k];
+        if (_claim(b->a, b->keys[i], b->data ? b->data[i] : NULL, \
+        b->h[i], b->len[i])) {
+            b->added[t]++;
+        }
+    }
+}
+
+/* _add_data() for several threads at once, checking for
+   the key on the way. Each group is searched for the key
+   before any of its EMPTY slots is taken. A BUSY slot
+   belongs to another thread, so can't hold this key.
+   false => duplicate
+*/
+bool _claim(assoc* a, void* key, void* data, unsigned long h, \
+unsigned int len) {
+
+    unsigned int groups = a->capacity / GROUPSIZE, \
+    g = (unsigned int)(h >> TAGBITS) & (groups - 1), step = 0, i;
+    unsigned char tag = (unsigned char)(h & (EMPTY - 1)), empty;
+    unsigned char* ctrl;
+
+    do {
+        ctrl = &a->ctrl[g * GROUPSIZE];
+        for (i = 0; i < GROUPSIZE; i++) {
+            if (__atomic_load_n(&ctrl[i], __ATOMIC_ACQUIRE) == tag && \
+            _keymatch(a, a->slots[g * GROUPSIZE + i].key, key, len)) {
+                return false;
+            }
+        }
+        for (i = 0; i < GROUPSIZE; i++) {
+            empty = EMPTY;
+            if (__atomic_load_n(&ctrl[i], __ATOMIC_RELAXED) == EMPTY && \
+            __atomic_compare_exchange_n(&ctrl[i], &empty, BUSY, false, \
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                a->slots[g * GROUPSIZE + i].key = key;
+                a->slots[g * GROUPSIZE + i].data = data;
+                __atomic_store_n(&ctrl[i], tag, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        g = (g + ++step) & (groups - 1);
+    } while (step < groups);
+    on_error("Error finding a slot\n");
+    return false;
+}
+
+/* One 64 bit hash per key (see hashfn.h): the low TAGBITS
+become the tag, the rest pick the first group
+*/
+unsigned long _hashkey(assoc* a, void* key, unsigned int* len) {
+
+    *len = a->keysize;
+    if (!*len) {
+        *len = strlen((char*)key);
+    }
+    return a->hashfn(key, *len, HASHSEED);
+}
+
+/* Bit i set <=> group[i] == tag, for GROUPSIZE tags at once
+*/
+unsigned int _match(const unsigned char* group, unsigned char tag) {
+
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+
+    return (unsigned int)_mm_movemask_epi8( \
+    _mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+    unsigned int i, mask = 0;
+
+    /*Plain loop, which compilers vectorise where they can*/
+    for (i = 0; i < GROUPSIZE; i++) {
+        mask |= (unsigned int)(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+/* Index of the lowest set bit of a non-zero mask
+*/
+unsigned int _lowbit(unsigned int mask) {
+
+#ifdef __GNUC__
+    return (unsigned int)__builtin_ctz(mask);
+#else
+    unsigned int i = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+assoc* _alloc(unsigned int capacity, unsigned int keysize, \
+hashfunc fn) {
+
+    assoc* a = ncalloc(1, sizeof(assoc));
+
+    a->capacity = capacity;
+    a->ctrl = ncalloc(sizeof(unsigned char), capacity);
+    memset(a->ctrl, EMPTY, capacity);
+    a->slots = ncalloc(sizeof(slot), capacity);
+    a->keysize = keysize;
+    a->hashfn = fn;
+    a->growth = SCALEFACTOR;
+    a->maxload = MAXLOAD;
+
+    return a;
+}
+
+/* Free the table but not the keys, which a resize
+hands on to the next table
+*/
+void _drop(assoc* a) {
+
+    free(a->ctrl);
+    free(a->slots);
+    free(a);
+}
+
+/* The table's own copy of a new key
+*/
+void* _ownkey(assoc* a, void* key) {
+
+    size_t len = a->keysize;
+    void* copy;
+
+    if (!len) {
+        len = strlen((char*)key) + 1;
+    }
+    copy = arena_copy(a->owned, key, len, arena_align(len, !a->keysize));
+    if (copy == NULL) {
+        on_error("Error: Cannot allocate key arena\n");
+    }
+    return copy;
+}
+
+/* Capacity after one resize: growth times bigger, up to
+the next power of two, and at least double
+*/
+unsigned long _grown(assoc* a) {
+
+    unsigned long capacity = (unsigned long)a->capacity * 2;
+
+    while (capacity < a->capacity * a->growth) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/* An empty table of 'capacity' with a's settings
+*/
+assoc* _like(assoc* a, unsigned long capacity) {
+
+    assoc* b;
+
+    if (capacity > UINT32_MAX) {
+        on_error("Error: Hash table too big\n");
+    }
+    b = _alloc((unsigned int)capacity, a->keysize, a->hashfn);
+    b->growth = a->growth;
+    b->maxload = a->maxload;
+    b->owned = a->owned;
+    _stat_copy(&b->stats, &a->stats);
+    return b;
+}
+
+/* Rehash everything into a table of 'capacity', re-direct
+*a to it and free the old one. Returns the new table
+*/
+assoc* _resize(assoc** a, unsigned long capacity) {
+
+    unsigned long since = _stat_clock(), lat = _lat_resizing();
+    assoc *p = *a, *b = _like(p, capacity);
+
+    if (!_rehash(p, b)) {
+        on_error("Error: Null pointer\n");
+    }
+    _stat_resized(&b->stats, since);
+    _lat_resized(lat);
+    *a = b;
+    _drop(p);
+    return b;
+}
+
+/* Keys a table of 'capacity' takes before it grows,
+always leaving one slot EMPTY
+*/
+unsigned long _limit(assoc* a, unsigned long capacity) {
+
+    unsigned long limit = (unsigned long)(capacity * a->maxload + 1e-6);
+
+    return limit < capacity ? limit : capacity - 1;
+}
+
+/* Smallest capacity, at least INITIALGROUPS groups, that
+takes n keys before it grows
+*/
+unsigned long _fit(assoc* a, unsigned long n) {
+
+    unsigned long capacity = INITIALGROUPS * GROUPSIZE;
+
+    while (_limit(a, capacity) < n) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/* Take every key from one table and place into the other.
+Tables big enough to share out go through _rehash_parallel()
+*/
+bool _rehash(assoc* a, assoc* b) {
+
+    unsigned int i, len;
+
+    if (a == NULL || b == NULL) {
+        return false;
+    }
+    if (_rehash_threads(a->size) > 1) {
+        return _rehash_parallel(a, b, _rehash_threads(a->size));
+    }
+    for (i = 0; i < a->capacity; i++) {
+        if (!(a->ctrl[i] & EMPTY)) {
+            _add_data(b, a->slots[i].key, a->slots[i].data, \
+            _hashkey(b, a->slots[i].key, &len));
+        }
+    }
+    return true;
+}
+
+/* _rehash() over threads: every key is gathered, then
+hashed and placed as assoc_build() does it, each thread
+starting from its own run of groups and claiming slots by
+swapping their tags
+*/
+bool _rehash_parallel(assoc* a, assoc* b, unsigned int threads) {
+
+    unsigned int p, n = a->size;
+    rehash r;
+    build bd;
+
+    memset(&bd, 0, sizeof(bd));
+    bd.a = b;
+    bd.n = n;
+    bd.parts = threads;
+    bd.keys = (void**) ncalloc(sizeof(void*), n);
+    bd.data = (void**) ncalloc(sizeof(void*), n);
+    bd.h = (unsigned long*) ncalloc(sizeof(unsigned long), n);
+    bd.len = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    bd.order = (unsigned int*) ncalloc(sizeof(unsigned int), n);
+    r.a = a;
+    r.b = &bd;
+    if (_gather(a->capacity, _old_kept, _old_put, &r, threads) < 0) {
+        on_error("Error: Cannot allocate gather counts\n");
+    }
+    _parallel(_build_hash, &bd, threads);
+    if (!_partition(n, threads, _build_part, &bd, threads, bd.order, \
+    bd.start)) {
+        on_error("Error: Cannot allocate partition counts\n");
+    }
+    _parallel(_build_place, &bd, threads);
+    for (p = 0; p < threads; p++) {
+        b->size += bd.added[p];
+    }
+    free(bd.keys);
+    free(bd.data);
+    free(bd.h);
+    free(bd.len);
+    free(bd.order);
+    return true;
+}
+
+bool _old_kept(void* ctx, unsigned long i) {
+
+    return !(((rehash*)ctx)->a->ctrl[i] & EMPTY);
+}
+
+/* Key k of the rehash is in old slot i
+*/
+void _old_put(void* ctx, unsigned long i, unsigned long k) {
+
+    rehash* r = (rehash*)ctx;
+
+    r->b->keys[k] = r->a->slots[i].key;
+    r->b->data[k] = r->a->slots[i].data;
+}
+
+/* The slot holding key. The probe looking for it notes the
+   first EMPTY slot it passes, which is where
+   _add_data() would put a new key, so a new key costs no
+   second probe unless the table has to grow first. A new
+   key gets 'data', an old one keeps its own
+*/
+slot* _upsert(assoc** a, void* key, void* data, bool* inserted) {
+
+    assoc* p = *a;
+    unsigned int len, groups = p->capacity / GROUPSIZE, g, step = 0, \
+    mask, i, free = p->capacity;
+    unsigned long h = _hashkey(p, key, &len);
+    unsigned char tag = (unsigned char)(h & (EMPTY - 1));
+    const unsigned char* group;
+
+    STAT_ADD(p->stats.searches, 1);
+    g = (unsigned int)(h >> TAGBITS) & (groups - 1);
+    do {
+        group = &p->ctrl[g * GROUPSIZE];
+        for (mask = _match(group, tag); mask; mask &= mask - 1) {
+            i = g * GROUPSIZE + _lowbit(mask);
+            if (_keymatch(p, p->slots[i].key, key, len)) {
+                *inserted = false;
+                return &p->slots[i];
+            }
+        }
+        mask = _match(group, EMPTY);
+        if (free == p->capacity && mask) {
+            free = g * GROUPSIZE + _lowbit(mask);
+        }
+        g = (g + ++step) & (groups - 1);
+    } while (!_match(group, EMPTY) && step < groups);
+
+    *inserted = true;
+    /* Grow first, so there is always an EMPTY slot to
+    end a probe */
+    if (p->size + 1 > _limit(p, p->capacity)) {
+        p = _resize(a, _grown(p));
+        free = p->capacity;
+    }
+    if (p->owned != NULL) {
+        key = _ownkey(p, key);
+    }
+    if (free == p->capacity) {
+        return _add_data(p, key, data, h);
+    }
+    p->ctrl[free] = tag;
+    p->slots[free].key = key;
+    p->slots[free].data = data;
+    p->size += 1;
+    return &p->slots[free];
+}
+
+/* Put a key known not to be in the table into the first
+EMPTY slot along its probe sequence, and return
+that slot
+*/
+slot* _add_data(assoc* a, void* key, void* data, unsigned long h) {
+
+    unsigned int groups = a->capacity / GROUPSIZE, \
+    g = (unsigned int)(h >> TAGBITS) & (groups - 1), step = 0, \
+    mask, i;
+
+    for (;;) {
+        mask = _match(&a->ctrl[g * GROUPSIZE], EMPTY);
+        if (mask) {
+            i = g * GROUPSIZE + _lowbit(mask);
+            a->ctrl[i] = (unsigned char)(h & (EMPTY - 1));
+            a->slots[i].key = key;
+            a->slots[i].data = data;
+            a->size += 1;
+            return &a->slots[i];
+        }
+        g = (g + ++step) & (groups - 1);
+    }
+}
+
+/* Find the slot holding key, NULL if there isn't one. Only
+slots whose tag matches are compared; a group with an
+EMPTY tag ends the search
+*/
+slot* _search(assoc* a, void* key) {
+
+    unsigned int len;
+    unsigned long h;
+
+    if (key == NULL) {
+        return NULL;
+    }
+    h = _hashkey(a, key, &len);
+    return _search_hashed(a, key, h, len);
+}
+
+/* _search once the key has been hashed
+*/
+slot* _search_hashed(assoc* a, void* key, unsigned long h, \
+unsigned int len) {
+
+    unsigned int groups = a->capacity / GROUPSIZE, g, step = 0, mask;
+    unsigned char tag;
+    const unsigned char* group;
+
+    tag = (unsigned char)(h & (EMPTY - 1));
+    g = (unsigned int)(h >> TAGBITS) & (groups - 1);
+    do {
+        group = &a->ctrl[g * GROUPSIZE];
+        for (mask = _match(group, tag); mask; mask &= mask - 1) {
+            if (_keymatch(a, a->slots[g * GROUPSIZE + \
+            _lowbit(mask)].key, key, len)) {
+                return &a->slots[g * GROUPSIZE + _lowbit(mask)];
+            }
+        }
+        g = (g + ++step) & (groups - 1);
+    } while (!_match(group, EMPTY) && step < groups);
+    return NULL;
+}
+
+/* Compare a stored key using strcmp or memcmp
+*/
+bool _keymatch(assoc* a, void* stored, void* key, unsigned int len) {
+
+    STAT_ADD(a->stats.compares, 1);
+    if (!a->keysize) {
+        return !strcmp((char*)stored, (char*)key);
+    }
+    return !memcmp(stored, key, len);
+}
+
+/* Groups probed before the one holding the key in slot i
+*/
+unsigned int _groupsteps(assoc* a, unsigned int i) {
+
+    unsigned int len, groups = a->capacity / GROUPSIZE, g, step = 0;
+    unsigned long h = _hashkey(a, a->slots[i].key, &len);
+
+    g = (unsigned int)(h >> TAGBITS) & (groups - 1);
+    while (g != i / GROUPSIZE && step < groups) {
+        g = (g + ++step) & (groups - 1);
+    }
+    return step;
+}
+
+/* Count a key up by one, its data being the count
+*/
+static void* _testcount(void* data, bool inserted, void* arg) {
+
+    (void)arg;
+    assert(inserted == (data == NULL));
+    return (void*)((uintptr_t)data + 1);
+}
+
+void _assoc_test(void) {
+
+    unsigned char group[GROUPSIZE];
+    int i, ints[1000], *many;
+    unsigned int len, capacity, grown, threads;
+    unsigned long h;
+    char words[1000][8], str[16];
+    void *keys[37], *out[37], **pairs, **slot;
+    bool fresh;
+    assocstats st;
+    assoclatency lat;
+    assoc *a, *b, *c;
+
+    /* Test assoc_init function*/
+    a = assoc_init(sizeof(int));
+    assert(a->size == 0);
+    assert(a->capacity == INITIALGROUPS * GROUPSIZE);
+    for (i = 0; i < (int)a->capacity; i++) {
+        assert(a->ctrl[i] == EMPTY);
+    }
+    assoc_free(a);
+
+    /*Test _match finds every matching tag in a group*/
+    memset(group, EMPTY, GROUPSIZE);
+    assert(_match(group, EMPTY) == 0xffff);
+    assert(_match(group, 5) == 0);
+    group[0] = 5;
+    group[7] = 5;
+    group[15] = 5;
+    group[9] = BUSY;
+    assert(_match(group, 5) == (1u << 0 | 1u << 7 | 1u << 15));
+    assert(_match(group, BUSY) == 1u << 9);
+    assert(_lowbit(1u << 7 | 1u << 15) == 7);
+    assert(_lowbit(1) == 0);
+
+    /*Test a key goes in its home group, tagged with its hash*/
+    a = assoc_init(sizeof(int));
+    i = 1234;
+    h = _hashkey(a, &i, &len);
+    assoc_insert(&a, &i, &ints[0]);
+    capacity = (unsigned int)(h >> TAGBITS) & \
+    (a->capacity / GROUPSIZE - 1);
+    assert(_match(&a->ctrl[capacity * GROUPSIZE], \
+    (unsigned char)(h & (EMPTY - 1))));
+    assert(assoc_lookup(a, &i) == &ints[0]);
+    assoc_free(a);
+
+    /*Test ints: all found, duplicates ignored*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_insert(&a, &ints[5], NULL);
+    assert(assoc_count(a) == 1000);
+    assert(assoc_lookup(a, &ints[5]) == &ints[5]);
+    i = -1;
+    assert(assoc_lookup(a, &i) == NULL);
+    /*...unless replaced through assoc_upsert*/
+    slot = assoc_upsert(&a, &ints[5], &fresh);
+    assert(!fresh && *slot == &ints[5]);
+    *slot = &ints[6];
+    assert(assoc_lookup(a, &ints[5]) == &ints[6]);
+    assert(assoc_count(a) == 1000);
+    *slot = &ints[5];
+
+    /*Test counting with assoc_upsert through resizes: new
+    keys come back with NULL data, and are only copied then*/
+    b = assoc_init(sizeof(int));
+    assoc_ownkeys(b);
+    many = (int*) ncalloc(sizeof(int), 500);
+    for (i = 0; i < 2000; i++) {
+        len = (unsigned int)i % 500;
+        slot = assoc_upsert(&b, &len, &fresh);
+        assert(fresh == (i < 500));
+        if (fresh) {
+            assert(*slot == NULL);
+            *slot = &many[len];
+        }
+        (*(int*)*slot)++;
+    }
+    assert(assoc_count(b) == 500);
+    assert(b->owned->bytes == 500 * sizeof(int));
+    for (len = 0; len < 500; len++) {
+        assert(assoc_lookup(b, &len) == &many[len]);
+        assert(many[len] == 4);
+    }
+    assert(assoc_upsert(&b, &len, NULL) != NULL);
+    assoc_free(b);
+    free(many);
+
+    /*Test assoc_update counts in the same step, through
+    resizes*/
+    b = assoc_init(sizeof(int));
+    assoc_ownkeys(b);
+    for (i = 0; i < 2000; i++) {
+        len = (unsigned int)i % 500;
+        assert((uintptr_t)assoc_update(&b, &len, _testcount, NULL) == \
+        (uintptr_t)(i / 500 + 1));
+    }
+    assert(assoc_count(b) == 500);
+    for (len = 0; len < 500; len++) {
+        assert((uintptr_t)assoc_lookup(b, &len) == 4);
+    }
+    assoc_free(b);
+
+    /*Test batched lookups agree with single ones, misses
+    included, in batches that don't divide evenly*/
+    for (i = 0; i < 37; i++) {
+        keys[i] = &ints[i * 27];
+    }
+    i = -1;
+    keys[36] = &i;
+    assoc_lookup_batch(a, keys, 37, out);
+    for (len = 0; len < 37; len++) {
+        assert(out[len] == (len < 36 ? keys[len] : NULL));
+        assert(out[len] == assoc_lookup(a, keys[len]));
+    }
+    assoc_free(a);
+
+    /*Test a table can be given another hash function*/
+    a = assoc_init(sizeof(int));
+    assoc_sethash(a, hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(a->hashfn == hash_fnv1a);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test strings fill to 7/8 before a resize*/
+    a = assoc_init(0);
+    grown = 0;
+    for (i = 0; i < 1000; i++) {
+        sprintf(words[i], "w%d", i * 31);
+        b = a;
+        capacity = a->capacity;
+        assoc_insert(&a, words[i], words[i]);
+        if (a != b) {
+            assert(assoc_count(a) - 1 == capacity * 7 / 8);
+            assert(a->capacity == capacity * SCALEFACTOR);
+            grown++;
+        }
+    }
+    assert(grown > 0);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, words[i]) == words[i]);
+    }
+    words[0][0] = 'x';
+    assert(assoc_lookup(a, words[0]) == NULL);
+    assoc_free(a);
+
+    /*Test a reserve takes n keys without resizing, and a
+    shrink comes back down to fit what's there*/
+    a = assoc_init(sizeof(int));
+    assoc_reserve(&a, 1000);
+    assert(a->capacity == 2048 && _limit(a, a->capacity) >= 1000);
+    b = a;
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 7919;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(a == b && a->capacity == 2048);
+    assoc_reserve(&a, 100000);
+    assert(a->capacity == 131072);
+    assoc_shrink_to_fit(&a);
+    assert(a->capacity == 2048);
+    assert(assoc_count(a) == 1000);
+    for (i = 0; i < 1000; i++) {
+        assert(assoc_lookup(a, &ints[i]) == &ints[i]);
+    }
+    assoc_free(a);
+
+    /*Test the policy: a factor rounds up to a power of two,
+    and the table grows once maxload is reached*/
+    a = assoc_init(sizeof(int));
+    assoc_setgrowth(a, 3, 0.5);
+    assoc_setgrowth(a, 0, 0);
+    assert(fabs(a->growth - 3) < 1e-9 && \
+    fabs(a->maxload - 0.5) < 1e-9);
+    assert(_grown(a) == a->capacity * 4);
+    assoc_setgrowth(a, 1.1, 0);
+    assert(_grown(a) == a->capacity * 2);
+    grown = 0;
+    for (i = 0; i < 1000; i++) {
+        capacity = a->capacity;
+        assoc_insert(&a, &ints[i], &ints[i]);
+        if (a->capacity != capacity) {
+            assert(assoc_count(a) - 1 == capacity / 2);
+            grown++;
+        }
+    }
+    assert(grown == 6);
+    /*...but always leaves a slot EMPTY*/
+    assoc_setgrowth(a, 0, 1);
+    assert(_limit(a, a->capacity) == a->capacity - 1);
+    assoc_free(a);
+
+    /*Test a build matches inserting in order: duplicates
+    keep the first data, whatever thread they went to, and
+    the table starts at the size inserting would end at*/
+    many = (int*) ncalloc(sizeof(int), BUILDKEYS);
+    pairs = (void**) ncalloc(sizeof(void*), BUILDKEYS * 2);
+    for (i = 0; i < BUILDKEYS; i++) {
+        many[i] = i * 7919;
+        /*Every fifth key comes round again later*/
+        pairs[i] = &many[i % 5 ? i : i / 5];
+        pairs[BUILDKEYS + i] = &many[i];
+    }
+    for (threads = 1; threads <= 4; threads += 3) {
+        a = _build(pairs, &pairs[BUILDKEYS], BUILDKEYS, sizeof(int), \
+        threads);
+        b = assoc_init(sizeof(int));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assoc_insert(&b, pairs[i], pairs[BUILDKEYS + i]);
+        }
+        assert(assoc_count(a) == assoc_count(b));
+        assert(a->capacity <= b->capacity);
+        for (i = 0; i < BUILDKEYS; i++) {
+            assert(assoc_lookup(a, &many[i]) == \
+            assoc_lookup(b, &many[i]));
+        }
+        for (i = 0; i < (int)a->capacity; i++) {
+            assert(a->ctrl[i] != BUSY);
+        }
+        /*...and a rehash on as many threads moves every key*/
+        c = _like(b, b->capacity * 2);
+        assert(_rehash_parallel(b, c, threads));
+        assert(assoc_count(c) == assoc_count(b));
+        for (i = 0; i < BUILDKEYS; i++) {
+            assert(assoc_lookup(c, &many[i]) == \
+            assoc_lookup(b, &many[i]));
+        }
+        for (i = 0; i < (int)c->capacity; i++) {
+            assert(c->ctrl[i] != BUSY);
+        }
+        _drop(c);
+        assoc_free(a);
+        assoc_free(b);
+    }
+    free(many);
+    free(pairs);
+
+    /*Test a full build, strings, no data, and an empty one*/
+    for (i = 0; i < 28; i++) {
+        keys[i] = words[i + 1];
+    }
+    a = _build(keys, NULL, 28, 0, 2);
+    assert(a->capacity == INITIALGROUPS * GROUPSIZE);
+    assert(assoc_count(a) == 28);
+    assert(assoc_lookup(a, words[1]) == NULL);
+    b = a;
+    assoc_insert(&a, words[0], words[0]);
+    assert(a != b);
+    assert(assoc_lookup(a, words[0]) == words[0]);
+    assoc_free(a);
+    a = assoc_build(keys, NULL, 0, 0);
+    assert(assoc_count(a) == 0);
+    assoc_free(a);
+
+    /*Test owned keys: copied once each, back to back in
+    insert order, and still there once the caller's buffer
+    has moved on, through several grows*/
+    a = assoc_init(0);
+    assoc_ownkeys(a);
+    for (i = 0, h = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assoc_insert(&a, str, &ints[i]);
+        h += strlen(str) + 1;
+        assoc_insert(&a, str, NULL);
+    }
+    assert(a->owned->bytes == h);
+    for (i = 0; i < 1000; i++) {
+        sprintf(str, "own%d", i);
+        assert(assoc_lookup(a, str) == &ints[i]);
+    }
+    assert((char*)_search(a, "own1")->key == \
+    (char*)_search(a, "own0")->key + 5);
+    assoc_free(a);
+
+    /*Test owning keys after a build*/
+    for (i = 0; i < 37; i++) {
+        ints[i] = i * 5;
+        keys[i] = &ints[i];
+    }
+    a = assoc_build(keys, keys, 37, sizeof(int));
+    assoc_ownkeys(a);
+    assert(a->owned->bytes == 37 * sizeof(int));
+    for (i = 0; i < 37; i++) {
+        grown = (unsigned int)i * 5;
+        ints[i] = -1;
+        assert(assoc_lookup(a, &grown) == &ints[i]);
+        assert((unsigned long)_search(a, &grown)->key % sizeof(int) == 0);
+    }
+    assoc_free(a);
+
+    /*Test stats: every key binned once by the groups probed
+    to reach it, and counters that only move with STATS*/
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        ints[i] = i * 3;
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    assert(assoc_lookup(a, &ints[7]) == &ints[7]);
+    assoc_stats(a, &st);
+    assert(st.size == 1000 && st.slots == a->capacity);
+    assert(st.load <= MAXLOAD);
+    for (i = 0, h = 0; i < STATBINS; i++) {
+        h += st.probes[i];
+    }
+    assert(h == 1000);
+    assert(st.probes[0] > st.probes[1]);
+    assert(st.bytes >= a->capacity * (1 + sizeof(slot)));
+#if STATS
+    assert(st.resizes >= 1 && st.searches == 1001 && st.compares >= 1);
+#else
+    assert(!st.resizes && !st.searches && !st.compares);
+    assert(st.rehash_ms <= 0);
+#endif
+    assoc_free(a);
+
+    /*Test latency: 1 in LATSAMPLE inserts and lookups timed,
+    lookups split by hit or miss, every resize timed*/
+    assoc_latency_reset();
+    a = assoc_init(sizeof(int));
+    for (i = 0; i < 1000; i++) {
+        assoc_insert(&a, &ints[i], &ints[i]);
+    }
+    for (i = 0; i < 1000; i++) {
+        len = (unsigned int)(i * 3 + (i & 1));
+        assert((assoc_lookup(a, &len) != NULL) == !(i & 1));
+    }
+    assoc_latency(&lat);
+    h = latency_total(&lat, LAT_INSERT) + latency_total(&lat, LAT_HIT) + \
+    latency_total(&lat, LAT_MISS);
+#if LATENCY
+    assert(h >= 2000 / LATSAMPLE && h <= 2000 / LATSAMPLE + 1);
+    assert(latency_total(&lat, LAT_RESIZE) >= 1);
+#else
+    assert(h == 0 && latency_total(&lat, LAT_RESIZE) == 0);
+#endif
+    assoc_free(a);
+}
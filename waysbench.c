@@ -0,0 +1,177 @@
+/* Memory against lookup latency for cuckoo.c's d-ary mode
+
+     gcc -O2 waysbench.c cuckoo.c general.c -o waysbench -lm -pthread
+   then run ./waysbench [maxpow].
+
+   For d = 2, 3 and 4 ways (assoc_ways) 8 byte keys are loaded
+   at 10^4 up to 10^maxpow entries (default 10^6, at most 10^8),
+   growing by only GROWTH at a time at maxload 1, so a table
+   is never much bigger than the fill d ways allow. 'B/key' is
+   the resident memory the table adds, read from
+   /proc/self/statm. Hits and misses are then timed one call
+   at a time, as in bench.c; a miss searches every way, so
+   its latency is the price of the extra fill. Each row runs
+   in its own child process.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cuckoo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MINPOW 4
+#define MAXPOW 8
+#define DEFAULTPOW 6
+#define MINWAYS 2
+#define MAXWAYS 4
+#define GROWTH 1.1
+#define SAMPLES 100000
+
+static const double percentiles[3] = {0.5, 0.99, 0.999};
+
+/* splitmix64 finaliser - distinct inputs, distinct keys */
+static unsigned long long mix64(unsigned long long x) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double now_ns(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Resident bytes right now, 0 => can't tell */
+static double resident(void) {
+
+    FILE* f = fopen("/proc/self/statm", "r");
+    unsigned long size, pages = 0;
+
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%lu %lu", &size, &pages) != 2) {
+        pages = 0;
+    }
+    fclose(f);
+    return (double)pages * sysconf(_SC_PAGESIZE);
+}
+
+static int cmp_double(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void percentile(double* t, unsigned int n, double* out) {
+
+    int i;
+
+    qsort(t, n, sizeof(double), cmp_double);
+    for (i = 0; i < 3; i++) {
+        out[i] = t[(unsigned int)(percentiles[i] * (n - 1))];
+    }
+}
+
+/* Keys 0..n-1 go in, n..2n-1 are misses */
+static void run(unsigned int d, unsigned int n) {
+
+    unsigned long long* keys = malloc(sizeof(*keys) * 2 * (size_t)n);
+    double* lat = malloc(sizeof(double) * SAMPLES);
+    double t0, base, insert, hit[3], miss[3], perkey;
+    unsigned int i, j, samples, step, errors = 0;
+    assoc* a;
+
+    if (keys == NULL || lat == NULL) {
+        fprintf(stderr, "Cannot allocate workload\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 2 * n; i++) {
+        keys[i] = mix64(i);
+    }
+    base = resident();
+    a = assoc_init(sizeof(*keys));
+    assoc_ways(a, d);
+    assoc_setgrowth(a, GROWTH, 1.0);
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        assoc_insert(&a, &keys[i], &keys[i]);
+    }
+    insert = n / ((now_ns() - t0) / 1e3);
+    perkey = (resident() - base) / n;
+    if (assoc_count(a) != n) {
+        errors++;
+    }
+
+    samples = n < SAMPLES ? n : SAMPLES;
+    step = n / samples;
+    for (i = 0, j = 0; i < samples; i++, j += step) {
+        t0 = now_ns();
+        if (assoc_lookup(a, &keys[j]) != &keys[j]) {
+            errors++;
+        }
+        lat[i] = now_ns() - t0;
+    }
+    percentile(lat, samples, hit);
+    for (i = 0, j = n; i < samples; i++, j += step) {
+        t0 = now_ns();
+        if (assoc_lookup(a, &keys[j]) != NULL) {
+            errors++;
+        }
+        lat[i] = now_ns() - t0;
+    }
+    percentile(lat, samples, miss);
+
+    printf("%4u %10u %8.2f %8.1f %7.0f %7.0f %7.0f %7.0f %7.0f %7.0f %s\n", \
+    d, n, insert, perkey, hit[0], hit[1], hit[2], miss[0], miss[1], \
+    miss[2], errors ? "WRONG" : "ok");
+    assoc_free(a);
+    free(lat);
+    free(keys);
+}
+
+int main(int argc, char* argv[]) {
+
+    int maxpow = DEFAULTPOW, p, status;
+    unsigned int d, n;
+    pid_t pid;
+
+    if (argc > 1) {
+        maxpow = atoi(argv[1]);
+    }
+    if (maxpow < MINPOW || maxpow > MAXPOW) {
+        fprintf(stderr, "Usage: %s [maxpow %d..%d]\n", argv[0], \
+        MINPOW, MAXPOW);
+        return EXIT_FAILURE;
+    }
+
+    printf("%4s %10s %8s %8s %23s %23s\n", "ways", "n", "ins Mop", \
+    "B/key", "hit ns p50/p99/p99.9", "miss ns p50/p99/p99.9");
+    for (p = MINPOW, n = 10000; p <= maxpow; p++, n *= 10) {
+        for (d = MINWAYS; d <= MAXWAYS; d++) {
+            fflush(stdout);
+            pid = fork();
+            if (pid == 0) {
+                run(d, n);
+                fflush(stdout);
+                _exit(EXIT_SUCCESS);
+            }
+            if (pid < 0 || waitpid(pid, &status, 0) < 0 || \
+            !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                printf("%4u %10u FAILED\n", d, n);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}